@@ -0,0 +1,531 @@
+/*
+ *  audioout.c
+ *  pianod - Persistent audio output.
+ *
+ */
+
+/* Opening a libao device for every song costs tens to hundreds of
+   milliseconds on PulseAudio and ALSA, and often clicks.  Instead, an
+   output thread owns a single device and keeps it open for as long as the
+   sample format and destination stay the same.  Player threads decode into
+   a PCM ring; the output thread plays from it.  When the format changes,
+   queued audio is played out before the device is reopened.  The device is
+   closed when nothing has been played for a while, so other programs can
+   use it.
+
+   The ring is single-producer, single-consumer and lock-free: only the
+   player writes `head`, only the output thread writes `tail`.  The mutex
+   serves the control requests (configure, pause, flush) and sleeping when
+   the ring is full or empty; the side that sleeps raises a flag, and the
+   other side only takes the mutex to wake it when the flag is up. */
+
+#ifndef __FreeBSD__
+#define _DEFAULT_SOURCE /* strdup() */
+#define _DARWIN_C_SOURCE /* strdup() on OS X */
+#endif
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <ao/ao.h>
+
+#include "audioout.h"
+#include "logging.h"
+
+/* Default ring depth */
+#define AUDIO_OUTPUT_DEFAULT_BUFFER_MS (1000)
+/* Largest piece handed to ao_play at once; keeps flushes responsive */
+#define AUDIO_OUTPUT_CHUNK (8 * 1024)
+/* Close the device after this many seconds without audio */
+#define AUDIO_OUTPUT_IDLE_CLOSE (10)
+
+typedef struct audio_destination_t {
+	unsigned long rate;
+	int channels;
+	char *driver;
+	char *device;
+	char *id;
+	char *server;
+} AUDIO_DESTINATION;
+
+struct audio_output_t {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t changed; /* Broadcast on control changes and wakeups */
+	bool quit;
+	bool paused;
+	bool flush; /* Discard queued audio */
+	bool reconfigure; /* (Re)open device for `requested` once the ring is empty */
+	bool open_ok; /* Result of the last reconfigure */
+	bool streaming; /* A player is feeding the ring; running dry is an underrun */
+	unsigned int underruns;
+	int buffer_ms; /* Requested ring depth */
+	size_t requested_size; /* Ring size for `requested` */
+
+	/* PCM ring; head and tail only grow, fill is head - tail.  Accessed
+	   atomically, without the mutex. */
+	unsigned char *ring;
+	size_t size;
+	size_t head;
+	size_t tail;
+	int producer_waiting;
+	int consumer_waiting;
+	int ready; /* Device is open */
+
+	AUDIO_DESTINATION requested;
+	AUDIO_DESTINATION current; /* Valid while device is open */
+	ao_device *device; /* Output thread only */
+	time_t last_played;
+};
+
+#define atomic_get(var) __atomic_load_n (&(var), __ATOMIC_SEQ_CST)
+#define atomic_set(var, value) __atomic_store_n (&(var), (value), __ATOMIC_SEQ_CST)
+
+
+#define strdup_nullable(x) ((x) ? strdup (x) : NULL)
+static bool streq_nullable (const char *a, const char *b) {
+	return (a == NULL || b == NULL) ? a == b : strcmp (a, b) == 0;
+}
+
+static void destination_free (AUDIO_DESTINATION *dest) {
+	free (dest->driver);
+	free (dest->device);
+	free (dest->id);
+	free (dest->server);
+	memset (dest, 0, sizeof (*dest));
+}
+
+static bool destination_copy (AUDIO_DESTINATION *dest, const AUDIO_DESTINATION *src) {
+	destination_free (dest);
+	dest->rate = src->rate;
+	dest->channels = src->channels;
+	dest->driver = strdup_nullable (src->driver);
+	dest->device = strdup_nullable (src->device);
+	dest->id = strdup_nullable (src->id);
+	dest->server = strdup_nullable (src->server);
+	return ((dest->driver || !src->driver) && (dest->device || !src->device) &&
+			(dest->id || !src->id) && (dest->server || !src->server));
+}
+
+static bool destination_equal (const AUDIO_DESTINATION *a, const AUDIO_DESTINATION *b) {
+	return (a->rate == b->rate && a->channels == b->channels &&
+			streq_nullable (a->driver, b->driver) && streq_nullable (a->device, b->device) &&
+			streq_nullable (a->id, b->id) && streq_nullable (a->server, b->server));
+}
+
+
+/* Open a libao device for a destination.  Returns NULL on failure. */
+static ao_device *open_device (const AUDIO_DESTINATION *dest) {
+	/* Find driver, or use default if unspecified. */
+	int driver = dest->driver ? ao_driver_id (dest->driver) : ao_default_driver_id();
+	if (driver < 0) {
+		flog (LOG_ERROR, "audio driver '%s' not found", dest->driver ? dest->driver : "(default)");
+		return NULL;
+	}
+
+	ao_sample_format format;
+	memset (&format, 0, sizeof (format));
+	format.bits = 16;
+	format.channels = dest->channels;
+	format.rate = dest->rate;
+	format.byte_format = AO_FMT_NATIVE;
+
+	ao_option *options = NULL;
+	ao_append_option (&options, "client_name", PACKAGE);
+	if (dest->device) {
+		ao_append_option (&options, "dev", dest->device);
+	}
+	if (dest->id) {
+		ao_append_option (&options, "id", dest->id);
+	}
+	if (dest->server) {
+		ao_append_option (&options, "server", dest->server);
+	}
+
+	ao_device *device = ao_open_live (driver, &format, options);
+	if (device == NULL) {
+		flog (LOG_ERROR, "Cannot open audio device %s/%s/%s, trying default",
+			  dest->device ? dest->device : "default",
+			  dest->id ? dest->id : "default",
+			  dest->server ? dest->server : "default");
+		device = ao_open_live (driver, &format, NULL);
+	}
+	ao_free_options (options);
+	return device;
+}
+
+
+/* Close the device.  Called with the mutex held; drops it while closing. */
+static void close_device (AUDIO_OUTPUT *out) {
+	ao_device *device = out->device;
+	out->device = NULL;
+	atomic_set (out->ready, 0);
+	destination_free (&out->current);
+	pthread_mutex_unlock (&out->mutex);
+	ao_close (device);
+	pthread_mutex_lock (&out->mutex);
+}
+
+
+/* Bytes needed for a given depth and format, in whole frames */
+static size_t ring_size_for (int buffer_ms, unsigned long rate, int channels) {
+	size_t frame = (channels > 0 ? channels : 1) * sizeof (int16_t);
+	size_t frames = (size_t) rate * buffer_ms / 1000;
+	return (frames ? frames : 1) * frame;
+}
+
+
+/* Wake the other side if it's sleeping on the ring. */
+static void ring_wake (AUDIO_OUTPUT *out, int *waiting) {
+	if (atomic_get (*waiting)) {
+		pthread_mutex_lock (&out->mutex);
+		pthread_cond_broadcast (&out->changed);
+		pthread_mutex_unlock (&out->mutex);
+	}
+}
+
+
+/* Open the device for the requested destination, reusing the open one if
+   nothing changed.  Called by the output thread with the mutex held and
+   the ring empty. */
+static void reopen_device (AUDIO_OUTPUT *out) {
+	if (out->device && !destination_equal (&out->current, &out->requested)) {
+		close_device (out);
+	}
+	if (out->requested_size && out->requested_size != out->size &&
+		atomic_get (out->head) == out->tail) {
+		unsigned char *ring = malloc (out->requested_size);
+		if (ring) {
+			free (out->ring);
+			out->ring = ring;
+			out->size = out->requested_size;
+			atomic_set (out->head, 0);
+			atomic_set (out->tail, 0);
+		} else {
+			flog (LOG_ERROR, "audio output: malloc: %s", strerror (errno));
+		}
+	}
+	if (!out->device) {
+		AUDIO_DESTINATION dest;
+		memset (&dest, 0, sizeof (dest));
+		bool copied = destination_copy (&dest, &out->requested);
+		pthread_mutex_unlock (&out->mutex);
+		ao_device *device = copied ? open_device (&dest) : NULL;
+		pthread_mutex_lock (&out->mutex);
+		out->device = device;
+		if (device) {
+			out->current = dest;
+			atomic_set (out->ready, 1);
+		} else {
+			destination_free (&dest);
+		}
+	}
+	out->open_ok = (out->device != NULL);
+	out->last_played = time (NULL);
+}
+
+
+/* Output thread: play queued audio, opening and closing the device as needed. */
+static void *audio_output_thread (void *data) {
+	AUDIO_OUTPUT *out = data;
+	bool playing = false;
+
+	pthread_mutex_lock (&out->mutex);
+	while (!out->quit) {
+		size_t tail = out->tail;
+		size_t fill = atomic_get (out->head) - tail;
+		if (out->flush) {
+			atomic_set (out->tail, tail + fill);
+			out->flush = false;
+			playing = false;
+			pthread_cond_broadcast (&out->changed);
+			continue;
+		}
+		if (out->reconfigure && fill == 0) {
+			reopen_device (out);
+			out->reconfigure = false;
+			pthread_cond_broadcast (&out->changed);
+			continue;
+		}
+		if (fill > 0 && !out->device) {
+			/* Closed while idle; reopen it, or discard if we can't */
+			reopen_device (out);
+			if (!out->device) {
+				atomic_set (out->tail, tail + fill);
+				pthread_cond_broadcast (&out->changed);
+			}
+			continue;
+		}
+		if (fill == 0 || out->paused) {
+			if (fill == 0 && playing && out->streaming && !out->paused) {
+				out->underruns++;
+			}
+			playing = false;
+			if (out->device && fill == 0 &&
+				time (NULL) - out->last_played >= AUDIO_OUTPUT_IDLE_CLOSE) {
+				close_device (out);
+				continue;
+			}
+			/* Recheck after raising the flag, or we could miss a wakeup */
+			atomic_set (out->consumer_waiting, 1);
+			if (out->paused || atomic_get (out->head) == tail) {
+				struct timespec until;
+				clock_gettime (CLOCK_REALTIME, &until);
+				until.tv_sec += 1;
+				pthread_cond_timedwait (&out->changed, &out->mutex, &until);
+			}
+			atomic_set (out->consumer_waiting, 0);
+			continue;
+		}
+
+		/* Play from the ring without holding the mutex */
+		size_t offset = tail % out->size;
+		size_t chunk = fill;
+		if (chunk > out->size - offset) {
+			chunk = out->size - offset;
+		}
+		if (chunk > AUDIO_OUTPUT_CHUNK) {
+			chunk = AUDIO_OUTPUT_CHUNK;
+		}
+		ao_device *device = out->device;
+		pthread_mutex_unlock (&out->mutex);
+		ao_play (device, (char *) out->ring + offset, chunk);
+		atomic_set (out->tail, tail + chunk);
+		ring_wake (out, &out->producer_waiting);
+		pthread_mutex_lock (&out->mutex);
+		out->last_played = time (NULL);
+		playing = true;
+	}
+	if (out->device) {
+		close_device (out);
+	}
+	pthread_mutex_unlock (&out->mutex);
+	return NULL;
+}
+
+
+/* Create the audio output and start its thread.  The device is not opened
+   until audio_output_configure is called. */
+AUDIO_OUTPUT *audio_output_create (void) {
+	AUDIO_OUTPUT *out = calloc (1, sizeof (*out));
+	if (!out) {
+		flog (LOG_ERROR, "audio_output_create: calloc: %s", strerror (errno));
+		return NULL;
+	}
+	out->buffer_ms = AUDIO_OUTPUT_DEFAULT_BUFFER_MS;
+	out->size = ring_size_for (out->buffer_ms, 44100, 2);
+	if ((out->ring = malloc (out->size))) {
+		int err;
+		if ((err = pthread_mutex_init (&out->mutex, NULL)) == 0) {
+			if ((err = pthread_cond_init (&out->changed, NULL)) == 0) {
+				if ((err = pthread_create (&out->thread, NULL, audio_output_thread, out)) == 0) {
+					return out;
+				}
+				pthread_cond_destroy (&out->changed);
+			}
+			pthread_mutex_destroy (&out->mutex);
+		}
+		flog (LOG_ERROR, "audio_output_create: %s", strerror (err));
+	} else {
+		flog (LOG_ERROR, "audio_output_create: malloc: %s", strerror (errno));
+	}
+	free (out->ring);
+	free (out);
+	return NULL;
+}
+
+
+/* Stop the output thread and close the device.  Queued audio is discarded. */
+void audio_output_destroy (AUDIO_OUTPUT *out) {
+	if (!out) {
+		return;
+	}
+	pthread_mutex_lock (&out->mutex);
+	out->quit = true;
+	pthread_cond_broadcast (&out->changed);
+	pthread_mutex_unlock (&out->mutex);
+	pthread_join (out->thread, NULL);
+
+	pthread_cond_destroy (&out->changed);
+	pthread_mutex_destroy (&out->mutex);
+	destination_free (&out->requested);
+	destination_free (&out->current);
+	free (out->ring);
+	free (out);
+}
+
+
+/* Select the format and destination for the audio that follows.  If they
+   match the open device, it is kept; otherwise queued audio is played out
+   and the device reopened.  Returns false if the device can't be opened. */
+bool audio_output_configure (AUDIO_OUTPUT *out, unsigned long rate, int channels,
+							 const char *driver, const char *device,
+							 const char *id, const char *server) {
+	assert (out);
+	AUDIO_DESTINATION dest = { rate, channels, (char *) driver, (char *) device,
+							   (char *) id, (char *) server };
+	bool ok;
+	int cancel_state;
+
+	/* Player threads may be cancelled at shutdown; don't leave the mutex locked. */
+	pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &cancel_state);
+	pthread_mutex_lock (&out->mutex);
+	out->streaming = true;
+	out->underruns = 0;
+	size_t size = ring_size_for (out->buffer_ms, rate, channels);
+	if (out->device && destination_equal (&out->current, &dest) && size == out->size) {
+		ok = true;
+	} else if (!destination_copy (&out->requested, &dest)) {
+		flog (LOG_ERROR, "audio_output_configure: %s", strerror (ENOMEM));
+		ok = false;
+	} else {
+		out->requested_size = size;
+		out->reconfigure = true;
+		pthread_cond_broadcast (&out->changed);
+		while (out->reconfigure && !out->quit) {
+			pthread_cond_wait (&out->changed, &out->mutex);
+		}
+		ok = out->open_ok && !out->quit;
+	}
+	pthread_mutex_unlock (&out->mutex);
+	pthread_setcancelstate (cancel_state, NULL);
+	return ok;
+}
+
+
+/* Queue 16-bit samples for playback, waiting for room if the ring is full.
+   If the device was closed while idle, it is reopened.  Returns false if the
+   audio can't be played. */
+bool audio_output_play (AUDIO_OUTPUT *out, const void *samples, size_t size) {
+	assert (out);
+	const unsigned char *data = samples;
+	int cancel_state;
+
+	pthread_setcancelstate (PTHREAD_CANCEL_DISABLE, &cancel_state);
+	while (size > 0) {
+		if (!atomic_get (out->ready)) {
+			/* Rare: wait for the device to be (re)opened */
+			pthread_mutex_lock (&out->mutex);
+			out->reconfigure = true;
+			pthread_cond_broadcast (&out->changed);
+			while (out->reconfigure && !out->quit) {
+				pthread_cond_wait (&out->changed, &out->mutex);
+			}
+			bool ok = out->open_ok && !out->quit;
+			pthread_mutex_unlock (&out->mutex);
+			if (!ok) {
+				break;
+			}
+			continue;
+		}
+		size_t head = out->head;
+		size_t space = out->size - (head - atomic_get (out->tail));
+		if (space == 0) {
+			pthread_mutex_lock (&out->mutex);
+			atomic_set (out->producer_waiting, 1);
+			if (!out->quit && atomic_get (out->tail) + out->size == head) {
+				pthread_cond_wait (&out->changed, &out->mutex);
+			}
+			atomic_set (out->producer_waiting, 0);
+			bool quit = out->quit;
+			pthread_mutex_unlock (&out->mutex);
+			if (quit) {
+				break;
+			}
+			continue;
+		}
+		size_t offset = head % out->size;
+		size_t count = size;
+		if (count > space) {
+			count = space;
+		}
+		if (count > out->size - offset) {
+			count = out->size - offset;
+		}
+		memcpy (out->ring + offset, data, count);
+		atomic_set (out->head, head + count);
+		ring_wake (out, &out->consumer_waiting);
+		data += count;
+		size -= count;
+	}
+	pthread_setcancelstate (cancel_state, NULL);
+	return size == 0;
+}
+
+
+/* The player is done; the ring running dry from here on isn't an underrun. */
+void audio_output_finish (AUDIO_OUTPUT *out) {
+	if (!out) {
+		return;
+	}
+	pthread_mutex_lock (&out->mutex);
+	out->streaming = false;
+	pthread_mutex_unlock (&out->mutex);
+}
+
+
+/* Set ring depth in milliseconds.  Takes effect when the next song starts. */
+void audio_output_set_buffer (AUDIO_OUTPUT *out, int milliseconds) {
+	if (!out) {
+		return;
+	}
+	pthread_mutex_lock (&out->mutex);
+	out->buffer_ms = milliseconds;
+	pthread_mutex_unlock (&out->mutex);
+}
+
+
+/* Report ring fill level.  Returns false if the device isn't open. */
+bool audio_output_stats (AUDIO_OUTPUT *out, AUDIO_OUTPUT_STATS *stats) {
+	if (!out) {
+		return false;
+	}
+	pthread_mutex_lock (&out->mutex);
+	bool open = out->device != NULL;
+	if (open) {
+		size_t bytes_per_second = out->current.rate * out->current.channels * sizeof (int16_t);
+		size_t fill = atomic_get (out->head) - atomic_get (out->tail);
+		stats->buffered_ms = (int) ((unsigned long long) fill * 1000 / bytes_per_second);
+		stats->capacity_ms = (int) ((unsigned long long) out->size * 1000 / bytes_per_second);
+		stats->underruns = out->underruns;
+	}
+	pthread_mutex_unlock (&out->mutex);
+	return open;
+}
+
+
+/* Pause or resume output.  Queued audio is kept. */
+void audio_output_pause (AUDIO_OUTPUT *out, bool pause) {
+	if (!out) {
+		return;
+	}
+	pthread_mutex_lock (&out->mutex);
+	out->paused = pause;
+	pthread_cond_broadcast (&out->changed);
+	pthread_mutex_unlock (&out->mutex);
+}
+
+
+/* Discard queued audio, so a skip is heard immediately. */
+void audio_output_flush (AUDIO_OUTPUT *out) {
+	if (!out) {
+		return;
+	}
+	pthread_mutex_lock (&out->mutex);
+	if (atomic_get (out->head) != atomic_get (out->tail)) {
+		out->flush = true;
+		pthread_cond_broadcast (&out->changed);
+		while (out->flush && !out->quit) {
+			pthread_cond_wait (&out->changed, &out->mutex);
+		}
+	}
+	pthread_mutex_unlock (&out->mutex);
+}
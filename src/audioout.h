@@ -0,0 +1,35 @@
+/*
+ *  audioout.h
+ *  pianod - Persistent audio output.
+ *
+ */
+
+#ifndef _AUDIOOUT_H
+#define _AUDIOOUT_H
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct audio_output_t AUDIO_OUTPUT;
+
+typedef struct audio_output_stats_t {
+	int buffered_ms; /* Audio queued for the device */
+	int capacity_ms; /* Ring depth at the current format */
+	unsigned int underruns; /* Times the ring ran dry during the current song */
+} AUDIO_OUTPUT_STATS;
+
+extern AUDIO_OUTPUT *audio_output_create (void);
+extern void audio_output_destroy (AUDIO_OUTPUT *out);
+extern bool audio_output_configure (AUDIO_OUTPUT *out, unsigned long rate, int channels,
+									const char *driver, const char *device,
+									const char *id, const char *server);
+extern bool audio_output_play (AUDIO_OUTPUT *out, const void *samples, size_t size);
+extern void audio_output_finish (AUDIO_OUTPUT *out);
+extern void audio_output_set_buffer (AUDIO_OUTPUT *out, int milliseconds);
+extern bool audio_output_stats (AUDIO_OUTPUT *out, AUDIO_OUTPUT_STATS *stats);
+extern void audio_output_pause (AUDIO_OUTPUT *out, bool pause);
+extern void audio_output_flush (AUDIO_OUTPUT *out);
+
+#endif
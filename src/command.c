@@ -45,6 +45,7 @@
 #include "query.h"
 #include "users.h"
 #include "tuner.h"
+#include "metrics.h"
 
 #define countof(x) (sizeof (x) / sizeof (*x))
 
@@ -110,7 +111,7 @@ static FB_PARSE_DEFINITION userstatements[] = {
 };
 
 static FB_PARSE_DEFINITION adminstatements[] = {
-	{ SETAUDIOQUALITY,	"set audio quality <high|medium|low>" },		/* Set the audio quality */
+	{ SETAUDIOQUALITY,	"set audio quality <high|medium|low|auto>" },	/* Set the audio quality */
 	{ GETPANDORAUSER,	"get pandora user" },							/* Get Pandora account user/password */
 	{ GETRPCHOST,		"get rpc host" },								/* Read the RPC host */
 	{ SETRPCHOST,		"set rpc host {hostname}" },					/* libwaitress/libpiano setting */
@@ -134,6 +135,8 @@ static FB_PARSE_DEFINITION adminstatements[] = {
 	{ SETOUTPUTID,		"set audio output id [{#id}]" },				/* libao setting */
 	{ GETOUTPUTSERVER,	"get audio output server" },					/* libao setting */
 	{ SETOUTPUTSERVER,	"set audio output server [{server}]" },			/* libao setting */
+	{ GETAUDIOBUFFER,	"get audio buffer" },							/* Output buffer depth */
+	{ SETAUDIOBUFFER,	"set audio buffer {#milliseconds:100-10000}" },	/* Set aforementioned depth */
 	{ TESTAUDIOOUTPUT,	"test audio output" },							/* Output a test tone */
 #if defined(ENABLE_CAPTURE)
 	{ GETCAPTUREPATH,	"get capture" },
@@ -159,6 +162,9 @@ static FB_PARSE_DEFINITION adminstatements[] = {
 	{ SETVISITORRANK,	"set visitor rank " RANK_PATTERN },				/* Visitor privilege level */
 	{ AUTOTUNESETMODE,	"autotune mode <login|flag|all>" },				/* Which method to autotune by */
 	{ SHOWUSERACTIONS,	"announce user actions <on|off>" },				/* Whether to broadcast events */
+	{ SHOWMETRICS,		"metrics [{name}]" },							/* Latency histograms */
+	{ SHOWRESOLVER,		"resolver statistics" },						/* DNS cache hits/misses */
+	{ SHOWBANDWIDTH,	"bandwidth statistics" },						/* Throughput, stalls, quality */
 	{ SHUTDOWN,			"shutdown" },									/* Shutdown the player and quit */
 	{ USERCREATE,		"create <listener|user|admin> {user} {passwd}" },	/* Add a new user */
 	{ USERSETPASSWORD,	"set user password {user} {password}" },		/* Change a user's password */
@@ -301,7 +307,7 @@ static RESPONSE_CODE manipulate_quickmix (APPSTATE *app, FB_EVENT *event,
 		change_count = 2; /* Force generic change message */
 	}
 	while (*argv) {
-		station = PianoFindStationByName(app->ph.stations, *argv);
+		station = PianoLookupStationByName (&app->ph, *argv);
 		assert (station);
 		if (station) {
 			assert (!station->isQuickMix);
@@ -432,6 +438,8 @@ static void control_playback (APPSTATE *app, FB_EVENT *event, COMMAND cmd) {
 		 whether the playback thread restarts anew from the main run loop. */
 		reply (event, S_OK);
 	}
+	/* Queued audio must stop too, not just the decoder. */
+	audio_output_pause (app->output, app->playback_state == PAUSED);
 	if (app->playback_state == PAUSED) {
 		/* Reset stall data so we don't count pause as a stall */
 		memset (&app->stall, 0, sizeof (app->stall));
@@ -523,7 +531,7 @@ static void create_station_from_suggestion (APPSTATE *app, FB_EVENT *event,
 
 static void rename_station (APPSTATE *app, FB_EVENT *event,
 							  const char *from_name, char *to_name) {
-	PianoStation_t *station = PianoFindStationByName (app->ph.stations, from_name);
+	PianoStation_t *station = PianoLookupStationByName (&app->ph, from_name);
 	if (!station) {
 		reply (event, E_NOTFOUND);
 	}
@@ -612,7 +620,8 @@ static void authorize_and_execute (APPSTATE *app, FB_EVENT *event)
 	   in autotuning station calculations, reporting connected users, etc. */
 	fb_close_connection (event->connection);
 	USER_CONTEXT *user = (USER_CONTEXT *)event->context;
-	if ((user->user = authenticate_user (event->argv[2], event->argv[3]))) {
+	set_session_user (user, authenticate_user (event->argv[2], event->argv[3]));
+	if (user->user) {
 		/* We have to mangle argv, so copy the event and change it there. */
 		FB_EVENT child_event;
 		memcpy (&child_event, event, sizeof (child_event));
@@ -624,7 +633,7 @@ static void authorize_and_execute (APPSTATE *app, FB_EVENT *event)
 		} else {
 			execute_command(app, &child_event);
 		}
-		user->user = NULL; /* Prevent disconnect message */
+		set_session_user (user, NULL); /* Prevent disconnect message */
 	} else {
 		reply (event, E_CREDENTIALS);
 	}
@@ -635,20 +644,18 @@ static void authorize_and_execute (APPSTATE *app, FB_EVENT *event)
 
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wswitch"
-/* Process input from connection */
-void execute_command (APPSTATE *app, FB_EVENT *event) {
+/* Carry out an interpreted command */
+static void perform_command (APPSTATE *app, FB_EVENT *event, COMMAND cmd, char *errorpoint) {
 	USER_CONTEXT *context = (USER_CONTEXT *)event->context;
 	PianoStation_t *station;
 	PianoSong_t *song;
 	struct user_t *newuser;
-	char *errorpoint;
 	char *temp;
 	int i;
 	long l;
 #if defined(ENABLE_CAPTURE)
 	struct stat sbuf;
 #endif
-	COMMAND cmd = fb_interpret (app->parser, event->argv, &errorpoint);
 
 	/* UNPRIVILEGED COMMANDS START HERE. */
 	/* These guys aren't even authorized to get parser error messages. */
@@ -662,7 +669,7 @@ void execute_command (APPSTATE *app, FB_EVENT *event) {
 			fb_close_connection (event->connection);
 			return;
 		case AUTHENTICATE:
-			context->user = authenticate_user (event->argv[1], event->argv[2]);
+			set_session_user (context, authenticate_user (event->argv[1], event->argv[2]));
 			if (!context->user) {
 				reply (event, E_CREDENTIALS);
 				return;
@@ -706,7 +713,7 @@ void execute_command (APPSTATE *app, FB_EVENT *event) {
 				rename_station (app, event, event->argv[2], event->argv[4]);
 				return;
 			case STATIONDELETE:
-				if ((station = PianoFindStationByName(app->ph.stations, event->argv[2]))) {
+				if ((station = PianoLookupStationByName (&app->ph, event->argv[2]))) {
 					if (app->selected_station == station) {
 						app->selected_station = NULL;
 					}
@@ -832,7 +839,8 @@ void execute_command (APPSTATE *app, FB_EVENT *event) {
 			reply (event, S_DATA_END);
 			return;
 		case GETAUDIOQUALITY:
-			temp = PianoGetAudioQualityName (app->settings.audioQuality);
+			temp = app->settings.adaptive_quality ? "auto" :
+				   PianoGetAudioQualityName (app->settings.audioQuality);
 			report_setting (event, I_AUDIOQUALITY, temp);
 			return;
 		/* Pandora commands */
@@ -1032,7 +1040,7 @@ void execute_command (APPSTATE *app, FB_EVENT *event) {
 			 inappropriate songs will be skipped when track changes by
 			 purge_unselected_songs(). */
 			station = (cmd == PLAYQUICKMIX || cmd == SELECTQUICKMIX) ? PianoFindQuickMixStation (app->ph.stations) :
-																	   PianoFindStationByName(app->ph.stations, event->argv[2]);
+																	   PianoLookupStationByName (&app->ph, event->argv[2]);
 			if (station) {
 				app->selected_station = station;
 				app->automatic_stations = ((cmd == PLAYQUICKMIX || cmd == SELECTQUICKMIX) && strcasecmp (event->argv[1], "auto") == 0);
@@ -1107,14 +1115,20 @@ void execute_command (APPSTATE *app, FB_EVENT *event) {
             reply (event, S_OK);
 			return;
 		case SETAUDIOQUALITY:
+			/* An explicit quality overrides bandwidth adaptation */
+			app->settings.adaptive_quality = false;
 			if (strcasecmp (event->argv[3], "low") == 0) {
 				app->settings.audioQuality = PIANO_AQ_LOW;
 			} else if (strcasecmp (event->argv [3], "medium") == 0) {
 				app->settings.audioQuality = PIANO_AQ_MEDIUM;
+			} else if (strcasecmp (event->argv [3], "auto") == 0) {
+				app->settings.adaptive_quality = true;
+				app->bandwidth.upgrade_votes = 0;
 			} else {
 				app->settings.audioQuality = PIANO_AQ_HIGH;
 			}
-			temp = PianoGetAudioQualityName (app->settings.audioQuality);
+			temp = app->settings.adaptive_quality ? "auto" :
+				   PianoGetAudioQualityName (app->settings.audioQuality);
 			fb_fprintf (app->service, "%03d %s: %s\n", I_AUDIOQUALITY, Response (I_AUDIOQUALITY), temp);
 			reply (event, S_OK);
 			return;
@@ -1353,6 +1367,17 @@ void execute_command (APPSTATE *app, FB_EVENT *event) {
 		case SETOUTPUTSERVER:
 			change_setting (app, event, event->argv [4], &(app->settings.output_server));
 			return;
+		case GETAUDIOBUFFER:
+			reply (event, S_DATA);
+			fb_fprintf (event, "%03d %s: %d\n", I_AUDIO_BUFFER, Response (I_AUDIO_BUFFER), app->settings.audio_buffer);
+			reply (event, S_DATA_END);
+			return;
+		case SETAUDIOBUFFER:
+			app->settings.audio_buffer = atoi (event->argv [3]);
+			audio_output_set_buffer (app->output, app->settings.audio_buffer);
+			fb_fprintf (app->service, "%03d %s: %d\n", I_AUDIO_BUFFER, Response (I_AUDIO_BUFFER), app->settings.audio_buffer);
+			reply (event, S_OK);
+			return;
 		case TESTAUDIOOUTPUT:
 			if (app->current_song) {
 				reply (event, E_WRONG_STATE);
@@ -1373,6 +1398,22 @@ void execute_command (APPSTATE *app, FB_EVENT *event) {
 			app->settings.broadcast_user_actions = (strcasecmp (event->argv [3], "on") == 0);
 			reply (event, S_OK);
 			return;
+		case SHOWMETRICS:
+			send_metrics (event, event->argv [1]);
+			return;
+		case SHOWRESOLVER:
+			send_resolver_stats (event);
+			return;
+		case SHOWBANDWIDTH:
+			reply (event, S_DATA);
+			fb_fprintf (event, "%03d %s: quality %s auto %s estimate %.0fkbps tracks %u stalls %u startup %lums\n",
+						I_BANDWIDTH, Response (I_BANDWIDTH),
+						PianoGetAudioQualityName (app->settings.audioQuality),
+						app->settings.adaptive_quality ? "on" : "off",
+						app->bandwidth.estimate, app->bandwidth.tracks,
+						app->bandwidth.stalls, app->bandwidth.startup_ms);
+			reply (event, S_DATA_END);
+			return;
 		case SHUTDOWN:
 			/* Commence a server shutdown, which will take effect after the current song. */
 			app->quit_requested = true;
@@ -1488,6 +1529,37 @@ void execute_command (APPSTATE *app, FB_EVENT *event) {
 
 
 
+/* Process input from connection */
+void execute_command (APPSTATE *app, FB_EVENT *event) {
+	char *errorpoint;
+	uint64_t start = metrics_now ();
+	COMMAND cmd = fb_interpret (app->parser, event->argv, &errorpoint);
+	metrics_since (&metric_parse, 0, start);
+
+	start = metrics_now ();
+	perform_command (app, event, cmd, errorpoint);
+	if (cmd > 0) {
+		metrics_since (&metric_commands, cmd, start);
+	}
+}
+
+
+
+/* Label command metrics with the statement, up to its first parameter */
+static void label_command_metrics (const FB_PARSE_DEFINITION *statements, size_t count) {
+	size_t i;
+	for (i = 0; i < count; i++) {
+		const char *statement = statements [i].statement;
+		size_t length = strcspn (statement, "{<[#");
+		while (length > 0 && statement [length - 1] == ' ') {
+			length--;
+		}
+		metrics_label (&metric_commands, statements [i].response, statement, length);
+	}
+}
+
+
+
 /* Create a parser and add each group (one for each authorization level)
    of statement definitions to it.  All statements go in the same parser;
    authorization is handled by execute_command by checks between the
@@ -1499,6 +1571,7 @@ bool init_parser (APPSTATE *app) {
 		for (i = 0; i < countof (allstatements); i++) {
 			ok = fb_parser_add_statements (app->parser, allstatements [i].commandset,
 										   allstatements [i].count) && ok;
+			label_command_metrics (allstatements [i].commandset, allstatements [i].count);
 		}
 		if (ok) {
 			return true;
@@ -109,9 +109,14 @@ typedef enum my_commands_t {
 	SETOUTPUTID,
 	GETOUTPUTSERVER,
 	SETOUTPUTSERVER,
+	GETAUDIOBUFFER,
+	SETAUDIOBUFFER,
 	TESTAUDIOOUTPUT,
 	SETLOGGINGFLAGS,
 	SHOWUSERACTIONS,
+	SHOWMETRICS,
+	SHOWRESOLVER,
+	SHOWBANDWIDTH,
 	GETVISITORRANK,
 	SETVISITORRANK,
 	GETPAUSETIMEOUT,
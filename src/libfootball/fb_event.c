@@ -25,6 +25,8 @@
 #include <errno.h>
 #include <assert.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <stdbool.h>
 
 #include <assert.h>
@@ -71,9 +73,7 @@ static ssize_t fb_queue_single (FB_CONNECTION *connection, FB_MESSAGE *message)
 		return length;
 	}
     if (connection->http) {
-        if (fb_queue_add (&connection->assembly, message)) {
-            fb_websocket_encode (connection);
-        } else {
+        if (!fb_queue_websocket (connection, message)) {
             length = -1;
         }
     } else {
@@ -81,8 +81,9 @@ static ssize_t fb_queue_single (FB_CONNECTION *connection, FB_MESSAGE *message)
             length = -1;
         }
     }
-    /* This connection has nothing queued.  Try to send now, bypassing queueing. */
-    fb_send_output (NULL, connection);
+    /* Hold output until the application is done with this event, so a whole
+       response goes out together.  fb_poll* flushes it before waiting. */
+    fb_cork_output (connection);
 	return length;
 }
 
@@ -193,6 +194,60 @@ ssize_t fb_bvfprintf (void *thing, const char *format, va_list parameters) {
 
 
 
+/** @internal
+    Gather the front of an output queue into an I/O vector.
+    @param queue the queue to gather from.
+    @param iov the vector to fill in.
+    @param limit the number of entries in the vector.
+    @param max_bytes the maximum number of bytes to gather.
+    @param total on return, the number of bytes gathered.
+    @return the number of vector entries used. */
+static int fb_gather_output (FB_IOQUEUE *queue, struct iovec *iov, int limit,
+                             size_t max_bytes, ssize_t *total) {
+    int count = 0;
+    size_t offset = queue->consumed;
+    size_t gathered = 0;
+    FB_MESSAGELIST *q;
+    for (q = queue->first; q && count < limit && gathered < max_bytes; q = q->next) {
+        size_t length = q->message->length - offset;
+        if (length > max_bytes - gathered) {
+            length = max_bytes - gathered;
+        }
+        iov [count].iov_base = q->message->message + offset;
+        iov [count].iov_len = length;
+        gathered += length;
+        count++;
+        offset = 0;
+    }
+    *total = gathered;
+    return count;
+}
+
+#ifdef WORKING_LIBGNUTLS
+/** @internal
+    Send gathered output as a single TLS record.
+    Small messages are copied together so each doesn't get its own record.
+    @param connection the connection to send on.
+    @param iov the gathered output.
+    @param count the number of entries in the vector.
+    @param total the number of bytes in the vector, at most FB_TLS_RECORD_SIZE.
+    @return the value from gnutls_record_send. */
+static ssize_t fb_send_tls_record (FB_CONNECTION *connection, const struct iovec *iov, int count, ssize_t total) {
+    static char record [FB_TLS_RECORD_SIZE];
+    if (count == 1) {
+        return gnutls_record_send (connection->tls, iov [0].iov_base, iov [0].iov_len);
+    }
+    assert ((size_t) total <= sizeof (record));
+    char *fill = record;
+    int i;
+    for (i = 0; i < count; i++) {
+        memcpy (fill, iov [i].iov_base, iov [i].iov_len);
+        fill += iov [i].iov_len;
+    }
+    return gnutls_record_send (connection->tls, record, total);
+}
+#endif
+
 /** @internal
     Write output to a connection from the queue.
     Events are generated for connection closure only; there are none for writing.
@@ -226,18 +281,22 @@ FB_EVENT *fb_send_output (FB_EVENT *event, FB_CONNECTION *connection) {
 			fb_set_writable (connection->socket, false);
 		}
 	} else {
-        ssize_t written;
+        ssize_t written, total;
 		do {
-            FB_MESSAGE *message = connection->out.first->message;
-            size_t outlen = message->length - connection->out.consumed;
+            struct iovec iov [FB_OUTPUT_IOVECS];
             const char *error = NULL, *func = NULL;
 
 #ifdef WORKING_LIBGNUTLS
             if (connection->encrypted) {
-                written = gnutls_record_send (connection->tls,
-                                              message->message + connection->out.consumed,
-                                              outlen);
+                /* After EAGAIN, gnutls wants the same data again; the front of
+                   the queue is unchanged, so regather the same length. */
+                int count = fb_gather_output (&connection->out, iov, FB_OUTPUT_IOVECS,
+                                              connection->tls_retry ? connection->tls_retry
+                                                                    : FB_TLS_RECORD_SIZE, &total);
+                written = fb_send_tls_record (connection, iov, count, total);
+                connection->tls_retry = 0;
                 if (written == GNUTLS_E_AGAIN || written == GNUTLS_E_INTERRUPTED) {
+                    connection->tls_retry = total;
                     written = 0;
                 } else if (written < 0) {
                     func = "gnutls_record_send";
@@ -245,13 +304,16 @@ FB_EVENT *fb_send_output (FB_EVENT *event, FB_CONNECTION *connection) {
                 }
             } else {
 #endif
-                written = send (connection->socket,
-                                message->message + connection->out.consumed,
-                                outlen, MSG_NOSIGNAL);
+                struct msghdr msg;
+                memset (&msg, 0, sizeof (msg));
+                msg.msg_iov = iov;
+                msg.msg_iovlen = fb_gather_output (&connection->out, iov, FB_OUTPUT_IOVECS,
+                                                   SSIZE_MAX, &total);
+                written = sendmsg (connection->socket, &msg, MSG_NOSIGNAL);
                 if (written < 0 && (errno == EAGAIN || errno == EINTR)) {
                     written = 0;
                 } else if (written < 0) {
-                    func = "send";
+                    func = "sendmsg";
                     error = strerror (errno);
                 }
 #ifdef WORKING_LIBGNUTLS
@@ -267,7 +329,8 @@ FB_EVENT *fb_send_output (FB_EVENT *event, FB_CONNECTION *connection) {
                 fb_close_connection (connection);
                 break;
             }
-        } while (written > 0 && !fb_queue_empty (&connection->out));
+            /* A short write means the socket is full; wait until it's writable. */
+        } while (written == total && !fb_queue_empty (&connection->out));
         if (!fb_queue_empty (&connection->out)) {
             fb_set_writable (connection->socket, true);
         }
@@ -351,31 +414,73 @@ bool fb_recv_input (FB_CONNECTION *connection, ssize_t byte_count) {
     return bytes_read >= byte_count;
 }
 
+/** @internal
+    Discard input that has already been delivered, moving any remainder
+    to the front of the input buffer.
+    @param connection the connection whose buffer is compacted. */
+void fb_compact_input (FB_CONNECTION *connection) {
+    FB_INPUTBUFFER *in = &connection->in;
+    if (in->consumed) {
+        memmove (in->message, in->message + in->consumed, in->size - in->consumed);
+        in->size -= in->consumed;
+        in->consumed = 0;
+    }
+}
+
+/** @internal
+    Check if a complete line is waiting in the input buffer.
+    The socket manager uses this to deliver buffered lines without waiting
+    for the socket to become readable again.
+    @param connection the connection to check.
+    @return true if a line can be read without receiving more input. */
+bool fb_input_line_pending (FB_CONNECTION *connection) {
+    const FB_INPUTBUFFER *in = &connection->in;
+    bool line_mode = !connection->http || connection->state != FB_SOCKET_STATE_OPEN;
+    return (line_mode && in->size > in->consumed &&
+            memchr (in->message + in->consumed, '\n', in->size - in->consumed) != NULL);
+}
+
 /** @internal
     Read line-oriented input until encountering a newline.
-    If there isn't a newline, the read input is kept in the connection's
-    input buffer between invocations.
+    Whatever input is available is read in one go; lines beyond the first
+    stay in the connection's input buffer and are returned by subsequent
+    calls without reading the socket.  A partial line is kept between
+    invocations.
     @param connection the connection to read from.
     @param length the number of bytes in the completed input
     @return a pointer to the input, or NULL if it is not complete yet. */
 static char *fb_get_line_bytes (FB_CONNECTION *connection, size_t *length) {
     assert (connection);
-    bool ok;
-    do {
-        assert (connection->in.size <= connection->in.capacity);
-        if (connection->in.size == connection->in.capacity) {
-            if (!fb_set_input_buffer_size (connection, connection->in.capacity * 2 + 64)) {
+    FB_INPUTBUFFER *in = &connection->in;
+    assert (in->consumed <= in->size && in->size <= in->capacity);
+    char *line = in->message + in->consumed;
+    char *newline = (in->size > in->consumed ?
+                     memchr (line, '\n', in->size - in->consumed) : NULL);
+    if (!newline) {
+        fb_compact_input (connection);
+        if (in->capacity - in->size < FB_INPUT_READ_SIZE) {
+            if (!fb_set_input_buffer_size (connection, in->capacity * 2 + FB_INPUT_READ_SIZE)) {
                 return NULL;
             }
         }
-        ok = fb_recv_input (connection, 1);
-    } while (ok && connection->in.message [connection->in.size - 1] != '\n');
-    if (ok) {
-        *length = connection->in.size;
-        connection->in.size = 0;
-        return connection->in.message;
+        size_t scanned = in->size;
+        fb_recv_input (connection, in->capacity - in->size);
+        if (in->size == scanned) {
+            /* Nothing to read, or connection closed */
+            return NULL;
+        }
+        line = in->message;
+        newline = memchr (line + scanned, '\n', in->size - scanned);
+        if (!newline) {
+            return NULL;
+        }
     }
-    return NULL;
+    *length = newline + 1 - line;
+    in->consumed += *length;
+    if (in->consumed == in->size) {
+        in->consumed = in->size = 0;
+    }
+    return line;
 }
 
 /** @internal
@@ -92,7 +92,7 @@ static bool fb_queue_http (FB_CONNECTION *connection, char *message, size_t leng
         output->message = (char *)message;
         output->length = length;
         if (fb_queue_add (&connection->out, output)) {
-            fb_send_output (NULL, connection);
+            fb_cork_output (connection);
             return true;
         }
         fb_messagefree (output); /* Frees message with it */
@@ -503,13 +503,15 @@ static void perform_unmask (unsigned char *message, const unsigned long length,
 
 /** @internal
     Ensure that input buffer contains required number of bytes.
-    Read more input if necessary.
+    Read more input if necessary.  The buffer may already hold more
+    than required if the line reader read ahead before the connection
+    switched to WebSocket framing.
     @param connection the connection read from.
     @return true when the buffering requirements are met. */
 static bool fb_get_http_bytes (FB_CONNECTION *connection, size_t size) {
     assert (connection);
-    assert (size >= connection->in.size); /* Make sure we don't try to unread anything */
-    if (connection->in.size == size) {
+    assert (connection->in.consumed == 0);
+    if (connection->in.size >= size) {
         return true;
     }
     if (connection->in.capacity < size) {
@@ -528,6 +530,9 @@ static bool fb_get_http_bytes (FB_CONNECTION *connection, size_t size) {
     @param connection the connection to read from.
     @return an FB_EVENT_INPUT for the message received, or NULL if the packet is incomplete. */
 FB_EVENT *fb_read_websocket_input (FB_EVENT *event, FB_CONNECTION *connection) {
+    /* Drop the previous packet, if any, before reading the next. */
+    fb_compact_input (connection);
+
     /* We need at least 2 bytes to determine header size */
     if (!fb_get_http_bytes (connection, 2)) return NULL;
 
@@ -578,7 +583,10 @@ FB_EVENT *fb_read_websocket_input (FB_EVENT *event, FB_CONNECTION *connection) {
     if (!fb_get_http_bytes (connection, header_size + data_length)) return NULL;
     parse = (unsigned char *) connection->in.message + (parse - buffer);
     buffer = (unsigned char *) connection->in.message;
-    connection->in.size = 0;
+    connection->in.consumed = header_size + data_length;
+    if (connection->in.consumed == connection->in.size) {
+        connection->in.consumed = connection->in.size = 0;
+    }
 
     const unsigned char *mask = parse;
     parse += 4;
@@ -633,6 +641,105 @@ FB_EVENT *fb_read_websocket_input (FB_EVENT *event, FB_CONNECTION *connection) {
 
 
 
+/** @internal
+    Write a WebSocket text frame header.
+    @param header where to put the header, with room for WS_HEADER_MAXIMUM bytes.
+    @param message_size the length of the payload that will follow.
+    @return the size of the header. */
+static size_t fb_websocket_header (unsigned char *header, size_t message_size) {
+    size_t header_size = 2;
+
+    const bool fin = true; /* We never fragment headers currently. */
+    header [WS_OPCODE] = (fin ? WS_FIN : 0) | WSOC_TEXT;
+
+    unsigned char length_byte;
+    if (message_size <= WS_PAYLOAD_MAX_8BIT) {
+        length_byte = message_size;
+    } else if (message_size <= WS_PAYLOAD_MAX_16BIT) {
+        length_byte = WS_PAYLOAD_MAGIC_16BIT;
+        *(uint16_t *) (header + header_size) = htons (message_size);
+        header_size += 2;
+    } else {
+        length_byte = WS_PAYLOAD_MAGIC_64BIT;
+        *(uint32_t *) (header + header_size) = 0;
+        *(uint32_t *) (header + header_size + 4) = htonl ((uint32_t) message_size);
+        header_size += 8;
+    }
+    header [WS_PAYLOAD] = length_byte;
+    return header_size;
+}
+
+/** @internal
+    Get a message's WebSocket encoding, building it the first time it's needed.
+    Each line becomes a text frame.  The encoding is kept with the message, so
+    a broadcast is framed once and shared by every WebSocket connection; since
+    TLS is applied when sending, the same frames serve encrypted connections.
+    @param message a message consisting of complete lines.
+    @return the encoded message, or NULL on failure. */
+static FB_MESSAGE *fb_websocket_encoding (FB_MESSAGE *message) {
+    if (message->websocket) {
+        return message->websocket;
+    }
+    /* Total up the payloads and headers so we only allocate once. */
+    size_t encoded_size = 0;
+    const char *line = message->message;
+    const char *end = message->message + message->length;
+    const char *newline;
+    unsigned char scratch [WS_HEADER_MAXIMUM];
+    for (; (newline = memchr (line, '\n', end - line)); line = newline + 1) {
+        encoded_size += fb_websocket_header (scratch, newline - line) + (newline - line);
+    }
+    assert (line == end);
+
+    FB_MESSAGE *encoded = fb_messagealloc ();
+    if (!encoded) {
+        return NULL;
+    }
+    unsigned char *frame = malloc (encoded_size ? encoded_size : 1);
+    if (!frame) {
+        fb_perror ("malloc");
+        fb_messagefree (encoded);
+        return NULL;
+    }
+    encoded->message = (char *) frame;
+    encoded->length = encoded_size;
+    for (line = message->message; (newline = memchr (line, '\n', end - line)); line = newline + 1) {
+        frame += fb_websocket_header (frame, newline - line);
+        memcpy (frame, line, newline - line);
+        frame += newline - line;
+    }
+    assert (frame == (unsigned char *) encoded->message + encoded_size);
+    message->websocket = encoded;
+    return encoded;
+}
+
+/** @internal
+    Queue a message for a WebSocket connection.
+    Complete lines use the message's shared WebSocket encoding.  If there's a partial
+    line in assembly, or this message ends with one, it goes through assembly instead.
+    The caller's reference to the message is taken over.
+    @param connection the connection to send to.
+    @param message the message to send.
+    @return true on success, false on failure. */
+bool fb_queue_websocket (FB_CONNECTION *connection, FB_MESSAGE *message) {
+    if (fb_queue_empty (&connection->assembly) &&
+        message->length > 0 && message->message [message->length - 1] == '\n') {
+        FB_MESSAGE *encoded = fb_websocket_encoding (message);
+        bool ok = (encoded && fb_queue_add (&connection->out, encoded));
+        if (ok) {
+            encoded->usecount++;
+            fb_cork_output (connection);
+        }
+        fb_messagefree (message);
+        return ok;
+    }
+    if (fb_queue_add (&connection->assembly, message)) {
+        return fb_websocket_encode (connection);
+    }
+    fb_messagefree (message);
+    return false;
+}
+
 /** @internal
     Build WebSocket packets from output.
     Checks if there's a complete packet (line) in the assembly queue.
@@ -669,25 +776,7 @@ bool fb_websocket_encode (FB_CONNECTION *connection) {
 
     /* Construct the header */
     unsigned char *header = (unsigned char *) message;
-    size_t header_size = 2;
-
-    const bool fin = true; /* We never fragment headers currently. */
-    header [WS_OPCODE] = (fin ? WS_FIN : 0) | WSOC_TEXT;
-
-    unsigned char length_byte;
-    if (message_size <= WS_PAYLOAD_MAX_8BIT) {
-        length_byte = message_size;
-    } else if (message_size <= WS_PAYLOAD_MAX_16BIT) {
-        length_byte = WS_PAYLOAD_MAGIC_16BIT;
-        *(uint16_t *) (header + header_size) = htons (message_size);
-        header_size += 2;
-    } else {
-        length_byte = WS_PAYLOAD_MAGIC_64BIT;
-        *(uint32_t *) (header + header_size) = 0;
-        *(uint32_t *) (header + header_size + 4) = htonl ((uint32_t) message_size);
-        header_size += 8;
-    }
-    header [WS_PAYLOAD] = length_byte;
+    size_t header_size = fb_websocket_header (header, message_size);
 
     /* Assemble the message. */
     unsigned char *msg = header + header_size;
@@ -1084,6 +1173,47 @@ static bool http_serve_data (FB_CONNECTION *connection, char *name, FILE *file,
     return ok;
 }
 
+/** @internal
+    Serve content produced by the service's dynamic content function.
+    @param connection the connection to serve.
+    @param name the name of the content being served.
+    @param body the content, allocated with malloc; this function frees it.
+    @param media_type the content's media type.
+    @param sendbody true if the content should be served (GET request), false if not (HEAD) */
+static bool http_serve_content (FB_CONNECTION *connection, const char *name,
+                                char *body, const char *media_type, bool sendbody) {
+    char servedate [30];
+    struct tm servetime;
+    time_t when = time (NULL);
+    gmtime_r (&when, &servetime);
+    strftime (servedate, sizeof (servedate), "%a, %d %b %Y %H:%M:%S GMT", &servetime);
+
+    fb_log (FB_WHERE (FB_LOG_HTTP_TRAFFIC), "%#d: %s: HTTP request: %s %s (dynamic)", connection->socket,
+            connection->service->options.name ? connection->service->options.name : "Unnamed service",
+            sendbody ? "GET" : "HEAD", name);
+
+    size_t body_length = strlen (body);
+    char *header;
+    int length = asprintf (&header,
+            HTTP_VERSION " 200 Ok\r\nDate: %s\r\nCache-Control: no-cache\r\n"
+                         "Content-length: %u\r\n"
+            "Content-type: %s\r\nServer: pianod-" VERSION "\r\n\r\n",
+            servedate, (unsigned int) body_length, media_type);
+    if (length <= 0) {
+        fb_perror ("asprintf");
+        free (body);
+        http_response (connection, "500 Internal server error");
+        return false;
+    }
+    bool ok = fb_queue_http (connection, header, length);
+    if (sendbody && body_length) {
+        ok = ok && fb_queue_http (connection, body, body_length);
+    } else {
+        free (body);
+    }
+    return ok;
+}
+
 /** @internal
     Determine request maliciousness.
     Assess the filename of a GET/HEAD request to see if it looks maliciously crafted.
@@ -1120,9 +1250,16 @@ static bool http_file_request (FB_CONNECTION *connection) {
     } else {
         filename = strdup ("index.html");
     }
+    char *content = NULL;
+    const char *media_type = NULL;
     if (!filename) {
         http_response (connection, "500 Internal server error");
         failure = true;
+    } else if (options->dynamic_content &&
+               (content = options->dynamic_content (filename, &media_type))) {
+        if (!http_serve_content (connection, filename, content, media_type, !request->headonly)) {
+            failure = true;
+        }
     } else if (!options->serve_directory) {
 		http_response (connection, "503 Service unavailable");
     } else if (malicious_request (filename)) {
@@ -65,6 +65,9 @@ void fb_messagefree (FB_MESSAGE *freethis) {
 		if (freethis->message) {
 			free (freethis->message);
 		}
+		if (freethis->websocket) {
+			fb_messagefree (freethis->websocket);
+		}
 		freethis->message = (char *) freemessages;
 		freemessages = freethis;
 	}
@@ -141,7 +144,8 @@ bool fb_queue_add (FB_IOQUEUE *queue, FB_MESSAGE *message) {
 
 /** @internal
     Consume bytes at the front of the queue.
-    Bytes consumed must not exceed the remaining bytes in the front message block.
+    Bytes consumed may span several message blocks, but must not exceed
+    the total remaining in the queue.
     @param q the queue
     @param consume The number of bytes to consume. */
 void fb_queue_consume (FB_IOQUEUE *q, size_t consume) {
@@ -150,10 +154,9 @@ void fb_queue_consume (FB_IOQUEUE *q, size_t consume) {
     assert (consume == 0 || q->first);
     /* Skip past the portion transmitted */
     q->consumed += consume;
-    assert (q->consumed <= q->first->message->length);
-    if (q->consumed >= q->first->message->length) {
+    while (q->first && q->consumed >= q->first->message->length) {
         /* We finished with this message. Free it and move to the next. */
-        q->consumed = 0;
+        q->consumed -= q->first->message->length;
         FB_MESSAGELIST *freethis = q->first;
         q->first = q->first->next;
         if (q->first == NULL) {
@@ -161,6 +164,7 @@ void fb_queue_consume (FB_IOQUEUE *q, size_t consume) {
         }
         fb_qfree (freethis);
     }
+    assert (q->consumed == 0 || q->first);
 }
 
 /** @internal
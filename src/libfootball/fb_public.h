@@ -62,6 +62,11 @@ typedef enum fb_service_greeting_mode_t {
     FB_GREETING_REQUIRE /**< Both line and HTTP sessions wait for HELO.  Require HELO to start line session */
 } FB_GREETING_MODE;
 
+/** Dynamic content generator for HTTP requests.  Given the requested filename,
+    returns the body (allocated with malloc) and sets its media type, or returns
+    NULL to serve the request from the serve directory. */
+typedef char *(* FB_HTTP_CONTENT_FUNCTION)(const char *filename, const char **media_type);
+
 /** Service options are passed to a new service, defining its behavior. */
 typedef struct fb_service_options_t {
     int line_port; /**< Line-oriented port, or 0 to disable. */
@@ -72,6 +77,7 @@ typedef struct fb_service_options_t {
     char *greeting; /**< Default HELO */
     char *name; /**< Name of service, for URL processing. */
     char *serve_directory; /**< Location of files to be served by HTTP */
+    FB_HTTP_CONTENT_FUNCTION dynamic_content; /**< Generator for content not served from files, or NULL */
     FB_GREETING_MODE greeting_mode; /**< Whether to accept/require greeting.  See FB_GREETING_MODE */
     bool transfer_only; /** Service will accept transfers; no ports required. */
     struct fb_service_t *parent; /** Parent that may direct HELO and URLs to us */
@@ -126,10 +132,12 @@ extern bool fb_init_tls_support (const char *path);
 
 extern FB_EVENT *fb_accept_file (FB_SERVICE *service, char *filename);
 extern void fb_close_connection (FB_CONNECTION *connection);
+extern bool fb_connection_is_open (FB_CONNECTION *connection);
 extern ssize_t fb_fprintf (void *thing, const char *format, ...);
 extern ssize_t fb_vfprintf (void *thing, const char *format, va_list parameters);
 extern ssize_t fb_bfprintf (void *thing, const char *format, ...);
 extern ssize_t fb_bvfprintf (void *thing, const char *format, va_list parameters);
+extern void fb_flush_output (void);
 
 extern struct fb_parser_t *fb_create_parser (void);
 extern bool fb_parser_add_statements (FB_PARSER *parser, const FB_PARSE_DEFINITION def[], const size_t count);
@@ -141,6 +149,9 @@ extern FB_EVENT *fb_iterate_next (struct fb_iterator_t *it);
 extern void fb_destroy_iterator (FB_ITERATOR *it);
 extern void fb_accept_input (FB_CONNECTION *connection, bool input);
 
+extern bool fb_register_user_socket (int socket_fd, void *context);
+extern void fb_unregister_user_socket (int socket_fd);
+
 #ifdef __cplusplus
 }
 #endif
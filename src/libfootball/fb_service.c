@@ -497,6 +497,15 @@ void fb_close_connection (FB_CONNECTION *connection) {
 }
 
 
+/** Check whether a connection is open.
+    @param connection the connection to check
+    @return true if the connection is open, false if it is closing. */
+bool fb_connection_is_open (FB_CONNECTION *connection) {
+	assert (connection);
+	return connection->state == FB_SOCKET_STATE_OPEN;
+}
+
+
 
 /** Make a connection that reads from a file.
     @service the service to register the connection with
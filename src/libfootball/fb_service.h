@@ -48,6 +48,13 @@ typedef enum fb_log_types_t {
     FB_LOG_HTTP_ERROR = 0x2000,
     FB_LOG_HTTP_TRAFFIC = 0x4000,
 } FB_LOG_TYPE;
+/** Minimum free space in the input buffer before reading line input */
+#define FB_INPUT_READ_SIZE (1024)
+/** Maximum number of queued messages gathered into one send */
+#define FB_OUTPUT_IOVECS (64)
+/** Size of TLS records assembled from queued messages */
+#define FB_TLS_RECORD_SIZE (16384)
+
 /** Use FB_WHERE to send the log type; this macro includes the file, line and function
     when NDEBUG is not set. */
 #ifdef NDEBUG
@@ -125,6 +132,7 @@ typedef struct fb_message_t {
 	int usecount; /**< How many message lists this message is currently used in */
 	ssize_t length; /**< Length of this message */
 	char *message; /**< The message */
+	struct fb_message_t *websocket; /**< WebSocket-framed copy, built when first needed */
 } FB_MESSAGE;
 
 /** Q list structure.  Per-connection list of its messages. */
@@ -144,6 +152,7 @@ typedef struct fb_ioqueue_t {
 typedef struct fb_inputbuffer_t {
     size_t size; /**< Number of bytes currently in buffer */
     size_t capacity; /**< Maximum capacity of the buffer */
+    size_t consumed; /**< Bytes at the front of the buffer already delivered */
     char *message; /**< The buffer */
 } FB_INPUTBUFFER;
 
@@ -175,7 +184,9 @@ struct fb_connection_t {
     bool encrypted; /**< Flag set for TLS connections. */
 #ifdef WORKING_LIBGNUTLS
     gnutls_session_t tls; /**< TLS encryption state information */
+    size_t tls_retry; /**< Length of a TLS send to repeat, after it would have blocked */
 #endif
+    bool corked; /**< Output has been queued but not sent since the last poll */
     FB_HTTPREQUEST request;
     FB_IOQUEUE assembly; /**< Output to websocket, awaiting assembly to a WebSocket packet. */
     FB_IOQUEUE out; /**< Output ready to go out the socket. */
@@ -232,6 +243,8 @@ extern void fb_destroy_connection (FB_CONNECTION *connection);
 /* Event handling functions */
 extern bool fb_set_input_buffer_size (FB_CONNECTION *connection, size_t size);
 extern bool fb_recv_input (FB_CONNECTION *connection, ssize_t byte_count);
+extern void fb_compact_input (FB_CONNECTION *connection);
+extern bool fb_input_line_pending (FB_CONNECTION *connection);
 extern FB_EVENT *fb_read_input (FB_EVENT *event, FB_CONNECTION *connection);
 extern FB_EVENT *fb_new_connect (FB_EVENT *event, FB_SERVICE *service);
 extern FB_EVENT *fb_send_output (FB_EVENT *event, FB_CONNECTION *connection);
@@ -239,6 +252,7 @@ extern FB_EVENT *fb_send_output (FB_EVENT *event, FB_CONNECTION *connection);
 /* HTTP & Websocket support */
 extern FB_EVENT *fb_read_websocket_input (FB_EVENT *event, FB_CONNECTION *connection);
 extern bool fb_websocket_encode (FB_CONNECTION *connection);
+extern bool fb_queue_websocket (FB_CONNECTION *connection, FB_MESSAGE *message);
 extern void fb_destroy_httprequest (FB_HTTPREQUEST *request);
 extern void fb_collect_http_request (FB_EVENT *event, FB_HTTPREQUEST *request);
 extern void fb_collect_http_parameter (char *line, FB_HTTPREQUEST *request);
@@ -256,6 +270,7 @@ extern gnutls_priority_t fb_get_tls_priorities (void);
 extern void fb_set_buffering (int socket_fd, bool enable);
 extern void fb_set_readable (int socket, bool enable);
 extern void fb_set_writable (int socket, bool enable);
+extern void fb_cork_output (FB_CONNECTION *connection);
 
 /* Command line parsing */
 extern int fb_create_argv (const char *commandline, char ***result, char ***remainder);
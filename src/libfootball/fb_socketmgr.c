@@ -31,17 +31,30 @@
 
 #include "fb_service.h"
 
+#if defined (HAVE_SYS_EPOLL_H) && defined (HAVE_EPOLL_CREATE1)
+#define FB_USE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 /* Some Linuxes seem to be missing these */
 #ifndef FD_COPY
 #define FD_COPY(from,to) memmove(to, from, sizeof(*(from)))
 #endif
 
+#define countof(x) (sizeof (x) / sizeof (*x))
+
 /* The strategy here is to just register sockets in an array by their socket number.
    When socket N needs attention, it's easy and fast to find.  We also store the
    socket number in with that data, so can refer back. */
 typedef struct socket_data_t {
 	int socket;
 	FB_SOCKETTYPE type;
+	unsigned int flags; /**< Bitmask of actions requested for this socket */
+	unsigned int pending; /**< Bitmask of actions sitting in the ready list */
+#ifdef FB_USE_EPOLL
+	bool polling; /**< Socket is currently in the epoll set */
+	bool unpollable; /**< epoll refuses this descriptor (regular files); always ready */
+#endif
 	union {
 		FB_CONNECTION *connection;
 		FB_SERVICE *service;
@@ -49,8 +62,8 @@ typedef struct socket_data_t {
 	} thingie; /* Holds one of those thingies, y'know? */
 } FB_SOCKET_DATA;
 
-/* We need 3 bit arrays for the select() system call, one for each possible
-   I/O state for each socket. We need a fourth for GNUTLS, which may buffer too. */
+/* Each socket may be waiting to read, write, or for a fault (out-of-band data).
+   Buffering is for GNUTLS, which may have data it read ahead in its buffers. */
 typedef enum select_action_t {
 	ACTION_READING,
 	ACTION_WRITING,
@@ -59,16 +72,295 @@ typedef enum select_action_t {
 	ACTION_COUNT,
     ACTION_SELECT_COUNT = 3
 } ACTION;
+#define ACTION_FLAG(action) (1u << (action))
+#define ACTION_SELECT_FLAGS (ACTION_FLAG (ACTION_READING) | ACTION_FLAG (ACTION_WRITING) | \
+                             ACTION_FLAG (ACTION_FAULTING))
+
+/* The event backend reports sockets needing attention as a list of these,
+   so the work done per poll depends on the number of ready sockets. */
+typedef struct ready_socket_t {
+	int socket;
+	ACTION action;
+} FB_READY;
+
+/* A small list of file descriptors, for those that need special attention. */
+typedef struct fd_list_t {
+	int *fds;
+	size_t count;
+	size_t capacity;
+} FB_FD_LIST;
 
 
 static FB_SERVICE *reapq = NULL;
 static FB_SOCKET_DATA **sockets; /**< Index by socket number to service/connection/etc. */
 static int maxsockets = 0;
 static int activesockets = 0;
-static fd_set select_state [ACTION_COUNT];	/**< What we'll use on the next select() */
-static fd_set last_state [ACTION_SELECT_COUNT];	/**< What came back on the last select() */
+static FB_READY *ready; /**< Sockets the backend found ready on the last poll */
+static size_t ready_count = 0;
+static size_t ready_capacity = 0;
+static FB_FD_LIST buffering; /**< Sockets with TLS data or complete lines buffered */
+static FB_FD_LIST corked; /**< Connections with output held until the next poll */
+#ifdef FB_USE_EPOLL
+static int epoll_fd = -1;
+static FB_FD_LIST unpollables; /**< Sockets epoll won't accept */
+#else
+static fd_set select_state [ACTION_SELECT_COUNT];	/**< What we'll use on the next select() */
+#endif
 static FB_EVENT *queued_event = NULL; /**< Pending event (NULL if none, or single event. */
-static bool tls_currently_buffering; /**< Set when TLS has stuff in its buffers. */
+static bool tls_currently_buffering; /**< Set when TLS or line input has stuff in its buffers. */
+
+
+/** @internal
+    Add a file descriptor to a list, if it isn't already there.
+    @param list the list to add to.
+    @param socket_fd the descriptor to add.
+    @return true on success, false on failure. */
+static bool fb_fdlist_add (FB_FD_LIST *list, int socket_fd) {
+	size_t i;
+	for (i = 0; i < list->count; i++) {
+		if (list->fds [i] == socket_fd) {
+			return true;
+		}
+	}
+	if (!fb_expandcalloc ((void **) &list->fds, &list->capacity, list->count + 1, sizeof (int))) {
+		fb_perror ("fb_expandcalloc");
+		return false;
+	}
+	list->fds [list->count++] = socket_fd;
+	return true;
+}
+
+/** @internal
+    Remove a file descriptor from a list, if it's there.
+    @param list the list to remove from.
+    @param socket_fd the descriptor to remove. */
+static void fb_fdlist_remove (FB_FD_LIST *list, int socket_fd) {
+	size_t i;
+	for (i = 0; i < list->count; i++) {
+		if (list->fds [i] == socket_fd) {
+			list->fds [i] = list->fds [--list->count];
+			return;
+		}
+	}
+}
+
+/** @internal
+    Add a socket to the ready list, unless it's already there for that action.
+    @param socket_fd the ready socket.
+    @param action what it's ready for.
+    @return true if added, false if already present or out of memory. */
+static bool fb_add_ready (int socket_fd, ACTION action) {
+	FB_SOCKET_DATA *socket_data = sockets [socket_fd];
+	assert (socket_data);
+	if (socket_data->pending & ACTION_FLAG (action)) {
+		return false;
+	}
+	if (!fb_expandcalloc ((void **) &ready, &ready_capacity, ready_count + 1, sizeof (FB_READY))) {
+		fb_perror ("fb_expandcalloc");
+		return false;
+	}
+	ready [ready_count].socket = socket_fd;
+	ready [ready_count].action = action;
+	ready_count++;
+	socket_data->pending |= ACTION_FLAG (action);
+	return true;
+}
+
+
+/*
+ *                  Event backends
+ * Each backend provides initialization, a function to update the
+ * events a socket is interested in, and a wait function that fills
+ * the ready list.  epoll is used where available; select otherwise.
+ */
+
+#ifdef FB_USE_EPOLL
+/** @internal
+    Create the epoll instance.
+    @return true on success, false on failure. */
+static bool fb_backend_init (void) {
+	if (epoll_fd < 0) {
+		epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+		if (epoll_fd < 0) {
+			fb_perror ("epoll_create1");
+			return false;
+		}
+	}
+	return true;
+}
+
+/** @internal
+    Adjust the epoll registration for a socket to match its flags.
+    Sockets with nothing to wait for are removed from the epoll set,
+    since hangups and errors are otherwise reported whether requested or not.
+    @param socket_data the socket to update. */
+static void fb_backend_update (FB_SOCKET_DATA *socket_data) {
+	unsigned int flags = socket_data->flags & ACTION_SELECT_FLAGS;
+	if (socket_data->unpollable) {
+		return;
+	}
+	if (flags == 0) {
+		if (socket_data->polling) {
+			if (epoll_ctl (epoll_fd, EPOLL_CTL_DEL, socket_data->socket, NULL) < 0) {
+				fb_perror ("epoll_ctl");
+			}
+			socket_data->polling = false;
+		}
+		return;
+	}
+	struct epoll_event ev;
+	memset (&ev, 0, sizeof (ev));
+	ev.data.fd = socket_data->socket;
+	if (flags & ACTION_FLAG (ACTION_READING)) ev.events |= EPOLLIN;
+	if (flags & ACTION_FLAG (ACTION_WRITING)) ev.events |= EPOLLOUT;
+	if (flags & ACTION_FLAG (ACTION_FAULTING)) ev.events |= EPOLLPRI;
+	if (epoll_ctl (epoll_fd, socket_data->polling ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+				   socket_data->socket, &ev) == 0) {
+		socket_data->polling = true;
+	} else if (errno == EPERM) {
+		/* Regular files can't be polled, but are always ready (like select). */
+		socket_data->unpollable = true;
+		fb_fdlist_add (&unpollables, socket_data->socket);
+	} else {
+		fb_perror ("epoll_ctl");
+	}
+}
+
+/** @internal
+    Remove a socket from the backend on unregistration.
+    @param socket_data the socket being unregistered. */
+static void fb_backend_remove (FB_SOCKET_DATA *socket_data) {
+	socket_data->flags = 0;
+	fb_backend_update (socket_data);
+	if (socket_data->unpollable) {
+		fb_fdlist_remove (&unpollables, socket_data->socket);
+	}
+}
+
+/** @internal
+    Wait for activity and populate the ready list.
+    @param timeout Duration to wait, or NULL for indefinite wait.
+    @return number of ready sockets, or -1 on error. */
+static int fb_backend_wait (struct timeval *timeout) {
+	struct epoll_event events [64];
+	int timeout_ms = -1;
+	int count, i;
+	size_t u;
+
+	/* Regular files are always ready: don't wait if there's one. */
+	for (u = 0; u < unpollables.count; u++) {
+		FB_SOCKET_DATA *socket_data = sockets [unpollables.fds [u]];
+		int action;
+		for (action = 0; action < ACTION_SELECT_COUNT; action++) {
+			if (socket_data->flags & ACTION_FLAG (action)) {
+				fb_add_ready (socket_data->socket, action);
+			}
+		}
+	}
+	if (ready_count || tls_currently_buffering) {
+		timeout_ms = 0;
+	} else if (timeout) {
+		timeout_ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+	}
+	do {
+		count = epoll_wait (epoll_fd, events, countof (events), timeout_ms);
+	} while (timeout_ms != 0 && count < 0 && errno == EINTR);
+	if (count < 0) {
+		return errno == EINTR ? (int) ready_count : -1;
+	}
+
+	/* Mirror select's ordering: all reads, then writes, then faults. */
+	for (i = 0; i < count; i++) {
+		FB_SOCKET_DATA *socket_data = sockets [events [i].data.fd];
+		if (socket_data && (events [i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) &&
+			(socket_data->flags & ACTION_FLAG (ACTION_READING))) {
+			fb_add_ready (events [i].data.fd, ACTION_READING);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		FB_SOCKET_DATA *socket_data = sockets [events [i].data.fd];
+		if (socket_data && (events [i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) &&
+			(socket_data->flags & ACTION_FLAG (ACTION_WRITING))) {
+			fb_add_ready (events [i].data.fd, ACTION_WRITING);
+		}
+	}
+	for (i = 0; i < count; i++) {
+		FB_SOCKET_DATA *socket_data = sockets [events [i].data.fd];
+		if (socket_data && (events [i].events & EPOLLPRI) &&
+			(socket_data->flags & ACTION_FLAG (ACTION_FAULTING))) {
+			fb_add_ready (events [i].data.fd, ACTION_FAULTING);
+		}
+	}
+	return (int) ready_count;
+}
+
+#else /* select */
+
+/** @internal
+    Initialize the select state.
+    @return true. */
+static bool fb_backend_init (void) {
+	memset (&select_state, 0, sizeof (select_state));
+	return true;
+}
+
+/** @internal
+    Update the select masks to match a socket's flags.
+    @param socket_data the socket to update. */
+static void fb_backend_update (FB_SOCKET_DATA *socket_data) {
+	int action;
+	for (action = 0; action < ACTION_SELECT_COUNT; action++) {
+		if (socket_data->flags & ACTION_FLAG (action)) {
+			FD_SET (socket_data->socket, &select_state [action]);
+		} else {
+			FD_CLR (socket_data->socket, &select_state [action]);
+		}
+	}
+}
+
+/** @internal
+    Remove a socket from the select masks on unregistration.
+    @param socket_data the socket being unregistered. */
+static void fb_backend_remove (FB_SOCKET_DATA *socket_data) {
+	socket_data->flags = 0;
+	fb_backend_update (socket_data);
+}
+
+/** @internal
+    Select and populate the ready list.
+    @param timeout Duration to select, or NULL for indefinite wait.
+    @return number of ready sockets, or -1 on error. */
+static int fb_backend_wait (struct timeval *timeout) {
+	fd_set last_state [ACTION_SELECT_COUNT];
+	int count, fd, action;
+
+	/* Create a fresh copy of the selector masks */
+	for (action = 0; action < ACTION_SELECT_COUNT; action++) {
+		FD_COPY(&select_state[action], &last_state [action]);
+	}
+	/* Select, repeating if we get an interrupted system call */
+	do {
+		struct timeval zero;
+		zero.tv_sec = 0;
+		zero.tv_usec = 0;
+		count = select (activesockets, &last_state [ACTION_READING],
+						&last_state [ACTION_WRITING], &last_state [ACTION_FAULTING],
+						tls_currently_buffering ? &zero : timeout);
+	} while (!tls_currently_buffering && count < 0 && errno == EINTR);
+	if (count < 0) {
+		return errno == EINTR ? 0 : -1;
+	}
+	for (action = 0; count > 0 && action < ACTION_SELECT_COUNT; action++) {
+		for (fd = 0; count > 0 && fd < activesockets; fd++) {
+			if (FD_ISSET (fd, &last_state [action])) {
+				count--;
+				fb_add_ready (fd, action);
+			}
+		}
+	}
+	return (int) ready_count;
+}
+#endif
 
 /** @internal
     Schedule a service for reaping when it has no connections left. */
@@ -109,27 +401,32 @@ void fb_dispose_event (FB_EVENT *event) {
     @param thing Pointer of type indicated by 'type'.
     @return true on success, false on failure */
 bool fb_register (int socket_fd, FB_SOCKETTYPE type, void *thing) {
-	/* Initialize the select state if this is the first registration */
+	/* Initialize the event backend if this is the first registration */
 	if (maxsockets == 0) {
-		memset (&select_state, 0, sizeof (select_state));
+		if (!fb_backend_init ()) {
+			return false;
+		}
 	}
 	
+#ifndef FB_USE_EPOLL
 	/* We're limited by select(2), unless we want to do unsupported things */
 	if (socket_fd >= FD_SETSIZE) {
 		return false;
 	}
+#endif
 	
 	/* Make sure we've got enough space in the socket registry */
 	if (maxsockets <= socket_fd) {
-		/* maxsockets affects the select(), so used a balanced
-		 approach to growing the collection */
+		/* Use a balanced approach to growing the collection */
 		int newsize = maxsockets + (maxsockets / 4) + 10;
         if (newsize <= socket_fd) {
             newsize = socket_fd + 10;
         }
+#ifndef FB_USE_EPOLL
 		if (newsize > FD_SETSIZE) {
 			newsize = FD_SETSIZE;
 		}
+#endif
 		FB_SOCKET_DATA **newsockets = realloc (sockets, newsize * sizeof (FB_SOCKET_DATA *));
 		if (newsockets == NULL) {
             fb_perror ("realloc");
@@ -143,17 +440,18 @@ bool fb_register (int socket_fd, FB_SOCKETTYPE type, void *thing) {
 	
 	/* Insert the socket into the registry. */
 	assert (sockets [socket_fd] == NULL);		/* There shouldn't be anything there yet. */
-	if ((sockets [socket_fd] = malloc (sizeof (FB_SOCKET_DATA)))) {
+	if ((sockets [socket_fd] = calloc (1, sizeof (FB_SOCKET_DATA)))) {
 		sockets [socket_fd]->thingie.user = thing;
 		sockets [socket_fd]->socket = socket_fd;
 		sockets [socket_fd]->type = type;
-		FD_SET (socket_fd, &select_state[ACTION_READING]); /* Enable input */
+		sockets [socket_fd]->flags = ACTION_FLAG (ACTION_READING); /* Enable input */
+		fb_backend_update (sockets [socket_fd]);
         if (socket_fd >= activesockets) {
             activesockets = socket_fd + 1;
         }
 		return true;
 	}
-    fb_perror ("malloc");
+    fb_perror ("calloc");
 	return false;
 }
 
@@ -164,12 +462,11 @@ void fb_unregister (int socket_fd) {
 	assert (socket_fd > 0 && socket_fd < maxsockets);	/* We shouldn't be freeing sockets that don't fit in the registry. */
 	assert (sockets [socket_fd]);	/* The socket to be freed should exist in the registry. */
 	
-	/* Turn off listening to it and cancel any pending processing */
-	int i;
-	for (i = 0; i < ACTION_COUNT; i++) {
-		FD_CLR(socket_fd, &select_state[i]);
-		FD_CLR(socket_fd, &last_state[i]);
-	}
+	/* Turn off listening to it.  Any entries in the ready list are
+	   ignored once the registry entry is gone. */
+	fb_backend_remove (sockets [socket_fd]);
+	fb_fdlist_remove (&buffering, socket_fd);
+	fb_fdlist_remove (&corked, socket_fd);
 	
 	free (sockets [socket_fd]);
 	sockets [socket_fd] = NULL;
@@ -181,6 +478,23 @@ void fb_unregister (int socket_fd) {
 }
 
 
+/** Add an application socket to the registry.
+    Football polls it along with its own sockets, and returns
+    FB_EVENT_READABLE events for it with the supplied context.
+    @param socket_fd The file descriptor to watch.
+    @param context Returned in the event's context field.
+    @return true on success, false on failure */
+bool fb_register_user_socket (int socket_fd, void *context) {
+	return fb_register (socket_fd, FB_SOCKTYPE_USER, context);
+}
+
+/** Remove an application socket from the registry.
+    @param socket_fd The file descriptor to stop watching. */
+void fb_unregister_user_socket (int socket_fd) {
+	fb_unregister (socket_fd);
+}
+
+
 /** @internal
     Enable/disable the flags for selecting, or the buffering flags.
     @param socket_fd the file descriptor to set flags for
@@ -190,11 +504,22 @@ void fb_set_socket_select_flags (int socket_fd, ACTION group, bool enable) {
 	assert (socket_fd > 0 && socket_fd < activesockets);
 	assert (sockets [socket_fd] != NULL);
 
-	if (sockets [socket_fd]) {
-		if (enable) {
-			FD_SET(socket_fd, &select_state[group]);
+	FB_SOCKET_DATA *socket_data = sockets [socket_fd];
+	if (socket_data) {
+		unsigned int flags = (enable ? (socket_data->flags | ACTION_FLAG (group)) :
+									   (socket_data->flags & ~ACTION_FLAG (group)));
+		if (flags == socket_data->flags) {
+			return;
+		}
+		socket_data->flags = flags;
+		if (group == ACTION_BUFFERING) {
+			if (enable) {
+				fb_fdlist_add (&buffering, socket_fd);
+			} else {
+				fb_fdlist_remove (&buffering, socket_fd);
+			}
 		} else {
-			FD_CLR(socket_fd, &select_state[group]);
+			fb_backend_update (socket_data);
 		}
 	}
 }
@@ -203,9 +528,10 @@ void fb_set_socket_select_flags (int socket_fd, ACTION group, bool enable) {
 
 /** @internal
     Enable/disable writing on a socket.
-    This is used to remember TLS data buffering.
+    This is used to remember TLS data buffering, and lines already read
+    but not yet delivered.
     @param socket_fd the file descriptor to apply flags to
-    @param enable true if TLS is buffering, false if it is not. */
+    @param enable true if input is buffered, false if it is not. */
 void fb_set_buffering (int socket_fd, bool enable) {
     fb_set_socket_select_flags (socket_fd, ACTION_BUFFERING, enable);
     if (enable) {
@@ -213,6 +539,35 @@ void fb_set_buffering (int socket_fd, bool enable) {
     }
 }
 
+/** @internal
+    Hold a connection's output until the application returns to poll,
+    so everything queued while handling an event goes out together.
+    If the connection can't be remembered, its output is sent immediately.
+    @param connection the connection with freshly queued output. */
+void fb_cork_output (FB_CONNECTION *connection) {
+    if (!connection->corked) {
+        connection->corked = fb_fdlist_add (&corked, connection->socket);
+        if (!connection->corked) {
+            fb_send_output (NULL, connection);
+        }
+    }
+}
+
+/** Send output being held for all connections.
+    The poll functions do this automatically; applications should call
+    this before doing something lengthy while handling an event, so
+    that responses already queued aren't delayed. */
+void fb_flush_output (void) {
+    size_t i;
+    for (i = 0; i < corked.count; i++) {
+        FB_SOCKET_DATA *socket_data = sockets [corked.fds [i]];
+        assert (socket_data && socket_data->type == FB_SOCKTYPE_CONNECTION);
+        socket_data->thingie.connection->corked = false;
+        fb_send_output (NULL, socket_data->thingie.connection);
+    }
+    corked.count = 0;
+}
+
 /** @internal
     Enable/disable writing on a socket.
     This is used within Football, enabled when fresh data is queued for a socket and
@@ -240,13 +595,16 @@ void fb_accept_input (FB_CONNECTION *connection, bool input) {
 	
 	fb_set_readable (connection->socket, input && connection->state <= FB_SOCKET_STATE_OPEN);
     if (input) {
-        /* Set buffering flag if TLS is buffering data for this socket. */
+        /* Set buffering flag if we have complete lines waiting,
+           or TLS is buffering data for this socket. */
+        bool pending = fb_input_line_pending (connection);
         if (connection->encrypted && connection->state > FB_SOCKET_STATE_TLS_HANDSHAKE &&
                                      connection->state <= FB_SOCKET_STATE_OPEN) {
 #ifdef WORKING_LIBGNUTLS
-            fb_set_buffering (connection->socket, gnutls_record_check_pending (connection->tls));
+            pending = pending || gnutls_record_check_pending (connection->tls);
 #endif
         }
+        fb_set_buffering (connection->socket, pending);
     } else {
         /* Clear buffering flag so we don't try to read that way either. */
         fb_set_buffering (connection->socket, false);
@@ -298,16 +656,21 @@ FB_EVENT *fb_process_event (int socket_fd, ACTION action) {
 				case ACTION_READING:
                 {
                     FB_EVENT *e = fb_read_input (&event, socket_data->thingie.connection);
-#ifdef WORKING_LIBGNUTLS
+                    /* If more lines were read than delivered, or TLS is holding data,
+                       come back on the next pass without waiting on the socket. */
                     socket_data = sockets [socket_fd];
-                    if (socket_data &&
-                        socket_data->thingie.connection->encrypted) {
+                    if (socket_data) {
+                        FB_CONNECTION *connection = socket_data->thingie.connection;
+                        bool pending = fb_input_line_pending (connection);
+#ifdef WORKING_LIBGNUTLS
+                        pending = pending || (connection->encrypted &&
+                                              gnutls_record_check_pending (connection->tls));
+#endif
                         fb_set_buffering (socket_fd,
-                                          socket_data->thingie.connection->state <= FB_SOCKET_STATE_OPEN &&
-                                          FD_ISSET (socket_fd, &select_state [ACTION_READING]) &&
-                                          gnutls_record_check_pending (socket_data->thingie.connection->tls));
+                                          connection->state <= FB_SOCKET_STATE_OPEN &&
+                                          (socket_data->flags & ACTION_FLAG (ACTION_READING)) &&
+                                          pending);
                     }
-#endif
                     return e;
                 }
 				case ACTION_WRITING:
@@ -354,9 +717,7 @@ FB_EVENT *fb_process_event (int socket_fd, ACTION action) {
 static FB_EVENT *fb_poll_for (struct timeval *timeout) {
 pollagain:;
 	static FB_EVENT event; /* Reusable timeout event */
-	static int events_remaining = 0;
-	static ACTION process_action = 0;
-	static int process_fd = 0;
+	static size_t process_index = 0;
 	
 	/* Something should have been registered by now. */
 	assert (maxsockets > 0);
@@ -366,6 +727,9 @@ pollagain:;
         return NULL;
     }
 
+    /* The application is done with the last event; send its output. */
+    fb_flush_output ();
+
     if (queued_event) {
         FB_EVENT *temp = queued_event;
         queued_event = NULL;
@@ -395,46 +759,30 @@ pollagain:;
 	}
 	
 	/* See if it's time to refill the coffers, so-to-speak */
-	if (events_remaining == 0) {
-		/* Reset the event searching loops */
-		process_action = 0;
-		process_fd = 0;
-		
-		/* Create a fresh copy of the selector masks */
-		int i;
-		for (i = 0; i < ACTION_SELECT_COUNT; i++) {
-			FD_COPY(&select_state[i], &last_state [i]);
-		}
-		/* Select, repeating if we get an interrupted system call */
-		do {
-            struct timeval zero;
-            zero.tv_sec = 0;
-            zero.tv_usec = 0;
-			events_remaining = select (maxsockets, &last_state [ACTION_READING],
-									   &last_state [ACTION_WRITING], &last_state [ACTION_FAULTING],
-                                       tls_currently_buffering ? &zero : timeout);
-		} while (!tls_currently_buffering && events_remaining < 0 && errno == EINTR);
-
-        /* Add TLS's buffered reads into select's read flags */
+	if (process_index >= ready_count) {
+		process_index = 0;
+		ready_count = 0;
+
+		int events_found = fb_backend_wait (timeout);
+
+        /* Add buffered reads (TLS or line input) into the ready list */
         if (tls_currently_buffering) {
             tls_currently_buffering = false;
-            for (i = 0; i < maxsockets; i++) {
-                if ( FD_ISSET(i, &select_state [ACTION_BUFFERING]) &&
-                    !FD_ISSET(i, &last_state [ACTION_READING])) {
-                    events_remaining++;
-                    FD_SET(i, &last_state [ACTION_READING]);
+            size_t i;
+            for (i = 0; i < buffering.count; i++) {
+                if (fb_add_ready (buffering.fds [i], ACTION_READING)) {
+                    events_found++;
                 }
             }
         }
 
 		/* Check for/handle (don't handle) errors */
-		if (events_remaining < 0) {
-			events_remaining = 0;
-            fb_perror ("select");
+		if (events_found < 0 && ready_count == 0) {
+            fb_perror ("poll");
 			return NULL;
 		}
 		/* Check for/handle timeout */
-		if (events_remaining == 0) {
+		if (ready_count == 0) {
 			/* We'll just keep reusing this, just clearing it out each time. */
 			memset (&event, 0, sizeof (event));
 			event.magic = FB_SOCKTYPE_EVENT;
@@ -443,37 +791,20 @@ pollagain:;
 		}
 	}
 
-	/* Search the mask returned by select to find what needs attention */
-	while (process_action < ACTION_SELECT_COUNT) {
-		while (process_fd < maxsockets) {
-			if (FD_ISSET (process_fd, &last_state [process_action])) {
-				/* This needs attention.  Count and process it. */
-				events_remaining--;
-				FB_EVENT *fd_event = fb_process_event (process_fd, process_action);
-				if (fd_event) {
-					/* An event resulted from the processing. Bump to the */
-					/* next socket so we don't repeat, then return the event. */
-					if (++process_fd >= maxsockets) {
-						process_fd = 0;
-						process_action++;
-					}
-					return (fd_event);
-				}
-#ifndef NDEBUG
-				/* If there are no more events, stop looking.  But in test mode,
-				 continue to make sure we counts confirm good behavior. */
-				if (events_remaining <= 0) goto pollagain;
-#endif
-			}
-			process_fd++;
+	/* Work through the ready list to find what needs attention */
+	while (process_index < ready_count) {
+		FB_READY *item = &ready [process_index++];
+		FB_SOCKET_DATA *socket_data = item->socket < maxsockets ? sockets [item->socket] : NULL;
+		/* Skip sockets that were closed (or replaced) since the poll */
+		if (!socket_data || !(socket_data->pending & ACTION_FLAG (item->action))) {
+			continue;
+		}
+		socket_data->pending &= ~ACTION_FLAG (item->action);
+		FB_EVENT *fd_event = fb_process_event (item->socket, item->action);
+		if (fd_event) {
+			return (fd_event);
 		}
-		process_fd = 0;
-		process_action++;
-	}
-	if (events_remaining != 0) {
-        fb_log (FB_WHERE (FB_LOG_WARNING), "%d event(s) not found", events_remaining);
 	}
-	events_remaining = 0;
 	goto pollagain; /* Tail recursion would probably collapse and work too */
 }
 
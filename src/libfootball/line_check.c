@@ -0,0 +1,191 @@
+///
+/// Line input check and benchmark.
+/// @file       line_check.c - Football line-oriented input check, run by "make check"
+///
+/// A client thread pipelines a large amount of input at a line port in
+/// irregular chunks, so lines arrive split across reads and many lines
+/// arrive per read; long lines force the input buffer to grow.  Every line
+/// must come back as one input event, in order.  A line whose newline is
+/// sent later must be held until then, and a final line with no newline
+/// is discarded when the connection closes.
+///
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fb_public.h"
+
+#define CHECK_LINES (200000)
+#define CHECK_LONG_LINE (20000) /* Bytes; exceeds the input read size */
+#define CHECK_LONG_EVERY (997) /* Every so many lines is a long one */
+#define CHECK_MAX_CHUNK (4096)
+#define CHECK_SKIP (77) /* automake's "skipped" exit status */
+
+static int port;
+
+/** Format line number 'n' into 'buffer', without its newline.
+    @return the length of the line. */
+static size_t check_line (char *buffer, int n) {
+    size_t length = sprintf (buffer, "line %d", n);
+    size_t target = (n % CHECK_LONG_EVERY == 0) ? CHECK_LONG_LINE : n % 61;
+    while (length < target) {
+        buffer [length] = 'a' + (length + n) % 26;
+        length++;
+    }
+    buffer [length] = '\0';
+    return length;
+}
+
+/** Write all of a buffer. */
+static bool check_write (int sock, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t written = write (sock, data, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror ("write");
+            return false;
+        }
+        data += written;
+        size -= written;
+    }
+    return true;
+}
+
+/** Client: send every line in chunks of random size, then the special cases. */
+static void *check_client (void *unused) {
+    static char line [CHECK_LONG_LINE + 2];
+    char *pending = malloc (CHECK_MAX_CHUNK * 2 + CHECK_LONG_LINE + 2);
+    struct sockaddr_in address;
+    memset (&address, 0, sizeof (address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons (port);
+    address.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    int sock = socket (AF_INET, SOCK_STREAM, 0);
+    if (!pending || sock < 0 || connect (sock, (struct sockaddr *) &address, sizeof (address)) < 0) {
+        perror ("check_client");
+        exit (1);
+    }
+    srand (1);
+    size_t used = 0;
+    for (int n = 0; n < CHECK_LINES; n++) {
+        size_t length = check_line (line, n);
+        line [length++] = (n % 3 == 0) ? '\r' : '\n';
+        if (line [length - 1] == '\r') {
+            line [length++] = '\n';
+        }
+        memcpy (pending + used, line, length);
+        used += length;
+        /* Send a random part of what has accumulated */
+        size_t chunk = 1 + rand () % CHECK_MAX_CHUNK;
+        while (used >= chunk) {
+            if (!check_write (sock, pending, chunk)) {
+                exit (1);
+            }
+            memmove (pending, pending + chunk, used - chunk);
+            used -= chunk;
+            chunk = 1 + rand () % CHECK_MAX_CHUNK;
+        }
+    }
+    if (!check_write (sock, pending, used)) {
+        exit (1);
+    }
+    /* A line completed after a pause must be held, then delivered whole */
+    check_write (sock, "held ", 5);
+    usleep (100000);
+    check_write (sock, "line\n", 5);
+    /* Unterminated final line */
+    check_write (sock, "unterminated", 12);
+    usleep (100000);
+    close (sock);
+    free (pending);
+    return NULL;
+}
+
+static double check_seconds (void) {
+    struct timespec now;
+    clock_gettime (CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+int main (void) {
+    static char expected [CHECK_LONG_LINE + 1];
+    FB_SERVICE_OPTIONS options;
+    FB_SERVICE *service = NULL;
+    memset (&options, 0, sizeof (options));
+    options.queue_size = 5;
+    options.greeting_mode = FB_GREETING_ALLOW;
+    /* Find a free port */
+    for (int attempt = 0; attempt < 50 && !service; attempt++) {
+        port = options.line_port = 20000 + (getpid () * 7 + attempt * 131) % 40000;
+        service = fb_create_service (&options);
+    }
+    if (!service) {
+        fprintf (stderr, "Cannot create line service\n");
+        return CHECK_SKIP;
+    }
+
+    pthread_t client;
+    if (pthread_create (&client, NULL, check_client, NULL) != 0) {
+        perror ("pthread_create");
+        return 1;
+    }
+
+    int received = 0;
+    bool held = false, closed = false;
+    double start = check_seconds ();
+    double finish = start;
+    while (!closed) {
+        FB_EVENT *event = fb_wait ();
+        if (!event) {
+            continue;
+        }
+        if (event->type == FB_EVENT_CLOSE) {
+            closed = true;
+        } else if (event->type != FB_EVENT_INPUT) {
+            continue;
+        } else if (received < CHECK_LINES) {
+            check_line (expected, received);
+            if (strcmp (event->command, expected) != 0) {
+                fprintf (stderr, "Line %d: got '%.40s', expected '%.40s'\n",
+                         received, event->command, expected);
+                return 1;
+            }
+            if (++received == CHECK_LINES) {
+                finish = check_seconds ();
+            }
+        } else if (!held && strcmp (event->command, "held line") == 0) {
+            held = true;
+        } else {
+            fprintf (stderr, "Unexpected input: '%.40s'\n", event->command);
+            return 1;
+        }
+    }
+    pthread_join (client, NULL);
+    fb_close_service (service);
+    while (fb_services_are_open ()) {
+        fb_poll ();
+    }
+
+    if (received != CHECK_LINES || !held) {
+        fprintf (stderr, "Received %d of %d lines, %s held line\n",
+                 received, CHECK_LINES, held ? "with" : "without");
+        return 1;
+    }
+    printf ("%d lines in %.3f seconds, %.0f lines/s\n", received,
+            finish - start, received / (finish - start));
+    return 0;
+}
@@ -23,12 +23,23 @@ THE SOFTWARE.
 
 #include <string.h>
 #include <assert.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 
 #include "crypt.h"
 
+static const char hexDigits[16] = "0123456789abcdef";
+
+/*	hex digit values plus one, indexed by character; 0 for anything that is
+ *	not a hex digit
+ */
+static const unsigned char hexValues[256] = {
+	['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+	['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+	['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+	['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
 /*	decrypt hex-encoded, blowfish-crypted string: decode 2 hex-encoded blocks,
  *	decrypt, byteswap
  *	@param gcrypt handle
@@ -45,14 +56,21 @@ char *PianoDecryptString (gcry_cipher_hd_t h, const char * const input,
 
 	assert (inputLen%2 == 0);
 
-	output = calloc (outputLen+1, sizeof (*output));
+	if ((output = malloc (outputLen+1)) == NULL) {
+		return NULL;
+	}
 	/* hex decode */
+	const unsigned char *in = (const unsigned char *) input;
 	for (size_t i = 0; i < outputLen; i++) {
-		char hex[3];
-		memcpy (hex, &input[i*2], 2);
-		hex[2] = '\0';
-		output[i] = strtol (hex, NULL, 16);
+		const unsigned char hi = hexValues[in[i*2]];
+		const unsigned char lo = hexValues[in[i*2+1]];
+		if (hi == 0 || lo == 0) {
+			free (output);
+			return NULL;
+		}
+		output[i] = ((hi - 1) << 4) | (lo - 1);
 	}
+	output[outputLen] = '\0';
 
 	gret = gcry_cipher_decrypt (h, output, outputLen, NULL, 0);
 	if (gret) {
@@ -71,28 +89,34 @@ char *PianoDecryptString (gcry_cipher_hd_t h, const char * const input,
  *	@return encrypted, hex-encoded string
  */
 char *PianoEncryptString (gcry_cipher_hd_t h, const char *s) {
-	unsigned char *paddedInput, *hexOutput;
+	unsigned char *output, *crypted;
 	size_t inputLen = strlen (s);
 	/* blowfish expects two 32 bit blocks */
 	size_t paddedInputLen = (inputLen % 8 == 0) ? inputLen : inputLen + (8-inputLen%8);
 	gcry_error_t gret;
 
-	paddedInput = calloc (paddedInputLen+1, sizeof (*paddedInput));
-	memcpy (paddedInput, s, inputLen);
+	/* encrypt in place in the second half of the output buffer, then
+	 * hex-encode front to back; each byte is read before the two digits
+	 * written for it can reach it */
+	if ((output = malloc (paddedInputLen*2+1)) == NULL) {
+		return NULL;
+	}
+	crypted = output + paddedInputLen;
+	memcpy (crypted, s, inputLen);
+	memset (crypted + inputLen, 0, paddedInputLen - inputLen);
 
-	gret = gcry_cipher_encrypt (h, paddedInput, paddedInputLen, NULL, 0);
+	gret = gcry_cipher_encrypt (h, crypted, paddedInputLen, NULL, 0);
 	if (gret) {
-		free (paddedInput);
+		free (output);
 		return NULL;
 	}
 
-	hexOutput = calloc (paddedInputLen*2+1, sizeof (*hexOutput));
 	for (size_t i = 0; i < paddedInputLen; i++) {
-		snprintf ((char * restrict) &hexOutput[i*2], 3, "%02x", paddedInput[i]);
+		const unsigned char c = crypted[i];
+		output[i*2] = hexDigits[c >> 4];
+		output[i*2+1] = hexDigits[c & 0xf];
 	}
+	output[paddedInputLen*2] = '\0';
 
-	free (paddedInput);
-
-	return (char *) hexOutput;
+	return (char *) output;
 }
-
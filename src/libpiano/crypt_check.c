@@ -0,0 +1,164 @@
+/*
+ *  crypt_check.c
+ *  Checks PianoEncryptString/PianoDecryptString against a straightforward
+ *  reference (gcrypt plus printf hex encoding), and times both.
+ *  Run by "make check".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "crypt.h"
+
+#define KEY "6#26FRL$ZWD"
+#define ROUNDS 2000
+#define BENCH_ROUNDS 20000
+#define BENCH_SIZE 1024
+
+/*	reference encryption: pad, encrypt, hex encode with snprintf
+ */
+static char *ReferenceEncrypt (gcry_cipher_hd_t h, const char *s) {
+	const size_t inputLen = strlen (s);
+	const size_t paddedLen = (inputLen + 7) / 8 * 8;
+	unsigned char *crypted = calloc (paddedLen + 1, 1);
+	char *output = calloc (paddedLen * 2 + 1, 1);
+
+	if (crypted == NULL || output == NULL) {
+		free (crypted);
+		free (output);
+		return NULL;
+	}
+	memcpy (crypted, s, inputLen);
+	gcry_cipher_encrypt (h, crypted, paddedLen, NULL, 0);
+	for (size_t i = 0; i < paddedLen; i++) {
+		snprintf (output + i * 2, 3, "%02x", crypted[i]);
+	}
+	free (crypted);
+	return output;
+}
+
+static double Seconds (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool OpenCipher (gcry_cipher_hd_t *h) {
+	return gcry_cipher_open (h, GCRY_CIPHER_BLOWFISH, GCRY_CIPHER_MODE_ECB,
+			0) == 0 &&
+			gcry_cipher_setkey (*h, (const unsigned char *) KEY,
+			strlen (KEY)) == 0;
+}
+
+/*	encrypt, compare with reference, decrypt (lower and upper case hex) and
+ *	make sure a non-hex digit is refused
+ *	@return true if all is well
+ */
+static bool CheckString (gcry_cipher_hd_t enc, gcry_cipher_hd_t dec,
+		const char *plain) {
+	const size_t plainLen = strlen (plain);
+	char *crypted = PianoEncryptString (enc, plain);
+	char *reference = ReferenceEncrypt (enc, plain);
+	char *decrypted = NULL, *upperDecrypted = NULL, *invalid = NULL;
+	size_t size = 0, upperSize = 0, invalidSize;
+	bool ok = false;
+
+	if (crypted == NULL || reference == NULL) {
+		fprintf (stderr, "encryption failed\n");
+	} else if (strcmp (crypted, reference) != 0) {
+		fprintf (stderr, "encrypted %zu bytes: got %s, expected %s\n",
+				plainLen, crypted, reference);
+	} else if ((decrypted = PianoDecryptString (dec, crypted, &size)) == NULL ||
+			size < plainLen || memcmp (decrypted, plain, plainLen) != 0 ||
+			decrypted[size] != '\0') {
+		fprintf (stderr, "round trip of %zu bytes failed\n", plainLen);
+	} else {
+		for (char *p = crypted; *p != '\0'; p++) {
+			*p = toupper ((unsigned char) *p);
+		}
+		upperDecrypted = PianoDecryptString (dec, crypted, &upperSize);
+		/* odd and even positions */
+		crypted[0] = 'g';
+		invalid = PianoDecryptString (dec, crypted, &invalidSize);
+		crypted[0] = '0';
+		crypted[1] = ' ';
+		if (invalid == NULL) {
+			invalid = PianoDecryptString (dec, crypted, &invalidSize);
+		}
+		if (upperDecrypted == NULL || upperSize != size ||
+				memcmp (upperDecrypted, decrypted, size) != 0) {
+			fprintf (stderr, "upper case hex of %zu bytes not decoded\n",
+					plainLen);
+		} else if (invalid != NULL) {
+			fprintf (stderr, "non-hex input accepted\n");
+		} else {
+			ok = true;
+		}
+	}
+	free (crypted);
+	free (reference);
+	free (decrypted);
+	free (upperDecrypted);
+	free (invalid);
+	return ok;
+}
+
+int main (void) {
+	gcry_cipher_hd_t enc, dec;
+	char plain[300];
+
+	if (!gcry_check_version (NULL) || !OpenCipher (&enc) ||
+			!OpenCipher (&dec)) {
+		fprintf (stderr, "cannot set up blowfish\n");
+		return 1;
+	}
+
+	/* all padding lengths, then random strings */
+	srand (1);
+	for (int round = 0; round < ROUNDS; round++) {
+		const size_t len = round < 24 ? (size_t) round + 1 :
+				(size_t) (rand () % (sizeof (plain) - 1)) + 1;
+		for (size_t i = 0; i < len; i++) {
+			plain[i] = 1 + rand () % 255;
+		}
+		plain[len] = '\0';
+		if (!CheckString (enc, dec, plain)) {
+			return 1;
+		}
+	}
+
+	/* throughput, informational */
+	char *big = malloc (BENCH_SIZE + 1);
+	if (big == NULL) {
+		return 1;
+	}
+	memset (big, 'x', BENCH_SIZE);
+	big[BENCH_SIZE] = '\0';
+	for (int reference = 0; reference < 2; reference++) {
+		const double start = Seconds ();
+		for (int i = 0; i < BENCH_ROUNDS; i++) {
+			free (reference ? ReferenceEncrypt (enc, big) :
+					PianoEncryptString (enc, big));
+		}
+		printf ("%s encrypt: %.1f MB/s\n", reference ? "reference" : "libpiano",
+				BENCH_ROUNDS * (BENCH_SIZE / 1048576.0) / (Seconds () - start));
+	}
+	char *crypted = PianoEncryptString (enc, big);
+	const double start = Seconds ();
+	for (int i = 0; i < BENCH_ROUNDS && crypted != NULL; i++) {
+		size_t size;
+		free (PianoDecryptString (dec, crypted, &size));
+	}
+	printf ("libpiano decrypt: %.1f MB/s\n",
+			BENCH_ROUNDS * (BENCH_SIZE / 1048576.0) / (Seconds () - start));
+	free (crypted);
+	free (big);
+
+	gcry_cipher_close (enc);
+	gcry_cipher_close (dec);
+	return 0;
+}
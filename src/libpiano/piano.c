@@ -28,9 +28,11 @@ THE SOFTWARE.
 
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <stdint.h>
+#include <ctype.h>
 
 #include "piano_private.h"
 #include "piano.h"
@@ -194,6 +196,7 @@ static void PianoDestroyPartner (PianoPartner_t *partner) {
 void PianoDestroy (PianoHandle_t *ph) {
 	PianoDestroyUserInfo (&ph->user);
 	PianoDestroyStations (ph->stations);
+	free (ph->stationIndex.byId);
 	PianoDestroyPartner (&ph->partner);
 	/* destroy genre stations */
 	PianoGenreCategory_t *curGenreCat = ph->genreStations, *lastGenreCat;
@@ -213,6 +216,7 @@ void PianoDestroy (PianoHandle_t *ph) {
  */
 void PianoDestroyRequest (PianoRequest_t *req) {
 	free (req->postData);
+	PianoDestroyResponseParser (req);
 	memset (req, 0, sizeof (*req));
 }
 
@@ -235,6 +239,137 @@ PianoStation_t *PianoFindStationById (PianoStation_t * const stations,
 	return NULL;
 }
 
+/*	FNV-1a hash, optionally folding case
+ *	@param string to hash
+ *	@param fold to lower case
+ *	@return hash
+ */
+static uint32_t PianoStationHash (const char *s, bool fold) {
+	uint32_t hash = 2166136261u;
+	for (; *s != '\0'; s++) {
+		const unsigned char c = (unsigned char) *s;
+		hash ^= fold ? (uint32_t) tolower (c) : c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/*	mark the station index stale; must be called whenever stations are
+ *	added, removed or renamed
+ *	@param piano handle
+ */
+void PianoStationIndexInvalidate (PianoHandle_t *ph) {
+	ph->stationIndex.valid = false;
+}
+
+/*	rebuild both station tables from the station list; where stations
+ *	share an id or name, the first in the list wins, like a linear search
+ *	@param piano handle
+ *	@return false if out of memory
+ */
+static bool PianoStationIndexBuild (PianoHandle_t *ph) {
+	PianoStationIndex_t * const index = &ph->stationIndex;
+	size_t count = 0, size = 16;
+	PianoStation_t *station;
+
+	station = ph->stations;
+	PianoListForeachP (station) {
+		count++;
+	}
+	/* keep load at or below one half */
+	while (size < count * 2) {
+		size *= 2;
+	}
+	if (size != index->size || index->byId == NULL) {
+		PianoStation_t **tables = calloc (size * 2, sizeof (*tables));
+		if (tables == NULL) {
+			return false;
+		}
+		free (index->byId);
+		index->byId = tables;
+		index->byName = tables + size;
+		index->size = size;
+	} else {
+		memset (index->byId, 0, size * 2 * sizeof (*index->byId));
+	}
+
+	const size_t mask = size - 1;
+	station = ph->stations;
+	PianoListForeachP (station) {
+		size_t slot = PianoStationHash (station->id, false) & mask;
+		while (index->byId[slot] != NULL &&
+				strcmp (index->byId[slot]->id, station->id) != 0) {
+			slot = (slot + 1) & mask;
+		}
+		if (index->byId[slot] == NULL) {
+			index->byId[slot] = station;
+		}
+
+		slot = PianoStationHash (station->name, true) & mask;
+		while (index->byName[slot] != NULL &&
+				strcasecmp (index->byName[slot]->name, station->name) != 0) {
+			slot = (slot + 1) & mask;
+		}
+		if (index->byName[slot] == NULL) {
+			index->byName[slot] = station;
+		}
+	}
+	index->valid = true;
+	return true;
+}
+
+/*	get station by id, using the station index
+ *	@param piano handle
+ *	@param search for this
+ *	@return the first station structure matching the given id
+ */
+PianoStation_t *PianoLookupStationById (PianoHandle_t *ph, const char *id) {
+	assert (id != NULL);
+
+	PianoStationIndex_t * const index = &ph->stationIndex;
+	if (!index->valid && !PianoStationIndexBuild (ph)) {
+		return PianoFindStationById (ph->stations, id);
+	}
+	const size_t mask = index->size - 1;
+	size_t slot = PianoStationHash (id, false) & mask;
+	while (index->byId[slot] != NULL) {
+		if (strcmp (index->byId[slot]->id, id) == 0) {
+			return index->byId[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+/*	get station by name, ignoring case, using the station index
+ *	@param piano handle
+ *	@param search for this
+ *	@return the first station structure matching the given name
+ */
+PianoStation_t *PianoLookupStationByName (PianoHandle_t *ph, const char *name) {
+	assert (name != NULL);
+
+	PianoStationIndex_t * const index = &ph->stationIndex;
+	if (!index->valid && !PianoStationIndexBuild (ph)) {
+		PianoStation_t *station = ph->stations;
+		PianoListForeachP (station) {
+			if (strcasecmp (station->name, name) == 0) {
+				return station;
+			}
+		}
+		return NULL;
+	}
+	const size_t mask = index->size - 1;
+	size_t slot = PianoStationHash (name, true) & mask;
+	while (index->byName[slot] != NULL) {
+		if (strcasecmp (index->byName[slot]->name, name) == 0) {
+			return index->byName[slot];
+		}
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
 /*	convert return value to human-readable string
  *	@param enum
  *	@return error string
@@ -129,10 +129,19 @@ typedef struct PianoPartner {
 	unsigned int id;
 } PianoPartner_t;
 
+/* open-addressing hash tables over the station list, by id and by
+ * (case-insensitive) name; rebuilt on demand after the list changes */
+typedef struct PianoStationIndex {
+	PianoStation_t **byId, **byName;
+	size_t size; /* slots per table, a power of two */
+	bool valid;
+} PianoStationIndex_t;
+
 typedef struct PianoHandle {
 	PianoUserInfo_t user;
 	/* linked lists */
 	PianoStation_t *stations;
+	PianoStationIndex_t stationIndex;
 	PianoGenreCategory_t *genreStations;
 	PianoPartner_t partner;
 	int timeOffset;
@@ -181,6 +190,11 @@ typedef struct PianoRequest {
 	char urlPath[1024];
 	char *postData;
 	char *responseData;
+	/* incremental parsing, see PianoResponseFeed () */
+	struct json_tokener *responseTokener;
+	struct json_object *responseJson;
+	/* station lists skip json-c, see PianoStationListFeed () */
+	struct PianoStationListParser *responseStations;
 } PianoRequest_t;
 
 /* request data structures */
@@ -342,11 +356,15 @@ void PianoDestroyStations (PianoStation_t *stations);
 PianoReturn_t PianoRequest (PianoHandle_t *, PianoRequest_t *,
 		PianoRequestType_t);
 PianoReturn_t PianoResponse (PianoHandle_t *, PianoRequest_t *);
+PianoReturn_t PianoResponseFeed (PianoRequest_t *, const char *, size_t);
 void PianoDestroyRequest (PianoRequest_t *);
 
 /* misc */
 PianoStation_t *PianoFindStationById (PianoStation_t * const,
 		const char * const);
+PianoStation_t *PianoLookupStationById (PianoHandle_t *, const char *);
+PianoStation_t *PianoLookupStationByName (PianoHandle_t *, const char *);
+void PianoStationIndexInvalidate (PianoHandle_t *);
 const char *PianoErrorToStr (PianoReturn_t);
 
 #endif /* SRC_LIBPIANO_PIANO_H_MFBT13PN */
@@ -28,5 +28,9 @@ THE SOFTWARE.
 
 void PianoDestroyUserInfo (PianoUserInfo_t *user);
 void PianoDestroyStation (PianoStation_t *station);
+void PianoDestroyResponseParser (PianoRequest_t *req);
+PianoReturn_t PianoStationListFeed (PianoRequest_t *, const char *, size_t);
+PianoReturn_t PianoStationListFinish (PianoHandle_t *, PianoRequest_t *);
+void PianoStationListDestroy (PianoRequest_t *);
 
 #endif /* _PIANO_PRIVATE_H */
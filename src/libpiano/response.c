@@ -42,6 +42,7 @@ THE SOFTWARE.
 #include <assert.h>
 #include <time.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include "piano.h"
 #include "piano_private.h"
@@ -93,10 +94,70 @@ static void PianoStrpcat (char * restrict dest, const char * restrict src,
 	*dest = '\0';
 }
 
-/*	parse xml response and update data structures/return new data structure
+/*	parse a chunk of the json response as it arrives, instead of collecting
+ *	the whole response in responseData first. A malformed response is not
+ *	an error here; the tokener keeps its error and the rest of the body is
+ *	ignored, so the transfer completes and PianoResponse () reports it.
+ *	@param initialized request
+ *	@param response data, not \0-terminated
+ *	@param size of response data
+ *	@return PIANO_RET_OK, or PIANO_RET_OUT_OF_MEMORY
+ */
+PianoReturn_t PianoResponseFeed (PianoRequest_t *req, const char *data,
+		size_t size) {
+	assert (req != NULL);
+	assert (data != NULL);
+
+	if (req->type == PIANO_REQUEST_GET_STATIONS) {
+		return PianoStationListFeed (req, data, size);
+	}
+	if (req->responseJson != NULL) {
+		/* anything after the top-level object is ignored */
+		return PIANO_RET_OK;
+	}
+	if (req->responseTokener == NULL) {
+		if ((req->responseTokener = json_tokener_new ()) == NULL) {
+			return PIANO_RET_OUT_OF_MEMORY;
+		}
+	} else if (json_tokener_get_error (req->responseTokener) !=
+			json_tokener_continue) {
+		/* already failed, drain the body */
+		return PIANO_RET_OK;
+	}
+	while (size > 0) {
+		const int chunk = size > INT_MAX ? INT_MAX : size;
+		req->responseJson = json_tokener_parse_ex (req->responseTokener,
+				data, chunk);
+		if (req->responseJson != NULL ||
+				json_tokener_get_error (req->responseTokener) !=
+				json_tokener_continue) {
+			break;
+		}
+		data += chunk;
+		size -= chunk;
+	}
+	return PIANO_RET_OK;
+}
+
+/*	release incremental parser state
+ *	@param request
+ */
+void PianoDestroyResponseParser (PianoRequest_t *req) {
+	if (req->responseTokener != NULL) {
+		json_tokener_free (req->responseTokener);
+		req->responseTokener = NULL;
+	}
+	if (req->responseJson != NULL) {
+		json_object_put (req->responseJson);
+		req->responseJson = NULL;
+	}
+	PianoStationListDestroy (req);
+}
+
+/*	parse json response and update data structures/return new data structure
  *	@param piano handle
  *	@param initialized request (expects responseData to be a NUL-terminated
- *			string)
+ *			string, or the response to have been fed to PianoResponseFeed)
  */
 PianoReturn_t PianoResponse (PianoHandle_t *ph, PianoRequest_t *req) {
 	PianoReturn_t ret = PIANO_RET_OK;
@@ -105,7 +166,33 @@ PianoReturn_t PianoResponse (PianoHandle_t *ph, PianoRequest_t *req) {
 	assert (ph != NULL);
 	assert (req != NULL);
 
-	j = json_tokener_parse (req->responseData);
+	if (req->type == PIANO_REQUEST_GET_STATIONS) {
+		/* parsed without json-c, see stationlist.c */
+		if (req->responseStations == NULL && req->responseData != NULL) {
+			ret = PianoStationListFeed (req, req->responseData,
+					strlen (req->responseData));
+			if (ret != PIANO_RET_OK) {
+				PianoStationListDestroy (req);
+				return ret;
+			}
+		}
+		return PianoStationListFinish (ph, req);
+	}
+
+	if (req->responseTokener != NULL) {
+		/* take ownership of the incrementally parsed response; there is none
+		 * if it was malformed or truncated */
+		j = req->responseJson;
+		req->responseJson = NULL;
+		PianoDestroyResponseParser (req);
+		if (j == NULL) {
+			return PIANO_RET_INVALID_RESPONSE;
+		}
+	} else if (req->responseData != NULL) {
+		j = json_tokener_parse (req->responseData);
+	} else {
+		return PIANO_RET_INVALID_RESPONSE;
+	}
 
 	status = JSON_OBJECT_OBJECT_GET (j, "stat");
 	if (status == NULL) {
@@ -144,7 +231,6 @@ PianoReturn_t PianoResponse (PianoHandle_t *ph, PianoRequest_t *req) {
 			/* authenticate user */
 			PianoRequestDataLogin_t *reqData = req->data;
 
-			assert (req->responseData != NULL);
 			assert (reqData != NULL);
 
 			switch (reqData->step) {
@@ -191,54 +277,16 @@ PianoReturn_t PianoResponse (PianoHandle_t *ph, PianoRequest_t *req) {
 			break;
 		}
 
-		case PIANO_REQUEST_GET_STATIONS: {
-			/* get stations */
-			assert (req->responseData != NULL);
-
-			json_object *stations = JSON_OBJECT_OBJECT_GET (result,
-					"stations"), *mix = NULL;
-
-			for (int i = 0; i < json_object_array_length (stations); i++) {
-				PianoStation_t *tmpStation;
-				json_object *s = json_object_array_get_idx (stations, i);
-
-				if ((tmpStation = calloc (1, sizeof (*tmpStation))) == NULL) {
-					return PIANO_RET_OUT_OF_MEMORY;
-				}
-
-				PianoJsonParseStation (s, tmpStation);
-
-				if (tmpStation->isQuickMix) {
-					/* fix flags on other stations later */
-					mix = JSON_OBJECT_OBJECT_GET (s, "quickMixStationIds");
-				}
-
-				/* start new linked list or append */
-				ph->stations = PianoListAppendP (ph->stations, tmpStation);
-			}
-
-			/* fix quickmix flags */
-			if (mix != NULL) {
-				PianoStation_t *curStation = ph->stations;
-				PianoListForeachP (curStation) {
-					for (int i = 0; i < json_object_array_length (mix); i++) {
-						json_object *id = json_object_array_get_idx (mix, i);
-						if (strcmp (json_object_get_string (id),
-								curStation->id) == 0) {
-							curStation->useQuickMix = true;
-						}
-					}
-				}
-			}
+		case PIANO_REQUEST_GET_STATIONS:
+			/* handled above */
+			assert (0);
 			break;
-		}
 
 		case PIANO_REQUEST_GET_PLAYLIST: {
 			/* get playlist, usually four songs */
 			PianoRequestDataGetPlaylist_t *reqData = req->data;
 			PianoSong_t *playlist = NULL;
 
-			assert (req->responseData != NULL);
 			assert (reqData != NULL);
 			assert (reqData->quality != PIANO_AQ_UNKNOWN);
 
@@ -336,6 +384,7 @@ PianoReturn_t PianoResponse (PianoHandle_t *ph, PianoRequest_t *req) {
 
 			free (reqData->station->name);
 			reqData->station->name = strdup (reqData->newName);
+			PianoStationIndexInvalidate (ph);
 			break;
 		}
 
@@ -348,6 +397,7 @@ PianoReturn_t PianoResponse (PianoHandle_t *ph, PianoRequest_t *req) {
 			ph->stations = PianoListDeleteP (ph->stations, station);
 			PianoDestroyStation (station);
 			free (station);
+			PianoStationIndexInvalidate (ph);
 			break;
 		}
 
@@ -356,7 +406,6 @@ PianoReturn_t PianoResponse (PianoHandle_t *ph, PianoRequest_t *req) {
 			PianoRequestDataSearch_t *reqData = req->data;
 			PianoSearchResult_t *searchResult;
 
-			assert (req->responseData != NULL);
 			assert (reqData != NULL);
 
 			searchResult = &reqData->searchResult;
@@ -413,7 +462,7 @@ PianoReturn_t PianoResponse (PianoHandle_t *ph, PianoRequest_t *req) {
 
 			PianoJsonParseStation (result, tmpStation);
 
-			PianoStation_t *search = PianoFindStationById (ph->stations,
+			PianoStation_t *search = PianoLookupStationById (ph,
 					tmpStation->id);
 			if (search != NULL) {
 				ph->stations = PianoListDeleteP (ph->stations, search);
@@ -421,6 +470,7 @@ PianoReturn_t PianoResponse (PianoHandle_t *ph, PianoRequest_t *req) {
 				free (search);
 			}
 			ph->stations = PianoListAppendP (ph->stations, tmpStation);
+			PianoStationIndexInvalidate (ph);
 			break;
 		}
 
@@ -488,7 +538,6 @@ PianoReturn_t PianoResponse (PianoHandle_t *ph, PianoRequest_t *req) {
 			/* transform shared station into private and update isCreator flag */
 			PianoStation_t *station = req->data;
 
-			assert (req->responseData != NULL);
 			assert (station != NULL);
 
 			station->isCreator = 1;
@@ -0,0 +1,807 @@
+/*
+Copyright (c) 2008-2013
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* user.getStationList is by far the largest response we get. Rather than
+ * build a json-c document for it, scan the json as it arrives and fill in
+ * PianoStation_t records directly; strings we don't use are skipped without
+ * being stored. */
+
+#ifndef __FreeBSD__
+#define _DEFAULT_SOURCE /* required by strdup() */
+#define _DARWIN_C_SOURCE /* strdup() on OS X */
+#endif
+
+#include <config.h>
+
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+
+#include "piano.h"
+#include "piano_private.h"
+
+/* json-c's default nesting limit */
+#define PIANO_STATIONLIST_MAX_DEPTH 32
+/* longest number or literal we care to read */
+#define PIANO_STATIONLIST_MAX_LITERAL 32
+
+/* where a container sits in the response */
+typedef enum {
+	PIANO_SL_OTHER = 0, /* not interesting */
+	PIANO_SL_ROOT, /* { "stat": ..., "code": ..., "result": ... } */
+	PIANO_SL_RESULT, /* { "stations": [...] } */
+	PIANO_SL_STATIONS, /* [ station, ... ] */
+	PIANO_SL_STATION, /* { "stationName": ..., ... } */
+	PIANO_SL_MIX, /* quickMixStationIds: [ id, ... ] */
+} PianoStationListRole_t;
+
+/* the keys we look for, in whichever object they appear */
+typedef enum {
+	PIANO_SL_KEY_OTHER = 0,
+	PIANO_SL_KEY_STAT,
+	PIANO_SL_KEY_CODE,
+	PIANO_SL_KEY_RESULT,
+	PIANO_SL_KEY_STATIONS,
+	PIANO_SL_KEY_NAME,
+	PIANO_SL_KEY_TOKEN,
+	PIANO_SL_KEY_SHARED,
+	PIANO_SL_KEY_QUICKMIX,
+	PIANO_SL_KEY_MIX,
+} PianoStationListKey_t;
+
+static const char * const PianoStationListKeys[] = {
+	[PIANO_SL_KEY_STAT] = "stat",
+	[PIANO_SL_KEY_CODE] = "code",
+	[PIANO_SL_KEY_RESULT] = "result",
+	[PIANO_SL_KEY_STATIONS] = "stations",
+	[PIANO_SL_KEY_NAME] = "stationName",
+	[PIANO_SL_KEY_TOKEN] = "stationToken",
+	[PIANO_SL_KEY_SHARED] = "isShared",
+	[PIANO_SL_KEY_QUICKMIX] = "isQuickMix",
+	[PIANO_SL_KEY_MIX] = "quickMixStationIds",
+};
+
+typedef struct {
+	char **ids;
+	size_t count, size;
+} PianoStationListIds_t;
+
+struct PianoStationListParser {
+	enum {
+		PIANO_SL_VALUE, /* a value comes next */
+		PIANO_SL_FIRST_VALUE, /* a value or the end of an empty array */
+		PIANO_SL_KEY, /* an object key comes next */
+		PIANO_SL_FIRST_KEY, /* a key or the end of an empty object */
+		PIANO_SL_COLON,
+		PIANO_SL_NEXT, /* a comma or the end of the container */
+		PIANO_SL_STRING,
+		PIANO_SL_ESCAPE, /* after a backslash */
+		PIANO_SL_UNICODE, /* in the four digits after \u */
+		PIANO_SL_LITERAL, /* number, true, false or null */
+		PIANO_SL_DONE, /* top-level object complete, ignore the rest */
+		PIANO_SL_ERROR,
+	} state;
+	bool outOfMemory;
+
+	/* open containers */
+	struct {
+		bool isObject;
+		PianoStationListRole_t role;
+	} stack[PIANO_STATIONLIST_MAX_DEPTH];
+	unsigned int depth;
+	/* key of the value being read, if it's an object member */
+	PianoStationListKey_t key;
+	bool keyPending; /* the string being read is a key */
+	bool keepString; /* the string being read is stored in text */
+
+	/* current string or literal; only strings we use are stored */
+	char *text;
+	size_t textLen, textSize;
+	unsigned int unicodeDigits;
+	uint32_t unicode;
+	uint32_t highSurrogate;
+
+	/* what we have found so far */
+	bool statOk, haveStat, haveCode;
+	int code;
+	PianoStation_t *stations, *lastStation;
+	PianoStation_t *station; /* being read */
+	bool stationQuickMix;
+	PianoStationListIds_t stationMix; /* of the station being read */
+	PianoStationListIds_t mix; /* of the last quickmix station */
+	bool invalid; /* a station lacked its name or id */
+};
+
+typedef struct PianoStationListParser PianoStationListParser_t;
+
+static void PianoStationListIdsClear (PianoStationListIds_t *ids) {
+	for (size_t i = 0; i < ids->count; i++) {
+		free (ids->ids[i]);
+	}
+	free (ids->ids);
+	memset (ids, 0, sizeof (*ids));
+}
+
+static bool PianoStationListIdsAdd (PianoStationListIds_t *ids,
+		const char *id) {
+	if (ids->count == ids->size) {
+		const size_t size = ids->size ? ids->size * 2 : 16;
+		char **grown = realloc (ids->ids, size * sizeof (*grown));
+		if (grown == NULL) {
+			return false;
+		}
+		ids->ids = grown;
+		ids->size = size;
+	}
+	if ((ids->ids[ids->count] = strdup (id)) == NULL) {
+		return false;
+	}
+	++ids->count;
+	return true;
+}
+
+/*	release a parser and everything it collected
+ *	@param parser
+ */
+static void PianoStationListFree (PianoStationListParser_t *p) {
+	PianoDestroyStations (p->stations);
+	if (p->station != NULL) {
+		PianoDestroyStation (p->station);
+		free (p->station);
+	}
+	PianoStationListIdsClear (&p->stationMix);
+	PianoStationListIdsClear (&p->mix);
+	free (p->text);
+	free (p);
+}
+
+static bool PianoStationListTextAdd (PianoStationListParser_t *p,
+		const char *s, size_t len) {
+	/* one spare byte for the terminator */
+	if (p->textLen + len + 1 > p->textSize) {
+		size_t size = p->textSize ? p->textSize : 64;
+		while (p->textLen + len + 1 > size) {
+			size *= 2;
+		}
+		char *grown = realloc (p->text, size);
+		if (grown == NULL) {
+			p->outOfMemory = true;
+			return false;
+		}
+		p->text = grown;
+		p->textSize = size;
+	}
+	memcpy (p->text + p->textLen, s, len);
+	p->textLen += len;
+	p->text[p->textLen] = '\0';
+	return true;
+}
+
+/*	append a code point to the current string as utf-8
+ */
+static bool PianoStationListTextAddCodepoint (PianoStationListParser_t *p,
+		uint32_t c) {
+	char utf8[4];
+	size_t len;
+
+	if (c < 0x80) {
+		utf8[0] = c;
+		len = 1;
+	} else if (c < 0x800) {
+		utf8[0] = 0xc0 | (c >> 6);
+		utf8[1] = 0x80 | (c & 0x3f);
+		len = 2;
+	} else if (c < 0x10000) {
+		utf8[0] = 0xe0 | (c >> 12);
+		utf8[1] = 0x80 | ((c >> 6) & 0x3f);
+		utf8[2] = 0x80 | (c & 0x3f);
+		len = 3;
+	} else {
+		utf8[0] = 0xf0 | (c >> 18);
+		utf8[1] = 0x80 | ((c >> 12) & 0x3f);
+		utf8[2] = 0x80 | ((c >> 6) & 0x3f);
+		utf8[3] = 0x80 | (c & 0x3f);
+		len = 4;
+	}
+	return PianoStationListTextAdd (p, utf8, len);
+}
+
+static PianoStationListRole_t PianoStationListParentRole (
+		const PianoStationListParser_t *p) {
+	return p->depth > 0 ? p->stack[p->depth-1].role : PIANO_SL_OTHER;
+}
+
+/*	where a container opened here sits in the response
+ */
+static PianoStationListRole_t PianoStationListChildRole (
+		const PianoStationListParser_t *p, bool isObject) {
+	if (p->depth == 0) {
+		return isObject ? PIANO_SL_ROOT : PIANO_SL_OTHER;
+	}
+	switch (PianoStationListParentRole (p)) {
+		case PIANO_SL_ROOT:
+			return isObject && p->key == PIANO_SL_KEY_RESULT ?
+					PIANO_SL_RESULT : PIANO_SL_OTHER;
+
+		case PIANO_SL_RESULT:
+			return !isObject && p->key == PIANO_SL_KEY_STATIONS ?
+					PIANO_SL_STATIONS : PIANO_SL_OTHER;
+
+		case PIANO_SL_STATIONS:
+			return isObject ? PIANO_SL_STATION : PIANO_SL_OTHER;
+
+		case PIANO_SL_STATION:
+			return !isObject && p->key == PIANO_SL_KEY_MIX ?
+					PIANO_SL_MIX : PIANO_SL_OTHER;
+
+		default:
+			return PIANO_SL_OTHER;
+	}
+}
+
+static bool PianoStationListOpen (PianoStationListParser_t *p,
+		bool isObject) {
+	if (p->depth == PIANO_STATIONLIST_MAX_DEPTH) {
+		return false;
+	}
+	const PianoStationListRole_t role = PianoStationListChildRole (p,
+			isObject);
+	if (p->depth == 0 && role != PIANO_SL_ROOT) {
+		/* the response must be an object */
+		return false;
+	}
+	if (role == PIANO_SL_STATION) {
+		assert (p->station == NULL);
+		if ((p->station = calloc (1, sizeof (*p->station))) == NULL) {
+			p->outOfMemory = true;
+			return false;
+		}
+		/* unless isShared says otherwise */
+		p->station->isCreator = true;
+		p->stationQuickMix = false;
+		PianoStationListIdsClear (&p->stationMix);
+	} else if (role == PIANO_SL_MIX) {
+		/* only the last list counts, like any repeated key */
+		PianoStationListIdsClear (&p->stationMix);
+	}
+	p->stack[p->depth].isObject = isObject;
+	p->stack[p->depth].role = role;
+	++p->depth;
+	p->state = isObject ? PIANO_SL_FIRST_KEY : PIANO_SL_FIRST_VALUE;
+	return true;
+}
+
+/*	a station object is complete, add it to the list
+ */
+static void PianoStationListAddStation (PianoStationListParser_t *p) {
+	PianoStation_t * const s = p->station;
+
+	p->station = NULL;
+	if (s->name == NULL || s->id == NULL) {
+		p->invalid = true;
+		PianoDestroyStation (s);
+		free (s);
+		return;
+	}
+	if (p->lastStation == NULL) {
+		p->stations = s;
+	} else {
+		p->lastStation->head.next = &s->head;
+	}
+	p->lastStation = s;
+
+	if (p->stationQuickMix) {
+		/* fix flags on other stations later */
+		PianoStationListIdsClear (&p->mix);
+		p->mix = p->stationMix;
+		memset (&p->stationMix, 0, sizeof (p->stationMix));
+	}
+	s->isQuickMix = p->stationQuickMix;
+}
+
+static bool PianoStationListClose (PianoStationListParser_t *p,
+		bool isObject) {
+	if (p->depth == 0 || p->stack[p->depth-1].isObject != isObject) {
+		return false;
+	}
+	--p->depth;
+	if (p->stack[p->depth].role == PIANO_SL_STATION) {
+		PianoStationListAddStation (p);
+	}
+	p->state = p->depth == 0 ? PIANO_SL_DONE : PIANO_SL_NEXT;
+	return true;
+}
+
+/*	a scalar value is complete, its text is in text (if kept)
+ *	@param parser
+ *	@param string or literal
+ */
+static bool PianoStationListScalar (PianoStationListParser_t *p,
+		bool isString) {
+	const PianoStationListRole_t role = PianoStationListParentRole (p);
+	/* json_object_get_boolean () semantics */
+	const bool truth = isString ? p->textLen > 0 :
+			(strcmp (p->text, "true") == 0 ||
+			(strcmp (p->text, "false") != 0 &&
+			strcmp (p->text, "null") != 0 && strtod (p->text, NULL) != 0));
+
+	if (p->depth == 0) {
+		/* the response must be an object */
+		return false;
+	}
+	if (role == PIANO_SL_ROOT) {
+		if (p->key == PIANO_SL_KEY_STAT) {
+			p->haveStat = true;
+			p->statOk = isString && strcmp (p->text, "ok") == 0;
+		} else if (p->key == PIANO_SL_KEY_CODE && !isString) {
+			const double code = strtod (p->text, NULL);
+			p->haveCode = true;
+			p->code = code > INT_MAX ? INT_MAX :
+					(code < INT_MIN ? INT_MIN : (int) code);
+		}
+	} else if (role == PIANO_SL_STATION) {
+		PianoStation_t * const s = p->station;
+		char **field = NULL;
+
+		switch (p->key) {
+			case PIANO_SL_KEY_NAME:
+				field = &s->name;
+				break;
+
+			case PIANO_SL_KEY_TOKEN:
+				field = &s->id;
+				break;
+
+			case PIANO_SL_KEY_SHARED:
+				s->isCreator = !truth;
+				break;
+
+			case PIANO_SL_KEY_QUICKMIX:
+				p->stationQuickMix = truth;
+				break;
+
+			default:
+				break;
+		}
+		if (field != NULL && isString) {
+			free (*field);
+			if ((*field = strdup (p->text)) == NULL) {
+				p->outOfMemory = true;
+				return false;
+			}
+		}
+	} else if (role == PIANO_SL_MIX && isString) {
+		if (!PianoStationListIdsAdd (&p->stationMix, p->text)) {
+			p->outOfMemory = true;
+			return false;
+		}
+	}
+	p->state = PIANO_SL_NEXT;
+	return true;
+}
+
+/*	a string starts; decide whether to keep its text
+ */
+static bool PianoStationListStringStart (PianoStationListParser_t *p,
+		bool isKey) {
+	const PianoStationListRole_t role = PianoStationListParentRole (p);
+
+	p->keyPending = isKey;
+	if (isKey) {
+		p->keepString = role == PIANO_SL_ROOT || role == PIANO_SL_RESULT ||
+				role == PIANO_SL_STATION;
+	} else if (role == PIANO_SL_ROOT) {
+		p->keepString = p->key == PIANO_SL_KEY_STAT;
+	} else if (role == PIANO_SL_STATION) {
+		p->keepString = p->key != PIANO_SL_KEY_OTHER;
+	} else {
+		p->keepString = role == PIANO_SL_MIX;
+	}
+	p->textLen = 0;
+	p->highSurrogate = 0;
+	p->state = PIANO_SL_STRING;
+	return PianoStationListTextAdd (p, "", 0);
+}
+
+static bool PianoStationListStringEnd (PianoStationListParser_t *p) {
+	if (p->keyPending) {
+		p->key = PIANO_SL_KEY_OTHER;
+		if (p->keepString) {
+			for (size_t i = 1; i < sizeof (PianoStationListKeys) /
+					sizeof (*PianoStationListKeys); i++) {
+				if (strcmp (p->text, PianoStationListKeys[i]) == 0) {
+					p->key = i;
+					break;
+				}
+			}
+		}
+		p->state = PIANO_SL_COLON;
+		return true;
+	}
+	return PianoStationListScalar (p, true);
+}
+
+static bool PianoStationListLiteralEnd (PianoStationListParser_t *p) {
+	char *end;
+
+	if (strcmp (p->text, "true") != 0 && strcmp (p->text, "false") != 0 &&
+			strcmp (p->text, "null") != 0) {
+		strtod (p->text, &end);
+		if (p->textLen == 0 || *end != '\0') {
+			return false;
+		}
+	}
+	return PianoStationListScalar (p, false);
+}
+
+static bool PianoStationListIsSpace (char c) {
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool PianoStationListIsLiteral (char c) {
+	return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '-' ||
+			c == '+' || c == '.' || c == 'E';
+}
+
+/*	feed string content, up to the closing quote or a backslash
+ *	@return bytes consumed
+ */
+static size_t PianoStationListStringRun (PianoStationListParser_t *p,
+		const char *data, size_t size) {
+	size_t i = 0;
+	while (i < size && data[i] != '"' && data[i] != '\\') {
+		++i;
+	}
+	if (i > 0) {
+		if (p->highSurrogate != 0) {
+			/* unpaired */
+			p->highSurrogate = 0;
+			if (p->keepString && !PianoStationListTextAddCodepoint (p, 0xfffd)) {
+				return 0;
+			}
+		}
+		if (p->keepString && !PianoStationListTextAdd (p, data, i)) {
+			return 0;
+		}
+	}
+	return i;
+}
+
+static bool PianoStationListEscape (PianoStationListParser_t *p, char c) {
+	static const char escapes[] = "\"\"\\\\//b\bf\fn\nr\rt\t";
+
+	if (c == 'u') {
+		p->unicodeDigits = 0;
+		p->unicode = 0;
+		p->state = PIANO_SL_UNICODE;
+		return true;
+	}
+	for (size_t i = 0; escapes[i] != '\0'; i += 2) {
+		if (escapes[i] == c) {
+			p->state = PIANO_SL_STRING;
+			if (p->highSurrogate != 0) {
+				p->highSurrogate = 0;
+				if (p->keepString &&
+						!PianoStationListTextAddCodepoint (p, 0xfffd)) {
+					return false;
+				}
+			}
+			return !p->keepString ||
+					PianoStationListTextAdd (p, &escapes[i+1], 1);
+		}
+	}
+	return false;
+}
+
+static bool PianoStationListUnicode (PianoStationListParser_t *p, char c) {
+	uint32_t digit;
+
+	if (c >= '0' && c <= '9') {
+		digit = c - '0';
+	} else if (c >= 'a' && c <= 'f') {
+		digit = c - 'a' + 10;
+	} else if (c >= 'A' && c <= 'F') {
+		digit = c - 'A' + 10;
+	} else {
+		return false;
+	}
+	p->unicode = p->unicode << 4 | digit;
+	if (++p->unicodeDigits < 4) {
+		return true;
+	}
+
+	const uint32_t u = p->unicode;
+	p->state = PIANO_SL_STRING;
+	if (!p->keepString) {
+		return true;
+	}
+	if (u >= 0xd800 && u < 0xdc00) {
+		bool ok = true;
+		if (p->highSurrogate != 0) {
+			ok = PianoStationListTextAddCodepoint (p, 0xfffd);
+		}
+		p->highSurrogate = u;
+		return ok;
+	} else if (u >= 0xdc00 && u < 0xe000) {
+		if (p->highSurrogate == 0) {
+			return PianoStationListTextAddCodepoint (p, 0xfffd);
+		}
+		const uint32_t c32 = 0x10000 + ((p->highSurrogate - 0xd800) << 10) +
+				(u - 0xdc00);
+		p->highSurrogate = 0;
+		return PianoStationListTextAddCodepoint (p, c32);
+	}
+	if (p->highSurrogate != 0) {
+		p->highSurrogate = 0;
+		if (!PianoStationListTextAddCodepoint (p, 0xfffd)) {
+			return false;
+		}
+	}
+	return PianoStationListTextAddCodepoint (p, u);
+}
+
+/*	run the scanner over one piece of the response
+ *	@return false on malformed json or out of memory
+ */
+static bool PianoStationListScan (PianoStationListParser_t *p,
+		const char *data, size_t size) {
+	size_t i = 0;
+
+	while (i < size) {
+		const char c = data[i];
+
+		switch (p->state) {
+			case PIANO_SL_STRING: {
+				if (c == '"') {
+					if (p->highSurrogate != 0) {
+						p->highSurrogate = 0;
+						if (p->keepString &&
+								!PianoStationListTextAddCodepoint (p, 0xfffd)) {
+							return false;
+						}
+					}
+					++i;
+					if (!PianoStationListStringEnd (p)) {
+						return false;
+					}
+				} else if (c == '\\') {
+					++i;
+					p->state = PIANO_SL_ESCAPE;
+				} else if ((unsigned char) c < 0x20) {
+					return false;
+				} else {
+					const size_t run = PianoStationListStringRun (p, data + i,
+							size - i);
+					if (run == 0) {
+						return false;
+					}
+					i += run;
+				}
+				break;
+			}
+
+			case PIANO_SL_ESCAPE:
+				++i;
+				if (!PianoStationListEscape (p, c)) {
+					return false;
+				}
+				break;
+
+			case PIANO_SL_UNICODE:
+				++i;
+				if (!PianoStationListUnicode (p, c)) {
+					return false;
+				}
+				break;
+
+			case PIANO_SL_LITERAL:
+				if (PianoStationListIsLiteral (c)) {
+					if (p->textLen == PIANO_STATIONLIST_MAX_LITERAL ||
+							!PianoStationListTextAdd (p, &c, 1)) {
+						return false;
+					}
+					++i;
+				} else if (!PianoStationListLiteralEnd (p)) {
+					return false;
+				}
+				/* the delimiter is handled in state NEXT */
+				break;
+
+			case PIANO_SL_DONE:
+				/* anything after the top-level object is ignored */
+				return true;
+
+			case PIANO_SL_ERROR:
+				return false;
+
+			default:
+				++i;
+				if (PianoStationListIsSpace (c)) {
+					break;
+				}
+				switch (p->state) {
+					case PIANO_SL_FIRST_VALUE:
+						if (c == ']') {
+							if (!PianoStationListClose (p, false)) {
+								return false;
+							}
+							break;
+						}
+						/* fall through */
+
+					case PIANO_SL_VALUE:
+						if (c == '{' || c == '[') {
+							if (!PianoStationListOpen (p, c == '{')) {
+								return false;
+							}
+						} else if (c == '"') {
+							if (!PianoStationListStringStart (p, false)) {
+								return false;
+							}
+						} else if (PianoStationListIsLiteral (c)) {
+							p->textLen = 0;
+							if (!PianoStationListTextAdd (p, &c, 1)) {
+								return false;
+							}
+							p->state = PIANO_SL_LITERAL;
+						} else {
+							return false;
+						}
+						break;
+
+					case PIANO_SL_FIRST_KEY:
+						if (c == '}') {
+							if (!PianoStationListClose (p, true)) {
+								return false;
+							}
+							break;
+						}
+						/* fall through */
+
+					case PIANO_SL_KEY:
+						if (c != '"' || !PianoStationListStringStart (p, true)) {
+							return false;
+						}
+						break;
+
+					case PIANO_SL_COLON:
+						if (c != ':') {
+							return false;
+						}
+						p->state = PIANO_SL_VALUE;
+						break;
+
+					case PIANO_SL_NEXT:
+						if (c == ',') {
+							p->state = p->stack[p->depth-1].isObject ?
+									PIANO_SL_KEY : PIANO_SL_VALUE;
+						} else if (c == '}' || c == ']') {
+							if (!PianoStationListClose (p, c == '}')) {
+								return false;
+							}
+						} else {
+							return false;
+						}
+						break;
+
+					default:
+						assert (0);
+						return false;
+				}
+				break;
+		}
+	}
+	return true;
+}
+
+/*	parse a piece of a user.getStationList response
+ *	@param initialized request
+ *	@param response data, not \0-terminated
+ *	@param size of response data
+ *	@return PIANO_RET_OK, or PIANO_RET_OUT_OF_MEMORY
+ */
+PianoReturn_t PianoStationListFeed (PianoRequest_t *req, const char *data,
+		size_t size) {
+	assert (req != NULL);
+	assert (data != NULL);
+
+	PianoStationListParser_t *p = req->responseStations;
+	if (p == NULL) {
+		if ((p = calloc (1, sizeof (*p))) == NULL) {
+			return PIANO_RET_OUT_OF_MEMORY;
+		}
+		p->state = PIANO_SL_VALUE;
+		req->responseStations = p;
+	}
+	if (!PianoStationListScan (p, data, size)) {
+		/* like PianoResponseFeed (), drain the body and report it later */
+		p->state = PIANO_SL_ERROR;
+		if (p->outOfMemory) {
+			return PIANO_RET_OUT_OF_MEMORY;
+		}
+	}
+	return PIANO_RET_OK;
+}
+
+/*	finish a user.getStationList response, appending its stations
+ *	@param piano handle
+ *	@param request
+ *	@return PIANO_RET_OK or the error reported by Pandora
+ */
+PianoReturn_t PianoStationListFinish (PianoHandle_t *ph,
+		PianoRequest_t *req) {
+	PianoStationListParser_t * const p = req->responseStations;
+	PianoReturn_t ret = PIANO_RET_OK;
+
+	if (p == NULL) {
+		return PIANO_RET_INVALID_RESPONSE;
+	}
+	req->responseStations = NULL;
+
+	if (p->state != PIANO_SL_DONE || !p->haveStat) {
+		ret = PIANO_RET_INVALID_RESPONSE;
+	} else if (!p->statOk) {
+		ret = p->haveCode ? p->code + PIANO_RET_OFFSET :
+				PIANO_RET_INVALID_RESPONSE;
+	} else if (p->invalid) {
+		ret = PIANO_RET_INVALID_RESPONSE;
+	} else {
+		PianoStationIndexInvalidate (ph);
+		/* PianoListAppend () takes single elements only */
+		if (ph->stations == NULL) {
+			ph->stations = p->stations;
+		} else {
+			PianoStation_t *last = ph->stations;
+			while (last->head.next != NULL) {
+				last = PianoListNextP (last);
+			}
+			last->head.next = p->stations == NULL ? NULL : &p->stations->head;
+		}
+		p->stations = NULL;
+
+		/* fix quickmix flags */
+		for (size_t i = 0; i < p->mix.count; i++) {
+			PianoStation_t *curStation = PianoLookupStationById (ph,
+					p->mix.ids[i]);
+			if (curStation != NULL) {
+				curStation->useQuickMix = true;
+			}
+		}
+	}
+
+	PianoStationListFree (p);
+	return ret;
+}
+
+/*	release a station list parser left over from an unfinished request
+ *	@param request
+ */
+void PianoStationListDestroy (PianoRequest_t *req) {
+	if (req->responseStations != NULL) {
+		PianoStationListFree (req->responseStations);
+		req->responseStations = NULL;
+	}
+}
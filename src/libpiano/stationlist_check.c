@@ -0,0 +1,295 @@
+/*
+ *  stationlist_check.c
+ *  Feeds user.getStationList responses to libpiano in random pieces and
+ *  checks the stations it builds, then times a large list and reports the
+ *  memory it takes.  Run by "make check".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "piano.h"
+
+#define ROUNDS 50
+#define BENCH_STATIONS 2000
+#define BENCH_CHUNK 16384
+#define BENCH_ROUNDS 5
+
+/* stations as name|id|flags, flags being C(reator), Q(uickmix) and
+ * U(se in quickmix) */
+typedef struct {
+	const char *json;
+	PianoReturn_t ret;
+	const char *stations;
+} StationListCase_t;
+
+static const StationListCase_t cases[] = {
+	{"{\"stat\":\"ok\",\"result\":{\"stations\":[]}}", PIANO_RET_OK, ""},
+	{"{\"stat\":\"ok\",\"result\":{\"stations\":["
+			"{\"stationName\":\"Rock\",\"stationToken\":\"11\",\"isShared\":false,"
+			"\"isQuickMix\":false},"
+			"{\"stationToken\":\"12\",\"stationName\":\"Jazz\",\"isShared\":true},"
+			"{\"isQuickMix\":true,\"stationName\":\"QuickMix\","
+			"\"stationToken\":\"10\",\"quickMixStationIds\":[\"12\",\"99\"]}"
+			"]}}",
+			PIANO_RET_OK, "Rock|11|C;Jazz|12|U;QuickMix|10|CQ;"},
+	/* unknown members of every kind, and look-alike keys in other objects */
+	{" {\"result\" : {\"checksum\":\"x\",\"other\":{\"stations\":[{\"stationName\":\"No\","
+			"\"stationToken\":\"0\"}]},\"stations\" : [ 7, \"s\", [{\"stationName\":"
+			"\"N\",\"stationToken\":\"9\"}], {\"dateCreated\":{\"time\":"
+			"1.5e12,\"year\":-3},\"genre\":[\"a\",[],{}],\"stationName\":\"A\\\"\\\\\\/"
+			"\\b\\f\\n\\r\\t\",\"allowRename\":null,\"stationToken\":\"\\u0031\","
+			"\"isShared\":0,\"stationName\":\"Caf\\u00e9 \\ud83c\\udfb5 \\u20ac\"} ] } ,"
+			"\"stat\" : \"ok\" } trailing garbage",
+			PIANO_RET_OK, "Caf\xc3\xa9 \xf0\x9f\x8e\xb5 \xe2\x82\xac|1|C;"},
+	/* only the last quickmix station's list counts */
+	{"{\"stat\":\"ok\",\"result\":{\"stations\":["
+			"{\"stationName\":\"M1\",\"stationToken\":\"1\",\"isQuickMix\":1,"
+			"\"quickMixStationIds\":[\"3\"]},"
+			"{\"stationName\":\"S2\",\"stationToken\":\"2\",\"isQuickMix\":\"\","
+			"\"quickMixStationIds\":[\"1\"]},"
+			"{\"stationName\":\"M3\",\"stationToken\":\"3\",\"isQuickMix\":\"yes\","
+			"\"isShared\":\"yes\",\"quickMixStationIds\":[\"2\"]}"
+			"]}}",
+			PIANO_RET_OK, "M1|1|CQ;S2|2|CU;M3|3|Q;"},
+	{"{\"stat\":\"fail\",\"message\":\"An unexpected error occurred\",\"code\":1001}",
+			PIANO_RET_P_INVALID_AUTH_TOKEN, ""},
+	{"{\"stat\":\"fail\"}", PIANO_RET_INVALID_RESPONSE, ""},
+	{"{\"stat\":\"ok\",\"result\":{\"stations\":[{\"stationName\":\"x\"}]}}",
+			PIANO_RET_INVALID_RESPONSE, ""},
+	{"{\"stat\":\"ok\",\"result\":{\"stations\":[{\"stationName\":\"x\","
+			"\"stationToken\":\"1\"}", PIANO_RET_INVALID_RESPONSE, ""},
+	{"{\"stat\":\"ok\",\"result\":{\"stations\":[,]}}", PIANO_RET_INVALID_RESPONSE, ""},
+	{"{\"stat\":\"ok\",\"result\":{\"stations\":[{\"stationName\":\"x\","
+			"\"stationToken\":\"1\",}]}}", PIANO_RET_INVALID_RESPONSE, ""},
+	{"{\"stat\":\"ok\",\"code\":12x}", PIANO_RET_INVALID_RESPONSE, ""},
+	{"{\"stat\":\"ok\",\"a\":\"\\x\"}", PIANO_RET_INVALID_RESPONSE, ""},
+	{"{\"stat\":\"ok\",\"a\":\"\\u12g4\"}", PIANO_RET_INVALID_RESPONSE, ""},
+	{"{\"stat\":\"ok\",\"a\":[}", PIANO_RET_INVALID_RESPONSE, ""},
+	{"[{\"stat\":\"ok\"}]", PIANO_RET_INVALID_RESPONSE, ""},
+	{"\"ok\"", PIANO_RET_INVALID_RESPONSE, ""},
+	{"{\"stat\":\"ok\"", PIANO_RET_INVALID_RESPONSE, ""},
+	{"", PIANO_RET_INVALID_RESPONSE, ""},
+	{"{\"stat\":\"ok\",\"a\":[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[["
+			"]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]}", PIANO_RET_INVALID_RESPONSE, ""},
+	{"{\"stat\":\"ok\",\"a\":[[[[[[[[[[[[[[[[[[[[[[[[[[[[[[]]]]]]]]]]]]]]]]]]]]]]]]]]]]]]}",
+			PIANO_RET_OK, ""},
+};
+
+static double Seconds (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*	describe a station list the way the cases do
+ */
+static char *DescribeStations (PianoStation_t *s) {
+	size_t size = 1;
+	char *text;
+
+	for (PianoStation_t *i = s; i != NULL; i = PianoListNextP (i)) {
+		size += strlen (i->name) + strlen (i->id) + 6;
+	}
+	if ((text = calloc (size, 1)) == NULL) {
+		return NULL;
+	}
+	PianoListForeachP (s) {
+		sprintf (text + strlen (text), "%s|%s|%s%s%s;", s->name, s->id,
+				s->isCreator ? "C" : "", s->isQuickMix ? "Q" : "",
+				s->useQuickMix ? "U" : "");
+	}
+	return text;
+}
+
+/*	run one response through PianoResponseFeed in pieces of up to maxChunk
+ *	bytes (or through responseData if 0)
+ */
+static PianoReturn_t ParseStations (PianoHandle_t *ph, const char *json,
+		size_t maxChunk) {
+	PianoRequest_t req;
+	PianoReturn_t ret = PIANO_RET_OK;
+	const size_t len = strlen (json);
+
+	memset (&req, 0, sizeof (req));
+	req.type = PIANO_REQUEST_GET_STATIONS;
+	if (maxChunk == 0) {
+		req.responseData = (char *) json;
+	} else {
+		for (size_t pos = 0; pos < len && ret == PIANO_RET_OK; ) {
+			size_t chunk = 1 + rand () % maxChunk;
+			if (chunk > len - pos) {
+				chunk = len - pos;
+			}
+			ret = PianoResponseFeed (&req, json + pos, chunk);
+			pos += chunk;
+		}
+	}
+	if (ret == PIANO_RET_OK) {
+		ret = PianoResponse (ph, &req);
+	}
+	req.responseData = NULL;
+	PianoDestroyRequest (&req);
+	return ret;
+}
+
+static bool CheckCase (const StationListCase_t *c, size_t maxChunk) {
+	PianoHandle_t ph;
+	bool ok = false;
+
+	memset (&ph, 0, sizeof (ph));
+	const PianoReturn_t ret = ParseStations (&ph, c->json, maxChunk);
+	char *stations = DescribeStations (ph.stations);
+	if (ret != c->ret) {
+		fprintf (stderr, "%s\n(in pieces of up to %zu) returned %s, expected %s\n",
+				c->json, maxChunk, PianoErrorToStr (ret),
+				PianoErrorToStr (c->ret));
+	} else if (stations == NULL || strcmp (stations, c->stations) != 0) {
+		fprintf (stderr, "%s\n(in pieces of up to %zu) gave stations %s, "
+				"expected %s\n", c->json, maxChunk, stations, c->stations);
+	} else {
+		ok = true;
+	}
+	free (stations);
+	PianoDestroy (&ph);
+	return ok;
+}
+
+/*	a station list like Pandora's, with a quickmix of every other station
+ */
+static char *BigStationList (size_t count) {
+	const size_t size = 64 + count * 1400;
+	char *json = malloc (size), *pos = json;
+
+	if (json == NULL) {
+		return NULL;
+	}
+	pos += sprintf (pos, "{\"stat\":\"ok\",\"result\":{\"stations\":[");
+	for (size_t i = 0; i < count; i++) {
+		pos += sprintf (pos, "%s{\"suppressVideoAds\":false,\"isQuickMix\":%s,"
+				"\"stationId\":\"%zu\",\"allowDelete\":true,\"isShared\":%s,"
+				"\"dateCreated\":{\"date\":%zu,\"day\":3,\"hours\":21,"
+				"\"minutes\":4,\"month\":6,\"nanos\":%zu,\"seconds\":53,"
+				"\"time\":13415%08zu,\"timezoneOffset\":480,\"year\":112},"
+				"\"stationDetailUrl\":\"https://www.pandora.com/login?target="
+				"%%2Fstations%%2F%08zx\",\"stationToken\":\"%zu\","
+				"\"stationSharingUrl\":\"https://www.pandora.com/?sc=sh%zu"
+				"&shareImp=true\",\"allowEditDescription\":true,"
+				"\"requiresCleanAds\":false,\"isGenreStation\":false,"
+				"\"stationName\":\"Station \\u00e9 number %zu Radio\","
+				"\"allowAddMusic\":true,\"allowRename\":true,"
+				"\"artUrl\":\"http://cont-2.p-cdn.com/images/public/amz/9/2/"
+				"%zu/1/%08zx_500W_500H.jpg\",\"genre\":[\"Rock\",\"Pop\"],"
+				"\"initialSeed\":{\"musicToken\":\"R%zu\",\"artist\":"
+				"{\"artistName\":\"Artist %zu\",\"musicToken\":\"R%zu\"}}",
+				i == 0 ? "" : ",", i == 0 ? "true" : "false", 1000000 + i,
+				i % 3 == 0 ? "true" : "false", i % 28, i * 1000, i, i,
+				4000000000 + i, 4000000000 + i, i, i % 10, i, i, i, i);
+		if (i == 0) {
+			pos += sprintf (pos, ",\"quickMixStationIds\":[");
+			for (size_t j = 1; j < count; j += 2) {
+				pos += sprintf (pos, "%s\"%zu\"", j == 1 ? "" : ",",
+						4000000000 + j);
+			}
+			pos += sprintf (pos, "]");
+		}
+		pos += sprintf (pos, "}");
+	}
+	sprintf (pos, "]}}");
+	return json;
+}
+
+static long MaxRssKb (void) {
+	struct rusage usage;
+	getrusage (RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+int main (void) {
+	/* every case whole, through responseData, byte by byte and in random
+	 * pieces */
+	srand (1);
+	for (size_t i = 0; i < sizeof (cases) / sizeof (*cases); i++) {
+		if (!CheckCase (&cases[i], strlen (cases[i].json) + 1) ||
+				!CheckCase (&cases[i], 0) || !CheckCase (&cases[i], 1)) {
+			return 1;
+		}
+		for (int round = 0; round < ROUNDS; round++) {
+			if (!CheckCase (&cases[i], 1 + rand () % 16)) {
+				return 1;
+			}
+		}
+	}
+
+	/* stations are appended to those already there */
+	PianoHandle_t ph;
+	memset (&ph, 0, sizeof (ph));
+	if (ParseStations (&ph, cases[1].json, 7) != PIANO_RET_OK ||
+			ParseStations (&ph, cases[3].json, 7) != PIANO_RET_OK) {
+		fprintf (stderr, "station lists not parsed\n");
+		return 1;
+	}
+	char *stations = DescribeStations (ph.stations);
+	const char * const expected = "Rock|11|C;Jazz|12|U;QuickMix|10|CQ;"
+			"M1|1|CQ;S2|2|CU;M3|3|Q;";
+	if (stations == NULL || strcmp (stations, expected) != 0) {
+		fprintf (stderr, "appended station list is %s, expected %s\n",
+				stations, expected);
+		return 1;
+	}
+	free (stations);
+	PianoDestroy (&ph);
+
+	/* a large list, informational apart from the station count */
+	char *json = BigStationList (BENCH_STATIONS);
+	if (json == NULL) {
+		return 1;
+	}
+	const size_t len = strlen (json);
+	const long rssBefore = MaxRssKb ();
+	double best = 0;
+	for (int round = 0; round < BENCH_ROUNDS; round++) {
+		PianoRequest_t req;
+		PianoReturn_t ret = PIANO_RET_OK;
+
+		memset (&ph, 0, sizeof (ph));
+		memset (&req, 0, sizeof (req));
+		req.type = PIANO_REQUEST_GET_STATIONS;
+		const double start = Seconds ();
+		for (size_t pos = 0; pos < len && ret == PIANO_RET_OK;
+				pos += BENCH_CHUNK) {
+			ret = PianoResponseFeed (&req, json + pos,
+					len - pos < BENCH_CHUNK ? len - pos : BENCH_CHUNK);
+		}
+		if (ret == PIANO_RET_OK) {
+			ret = PianoResponse (&ph, &req);
+		}
+		const double elapsed = Seconds () - start;
+		PianoDestroyRequest (&req);
+
+		size_t count = 0, mixed = 0;
+		for (PianoStation_t *s = ph.stations; s != NULL; s = PianoListNextP (s)) {
+			++count;
+			mixed += s->useQuickMix;
+		}
+		PianoDestroy (&ph);
+		if (ret != PIANO_RET_OK || count != BENCH_STATIONS ||
+				mixed != BENCH_STATIONS / 2) {
+			fprintf (stderr, "large station list: %s, %zu stations, %zu mixed\n",
+					PianoErrorToStr (ret), count, mixed);
+			return 1;
+		}
+		if (round == 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+	printf ("%d stations, %zu kB of json in %d kB pieces: %.2f ms, "
+			"peak RSS grew %ld kB\n", BENCH_STATIONS, len / 1024,
+			BENCH_CHUNK / 1024, best * 1000, MaxRssKb () - rssBefore);
+	free (json);
+	return 0;
+}
@@ -31,6 +31,7 @@ THE SOFTWARE.
 #include <sys/socket.h>
 #include <netdb.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -40,6 +41,8 @@ THE SOFTWARE.
 #include <errno.h>
 #include <assert.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "config.h"
 #include "waitress.h"
@@ -74,9 +77,15 @@ struct _mbedtls_ctx
 #define strcaseeq(a,b) (strcasecmp(a,b) == 0)
 #define WAITRESS_HTTP_VERSION "1.1"
 
+/* idle keep-alive connections are dropped after this many seconds */
+#define WAITRESS_POOL_IDLE_TIMEOUT 30
+/* maximum number of idle connections kept per destination */
+#define WAITRESS_POOL_MAX_IDLE 4
+
 typedef struct {
 	char *data;
 	size_t pos;
+	size_t size;
 } WaitressFetchBufCbBuffer_t;
 
 static WaitressReturn_t WaitressReceiveHeaders (WaitressHandle_t *, size_t *);
@@ -411,20 +420,21 @@ static WaitressCbReturn_t WaitressFetchBufCb (void *recvData, size_t recvDataSiz
 	char *recvBytes = recvData;
 	WaitressFetchBufCbBuffer_t *buffer = extraData;
 
-	if (buffer->data == NULL) {
-		if ((buffer->data = malloc (sizeof (*buffer->data) *
-				(recvDataSize + 1))) == NULL) {
-			return WAITRESS_CB_RET_ERR;
+	/* grow geometrically, copying the data received so far only rarely */
+	if (buffer->pos + recvDataSize + 1 > buffer->size) {
+		size_t newsize = buffer->size * 2;
+		if (newsize < buffer->pos + recvDataSize + 1) {
+			newsize = buffer->pos + recvDataSize + 1;
 		}
-	} else {
 		char *newbuf;
 		if ((newbuf = realloc (buffer->data,
-				sizeof (*buffer->data) *
-				(buffer->pos + recvDataSize + 1))) == NULL) {
+				sizeof (*buffer->data) * newsize)) == NULL) {
 			free (buffer->data);
+			buffer->data = NULL;
 			return WAITRESS_CB_RET_ERR;
 		}
 		buffer->data = newbuf;
+		buffer->size = newsize;
 	}
 	memcpy (buffer->data + buffer->pos, recvBytes, recvDataSize);
 	buffer->pos += recvDataSize;
@@ -455,6 +465,14 @@ WaitressReturn_t WaitressFetchBuf (WaitressHandle_t *waith, char **retBuffer) {
 	return wRet;
 }
 
+/*	monotonic clock in microseconds, for phase timings
+ */
+static uint64_t WaitressMicroseconds (void) {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 /*	poll wrapper that retries after signal interrupts, required for socksify
  *	wrapper
  */
@@ -712,9 +730,9 @@ static WaitressHandlerReturn_t WaitressHandleChunked (void *data, char *buf,
 					/* ignore */
 				} else if (buf[pos] == '\n') {
 					waith->request.chunkedState = DATA;
-					/* last chunk has size 0 */
+					/* last chunk has size 0, trailer follows */
 					if (waith->request.chunkSize == 0) {
-						return WAITRESS_HANDLER_DONE;
+						waith->request.chunkedState = TRAILER;
 					}
 				} else {
 					/* everything else is a protocol violation */
@@ -746,6 +764,22 @@ static WaitressHandlerReturn_t WaitressHandleChunked (void *data, char *buf,
 					++pos;
 				}
 				break;
+
+			case TRAILER:
+				/* skip trailer lines until the empty one; chunkSize counts
+				 * the characters in the current line */
+				if (buf[pos] == '\n') {
+					if (waith->request.chunkSize == 0) {
+						++pos;
+						waith->request.excessReceived = size - pos;
+						return WAITRESS_HANDLER_DONE;
+					}
+					waith->request.chunkSize = 0;
+				} else if (buf[pos] != '\r') {
+					++waith->request.chunkSize;
+				}
+				++pos;
+				break;
 		}
 	}
 
@@ -767,6 +801,10 @@ static void WaitressHandleHeader (WaitressHandle_t *waith, const char * const ke
 		if (strcaseeq (value, "chunked")) {
 			waith->request.dataHandler = WaitressHandleChunked;
 		}
+	} else if (strcaseeq (key, "Connection")) {
+		if (strcaseeq (value, "close")) {
+			waith->request.connectionClose = true;
+		}
 	}
 }
 
@@ -847,92 +885,837 @@ static WaitressReturn_t WaitressTlsVerify (const WaitressHandle_t *waith) {
 	return WAITRESS_RET_OK;
 }
 
-/*	Connect to server
+/*	Keep-alive connection pool. Connections are kept per destination (scheme,
+ *	host, port and proxy) and handed to the next request going there, which
+ *	saves the TCP and TLS handshakes. TLS session data is remembered as well,
+ *	so a new connection to a known host can resume the session.
  */
-static WaitressReturn_t WaitressConnect (WaitressHandle_t *waith) {
-	WaitressReturn_t ret;
-	struct addrinfo hints, *gares;
-	int hsret;
+typedef struct WaitressPoolConn {
+	int sockfd;
+#if defined(USE_MBEDTLS)
+	mbedtls_ctx *sslCtx;
+#else
+	gnutls_session_t tlsSession;
+	gnutls_certificate_credentials_t tlsCred;
+#endif
+	time_t lastUsed;
+	struct WaitressPoolConn *next;
+} WaitressPoolConn_t;
+
+typedef struct WaitressPoolHost {
+	char *key;
+	/* most recently used first */
+	WaitressPoolConn_t *idle;
+	size_t idleCount;
+#if defined(USE_MBEDTLS)
+	mbedtls_ssl_session session;
+	bool haveSession;
+#else
+	gnutls_datum_t session;
+#endif
+	struct WaitressPoolHost *next;
+} WaitressPoolHost_t;
 
-	memset (&hints, 0, sizeof hints);
+static WaitressPoolHost_t *waitressPool = NULL;
+static pthread_mutex_t waitressPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+#if defined(USE_MBEDTLS)
+static void WaitressTlsFree (mbedtls_ctx *sslCtx) {
+	mbedtls_ssl_free (&sslCtx->ssl);
+	mbedtls_ssl_config_free (&sslCtx->conf);
+	mbedtls_ctr_drbg_free (&sslCtx->ctr_drbg);
+	mbedtls_entropy_free (&sslCtx->entropy);
+	free (sslCtx);
+}
+#endif
+
+/*	build pool key for the handle's destination
+ */
+static void WaitressPoolKey (const WaitressHandle_t *waith, char *key,
+		const size_t keySize) {
+	const bool proxy = WaitressProxyEnabled (waith);
+
+	snprintf (key, keySize, "%s://%s:%s/%s:%s",
+			waith->url.tls ? "https" : "http",
+			waith->url.host, WaitressDefaultPort (&waith->url),
+			proxy ? waith->proxy.host : "",
+			proxy ? WaitressDefaultPort (&waith->proxy) : "");
+}
+
+/*	find pool entry for key, pool mutex must be held
+ *	@param create entry if it does not exist
+ *	@return entry or NULL
+ */
+static WaitressPoolHost_t *WaitressPoolFind (const char *key, bool create) {
+	WaitressPoolHost_t *host;
+
+	for (host = waitressPool; host != NULL; host = host->next) {
+		if (strcmp (host->key, key) == 0) {
+			return host;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	if ((host = calloc (1, sizeof (*host))) == NULL) {
+		return NULL;
+	}
+	if ((host->key = strdup (key)) == NULL) {
+		free (host);
+		return NULL;
+	}
+#if defined(USE_MBEDTLS)
+	mbedtls_ssl_session_init (&host->session);
+#endif
+	host->next = waitressPool;
+	waitressPool = host;
+	return host;
+}
+
+/*	close an idle connection. No close_notify is sent, the session’s transport
+ *	pointer refers to a request that is long gone.
+ */
+static void WaitressPoolDiscard (WaitressPoolConn_t *conn) {
+#if defined(USE_MBEDTLS)
+	if (conn->sslCtx != NULL) {
+		WaitressTlsFree (conn->sslCtx);
+	}
+#else
+	if (conn->tlsSession != NULL) {
+		gnutls_deinit (conn->tlsSession);
+		gnutls_certificate_free_credentials (conn->tlsCred);
+	}
+#endif
+	close (conn->sockfd);
+	free (conn);
+}
+
+/*	check that an idle connection is still usable. Idle connections have
+ *	nothing to say; if the socket is readable the server closed it.
+ */
+static bool WaitressPoolAlive (const WaitressPoolConn_t *conn) {
+	struct pollfd sockpoll = {conn->sockfd, POLLIN, 0};
+
+	if (poll (&sockpoll, 1, 0) != 0) {
+		return false;
+	}
+#if defined(USE_MBEDTLS)
+	if (conn->sslCtx != NULL &&
+			mbedtls_ssl_get_bytes_avail (&conn->sslCtx->ssl) > 0) {
+		return false;
+	}
+#else
+	if (conn->tlsSession != NULL &&
+			gnutls_record_check_pending (conn->tlsSession) > 0) {
+		return false;
+	}
+#endif
+	return true;
+}
+
+/*	close idle connections that have outlived the idle timeout, for every
+ *	destination. Pool mutex must be held.
+ */
+static void WaitressPoolExpire (const time_t now) {
+	WaitressPoolHost_t *host;
+
+	for (host = waitressPool; host != NULL; host = host->next) {
+		/* most recently used first, so the stale ones are at the tail */
+		WaitressPoolConn_t **link = &host->idle;
+		while (*link != NULL &&
+				now - (*link)->lastUsed < WAITRESS_POOL_IDLE_TIMEOUT) {
+			link = &(*link)->next;
+		}
+		while (*link != NULL) {
+			WaitressPoolConn_t *stale = *link;
+
+			*link = stale->next;
+			--host->idleCount;
+			WaitressPoolDiscard (stale);
+		}
+	}
+}
+
+/*	take an idle connection to the handle’s destination from the pool
+ *	@return true if a connection was found
+ */
+static bool WaitressPoolCheckout (WaitressHandle_t *waith) {
+	char key[512];
+	WaitressPoolHost_t *host;
+	WaitressPoolConn_t *conn = NULL;
+	const time_t now = time (NULL);
+
+	WaitressPoolKey (waith, key, sizeof (key));
+
+	pthread_mutex_lock (&waitressPoolMutex);
+	host = WaitressPoolFind (key, false);
+	while (conn == NULL && host != NULL && host->idle != NULL) {
+		WaitressPoolConn_t *candidate = host->idle;
+
+		host->idle = candidate->next;
+		--host->idleCount;
+		if (now - candidate->lastUsed < WAITRESS_POOL_IDLE_TIMEOUT &&
+				WaitressPoolAlive (candidate)) {
+			conn = candidate;
+		} else {
+			WaitressPoolDiscard (candidate);
+		}
+	}
+	pthread_mutex_unlock (&waitressPoolMutex);
 
+	if (conn == NULL) {
+		return false;
+	}
+
+	waith->request.sockfd = conn->sockfd;
+	if (waith->url.tls) {
+#if defined(USE_MBEDTLS)
+		waith->request.sslCtx = conn->sslCtx;
+		mbedtls_ssl_set_bio (&waith->request.sslCtx->ssl, waith,
+				WaitressPollWrite, WaitressPollRead, NULL);
+#else
+		waith->request.tlsSession = conn->tlsSession;
+		waith->tlsCred = conn->tlsCred;
+		gnutls_transport_set_ptr (waith->request.tlsSession,
+				(gnutls_transport_ptr_t) waith);
+#endif
+		waith->request.read = WaitressTlsRead;
+		waith->request.write = WaitressTlsWrite;
+	}
+	waith->request.reused = true;
+	free (conn);
+	return true;
+}
+
+/*	put the handle’s connection into the pool
+ *	@return true if the pool took ownership of the connection
+ */
+static bool WaitressPoolCheckin (WaitressHandle_t *waith) {
+	char key[512];
+	WaitressPoolHost_t *host;
+	WaitressPoolConn_t *conn;
+
+	WaitressPoolKey (waith, key, sizeof (key));
+
+	if ((conn = calloc (1, sizeof (*conn))) == NULL) {
+		return false;
+	}
+	conn->sockfd = waith->request.sockfd;
+#if defined(USE_MBEDTLS)
+	conn->sslCtx = waith->request.sslCtx;
+#else
+	conn->tlsSession = waith->request.tlsSession;
+	conn->tlsCred = waith->tlsCred;
+#endif
+	conn->lastUsed = time (NULL);
+
+	pthread_mutex_lock (&waitressPoolMutex);
+	/* destinations that are not requested again would keep their idle
+	 * connections (and the server’s resources) forever otherwise */
+	WaitressPoolExpire (conn->lastUsed);
+	host = WaitressPoolFind (key, true);
+	if (host == NULL || host->idleCount >= WAITRESS_POOL_MAX_IDLE) {
+		pthread_mutex_unlock (&waitressPoolMutex);
+		free (conn);
+		return false;
+	}
+	conn->next = host->idle;
+	host->idle = conn;
+	++host->idleCount;
+	pthread_mutex_unlock (&waitressPoolMutex);
+
+	waith->request.sockfd = -1;
+#if defined(USE_MBEDTLS)
+	waith->request.sslCtx = NULL;
+#else
+	waith->request.tlsSession = NULL;
+	waith->tlsCred = NULL;
+#endif
+	return true;
+}
+
+/*	remember TLS session of the handle’s connection for resumption
+ */
+static void WaitressPoolSaveSession (const WaitressHandle_t *waith) {
+	char key[512];
+	WaitressPoolHost_t *host;
+
+	WaitressPoolKey (waith, key, sizeof (key));
+
+	pthread_mutex_lock (&waitressPoolMutex);
+	if ((host = WaitressPoolFind (key, true)) != NULL) {
+#if defined(USE_MBEDTLS)
+		mbedtls_ssl_session_free (&host->session);
+		mbedtls_ssl_session_init (&host->session);
+		host->haveSession = mbedtls_ssl_get_session (
+				&waith->request.sslCtx->ssl, &host->session) == 0;
+#else
+		gnutls_datum_t data;
+
+		if (gnutls_session_get_data2 (waith->request.tlsSession, &data) ==
+				GNUTLS_E_SUCCESS) {
+			gnutls_free (host->session.data);
+			host->session = data;
+		}
+#endif
+	}
+	pthread_mutex_unlock (&waitressPoolMutex);
+}
+
+/*	offer remembered TLS session to the server before the handshake
+ */
+static void WaitressPoolResumeSession (WaitressHandle_t *waith) {
+	char key[512];
+	WaitressPoolHost_t *host;
+
+	WaitressPoolKey (waith, key, sizeof (key));
+
+	pthread_mutex_lock (&waitressPoolMutex);
+	if ((host = WaitressPoolFind (key, false)) != NULL) {
+#if defined(USE_MBEDTLS)
+		if (host->haveSession) {
+			mbedtls_ssl_set_session (&waith->request.sslCtx->ssl,
+					&host->session);
+		}
+#else
+		if (host->session.data != NULL) {
+			gnutls_session_set_data (waith->request.tlsSession,
+					host->session.data, host->session.size);
+		}
+#endif
+	}
+	pthread_mutex_unlock (&waitressPoolMutex);
+}
+
+/*	close all idle connections and forget TLS sessions
+ */
+void WaitressPoolFlush (void) {
+	pthread_mutex_lock (&waitressPoolMutex);
+	while (waitressPool != NULL) {
+		WaitressPoolHost_t *host = waitressPool;
+
+		waitressPool = host->next;
+		while (host->idle != NULL) {
+			WaitressPoolConn_t *conn = host->idle;
+
+			host->idle = conn->next;
+			WaitressPoolDiscard (conn);
+		}
+#if defined(USE_MBEDTLS)
+		mbedtls_ssl_session_free (&host->session);
+#else
+		gnutls_free (host->session.data);
+#endif
+		free (host->key);
+		free (host);
+	}
+	pthread_mutex_unlock (&waitressPoolMutex);
+}
+
+/*	Resolver cache. getaddrinfo() does not report record TTLs, so answers
+ *	are kept for a fixed time; once an answer is WAITRESS_RESOLVER_REFRESH
+ *	seconds old, a hit starts a lookup in the background and keeps
+ *	serving the cached addresses meanwhile. An expired answer is served
+ *	the same way until the background lookup replaces it, so a host that
+ *	has been resolved once never waits for the resolver again; if renewing
+ *	fails, it's retried every WAITRESS_RESOLVER_NEGATIVE_TTL seconds.
+ *	Only hosts without any addresses (never resolved, or failed) are looked
+ *	up synchronously by the caller, as there's nothing to connect to in the
+ *	meantime. Those failures are cached briefly too.
+ */
+#define WAITRESS_RESOLVER_TTL 300
+#define WAITRESS_RESOLVER_REFRESH 240
+#define WAITRESS_RESOLVER_NEGATIVE_TTL 15
+
+/*	getaddrinfo() result, shared by the cache and connects using it
+ */
+typedef struct {
+	struct addrinfo *list;
+	unsigned int refs;
+} WaitressAddrs_t;
+
+typedef struct WaitressResolverHost {
+	char *host, *port;
+	/* NULL if the host was never resolved successfully */
+	WaitressAddrs_t *addrs;
+	/* monotonic seconds */
+	time_t resolved, expires, nextRefresh;
+	bool refreshing;
+	unsigned long hits, negativeHits, misses, refreshes, failures;
+	struct WaitressResolverHost *next;
+} WaitressResolverHost_t;
+
+typedef struct {
+	char *host, *port;
+} WaitressResolverRefresh_t;
+
+static WaitressResolverHost_t *waitressResolver = NULL;
+static pthread_mutex_t waitressResolverMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t WaitressResolverNow (void) {
+	return WaitressMicroseconds () / 1000000;
+}
+
+/*	drop a reference, resolver mutex must be held
+ */
+static void WaitressAddrsUnref (WaitressAddrs_t *addrs) {
+	if (addrs != NULL && --addrs->refs == 0) {
+		freeaddrinfo (addrs->list);
+		free (addrs);
+	}
+}
+
+static void WaitressAddrsRelease (WaitressAddrs_t *addrs) {
+	pthread_mutex_lock (&waitressResolverMutex);
+	WaitressAddrsUnref (addrs);
+	pthread_mutex_unlock (&waitressResolverMutex);
+}
+
+/*	blocking lookup, must not be called with the resolver mutex held
+ *	@return new addresses with one reference or NULL
+ */
+static WaitressAddrs_t *WaitressResolverLookup (const char *host,
+		const char *port) {
+	struct addrinfo hints, *list;
+	WaitressAddrs_t *addrs;
+
+	memset (&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 
-	/* Use proxy? */
-	if (WaitressProxyEnabled (waith)) {
-		if (getaddrinfo (waith->proxy.host,
-				WaitressDefaultPort (&waith->proxy), &hints, &gares) != 0) {
-			return WAITRESS_RET_GETADDR_ERR;
+	if (getaddrinfo (host, port, &hints, &list) != 0) {
+		return NULL;
+	}
+	if ((addrs = malloc (sizeof (*addrs))) == NULL) {
+		freeaddrinfo (list);
+		return NULL;
+	}
+	addrs->list = list;
+	addrs->refs = 1;
+	return addrs;
+}
+
+/*	find cache entry, resolver mutex must be held
+ *	@param create entry if it does not exist
+ *	@return entry or NULL
+ */
+static WaitressResolverHost_t *WaitressResolverFind (const char *host,
+		const char *port, bool create) {
+	WaitressResolverHost_t *entry;
+
+	for (entry = waitressResolver; entry != NULL; entry = entry->next) {
+		if (strcasecmp (entry->host, host) == 0 &&
+				strcmp (entry->port, port) == 0) {
+			return entry;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+	if ((entry = calloc (1, sizeof (*entry))) == NULL) {
+		return NULL;
+	}
+	if ((entry->host = strdup (host)) == NULL ||
+			(entry->port = strdup (port)) == NULL) {
+		free (entry->host);
+		free (entry);
+		return NULL;
+	}
+	entry->next = waitressResolver;
+	waitressResolver = entry;
+	return entry;
+}
+
+/*	store a successful lookup, resolver mutex must be held
+ *	@param entry
+ *	@param new addresses, the entry takes over the reference
+ */
+static void WaitressResolverStore (WaitressResolverHost_t *entry,
+		WaitressAddrs_t *addrs) {
+	WaitressAddrsUnref (entry->addrs);
+	entry->addrs = addrs;
+	entry->resolved = WaitressResolverNow ();
+	entry->expires = entry->resolved + WAITRESS_RESOLVER_TTL;
+	entry->nextRefresh = entry->resolved + WAITRESS_RESOLVER_REFRESH;
+}
+
+/*	background refresh thread. The entry may have been flushed while the
+ *	lookup was running, so it's looked up again afterwards.
+ */
+static void *WaitressResolverRefreshThread (void *data) {
+	WaitressResolverRefresh_t *refresh = data;
+	WaitressAddrs_t *addrs = WaitressResolverLookup (refresh->host,
+			refresh->port);
+
+	pthread_mutex_lock (&waitressResolverMutex);
+	WaitressResolverHost_t *entry = WaitressResolverFind (refresh->host,
+			refresh->port, false);
+	if (entry == NULL) {
+		WaitressAddrsUnref (addrs);
+	} else {
+		entry->refreshing = false;
+		if (addrs != NULL) {
+			++entry->refreshes;
+			WaitressResolverStore (entry, addrs);
+		} else {
+			++entry->failures;
+			entry->nextRefresh = WaitressResolverNow () +
+					WAITRESS_RESOLVER_NEGATIVE_TTL;
 		}
+	}
+	pthread_mutex_unlock (&waitressResolverMutex);
+
+	free (refresh->host);
+	free (refresh->port);
+	free (refresh);
+	return NULL;
+}
+
+/*	start a background refresh, resolver mutex must be held
+ */
+static void WaitressResolverStartRefresh (WaitressResolverHost_t *entry) {
+	WaitressResolverRefresh_t *refresh;
+	pthread_attr_t attr;
+	pthread_t thread;
+
+	if ((refresh = calloc (1, sizeof (*refresh))) == NULL) {
+		return;
+	}
+	if ((refresh->host = strdup (entry->host)) == NULL ||
+			(refresh->port = strdup (entry->port)) == NULL) {
+		free (refresh->host);
+		free (refresh);
+		return;
+	}
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create (&thread, &attr, WaitressResolverRefreshThread,
+			refresh) == 0) {
+		entry->refreshing = true;
 	} else {
-		if (getaddrinfo (waith->url.host,
-				WaitressDefaultPort (&waith->url), &hints, &gares) != 0) {
-			return WAITRESS_RET_GETADDR_ERR;
+		free (refresh->host);
+		free (refresh->port);
+		free (refresh);
+	}
+	pthread_attr_destroy (&attr);
+}
+
+/*	resolve host, using the cache where possible
+ *	@param host
+ *	@param port
+ *	@param addresses, release with WaitressAddrsRelease
+ *	@return _OK or _GETADDR_ERR
+ */
+static WaitressReturn_t WaitressResolve (const char *host, const char *port,
+		WaitressAddrs_t **retAddrs) {
+	WaitressResolverHost_t *entry;
+	WaitressAddrs_t *addrs;
+	time_t now = WaitressResolverNow ();
+
+	pthread_mutex_lock (&waitressResolverMutex);
+	entry = WaitressResolverFind (host, port, true);
+	if (entry != NULL && entry->addrs != NULL) {
+		/* fresh, due for refresh or expired: renewed in the background */
+		++entry->hits;
+		addrs = entry->addrs;
+		++addrs->refs;
+		if (now >= entry->nextRefresh && !entry->refreshing) {
+			WaitressResolverStartRefresh (entry);
 		}
+		pthread_mutex_unlock (&waitressResolverMutex);
+		*retAddrs = addrs;
+		return WAITRESS_RET_OK;
+	}
+	if (entry != NULL && now < entry->expires) {
+		/* recently failed */
+		++entry->negativeHits;
+		pthread_mutex_unlock (&waitressResolverMutex);
+		*retAddrs = NULL;
+		return WAITRESS_RET_GETADDR_ERR;
+	}
+	if (entry != NULL) {
+		++entry->misses;
 	}
+	pthread_mutex_unlock (&waitressResolverMutex);
 
-	/* try all addresses */
-	for (struct addrinfo *gacurr = gares; gacurr != NULL;
-			gacurr = gacurr->ai_next) {
-		int sock = -1;
+	/* synchronous, see above */
 
-		ret = WAITRESS_RET_OK;
+	addrs = WaitressResolverLookup (host, port);
 
-		if ((sock = socket (gacurr->ai_family, gacurr->ai_socktype,
-				gacurr->ai_protocol)) == -1) {
-			ret = WAITRESS_RET_SOCK_ERR;
+	pthread_mutex_lock (&waitressResolverMutex);
+	/* may have been flushed in the meantime */
+	entry = WaitressResolverFind (host, port, true);
+	if (entry != NULL) {
+		if (addrs != NULL) {
+			WaitressResolverStore (entry, addrs);
+			++addrs->refs;
 		} else {
-			int pollres;
-
-			/* we need shorter timeouts for connect() */
-			fcntl (sock, F_SETFL, O_NONBLOCK);
-
-			/* increase socket receive buffer */
-			const int sockopt = 256*1024;
-			setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &sockopt,
-					sizeof (sockopt));
-
-			/* non-blocking connect will return immediately */
-			if (connect (sock, gacurr->ai_addr, gacurr->ai_addrlen) == -1) {
-				// Error if not in-progress or immediate success
-				if (errno != EINPROGRESS) {
-					// Close socket and try alternatives
-					close (sock);
-					continue;
-				}
+			++entry->failures;
+			/* another request may have succeeded meanwhile */
+			if ((addrs = entry->addrs) != NULL) {
+				++addrs->refs;
+			} else {
+				entry->expires = WaitressResolverNow () +
+						WAITRESS_RESOLVER_NEGATIVE_TTL;
+			}
+		}
+	}
+	pthread_mutex_unlock (&waitressResolverMutex);
+
+	*retAddrs = addrs;
+	return addrs != NULL ? WAITRESS_RET_OK : WAITRESS_RET_GETADDR_ERR;
+}
+
+/*	report resolver cache statistics
+ *	@param called once per cached host, must not call into libwaitress
+ *	@param passed to callback
+ */
+void WaitressResolverStats (void (*callback) (const WaitressResolverStats_t *,
+		void *), void *data) {
+	const time_t now = WaitressResolverNow ();
+
+	pthread_mutex_lock (&waitressResolverMutex);
+	for (const WaitressResolverHost_t *entry = waitressResolver;
+			entry != NULL; entry = entry->next) {
+		WaitressResolverStats_t stats;
+
+		stats.host = entry->host;
+		stats.port = entry->port;
+		stats.hits = entry->hits;
+		stats.negativeHits = entry->negativeHits;
+		stats.misses = entry->misses;
+		stats.refreshes = entry->refreshes;
+		stats.failures = entry->failures;
+		stats.resolved = entry->addrs != NULL;
+		stats.age = entry->addrs != NULL ? now - entry->resolved : 0;
+		stats.expires = entry->expires > now ? entry->expires - now : 0;
+		callback (&stats, data);
+	}
+	pthread_mutex_unlock (&waitressResolverMutex);
+}
+
+/*	forget all cached addresses and statistics. Connects still using an
+ *	answer keep their reference.
+ */
+void WaitressResolverFlush (void) {
+	pthread_mutex_lock (&waitressResolverMutex);
+	while (waitressResolver != NULL) {
+		WaitressResolverHost_t *entry = waitressResolver;
+
+		waitressResolver = entry->next;
+		WaitressAddrsUnref (entry->addrs);
+		free (entry->host);
+		free (entry->port);
+		free (entry);
+	}
+	pthread_mutex_unlock (&waitressResolverMutex);
+}
+
+/*	Connection racing (happy eyeballs, RFC 8305): attempts are started
+ *	WAITRESS_CONNECT_ATTEMPT_DELAY ms apart, or as soon as the previous one
+ *	fails, alternating address families. The first to complete wins, the
+ *	others are closed. A dead route thus costs one attempt delay instead of
+ *	a whole timeout.
+ */
+#define WAITRESS_CONNECT_ATTEMPT_DELAY 250
+
+/*	order addresses for racing: alternate families, starting with the
+ *	family of the resolver's first choice
+ *	@param address list
+ *	@param array of list length, receives the ordered addresses
+ *	@return number of addresses
+ */
+static size_t WaitressInterleaveAddrs (struct addrinfo *list,
+		struct addrinfo **ordered) {
+	const int family = list->ai_family;
+	struct addrinfo *primary = list, *other = list;
+	size_t count = 0;
+	bool takePrimary = true;
+
+	while (primary != NULL || other != NULL) {
+		while (primary != NULL && primary->ai_family != family) {
+			primary = primary->ai_next;
+		}
+		while (other != NULL && other->ai_family == family) {
+			other = other->ai_next;
+		}
+		if (primary != NULL && (takePrimary || other == NULL)) {
+			ordered[count++] = primary;
+			primary = primary->ai_next;
+		} else if (other != NULL) {
+			ordered[count++] = other;
+			other = other->ai_next;
+		}
+		takePrimary = !takePrimary;
+	}
+	return count;
+}
+
+/*	start a non-blocking connect
+ *	@return socket or -1
+ */
+static int WaitressStartConnect (const struct addrinfo *addr,
+		WaitressReturn_t *ret) {
+	int sock;
+
+	if ((sock = socket (addr->ai_family, addr->ai_socktype,
+			addr->ai_protocol)) == -1) {
+		*ret = WAITRESS_RET_SOCK_ERR;
+		return -1;
+	}
+
+	/* we need shorter timeouts for connect() */
+	fcntl (sock, F_SETFL, O_NONBLOCK);
+
+	/* increase socket receive buffer */
+	const int sockopt = 256*1024;
+	setsockopt (sock, SOL_SOCKET, SO_RCVBUF, &sockopt, sizeof (sockopt));
+
+	/* non-blocking connect will return immediately; an immediate success
+	 * is reported by poll() like any other */
+	if (connect (sock, addr->ai_addr, addr->ai_addrlen) == -1 &&
+			errno != EINPROGRESS) {
+		close (sock);
+		*ret = WAITRESS_RET_CONNECT_REFUSED;
+		return -1;
+	}
+	return sock;
+}
+
+/*	race connects to all addresses
+ *	@param waitress handle, receives the connected socket
+ *	@param address list
+ */
+static WaitressReturn_t WaitressRaceConnect (WaitressHandle_t *waith,
+		struct addrinfo *list) {
+	struct addrinfo **ordered;
+	struct pollfd *attempts;
+	size_t count = 0, next = 0, pending = 0;
+	int winner = -1;
+	WaitressReturn_t ret = WAITRESS_RET_CONNECT_REFUSED;
+	const uint64_t deadline = WaitressMicroseconds () +
+			(uint64_t) waith->timeout * 1000;
+	uint64_t nextAttempt = 0;
+
+	for (const struct addrinfo *curr = list; curr != NULL;
+			curr = curr->ai_next) {
+		++count;
+	}
+	ordered = malloc (count * sizeof (*ordered));
+	attempts = malloc (count * sizeof (*attempts));
+	if (ordered == NULL || attempts == NULL) {
+		free (ordered);
+		free (attempts);
+		return WAITRESS_RET_ERR;
+	}
+	count = WaitressInterleaveAddrs (list, ordered);
+
+	while (winner == -1) {
+		const uint64_t now = WaitressMicroseconds ();
+
+		/* start the next attempt when it's due, or right away if nothing
+		 * is in flight */
+		if (next < count && (pending == 0 || now >= nextAttempt)) {
+			const int sock = WaitressStartConnect (ordered[next++], &ret);
+			if (sock != -1) {
+				attempts[pending].fd = sock;
+				attempts[pending].events = POLLOUT;
+				attempts[pending].revents = 0;
+				++pending;
+				nextAttempt = now + WAITRESS_CONNECT_ATTEMPT_DELAY * 1000;
 			}
+			continue;
+		}
+		if (pending == 0) {
+			/* all attempts failed */
+			break;
+		}
+		if (now >= deadline) {
+			ret = WAITRESS_RET_TIMEOUT;
+			break;
+		}
 
-			pollres = WaitressPollLoop (sock, POLLOUT, waith->timeout);
-			if (pollres == 0) {
-				ret = WAITRESS_RET_TIMEOUT;
-			} else if (pollres == -1) {
-				ret = WAITRESS_RET_ERR;
+		uint64_t wait = deadline - now;
+		if (next < count && nextAttempt - now < wait) {
+			wait = nextAttempt - now;
+		}
+		/* round up, polling for 0 ms until the deadline would spin */
+		const int pollres = poll (attempts, pending, (wait + 999) / 1000);
+		if (pollres == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			ret = WAITRESS_RET_ERR;
+			break;
+		}
+
+		for (size_t i = 0; i < pending && winner == -1;) {
+			if (attempts[i].revents == 0) {
+				++i;
+				continue;
+			}
+			/* check connect () return value */
+			int error = 0;
+			socklen_t errorSize = sizeof (error);
+			getsockopt (attempts[i].fd, SOL_SOCKET, SO_ERROR, &error,
+					&errorSize);
+			if (error == 0) {
+				/* this one is working */
+				winner = attempts[i].fd;
 			} else {
-				/* check connect () return value */
-				socklen_t pollresSize = sizeof (pollres);
-				getsockopt (sock, SOL_SOCKET, SO_ERROR, &pollres,
-						&pollresSize);
-				if (pollres != 0) {
-					ret = WAITRESS_RET_CONNECT_REFUSED;
-				} else {
-					/* this one is working */
-					waith->request.sockfd = sock;
-					break;
-				}
+				close (attempts[i].fd);
+				ret = WAITRESS_RET_CONNECT_REFUSED;
+				/* a failure lets the next attempt start right away */
+				nextAttempt = now;
 			}
-			close (sock);
+			attempts[i] = attempts[--pending];
 		}
 	}
 
-	freeaddrinfo (gares);
+	/* cancel the losers */
+	for (size_t i = 0; i < pending; i++) {
+		close (attempts[i].fd);
+	}
+	free (ordered);
+	free (attempts);
+
+	if (winner == -1) {
+		return ret;
+	}
+	waith->request.sockfd = winner;
+	return WAITRESS_RET_OK;
+}
+
+/*	Connect to server
+ */
+static WaitressReturn_t WaitressConnect (WaitressHandle_t *waith) {
+	WaitressReturn_t ret;
+	WaitressAddrs_t *addrs;
+	uint64_t started = WaitressMicroseconds ();
+#if defined(USE_MBEDTLS)
+	int hsret;
+#endif
+
+	/* Use proxy? */
+	const WaitressUrl_t *url = WaitressProxyEnabled (waith) ?
+			&waith->proxy : &waith->url;
+	if ((ret = WaitressResolve (url->host, WaitressDefaultPort (url),
+			&addrs)) != WAITRESS_RET_OK) {
+		return ret;
+	}
+
+	ret = WaitressRaceConnect (waith, addrs->list);
+	WaitressAddrsRelease (addrs);
 	/* could not connect to any of the addresses */
 	if (ret != WAITRESS_RET_OK) {
 		return ret;
 	}
+	waith->request.connectTime = WaitressMicroseconds () - started;
+	started = WaitressMicroseconds ();
 
 	if (waith->url.tls) {
 		WaitressReturn_t wRet;
+		bool verifyFingerprint;
 
 		/* set up proxy tunnel */
 		if (WaitressProxyEnabled (waith)) {
@@ -959,6 +1742,9 @@ static WaitressReturn_t WaitressConnect (WaitressHandle_t *waith) {
 					WAITRESS_RET_OK) {
 				return wRet;
 			}
+			/* the proxy’s headers say nothing about the tunneled connection */
+			waith->request.connectionClose = false;
+			waith->request.responseStarted = false;
 		}
 
 #if defined(USE_MBEDTLS)
@@ -970,31 +1756,36 @@ static WaitressReturn_t WaitressConnect (WaitressHandle_t *waith) {
         }
 		mbedtls_ssl_set_hostname (&waith->request.sslCtx->ssl, waith->url.host);
 		mbedtls_ssl_setup (&waith->request.sslCtx->ssl, &waith->request.sslCtx->conf);
+		WaitressPoolResumeSession (waith);
 
 		hsret = mbedtls_ssl_handshake (&waith->request.sslCtx->ssl);
 		if (hsret != 0) {
             fprintf(stderr, "DEBUG: SSL Handshake returned: -0x%x\n", -hsret);
 			return WAITRESS_RET_TLS_HANDSHAKE_ERR;
 		}
+		verifyFingerprint = !waith->use_CAcerts;
 #else
 		/* Ignore return code as connection will likely still succeed */
 		gnutls_server_name_set (waith->request.tlsSession, GNUTLS_NAME_DNS,
 				waith->url.host, strlen (waith->url.host));
+		WaitressPoolResumeSession (waith);
 
 		if (gnutls_handshake (waith->request.tlsSession) != GNUTLS_E_SUCCESS) {
 			return WAITRESS_RET_TLS_HANDSHAKE_ERR;
 		}
+		verifyFingerprint = true;
 #endif
 
-        if (!waith->use_CAcerts) {
-            if ((wRet = WaitressTlsVerify (waith)) != WAITRESS_RET_OK) {
-                return wRet;
-            }
-        }
+		if (verifyFingerprint) {
+			if ((wRet = WaitressTlsVerify (waith)) != WAITRESS_RET_OK) {
+				return wRet;
+			}
+		}
 
 		/* now we can talk encrypted */
 		waith->request.read = WaitressTlsRead;
 		waith->request.write = WaitressTlsWrite;
+		waith->request.handshakeTime = WaitressMicroseconds () - started;
 	}
 
 	return WAITRESS_RET_OK;
@@ -1007,6 +1798,7 @@ static WaitressReturn_t WaitressSendRequest (WaitressHandle_t *waith) {
 	assert (waith->request.buf != NULL);
 
 	const char *path = waith->url.path;
+	const char *connection = waith->keepAlive ? "keep-alive" : "Close";
 	char * const buf = waith->request.buf;
 	WaitressReturn_t wRet = WAITRESS_RET_OK;
 
@@ -1022,16 +1814,17 @@ static WaitressReturn_t WaitressSendRequest (WaitressHandle_t *waith) {
 	if (WaitressProxyEnabled (waith) && !waith->url.tls) {
 		snprintf (buf, WAITRESS_BUFFER_SIZE,
 			"%s http://%s:%s/%s HTTP/" WAITRESS_HTTP_VERSION "\r\n"
-			"Host: %s\r\nUser-Agent: " LIBWAITRESS_NAME "\r\nConnection: Close\r\n",
+			"Host: %s\r\nUser-Agent: " LIBWAITRESS_NAME "\r\nConnection: %s\r\n",
 			(waith->method == WAITRESS_METHOD_GET ? "GET" : "POST"),
 			waith->url.host,
-			WaitressDefaultPort (&waith->url), path, waith->url.host);
+			WaitressDefaultPort (&waith->url), path, waith->url.host,
+			connection);
 	} else {
 		snprintf (buf, WAITRESS_BUFFER_SIZE,
 			"%s /%s HTTP/" WAITRESS_HTTP_VERSION "\r\n"
-			"Host: %s\r\nUser-Agent: " LIBWAITRESS_NAME "\r\nConnection: Close\r\n",
+			"Host: %s\r\nUser-Agent: " LIBWAITRESS_NAME "\r\nConnection: %s\r\n",
 			(waith->method == WAITRESS_METHOD_GET ? "GET" : "POST"),
-			path, waith->url.host);
+			path, waith->url.host, connection);
 	}
 	WRITE_RET (buf, strlen (buf));
 
@@ -1085,6 +1878,7 @@ static WaitressReturn_t WaitressReceiveHeaders (WaitressHandle_t *waith,
 			/* connection closed too early */
 			return WAITRESS_RET_CONNECTION_CLOSED;
 		}
+		waith->request.responseStarted = true;
 		bufFilled += recvSize;
 		buf[bufFilled] = '\0';
 		thisLine = buf;
@@ -1099,6 +1893,10 @@ static WaitressReturn_t WaitressReceiveHeaders (WaitressHandle_t *waith,
 						case 200:
 						case 206:
 							hdrParseMode = HDRM_LINES;
+							/* HTTP/1.0 servers close after each response */
+							if (strncmp (thisLine, "HTTP/1.0", 8) == 0) {
+								waith->request.connectionClose = true;
+							}
 							break;
 
 						case 400:
@@ -1176,6 +1974,7 @@ static WaitressReturn_t WaitressReceiveResponse (WaitressHandle_t *waith) {
 		buf[recvSize] = '\0';
 		switch (waith->request.dataHandler (waith, buf, recvSize)) {
 			case WAITRESS_HANDLER_DONE:
+				waith->request.bodyComplete = true;
 				return WAITRESS_RET_OK;
 				break;
 
@@ -1195,6 +1994,7 @@ static WaitressReturn_t WaitressReceiveResponse (WaitressHandle_t *waith) {
 				waith->request.contentReceived >= waith->request.contentLength) {
 			/* don’t call read() again if we know the body’s size and have all
 			 * of it already */
+			waith->request.bodyComplete = true;
 			break;
 		}
 		READ_RET (buf, WAITRESS_BUFFER_SIZE-1, &recvSize);
@@ -1203,94 +2003,167 @@ static WaitressReturn_t WaitressReceiveResponse (WaitressHandle_t *waith) {
 	return WAITRESS_RET_OK;
 }
 
-/*	Receive data from host and call *callback ()
- *	@param waitress handle
- *	@return WaitressReturn_t
+/*	set up TLS session for a new connection
  */
-WaitressReturn_t WaitressFetchCall (WaitressHandle_t *waith) {
-	WaitressReturn_t wRet = WAITRESS_RET_OK;
-
-	/* initialize */
-	memset (&waith->request, 0, sizeof (waith->request));
-	waith->request.sockfd = -1;
-	waith->request.dataHandler = WaitressHandleIdentity;
-	waith->request.read = WaitressOrdinaryRead;
-	waith->request.write = WaitressOrdinaryWrite;
-	waith->request.contentLengthKnown = false;
-
-	if (waith->url.tls) {
+static WaitressReturn_t WaitressTlsInit (WaitressHandle_t *waith) {
 #if defined(USE_MBEDTLS)
-		waith->request.sslCtx = calloc (1, sizeof(mbedtls_ctx));
+	waith->request.sslCtx = calloc (1, sizeof(mbedtls_ctx));
 
-		mbedtls_entropy_init (&waith->request.sslCtx->entropy);
-		mbedtls_ctr_drbg_init (&waith->request.sslCtx->ctr_drbg);
-		mbedtls_ctr_drbg_seed (&waith->request.sslCtx->ctr_drbg, mbedtls_entropy_func, &waith->request.sslCtx->entropy, _T("libwaitress"), 11);
+	mbedtls_entropy_init (&waith->request.sslCtx->entropy);
+	mbedtls_ctr_drbg_init (&waith->request.sslCtx->ctr_drbg);
+	mbedtls_ctr_drbg_seed (&waith->request.sslCtx->ctr_drbg, mbedtls_entropy_func, &waith->request.sslCtx->entropy, _T("libwaitress"), 11);
 
-		mbedtls_ssl_init (&waith->request.sslCtx->ssl);
-		mbedtls_ssl_config_init (&waith->request.sslCtx->conf);
+	mbedtls_ssl_init (&waith->request.sslCtx->ssl);
+	mbedtls_ssl_config_init (&waith->request.sslCtx->conf);
 
-		mbedtls_ssl_config_defaults (&waith->request.sslCtx->conf,
-                                    MBEDTLS_SSL_IS_CLIENT,
-                                    MBEDTLS_SSL_TRANSPORT_STREAM,
-                                    MBEDTLS_SSL_PRESET_DEFAULT );
+	mbedtls_ssl_config_defaults (&waith->request.sslCtx->conf,
+                                MBEDTLS_SSL_IS_CLIENT,
+                                MBEDTLS_SSL_TRANSPORT_STREAM,
+                                MBEDTLS_SSL_PRESET_DEFAULT );
 
-		mbedtls_ssl_conf_rng (&waith->request.sslCtx->conf, mbedtls_ctr_drbg_random, &waith->request.sslCtx->ctr_drbg);
+	mbedtls_ssl_conf_rng (&waith->request.sslCtx->conf, mbedtls_ctr_drbg_random, &waith->request.sslCtx->ctr_drbg);
 
-		mbedtls_ssl_set_bio (&waith->request.sslCtx->ssl, waith, WaitressPollWrite, WaitressPollRead, NULL);
+	mbedtls_ssl_set_bio (&waith->request.sslCtx->ssl, waith, WaitressPollWrite, WaitressPollRead, NULL);
 #else
-		gnutls_init (&waith->request.tlsSession, GNUTLS_CLIENT);
-		gnutls_set_default_priority (waith->request.tlsSession);
-
-		gnutls_certificate_allocate_credentials (&waith->tlsCred);
-		if (gnutls_credentials_set (waith->request.tlsSession,
-				GNUTLS_CRD_CERTIFICATE,
-				waith->tlsCred) != GNUTLS_E_SUCCESS) {
-			return WAITRESS_RET_ERR;
-		}
+	gnutls_init (&waith->request.tlsSession, GNUTLS_CLIENT);
+	gnutls_set_default_priority (waith->request.tlsSession);
+
+	gnutls_certificate_allocate_credentials (&waith->tlsCred);
+	if (gnutls_credentials_set (waith->request.tlsSession,
+			GNUTLS_CRD_CERTIFICATE,
+			waith->tlsCred) != GNUTLS_E_SUCCESS) {
+		return WAITRESS_RET_ERR;
+	}
 
-		/* set up custom read/write functions */
-		gnutls_transport_set_ptr (waith->request.tlsSession,
-				(gnutls_transport_ptr_t) waith);
-		gnutls_transport_set_pull_function (waith->request.tlsSession,
-				WaitressPollRead);
-		gnutls_transport_set_push_function (waith->request.tlsSession,
-				WaitressPollWrite);
+	/* set up custom read/write functions */
+	gnutls_transport_set_ptr (waith->request.tlsSession,
+			(gnutls_transport_ptr_t) waith);
+	gnutls_transport_set_pull_function (waith->request.tlsSession,
+			WaitressPollRead);
+	gnutls_transport_set_push_function (waith->request.tlsSession,
+			WaitressPollWrite);
 #endif
+	return WAITRESS_RET_OK;
+}
+
+/*	can the connection carry another request?
+ */
+static bool WaitressConnectionReusable (const WaitressHandle_t *waith) {
+	if (!waith->keepAlive || waith->request.connectionClose ||
+			!waith->request.bodyComplete) {
+		return false;
+	}
+	if (waith->request.dataHandler == WaitressHandleChunked) {
+		return waith->request.excessReceived == 0;
 	}
+	/* anything beyond Content-Length would confuse the next response */
+	return waith->request.contentReceived == waith->request.contentLength;
+}
 
-	/* buffer is required for connect already */
-	waith->request.buf = malloc (WAITRESS_BUFFER_SIZE *
-			sizeof (*waith->request.buf));
+/*	hand the connection to the pool, or shut it down
+ *	@param waitress handle
+ *	@param the request succeeded
+ */
+static void WaitressFinishConnection (WaitressHandle_t *waith,
+		const bool success) {
+	/* handshake completed if we’re talking encrypted */
+	const bool tlsEstablished = waith->request.read == WaitressTlsRead;
 
-	/* request */
-	if ((wRet = WaitressConnect (waith)) == WAITRESS_RET_OK) {
-		if ((wRet = WaitressSendRequest (waith)) == WAITRESS_RET_OK) {
-			wRet = WaitressReceiveResponse (waith);
-		}
-#if !defined(USE_MBEDTLS)
-		if (waith->url.tls) {
-			gnutls_bye (waith->request.tlsSession, GNUTLS_SHUT_RDWR);
-		}
-#endif
+	if (success && tlsEstablished && !waith->request.reused) {
+		WaitressPoolSaveSession (waith);
+	}
+	if (success && WaitressConnectionReusable (waith) &&
+			WaitressPoolCheckin (waith)) {
+		return;
 	}
 
-	/* cleanup */
 	if (waith->url.tls) {
 #if defined(USE_MBEDTLS)
-		mbedtls_ssl_free (&waith->request.sslCtx->ssl);
-		mbedtls_ssl_config_free(&waith->request.sslCtx->conf);
-		mbedtls_ctr_drbg_free(&waith->request.sslCtx->ctr_drbg);
-		mbedtls_entropy_free(&waith->request.sslCtx->entropy);
-		free (waith->request.sslCtx);
+		if (waith->request.sslCtx != NULL) {
+			WaitressTlsFree (waith->request.sslCtx);
+			waith->request.sslCtx = NULL;
+		}
 #else
-		gnutls_deinit (waith->request.tlsSession);
-		gnutls_certificate_free_credentials (waith->tlsCred);
+		if (waith->request.tlsSession != NULL) {
+			if (tlsEstablished) {
+				gnutls_bye (waith->request.tlsSession, GNUTLS_SHUT_RDWR);
+			}
+			gnutls_deinit (waith->request.tlsSession);
+			gnutls_certificate_free_credentials (waith->tlsCred);
+			waith->request.tlsSession = NULL;
+			waith->tlsCred = NULL;
+		}
 #endif
 	}
 	if (waith->request.sockfd != -1) {
 		close (waith->request.sockfd);
+		waith->request.sockfd = -1;
 	}
-	free (waith->request.buf);
+}
+
+/*	Receive data from host and call *callback ()
+ *	@param waitress handle
+ *	@return WaitressReturn_t
+ */
+WaitressReturn_t WaitressFetchCall (WaitressHandle_t *waith) {
+	WaitressReturn_t wRet = WAITRESS_RET_OK;
+	bool retry = false;
+
+	do {
+		/* initialize */
+		memset (&waith->request, 0, sizeof (waith->request));
+		waith->request.sockfd = -1;
+		waith->request.dataHandler = WaitressHandleIdentity;
+		waith->request.read = WaitressOrdinaryRead;
+		waith->request.write = WaitressOrdinaryWrite;
+		waith->request.contentLengthKnown = false;
+
+		/* buffer is required for connect already */
+		waith->request.buf = malloc (WAITRESS_BUFFER_SIZE *
+				sizeof (*waith->request.buf));
+
+		/* reuse an idle connection, unless it just failed us */
+		if (retry || !waith->keepAlive || !WaitressPoolCheckout (waith)) {
+			wRet = WAITRESS_RET_OK;
+			if (waith->url.tls) {
+				wRet = WaitressTlsInit (waith);
+			}
+			if (wRet == WAITRESS_RET_OK) {
+				wRet = WaitressConnect (waith);
+			}
+		}
+		retry = false;
+
+		/* request */
+		if (wRet == WAITRESS_RET_OK) {
+			const uint64_t started = WaitressMicroseconds ();
+			if ((wRet = WaitressSendRequest (waith)) == WAITRESS_RET_OK) {
+				wRet = WaitressReceiveResponse (waith);
+			}
+			waith->request.transferTime = WaitressMicroseconds () - started;
+			/* the server may have dropped an idle connection just as we
+			 * picked it up; nothing was processed, so try a new one */
+			if (waith->request.reused && !waith->request.responseStarted) {
+				switch (wRet) {
+					case WAITRESS_RET_ERR:
+					case WAITRESS_RET_READ_ERR:
+					case WAITRESS_RET_CONNECTION_CLOSED:
+					case WAITRESS_RET_TLS_WRITE_ERR:
+					case WAITRESS_RET_TLS_READ_ERR:
+						retry = true;
+						break;
+
+					default:
+						break;
+				}
+			}
+		}
+
+		/* cleanup */
+		WaitressFinishConnection (waith, wRet == WAITRESS_RET_OK);
+		free (waith->request.buf);
+		waith->request.buf = NULL;
+	} while (retry);
 
 	if (wRet == WAITRESS_RET_OK &&
 			waith->request.contentReceived < waith->request.contentLength) {
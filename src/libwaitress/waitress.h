@@ -104,6 +104,8 @@ typedef struct {
 	void *data;
 	WaitressCbReturn_t (*callback) (void *, size_t, void *);
 	const char *tlsFingerprint;
+	/* keep the connection open and reuse it for later requests */
+	bool keepAlive;
 
 	WaitressUrl_t url;
 	WaitressUrl_t proxy;
@@ -123,7 +125,20 @@ typedef struct {
 
 		size_t contentLength, contentReceived, chunkSize;
 		bool contentLengthKnown;
-		enum {CHUNKSIZE = 0, DATA = 1} chunkedState;
+		enum {CHUNKSIZE = 0, DATA = 1, TRAILER = 2} chunkedState;
+		/* bytes received after the end of the chunked body */
+		size_t excessReceived;
+		/* body was read completely */
+		bool bodyComplete;
+		/* server will close the connection after this response */
+		bool connectionClose;
+		/* connection was taken from the keep-alive pool */
+		bool reused;
+		/* at least one byte of the response arrived */
+		bool responseStarted;
+		/* microseconds spent connecting, in TLS handshake (including
+		 * proxy tunnel setup) and sending/receiving; zero if skipped */
+		unsigned long connectTime, handshakeTime, transferTime;
 
 		char *buf;
 		/* first argument is WaitressHandle_t, but that's not defined yet */
@@ -139,6 +154,18 @@ typedef struct {
 	} request;
 } WaitressHandle_t;
 
+/* resolver cache statistics for one host */
+typedef struct {
+	const char *host;
+	const char *port;
+	/* negative hits are answered from a cached failure */
+	unsigned long hits, negativeHits, misses, refreshes, failures;
+	/* whether addresses are cached */
+	bool resolved;
+	/* seconds since resolution, seconds until expiry */
+	unsigned long age, expires;
+} WaitressResolverStats_t;
+
 void WaitressInit (WaitressHandle_t *);
 void WaitressFree (WaitressHandle_t *);
 bool WaitressSetProxy (WaitressHandle_t *, const char *);
@@ -146,6 +173,10 @@ char *WaitressUrlEncode (const char *);
 bool WaitressSetUrl (WaitressHandle_t *, const char *);
 WaitressReturn_t WaitressFetchBuf (WaitressHandle_t *, char **);
 WaitressReturn_t WaitressFetchCall (WaitressHandle_t *);
+void WaitressPoolFlush (void);
+void WaitressResolverStats (void (*) (const WaitressResolverStats_t *, void *),
+		void *);
+void WaitressResolverFlush (void);
 const char *WaitressErrorToStr (WaitressReturn_t);
 
 #endif /* _WAITRESS_H */
@@ -0,0 +1,202 @@
+/*
+ *  waitress_check.c
+ *  Checks connection racing against local listeners: a blackhole (a
+ *  listener whose accept queue is full, so SYNs go unanswered) ahead of a
+ *  live listener must lose after one attempt delay, a refused address
+ *  must not delay the next one at all.  Run by "make check".
+ */
+
+/* reach the static functions */
+#include "waitress.c"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* automake's "skipped" exit status */
+#define CHECK_SKIP 77
+
+/*	listen on a free loopback port
+ *	@param listen backlog
+ *	@param receives the port
+ *	@return socket or -1
+ */
+static int CheckListen (int backlog, in_port_t *port) {
+	struct sockaddr_in sa;
+	socklen_t size = sizeof (sa);
+	int sock;
+
+	memset (&sa, 0, sizeof (sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+	if ((sock = socket (AF_INET, SOCK_STREAM, 0)) == -1) {
+		return -1;
+	}
+	if (bind (sock, (struct sockaddr *) &sa, sizeof (sa)) == -1 ||
+			listen (sock, backlog) == -1 ||
+			getsockname (sock, (struct sockaddr *) &sa, &size) == -1) {
+		close (sock);
+		return -1;
+	}
+	*port = sa.sin_port;
+	return sock;
+}
+
+/*	address list entry for a loopback port
+ */
+static struct addrinfo *CheckAddr (int family, in_port_t port,
+		struct addrinfo *next) {
+	struct addrinfo *ai = calloc (1, sizeof (*ai));
+	struct sockaddr_storage *sa = calloc (1, sizeof (*sa));
+
+	if (ai == NULL || sa == NULL) {
+		abort ();
+	}
+	if (family == AF_INET) {
+		struct sockaddr_in *sin = (struct sockaddr_in *) sa;
+		sin->sin_family = AF_INET;
+		sin->sin_port = port;
+		sin->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+		ai->ai_addrlen = sizeof (*sin);
+	} else {
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) sa;
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = port;
+		sin6->sin6_addr = in6addr_loopback;
+		ai->ai_addrlen = sizeof (*sin6);
+	}
+	ai->ai_family = family;
+	ai->ai_socktype = SOCK_STREAM;
+	ai->ai_addr = (struct sockaddr *) sa;
+	ai->ai_next = next;
+	return ai;
+}
+
+static void CheckFreeAddrs (struct addrinfo *list) {
+	while (list != NULL) {
+		struct addrinfo *next = list->ai_next;
+		free (list->ai_addr);
+		free (list);
+		list = next;
+	}
+}
+
+/*	race the list, then free it
+ *	@param connect timeout, ms
+ *	@param receives the elapsed time, ms
+ *	@param receives the port connected to, or 0
+ */
+static WaitressReturn_t CheckRace (struct addrinfo *list, int timeout,
+		unsigned long *elapsed, in_port_t *port) {
+	WaitressHandle_t waith;
+	const uint64_t start = WaitressMicroseconds ();
+
+	WaitressInit (&waith);
+	waith.timeout = timeout;
+	waith.request.sockfd = -1;
+	const WaitressReturn_t ret = WaitressRaceConnect (&waith, list);
+	*elapsed = (WaitressMicroseconds () - start) / 1000;
+	*port = 0;
+	if (waith.request.sockfd != -1) {
+		struct sockaddr_in sa;
+		socklen_t size = sizeof (sa);
+		if (getpeername (waith.request.sockfd, (struct sockaddr *) &sa,
+				&size) == 0) {
+			*port = sa.sin_port;
+		}
+		close (waith.request.sockfd);
+	}
+	CheckFreeAddrs (list);
+	return ret;
+}
+
+/*	the first address of each family, then alternating
+ */
+static bool CheckInterleave (void) {
+	struct addrinfo *list = CheckAddr (AF_INET6, htons (1),
+			CheckAddr (AF_INET6, htons (2), CheckAddr (AF_INET6, htons (3),
+			CheckAddr (AF_INET, htons (4), CheckAddr (AF_INET, htons (5),
+			NULL)))));
+	const in_port_t expected[] = {1, 4, 2, 5, 3};
+	struct addrinfo *ordered[5];
+	bool ok = WaitressInterleaveAddrs (list, ordered) == 5;
+
+	for (size_t i = 0; ok && i < 5; i++) {
+		const struct sockaddr_in *sa =
+				(const struct sockaddr_in *) ordered[i]->ai_addr;
+		ok = ntohs (sa->sin_port) == expected[i];
+	}
+	CheckFreeAddrs (list);
+	return ok;
+}
+
+int main (void) {
+	in_port_t blackhole, live, refused;
+	unsigned long elapsed;
+	in_port_t port;
+	WaitressReturn_t ret;
+
+	if (!CheckInterleave ()) {
+		fprintf (stderr, "address families not interleaved\n");
+		return 1;
+	}
+
+	/* never accepted, fill the queue so further SYNs are dropped */
+	if (CheckListen (0, &blackhole) == -1 || CheckListen (16, &live) == -1) {
+		fprintf (stderr, "cannot listen: %s\n", strerror (errno));
+		return CHECK_SKIP;
+	}
+	for (int i = 0; i < 8; i++) {
+		struct addrinfo *addr = CheckAddr (AF_INET, blackhole, NULL);
+		WaitressReturn_t ignored;
+		WaitressStartConnect (addr, &ignored);
+		CheckFreeAddrs (addr);
+	}
+	usleep (100000);
+	/* a port nobody listens on */
+	const int closed = CheckListen (1, &refused);
+	close (closed);
+
+	ret = CheckRace (CheckAddr (AF_INET, blackhole, NULL), 500, &elapsed,
+			&port);
+	if (ret != WAITRESS_RET_TIMEOUT) {
+		printf ("SKIP: cannot make a blackhole here (%s)\n",
+				WaitressErrorToStr (ret));
+		return CHECK_SKIP;
+	}
+	printf ("blackhole alone: timeout after %lu ms\n", elapsed);
+
+	ret = CheckRace (CheckAddr (AF_INET, blackhole, CheckAddr (AF_INET, live,
+			NULL)), 3000, &elapsed, &port);
+	printf ("blackhole, then live: %s after %lu ms\n",
+			WaitressErrorToStr (ret), elapsed);
+	if (ret != WAITRESS_RET_OK || port != live) {
+		fprintf (stderr, "live listener did not win\n");
+		return 1;
+	}
+	if (elapsed < WAITRESS_CONNECT_ATTEMPT_DELAY - 10 ||
+			elapsed > WAITRESS_CONNECT_ATTEMPT_DELAY * 3) {
+		fprintf (stderr, "expected to win after about %d ms\n",
+				WAITRESS_CONNECT_ATTEMPT_DELAY);
+		return 1;
+	}
+
+	ret = CheckRace (CheckAddr (AF_INET, refused, CheckAddr (AF_INET, live,
+			NULL)), 3000, &elapsed, &port);
+	printf ("refused, then live: %s after %lu ms\n",
+			WaitressErrorToStr (ret), elapsed);
+	if (ret != WAITRESS_RET_OK || port != live ||
+			elapsed >= WAITRESS_CONNECT_ATTEMPT_DELAY) {
+		fprintf (stderr, "refused address delayed the next one\n");
+		return 1;
+	}
+
+	ret = CheckRace (CheckAddr (AF_INET, refused, CheckAddr (AF_INET, refused,
+			NULL)), 3000, &elapsed, &port);
+	printf ("all refused: %s after %lu ms\n", WaitressErrorToStr (ret),
+			elapsed);
+	if (ret != WAITRESS_RET_CONNECT_REFUSED) {
+		fprintf (stderr, "expected connection refused\n");
+		return 1;
+	}
+	return 0;
+}
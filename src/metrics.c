@@ -0,0 +1,310 @@
+/*
+ *  metrics.c
+ *  pianod - Latency histograms for commands, Pandora requests and playback.
+ *
+ */
+
+/* Each family is a fixed array of histograms, one per command, request type
+   or whatever the family is indexed by.  Buckets are fixed and logarithmic,
+   from 100 microseconds to 10 seconds.  Recording uses atomic adds, since
+   Pandora requests complete on the RPC worker and playback timings come from
+   the player thread; readers may see a histogram mid-update, which is fine
+   for reporting.
+
+   Histograms are available with the "metrics" command, and in Prometheus
+   text format from the HTTP port at /pianod/metrics. */
+
+#ifndef __FreeBSD__
+#define _DEFAULT_SOURCE /* open_memstream() */
+#define _DARWIN_C_SOURCE /* open_memstream() on OS X */
+#endif
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+
+#include <piano.h>
+#include <fb_public.h>
+
+#include "metrics.h"
+#include "command.h"
+#include "response.h"
+#include "logging.h"
+
+#define countof(x) (sizeof (x) / sizeof (*(x)))
+#define METRIC_BUCKET_COUNT (16)
+#define METRIC_LABEL_MAX (40)
+
+/* Bucket upper bounds, in microseconds */
+static const uint64_t bucket_bounds [METRIC_BUCKET_COUNT] = {
+	100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+	100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+typedef struct metric_histogram_t {
+	char label [METRIC_LABEL_MAX]; /* Empty if unnamed */
+	unsigned long count;
+	uint64_t sum; /* Microseconds */
+	uint64_t max;
+	unsigned long buckets [METRIC_BUCKET_COUNT + 1]; /* Last is overflow */
+} METRIC_HISTOGRAM;
+
+struct metric_family_t {
+	const char *name; /* Prometheus name */
+	const char *help;
+	const char *label_name; /* NULL for a family with a single histogram */
+	unsigned int size;
+	METRIC_HISTOGRAM *series;
+};
+
+#define PIANO_REQUEST_LIMIT (PIANO_REQUEST_DELETE_SEED + 1)
+#define EVENT_TYPE_LIMIT (FB_EVENT_TIMEOUT + 1)
+
+static METRIC_HISTOGRAM parse_series [1];
+static METRIC_HISTOGRAM command_series [QUIT + 1];
+static METRIC_HISTOGRAM request_series [PIANO_REQUEST_LIMIT] = {
+	[PIANO_REQUEST_LOGIN] = { "login" },
+	[PIANO_REQUEST_GET_STATIONS] = { "get_stations" },
+	[PIANO_REQUEST_GET_PLAYLIST] = { "get_playlist" },
+	[PIANO_REQUEST_RATE_SONG] = { "rate_song" },
+	[PIANO_REQUEST_ADD_FEEDBACK] = { "add_feedback" },
+	[PIANO_REQUEST_RENAME_STATION] = { "rename_station" },
+	[PIANO_REQUEST_DELETE_STATION] = { "delete_station" },
+	[PIANO_REQUEST_SEARCH] = { "search" },
+	[PIANO_REQUEST_CREATE_STATION] = { "create_station" },
+	[PIANO_REQUEST_ADD_SEED] = { "add_seed" },
+	[PIANO_REQUEST_ADD_TIRED_SONG] = { "add_tired_song" },
+	[PIANO_REQUEST_SET_QUICKMIX] = { "set_quickmix" },
+	[PIANO_REQUEST_GET_GENRE_STATIONS] = { "get_genre_stations" },
+	[PIANO_REQUEST_TRANSFORM_STATION] = { "transform_station" },
+	[PIANO_REQUEST_EXPLAIN] = { "explain" },
+	[PIANO_REQUEST_BOOKMARK_SONG] = { "bookmark_song" },
+	[PIANO_REQUEST_BOOKMARK_ARTIST] = { "bookmark_artist" },
+	[PIANO_REQUEST_GET_STATION_INFO] = { "get_station_info" },
+	[PIANO_REQUEST_DELETE_FEEDBACK] = { "delete_feedback" },
+	[PIANO_REQUEST_DELETE_SEED] = { "delete_seed" }
+};
+static METRIC_HISTOGRAM waitress_series [METRIC_PHASE_COUNT] = {
+	[METRIC_PHASE_CONNECT] = { "connect" },
+	[METRIC_PHASE_HANDSHAKE] = { "handshake" },
+	[METRIC_PHASE_TRANSFER] = { "transfer" }
+};
+static METRIC_HISTOGRAM startup_series [1];
+static METRIC_HISTOGRAM event_series [EVENT_TYPE_LIMIT] = {
+	[FB_EVENT_CONNECT] = { "connect" },
+	[FB_EVENT_INPUT] = { "input" },
+	[FB_EVENT_CLOSE] = { "close" },
+	[FB_EVENT_STOPPED] = { "stopped" },
+	[FB_EVENT_READABLE] = { "readable" },
+	[FB_EVENT_TIMEOUT] = { "timeout" }
+};
+
+METRIC_FAMILY metric_parse = {
+	"pianod_command_parse_seconds", "Time to interpret command lines",
+	NULL, countof (parse_series), parse_series
+};
+METRIC_FAMILY metric_commands = {
+	"pianod_command_seconds", "Time to execute commands, including blocking Pandora requests",
+	"command", countof (command_series), command_series
+};
+METRIC_FAMILY metric_requests = {
+	"pianod_pandora_request_seconds", "Time for Pandora requests, from submission to completion",
+	"request", countof (request_series), request_series
+};
+METRIC_FAMILY metric_waitress = {
+	"pianod_http_phase_seconds", "Time spent in each phase of HTTP requests to Pandora",
+	"phase", countof (waitress_series), waitress_series
+};
+METRIC_FAMILY metric_player_startup = {
+	"pianod_player_startup_seconds", "Time from starting a track to its first audio output",
+	NULL, countof (startup_series), startup_series
+};
+METRIC_FAMILY metric_event_loop = {
+	"pianod_event_seconds", "Time to handle each event in the run loop",
+	"event", countof (event_series), event_series
+};
+
+static METRIC_FAMILY *families [] = {
+	&metric_parse, &metric_commands, &metric_requests,
+	&metric_waitress, &metric_player_startup, &metric_event_loop
+};
+
+
+/* Monotonic time, in microseconds */
+uint64_t metrics_now (void) {
+	struct timespec now;
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+/* Name a histogram, unless it's already named.  Label is not necessarily
+   terminated; length is the number of characters to use. */
+void metrics_label (METRIC_FAMILY *family, unsigned int index, const char *label, size_t length) {
+	assert (family->label_name);
+	if (index >= family->size || family->series [index].label [0]) {
+		return;
+	}
+	if (length >= METRIC_LABEL_MAX) {
+		length = METRIC_LABEL_MAX - 1;
+	}
+	memcpy (family->series [index].label, label, length);
+	family->series [index].label [length] = '\0';
+}
+
+
+/* Add a sample to a histogram.  Safe to call from any thread. */
+void metrics_record (METRIC_FAMILY *family, unsigned int index, uint64_t microseconds) {
+	if (index >= family->size) {
+		return;
+	}
+	METRIC_HISTOGRAM *histogram = &family->series [index];
+	unsigned int bucket = 0;
+	while (bucket < METRIC_BUCKET_COUNT && microseconds > bucket_bounds [bucket]) {
+		bucket++;
+	}
+	__atomic_fetch_add (&histogram->buckets [bucket], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&histogram->sum, microseconds, __ATOMIC_RELAXED);
+	__atomic_fetch_add (&histogram->count, 1, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n (&histogram->max, __ATOMIC_RELAXED);
+	while (microseconds > max &&
+		   !__atomic_compare_exchange_n (&histogram->max, &max, microseconds, false,
+										 __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+
+/* Add the time elapsed since start, as returned by metrics_now(). */
+void metrics_since (METRIC_FAMILY *family, unsigned int index, uint64_t start) {
+	metrics_record (family, index, metrics_now () - start);
+}
+
+
+/* Estimate a quantile from the buckets.  Returns the bucket's upper bound,
+   or the maximum if it falls in the overflow bucket. */
+static uint64_t quantile (const METRIC_HISTOGRAM *histogram, double q) {
+	unsigned long count = __atomic_load_n (&histogram->count, __ATOMIC_RELAXED);
+	unsigned long target = (unsigned long) (q * count + 0.5);
+	unsigned long cumulative = 0;
+	unsigned int bucket;
+	for (bucket = 0; bucket < METRIC_BUCKET_COUNT; bucket++) {
+		cumulative += __atomic_load_n (&histogram->buckets [bucket], __ATOMIC_RELAXED);
+		if (cumulative >= target) {
+			uint64_t max = __atomic_load_n (&histogram->max, __ATOMIC_RELAXED);
+			return bucket_bounds [bucket] < max ? bucket_bounds [bucket] : max;
+		}
+	}
+	return __atomic_load_n (&histogram->max, __ATOMIC_RELAXED);
+}
+
+
+/* Get a histogram's label, or its index if it was never named. */
+static const char *histogram_label (const METRIC_FAMILY *family, unsigned int index,
+									char *buffer, size_t size) {
+	if (family->label_name == NULL || family->series [index].label [0]) {
+		return family->series [index].label;
+	}
+	snprintf (buffer, size, "#%u", index);
+	return buffer;
+}
+
+
+/* Send histogram summaries for families or labels matching name,
+   or all of them if name is NULL. */
+void send_metrics (FB_EVENT *event, const char *name) {
+	bool found = false;
+	for (unsigned int f = 0; f < countof (families); f++) {
+		METRIC_FAMILY *family = families [f];
+		bool family_match = (name == NULL || strstr (family->name, name) != NULL);
+		for (unsigned int i = 0; i < family->size; i++) {
+			const METRIC_HISTOGRAM *histogram = &family->series [i];
+			unsigned long count = __atomic_load_n (&histogram->count, __ATOMIC_RELAXED);
+			char number [16];
+			const char *label = histogram_label (family, i, number, sizeof (number));
+			if (count == 0 || !(family_match || strcasecmp (label, name) == 0)) {
+				continue;
+			}
+			uint64_t sum = __atomic_load_n (&histogram->sum, __ATOMIC_RELAXED);
+			if (!found) {
+				reply (event, S_DATA);
+				found = true;
+			}
+			fb_fprintf (event, "%03d %s: %s%s%s count %lu mean %.3fms p50 %.3fms p95 %.3fms p99 %.3fms max %.3fms\n",
+						I_METRIC, Response (I_METRIC), family->name,
+						label [0] ? " " : "", label, count,
+						(double) sum / count / 1000.0,
+						quantile (histogram, 0.50) / 1000.0,
+						quantile (histogram, 0.95) / 1000.0,
+						quantile (histogram, 0.99) / 1000.0,
+						__atomic_load_n (&histogram->max, __ATOMIC_RELAXED) / 1000.0);
+		}
+	}
+	send_response_code (event, S_DATA_END, found ? "End of data" : "No data");
+}
+
+
+/* Write one histogram in Prometheus text format */
+static void write_prometheus_histogram (FILE *out, const METRIC_FAMILY *family, unsigned int index) {
+	const METRIC_HISTOGRAM *histogram = &family->series [index];
+	char label [METRIC_LABEL_MAX + 32] = "";
+	if (family->label_name) {
+		char number [16];
+		snprintf (label, sizeof (label), "%s=\"%s\",", family->label_name,
+				  histogram_label (family, index, number, sizeof (number)));
+	}
+	unsigned long cumulative = 0;
+	for (unsigned int bucket = 0; bucket < METRIC_BUCKET_COUNT; bucket++) {
+		cumulative += __atomic_load_n (&histogram->buckets [bucket], __ATOMIC_RELAXED);
+		fprintf (out, "%s_bucket{%sle=\"%g\"} %lu\n", family->name, label,
+				 bucket_bounds [bucket] / 1000000.0, cumulative);
+	}
+	cumulative += __atomic_load_n (&histogram->buckets [METRIC_BUCKET_COUNT], __ATOMIC_RELAXED);
+	fprintf (out, "%s_bucket{%sle=\"+Inf\"} %lu\n", family->name, label, cumulative);
+	/* Drop the trailing comma for sum and count */
+	size_t length = strlen (label);
+	if (length) {
+		label [length - 1] = '\0';
+	}
+	fprintf (out, "%s_sum%s%s%s %.6f\n", family->name, length ? "{" : "", label, length ? "}" : "",
+			 __atomic_load_n (&histogram->sum, __ATOMIC_RELAXED) / 1000000.0);
+	fprintf (out, "%s_count%s%s%s %lu\n", family->name, length ? "{" : "", label, length ? "}" : "",
+			 cumulative);
+}
+
+
+/* Football dynamic content handler: produce Prometheus text for "metrics".
+   Returns NULL for anything else, so files are served as usual. */
+char *metrics_http_content (const char *filename, const char **media_type) {
+	if (strcmp (filename, "metrics") != 0) {
+		return NULL;
+	}
+	char *text = NULL;
+	size_t size;
+	FILE *out = open_memstream (&text, &size);
+	if (!out) {
+		flog (LOG_ERROR, "metrics_http_content: open_memstream: %s", strerror (errno));
+		return NULL;
+	}
+	for (unsigned int f = 0; f < countof (families); f++) {
+		const METRIC_FAMILY *family = families [f];
+		fprintf (out, "# HELP %s %s\n# TYPE %s histogram\n", family->name, family->help, family->name);
+		for (unsigned int i = 0; i < family->size; i++) {
+			if (family->label_name == NULL ||
+				__atomic_load_n (&family->series [i].count, __ATOMIC_RELAXED) > 0) {
+				write_prometheus_histogram (out, family, i);
+			}
+		}
+	}
+	if (fclose (out) != 0) {
+		free (text);
+		return NULL;
+	}
+	*media_type = "text/plain; version=0.0.4";
+	return text;
+}
@@ -0,0 +1,41 @@
+/*
+ *  metrics.h
+ *  pianod - Latency histograms for commands, Pandora requests and playback.
+ *
+ */
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <config.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <fb_public.h>
+
+typedef struct metric_family_t METRIC_FAMILY;
+
+/* Phases of a libwaitress request */
+typedef enum metric_phase_t {
+	METRIC_PHASE_CONNECT,
+	METRIC_PHASE_HANDSHAKE,
+	METRIC_PHASE_TRANSFER,
+	METRIC_PHASE_COUNT
+} METRIC_PHASE;
+
+extern METRIC_FAMILY metric_parse; /* Command line interpretation */
+extern METRIC_FAMILY metric_commands; /* Indexed by COMMAND */
+extern METRIC_FAMILY metric_requests; /* Indexed by PianoRequestType_t */
+extern METRIC_FAMILY metric_waitress; /* Indexed by METRIC_PHASE */
+extern METRIC_FAMILY metric_player_startup; /* Player start to first sample */
+extern METRIC_FAMILY metric_event_loop; /* Indexed by FB_EVENTTYPE */
+
+extern uint64_t metrics_now (void);
+extern void metrics_label (METRIC_FAMILY *family, unsigned int index, const char *label, size_t length);
+extern void metrics_record (METRIC_FAMILY *family, unsigned int index, uint64_t microseconds);
+extern void metrics_since (METRIC_FAMILY *family, unsigned int index, uint64_t start);
+extern void send_metrics (FB_EVENT *event, const char *name);
+extern char *metrics_http_content (const char *filename, const char **media_type);
+
+#endif
@@ -0,0 +1,504 @@
+/*
+Copyright (c) 2008-2013
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* mp4 demuxer, split from player.c so it can be checked on its own */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mp4.h"
+
+/*	read big endian integers from mp4 boxes
+ */
+static inline uint32_t BarMp4Get32 (const unsigned char *p) {
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+			(uint32_t) p[2] << 8 | (uint32_t) p[3];
+}
+
+static inline uint64_t BarMp4Get64 (const unsigned char *p) {
+	return (uint64_t) BarMp4Get32 (p) << 32 | BarMp4Get32 (p + 4);
+}
+
+/*	make room for at least size bytes in the buffer; contents are kept
+ *	@param mp4 structure
+ *	@param required size
+ *	@return false if out of memory
+ */
+static bool BarMp4BufferReserve (BarMp4_t *mp4, const size_t size) {
+	if (size > mp4->bufferSize) {
+		size_t newSize = mp4->bufferSize ? mp4->bufferSize : BAR_MP4_BUFSIZE;
+		while (newSize < size) {
+			newSize *= 2;
+		}
+		unsigned char *buffer = realloc (mp4->buffer, newSize);
+		if (buffer == NULL) {
+			mp4->error = "Out of memory!";
+			return false;
+		}
+		mp4->buffer = buffer;
+		mp4->bufferSize = newSize;
+	}
+	return true;
+}
+
+/*	read an mpeg-4 descriptor header (tag and variable length size)
+ *	@param descriptor data, advanced past the header
+ *	@param remaining data length, reduced accordingly
+ *	@param expected tag
+ *	@return descriptor size, or 0 if malformed or not the expected tag
+ */
+static size_t BarMp4Descriptor (const unsigned char **p, size_t *len,
+		const unsigned char tag) {
+	if (*len < 2 || **p != tag) {
+		return 0;
+	}
+	size_t size = 0;
+	size_t i = 1;
+	do {
+		if (i >= *len || i > 4) {
+			return 0;
+		}
+		size = size << 7 | ((*p)[i] & 0x7f);
+	} while ((*p)[i++] & 0x80);
+	*p += i;
+	*len -= i;
+	return size <= *len ? size : 0;
+}
+
+/*	parse esds box and keep its audio specific config for the decoder
+ *	@param mp4 structure
+ *	@param box contents
+ *	@param box contents length
+ *	@return false on error
+ */
+static bool BarMp4ParseEsds (BarMp4_t *mp4, const unsigned char *p,
+		size_t len) {
+	size_t size;
+
+	/* skip version and flags */
+	if (len < 4) {
+		return false;
+	}
+	p += 4;
+	len -= 4;
+	/* ES descriptor: id, flags and optional fields */
+	if ((len = BarMp4Descriptor (&p, &len, 0x03)) < 3) {
+		return false;
+	}
+	const unsigned char flags = p[2];
+	size = 3 + ((flags & 0x80) ? 2 : 0) + ((flags & 0x20) ? 2 : 0);
+	if ((flags & 0x40) && len > size) {
+		size += 1 + p[size];
+	}
+	if (size > len) {
+		return false;
+	}
+	p += size;
+	len -= size;
+	/* decoder config descriptor: type, stream type, buffer size, bitrates */
+	if ((len = BarMp4Descriptor (&p, &len, 0x04)) < 13) {
+		return false;
+	}
+	p += 13;
+	len -= 13;
+	/* decoder specific info is the audio specific config */
+	if ((size = BarMp4Descriptor (&p, &len, 0x05)) == 0) {
+		return false;
+	}
+
+	if ((mp4->config = malloc (size)) == NULL) {
+		mp4->error = "Out of memory!";
+		return false;
+	}
+	memcpy (mp4->config, p, size);
+	mp4->configSize = size;
+	return true;
+}
+
+/*	parse stsd box, looking for the mp4a sample entry's esds
+ *	@param mp4 structure
+ *	@param box contents
+ *	@param box contents length
+ *	@return false on error
+ */
+static bool BarMp4ParseStsd (BarMp4_t *mp4, const unsigned char *p,
+		size_t len) {
+	/* skip version, flags and entry count; use the first entry */
+	if (len < 8 + 8) {
+		return false;
+	}
+	p += 8;
+	len -= 8;
+	size_t entrySize = BarMp4Get32 (p);
+	if (memcmp (p + 4, "mp4a", 4) != 0) {
+		mp4->error = "Unsupported audio format";
+		return false;
+	}
+	/* sample entry header and audio sample entry fields */
+	if (entrySize < 8 + 28 || entrySize > len) {
+		return false;
+	}
+	p += 8 + 28;
+	len = entrySize - 8 - 28;
+	while (len >= 8) {
+		size_t boxSize = BarMp4Get32 (p);
+		if (boxSize < 8 || boxSize > len) {
+			return false;
+		}
+		if (memcmp (p + 4, "esds", 4) == 0) {
+			return BarMp4ParseEsds (mp4, p + 8, boxSize - 8);
+		}
+		p += boxSize;
+		len -= boxSize;
+	}
+	return false;
+}
+
+/*	parse stsz box into the frame size table
+ *	@param mp4 structure
+ *	@param box contents
+ *	@param box contents length
+ *	@return false on error
+ */
+static bool BarMp4ParseStsz (BarMp4_t *mp4, const unsigned char *p,
+		size_t len) {
+	/* version, flags, common sample size, sample count */
+	if (len < 12) {
+		return false;
+	}
+	const uint32_t commonSize = BarMp4Get32 (p + 4);
+	const uint32_t count = BarMp4Get32 (p + 8);
+	p += 12;
+	len -= 12;
+	if (count == 0 || (commonSize == 0 && count > len / 4)) {
+		return false;
+	}
+
+	mp4->sampleSize = malloc (count * sizeof (*mp4->sampleSize));
+	if (mp4->sampleSize == NULL) {
+		mp4->error = "Out of memory!";
+		return false;
+	}
+	mp4->sampleSizeN = count;
+	mp4->sampleSizeCurr = 0;
+	/* a frame split across inputs is collected in the buffer, make sure
+	 * the largest one fits */
+	size_t maxSampleSize = 0;
+	for (size_t i = 0; i < count; i++) {
+		mp4->sampleSize[i] = commonSize ? commonSize : BarMp4Get32 (p + i * 4);
+		if (mp4->sampleSize[i] > maxSampleSize) {
+			maxSampleSize = mp4->sampleSize[i];
+		}
+	}
+	return BarMp4BufferReserve (mp4, maxSampleSize);
+}
+
+/*	parse a complete mp4 box we're interested in
+ *	@param mp4 structure
+ *	@param box type
+ *	@param box contents
+ *	@param box contents length
+ *	@return false on error
+ */
+static bool BarMp4ParseBox (BarMp4_t *mp4, const unsigned char *type,
+		const unsigned char *p, size_t len) {
+	if (mp4->audioTrack != 0 && mp4->track != mp4->audioTrack) {
+		/* another track's tables */
+		return true;
+	}
+	if (memcmp (type, "mdhd", 4) == 0) {
+		/* version 1 has 64 bit times and duration */
+		if (len >= 32 && p[0] == 1) {
+			mp4->timescale = BarMp4Get32 (p + 20);
+			mp4->duration = BarMp4Get64 (p + 24);
+		} else if (len >= 20) {
+			mp4->timescale = BarMp4Get32 (p + 12);
+			mp4->duration = BarMp4Get32 (p + 16);
+		}
+	} else if (memcmp (type, "stts", 4) == 0) {
+		if (len < 8) {
+			return false;
+		}
+		uint32_t entries = BarMp4Get32 (p + 4);
+		if (entries > (len - 8) / 8) {
+			return false;
+		}
+		mp4->sttsDuration = 0;
+		for (uint32_t i = 0; i < entries; i++) {
+			mp4->sttsDuration += (uint64_t) BarMp4Get32 (p + 8 + i * 8) *
+					BarMp4Get32 (p + 12 + i * 8);
+		}
+	} else if (memcmp (type, "stco", 4) == 0 || memcmp (type, "co64", 4) == 0) {
+		/* we only need to know where the first chunk begins */
+		if (len >= 12 && BarMp4Get32 (p + 4) > 0) {
+			mp4->firstChunk = type[1] == 'o' ? BarMp4Get64 (p + 8) :
+					BarMp4Get32 (p + 8);
+		}
+	} else if (memcmp (type, "stsd", 4) == 0) {
+		if (!BarMp4ParseStsd (mp4, p, len)) {
+			if (mp4->error == NULL) {
+				mp4->error = "Invalid audio description";
+			}
+			return false;
+		}
+		mp4->audioTrack = mp4->track;
+		mp4->state = BAR_MP4_DESCRIBED;
+	} else if (memcmp (type, "stsz", 4) == 0) {
+		if (mp4->state != BAR_MP4_DESCRIBED) {
+			/* no audio description yet */
+			return true;
+		}
+		if (!BarMp4ParseStsz (mp4, p, len)) {
+			if (mp4->error == NULL) {
+				mp4->error = "Invalid frame size table";
+			}
+			return false;
+		}
+		mp4->state = BAR_MP4_SIZED;
+	}
+	return true;
+}
+
+#define BAR_ARRAY_LEN(a) (sizeof (a) / sizeof (*(a)))
+
+/*	check whether a box type is in a list
+ */
+static bool BarMp4BoxIn (const unsigned char *type, const char list[][4],
+		const size_t n) {
+	for (size_t i = 0; i < n; i++) {
+		if (memcmp (type, list[i], 4) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void BarMp4Init (BarMp4_t *mp4) {
+	memset (mp4, 0, sizeof (*mp4));
+}
+
+void BarMp4Destroy (BarMp4_t *mp4) {
+	free (mp4->config);
+	free (mp4->sampleSize);
+	free (mp4->buffer);
+	memset (mp4, 0, sizeof (*mp4));
+}
+
+/*	walk the mp4 boxes up to the beginning of the audio data; containers on
+ *	the way to the sample tables are entered, boxes we need are collected
+ *	whole, everything else is skipped by size
+ *	@param mp4 structure
+ *	@param new data
+ *	@param data size
+ *	@return BAR_MP4_RET_OK once the audio data begins; the data following
+ *		the header is then queued as input
+ */
+BarMp4Ret_t BarMp4ParseHeader (BarMp4_t *mp4, const unsigned char *data,
+		size_t size) {
+	static const char containers[][4] = {"moov", "trak", "mdia", "minf", "stbl"};
+	static const char wanted[][4] = {"mdhd", "stsd", "stts", "stsz", "stco", "co64"};
+
+	if (mp4->state == BAR_MP4_FRAMES) {
+		BarMp4Input (mp4, data, size);
+		return BAR_MP4_RET_OK;
+	}
+	if (!BarMp4BufferReserve (mp4, mp4->bufferFilled + size)) {
+		return BAR_MP4_RET_ERR;
+	}
+	memcpy (mp4->buffer + mp4->bufferFilled, data, size);
+	mp4->bufferFilled += size;
+
+	while (true) {
+		const unsigned char *p = mp4->buffer + mp4->bufferRead;
+		size_t avail = mp4->bufferFilled - mp4->bufferRead;
+		size_t consume;
+
+		if (mp4->skip > 0) {
+			consume = mp4->skip < avail ? mp4->skip : avail;
+			if (consume == 0) {
+				break;
+			}
+			mp4->skip -= consume;
+			mp4->bufferRead += consume;
+			mp4->position += consume;
+			continue;
+		}
+
+		/* box header: 32 bit size, type, optional 64 bit size */
+		if (avail < 8) {
+			break;
+		}
+		uint64_t boxSize = BarMp4Get32 (p);
+		size_t headerSize = 8;
+		const unsigned char *type = p + 4;
+		if (boxSize == 1) {
+			if (avail < 16) {
+				break;
+			}
+			boxSize = BarMp4Get64 (p + 8);
+			headerSize = 16;
+		}
+
+		if (memcmp (type, "mdat", 4) == 0) {
+			if (mp4->state != BAR_MP4_SIZED) {
+				mp4->error = "Audio data precedes mp4 header";
+				return BAR_MP4_RET_ERR;
+			}
+			mp4->bufferRead += headerSize;
+			mp4->position += headerSize;
+			/* frames begin at the first chunk, usually right here */
+			if (mp4->firstChunk > mp4->position) {
+				mp4->skip = mp4->firstChunk - mp4->position;
+			}
+			mp4->sampleSizeCurr = 0;
+			mp4->state = BAR_MP4_FRAMES;
+			/* whatever follows the header is audio; the buffer now holds
+			 * partial frames only */
+			mp4->input = mp4->buffer + mp4->bufferRead;
+			mp4->inputSize = mp4->bufferFilled - mp4->bufferRead;
+			mp4->bufferFilled = mp4->bufferRead = 0;
+			return BAR_MP4_RET_OK;
+		}
+		if (boxSize < headerSize) {
+			/* size 0 (up to end of file) is valid for mdat only */
+			mp4->error = "Invalid mp4 box";
+			return BAR_MP4_RET_ERR;
+		}
+
+		if (BarMp4BoxIn (type, containers, BAR_ARRAY_LEN (containers))) {
+			/* descend: children follow the header */
+			if (memcmp (type, "trak", 4) == 0) {
+				++mp4->track;
+			}
+			consume = headerSize;
+		} else if (BarMp4BoxIn (type, wanted, BAR_ARRAY_LEN (wanted))) {
+			if (boxSize > BAR_MP4_MAX_BOX) {
+				mp4->error = "mp4 box too large";
+				return BAR_MP4_RET_ERR;
+			}
+			if (avail < boxSize) {
+				/* wait for the rest */
+				break;
+			}
+			if (!BarMp4ParseBox (mp4, type, p + headerSize,
+					boxSize - headerSize)) {
+				return BAR_MP4_RET_ERR;
+			}
+			consume = boxSize;
+		} else {
+			consume = headerSize;
+			mp4->skip = boxSize - headerSize;
+		}
+		mp4->bufferRead += consume;
+		mp4->position += consume;
+	}
+
+	/* keep the unparsed rest for next time */
+	memmove (mp4->buffer, mp4->buffer + mp4->bufferRead,
+			mp4->bufferFilled - mp4->bufferRead);
+	mp4->bufferFilled -= mp4->bufferRead;
+	mp4->bufferRead = 0;
+	return BAR_MP4_RET_AGAIN;
+}
+
+/*	song duration from the media header, or else the sample time table
+ *	@param mp4 structure
+ *	@return duration in ms, 0 if unknown
+ */
+unsigned long BarMp4DurationMs (const BarMp4_t *mp4) {
+	const uint64_t duration = mp4->duration ? mp4->duration :
+			mp4->sttsDuration;
+	if (mp4->timescale == 0) {
+		return 0;
+	}
+	return duration * 1000 / mp4->timescale;
+}
+
+/*	queue received audio data; it must stay valid until BarMp4NextFrame
+ *	returns NULL
+ *	@param mp4 structure
+ *	@param data
+ *	@param data size
+ */
+void BarMp4Input (BarMp4_t *mp4, const unsigned char *data, size_t size) {
+	mp4->input = data;
+	mp4->inputSize = size;
+}
+
+/*	get the next whole frame; it points into the input, or into the buffer
+ *	if it was split across inputs, and is valid until the next call
+ *	@param mp4 structure
+ *	@param returns the frame size
+ *	@return frame, or NULL once the input is used up
+ */
+const unsigned char *BarMp4NextFrame (BarMp4_t *mp4, size_t *size) {
+	/* anything between the mdat header and the first chunk */
+	if (mp4->skip > 0) {
+		size_t skip = mp4->skip < mp4->inputSize ? mp4->skip : mp4->inputSize;
+		mp4->skip -= skip;
+		mp4->input += skip;
+		mp4->inputSize -= skip;
+	}
+
+	if (mp4->sampleSizeCurr >= mp4->sampleSizeN) {
+		/* no more frames, drop the rest */
+		mp4->inputSize = 0;
+		return NULL;
+	}
+
+	const size_t frameSize = mp4->sampleSize[mp4->sampleSizeCurr];
+	const unsigned char *frame;
+	if (mp4->bufferFilled > 0) {
+		/* complete the frame left over from last time */
+		size_t missing = frameSize - mp4->bufferFilled;
+		if (missing > mp4->inputSize) {
+			missing = mp4->inputSize;
+		}
+		memcpy (mp4->buffer + mp4->bufferFilled, mp4->input, missing);
+		mp4->bufferFilled += missing;
+		mp4->input += missing;
+		mp4->inputSize -= missing;
+		if (mp4->bufferFilled < frameSize) {
+			return NULL;
+		}
+		mp4->bufferFilled = 0;
+		frame = mp4->buffer;
+	} else if (mp4->inputSize >= frameSize) {
+		frame = mp4->input;
+		mp4->input += frameSize;
+		mp4->inputSize -= frameSize;
+	} else {
+		/* keep the partial frame; the buffer holds the largest frame, and
+		 * the input may point into it */
+		memmove (mp4->buffer, mp4->input, mp4->inputSize);
+		mp4->bufferFilled = mp4->inputSize;
+		mp4->inputSize = 0;
+		return NULL;
+	}
+
+	++mp4->sampleSizeCurr;
+	*size = frameSize;
+	return frame;
+}
@@ -0,0 +1,71 @@
+/*
+ *  mp4.h
+ *  pianod - Streaming mp4 demuxer for the AAC player.
+ *
+ */
+
+#ifndef _MP4_H
+#define _MP4_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* initial size of the header buffer */
+#define BAR_MP4_BUFSIZE (20*1024)
+/* largest mp4 header box we're willing to buffer */
+#define BAR_MP4_MAX_BOX (16*1024*1024)
+
+typedef enum {
+	BAR_MP4_RET_OK = 0, /* header complete, frames follow */
+	BAR_MP4_RET_AGAIN, /* more data needed */
+	BAR_MP4_RET_ERR /* malformed or unsupported, see error */
+} BarMp4Ret_t;
+
+/* An mp4 file arrives in pieces of any size.  BarMp4ParseHeader collects
+ * the boxes needed to decode the first audio track, up to the audio data;
+ * after that, BarMp4Input and BarMp4NextFrame hand out whole frames,
+ * straight from the input where possible. */
+typedef struct {
+	/* from the header */
+	uint32_t timescale;
+	uint64_t duration; /* mdhd, in timescale units */
+	uint64_t sttsDuration; /* sum of the sample time table */
+	uint64_t firstChunk; /* file offset of the first audio chunk */
+	unsigned char *config; /* esds audio specific config */
+	size_t configSize;
+	uint32_t *sampleSize; /* stsz: size of each frame */
+	size_t sampleSizeN;
+	size_t sampleSizeCurr; /* next frame */
+	const char *error; /* reason for BAR_MP4_RET_ERR */
+
+	enum {
+		BAR_MP4_HEADER = 0, /* looking for the audio description */
+		BAR_MP4_DESCRIBED, /* looking for its frame size table */
+		BAR_MP4_SIZED, /* looking for the audio data */
+		BAR_MP4_FRAMES /* handing out frames */
+	} state;
+	unsigned int track; /* trak boxes entered so far */
+	unsigned int audioTrack; /* the one described by our stsd, 0 if none yet */
+	uint64_t position; /* file offset of the next header byte */
+	uint64_t skip; /* bytes left to skip */
+
+	/* header data while it's parsed, then a frame split across inputs */
+	unsigned char *buffer;
+	size_t bufferSize;
+	size_t bufferFilled;
+	size_t bufferRead;
+
+	/* data not yet handed out as frames */
+	const unsigned char *input;
+	size_t inputSize;
+} BarMp4_t;
+
+void BarMp4Init (BarMp4_t *);
+void BarMp4Destroy (BarMp4_t *);
+BarMp4Ret_t BarMp4ParseHeader (BarMp4_t *, const unsigned char *, size_t);
+unsigned long BarMp4DurationMs (const BarMp4_t *);
+void BarMp4Input (BarMp4_t *, const unsigned char *, size_t);
+const unsigned char *BarMp4NextFrame (BarMp4_t *, size_t *);
+
+#endif /* _MP4_H */
@@ -0,0 +1,461 @@
+/*
+ *  mp4_check.c
+ *  pianod - Checks the streaming mp4 demuxer on synthetic files fed in
+ *  pieces of every size.  Run by "make check".
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mp4.h"
+
+#define CHECK_CHUNK_MAX (4860) /* Largest piece for the chunk size sweep */
+#define CHECK_RANDOM_ROUNDS (200)
+#define CHECK_TIMESCALE (44100)
+
+typedef enum {
+	FAULT_NONE,
+	FAULT_MDAT_FIRST, /* Audio data before the header */
+	FAULT_NOT_MP4A, /* Some other codec */
+	FAULT_NO_CONFIG, /* esds without decoder specific info */
+	FAULT_SHORT_BOX, /* Box size smaller than its header */
+	FAULT_EMPTY_STSZ, /* No frames */
+	FAULT_HUGE_BOX /* Sample table beyond BAR_MP4_MAX_BOX */
+} FAULT;
+
+typedef struct {
+	const char *name;
+	int mdhd_version; /* 0, 1, or -1 for version 0 without a duration */
+	bool co64; /* 64 bit chunk offsets */
+	bool mdat64; /* 64 bit mdat size */
+	bool common_size; /* All frames the same size */
+	bool second_track; /* Another audio track after ours */
+	bool long_descriptors; /* Four byte descriptor sizes */
+	size_t gap; /* Bytes between the mdat header and the first frame */
+	size_t frames;
+	FAULT fault;
+	const char *error; /* Expected error for a fault */
+} LAYOUT;
+
+static const LAYOUT layouts [] = {
+	{ "mdhd v0, stco", 0, false, false, false, false, false, 0, 40, FAULT_NONE, NULL },
+	{ "mdhd v1, co64, 64 bit mdat", 1, true, true, false, false, true, 0, 40, FAULT_NONE, NULL },
+	{ "stts duration, gap before first chunk", -1, false, false, false, false, false, 29, 40, FAULT_NONE, NULL },
+	{ "common frame size", 0, false, false, true, false, false, 3, 25, FAULT_NONE, NULL },
+	{ "second track", 0, false, false, false, true, false, 11, 40, FAULT_NONE, NULL },
+	{ "mdat first", 0, false, false, false, false, false, 0, 4, FAULT_MDAT_FIRST, "Audio data precedes mp4 header" },
+	{ "not mp4a", 0, false, false, false, false, false, 0, 4, FAULT_NOT_MP4A, "Unsupported audio format" },
+	{ "no decoder config", 0, false, false, false, false, false, 0, 4, FAULT_NO_CONFIG, "Invalid audio description" },
+	{ "short box", 0, false, false, false, false, false, 0, 4, FAULT_SHORT_BOX, "Invalid mp4 box" },
+	{ "empty frame size table", 0, false, false, false, false, false, 0, 4, FAULT_EMPTY_STSZ, "Invalid frame size table" },
+	{ "huge box", 0, false, false, false, false, false, 0, 4, FAULT_HUGE_BOX, "mp4 box too large" }
+};
+
+static const unsigned char audio_config [] = { 0x13, 0x10, 0x56, 0xe5, 0x98 };
+static const unsigned char other_config [] = { 0x12, 0x08 };
+
+
+/* A file under construction */
+typedef struct {
+	unsigned char *data;
+	size_t size;
+	size_t capacity;
+	size_t open [8]; /* Boxes begun but not ended */
+	int depth;
+	size_t chunk_offset; /* Where the first chunk offset goes */
+} FILEBUF;
+
+static void put (FILEBUF *f, const void *data, size_t size) {
+	if (f->size + size > f->capacity) {
+		f->capacity = (f->size + size) * 2;
+		if (!(f->data = realloc (f->data, f->capacity))) {
+			perror ("realloc");
+			exit (1);
+		}
+	}
+	memcpy (f->data + f->size, data, size);
+	f->size += size;
+}
+
+static void put8 (FILEBUF *f, unsigned value) {
+	unsigned char byte = value;
+	put (f, &byte, 1);
+}
+
+static void fill (FILEBUF *f, unsigned value, size_t count) {
+	while (count--) {
+		put8 (f, value);
+	}
+}
+
+static void set32 (FILEBUF *f, size_t at, uint32_t value) {
+	for (int i = 0; i < 4; i++) {
+		f->data [at + i] = value >> (24 - 8 * i);
+	}
+}
+
+static void put32 (FILEBUF *f, uint32_t value) {
+	fill (f, 0, 4);
+	set32 (f, f->size - 4, value);
+}
+
+static void put64 (FILEBUF *f, uint64_t value) {
+	put32 (f, value >> 32);
+	put32 (f, value);
+}
+
+static void box_begin (FILEBUF *f, const char *type) {
+	f->open [f->depth++] = f->size;
+	put32 (f, 0);
+	put (f, type, 4);
+}
+
+static void box_end (FILEBUF *f) {
+	const size_t start = f->open [--f->depth];
+	set32 (f, start, f->size - start);
+}
+
+/* An empty box of some type we don't care about */
+static void box_skipped (FILEBUF *f, const char *type, size_t size) {
+	box_begin (f, type);
+	fill (f, 0x5a, size);
+	box_end (f);
+}
+
+/* MPEG-4 descriptor header, with the shortest or the longest size field */
+static void descriptor (FILEBUF *f, unsigned tag, size_t size, bool long_size) {
+	put8 (f, tag);
+	if (long_size) {
+		put8 (f, 0x80 | ((size >> 21) & 0x7f));
+		put8 (f, 0x80 | ((size >> 14) & 0x7f));
+		put8 (f, 0x80 | ((size >> 7) & 0x7f));
+	}
+	put8 (f, size & 0x7f);
+}
+
+static void esds (FILEBUF *f, const unsigned char *config, size_t config_size, const LAYOUT *l) {
+	const bool with_config = (l->fault != FAULT_NO_CONFIG);
+	const size_t header = l->long_descriptors ? 4 : 1;
+	const size_t info = with_config ? 1 + header + config_size : 0;
+	const size_t decoder = 1 + header + 13 + info;
+	box_begin (f, "esds");
+	put32 (f, 0); /* Version and flags */
+	/* ES descriptor with a depends-on id, to step over */
+	descriptor (f, 0x03, 3 + 2 + decoder + 3, l->long_descriptors);
+	put8 (f, 0); put8 (f, 1); put8 (f, 0x80);
+	put8 (f, 0); put8 (f, 2);
+	descriptor (f, 0x04, 13 + info, l->long_descriptors);
+	put8 (f, 0x40); put8 (f, 0x15); fill (f, 0, 3); put32 (f, 64000); put32 (f, 64000);
+	if (with_config) {
+		descriptor (f, 0x05, config_size, l->long_descriptors);
+		put (f, config, config_size);
+	}
+	/* SL config */
+	put8 (f, 0x06); put8 (f, 1); put8 (f, 2);
+	box_end (f);
+}
+
+static size_t frame_size (const LAYOUT *l, size_t frame) {
+	return l->common_size ? 333 : 1 + (frame * 97) % 700;
+}
+
+static unsigned char frame_byte (size_t frame, size_t offset) {
+	return (frame * 31 + offset * 7 + 1) & 0xff;
+}
+
+static uint64_t mdhd_duration (const LAYOUT *l) {
+	return (l->mdhd_version == 1 ? (UINT64_C (1) << 32) : 0) + l->frames * 1024 + 7;
+}
+
+static uint64_t stts_duration (const LAYOUT *l) {
+	return (l->frames - 1) * 1024 + 512;
+}
+
+/* One audio track; ours, or a decoy that must be ignored */
+static void track (FILEBUF *f, const LAYOUT *l, bool ours) {
+	box_begin (f, "trak");
+	box_skipped (f, "tkhd", 84);
+	box_begin (f, "mdia");
+	box_begin (f, "mdhd");
+	if (l->mdhd_version == 1 && ours) {
+		put32 (f, 1 << 24); put64 (f, 0); put64 (f, 0);
+		put32 (f, CHECK_TIMESCALE); put64 (f, mdhd_duration (l));
+	} else {
+		put32 (f, 0); put32 (f, 0); put32 (f, 0);
+		put32 (f, ours ? CHECK_TIMESCALE : 22050);
+		put32 (f, !ours ? 1 : l->mdhd_version < 0 ? 0 : mdhd_duration (l));
+	}
+	put32 (f, 0);
+	box_end (f);
+	box_skipped (f, "hdlr", 25);
+	box_begin (f, "minf");
+	box_skipped (f, "smhd", 8);
+	box_skipped (f, "dinf", 28);
+	box_begin (f, "stbl");
+
+	box_begin (f, "stsd");
+	put32 (f, 0); put32 (f, 1);
+	box_begin (f, l->fault == FAULT_NOT_MP4A ? "alac" : "mp4a");
+	fill (f, 0, 6); put8 (f, 0); put8 (f, 1); fill (f, 0, 8);
+	put8 (f, 0); put8 (f, 2); put8 (f, 0); put8 (f, 16); put32 (f, 0);
+	put32 (f, (uint32_t) CHECK_TIMESCALE << 16);
+	if (ours) {
+		esds (f, audio_config, sizeof (audio_config), l);
+	} else {
+		esds (f, other_config, sizeof (other_config), l);
+	}
+	box_end (f);
+	box_end (f);
+
+	if (l->fault == FAULT_HUGE_BOX) {
+		/* Only the header; the demuxer must give up right there */
+		put32 (f, BAR_MP4_MAX_BOX + 1);
+		put (f, "stts", 4);
+	} else {
+		box_begin (f, "stts");
+		put32 (f, 0);
+		if (ours) {
+			put32 (f, 2);
+			put32 (f, l->frames - 1); put32 (f, 1024);
+			put32 (f, 1); put32 (f, 512);
+		} else {
+			put32 (f, 1); put32 (f, 1); put32 (f, 1);
+		}
+		box_end (f);
+	}
+
+	box_skipped (f, "stsc", 20);
+
+	box_begin (f, "stsz");
+	put32 (f, 0);
+	if (!ours) {
+		put32 (f, 0); put32 (f, 1); put32 (f, 99999);
+	} else if (l->fault == FAULT_EMPTY_STSZ) {
+		put32 (f, 0); put32 (f, 0);
+	} else if (l->common_size) {
+		put32 (f, frame_size (l, 0)); put32 (f, l->frames);
+	} else {
+		put32 (f, 0); put32 (f, l->frames);
+		for (size_t i = 0; i < l->frames; i++) {
+			put32 (f, frame_size (l, i));
+		}
+	}
+	box_end (f);
+
+	box_begin (f, l->co64 ? "co64" : "stco");
+	put32 (f, 0); put32 (f, 1);
+	if (ours) {
+		f->chunk_offset = f->size;
+	}
+	if (l->co64) {
+		put64 (f, ours ? 0 : 5);
+	} else {
+		put32 (f, ours ? 0 : 5);
+	}
+	box_end (f);
+
+	box_end (f); /* stbl */
+	box_end (f); /* minf */
+	box_end (f); /* mdia */
+	box_end (f); /* trak */
+}
+
+static void audio_data (FILEBUF *f, const LAYOUT *l) {
+	const size_t start = f->size;
+	if (l->mdat64) {
+		put32 (f, 1);
+		put (f, "mdat", 4);
+		put64 (f, 0);
+	} else {
+		box_begin (f, "mdat");
+	}
+	fill (f, 0xee, l->gap);
+	const uint64_t first = f->size;
+	for (size_t i = 0; i < l->frames; i++) {
+		for (size_t j = 0; j < frame_size (l, i); j++) {
+			put8 (f, frame_byte (i, j));
+		}
+	}
+	if (l->mdat64) {
+		set32 (f, start + 8, (f->size - start) >> 32);
+		set32 (f, start + 12, f->size - start);
+	} else {
+		box_end (f);
+	}
+	if (f->chunk_offset) {
+		if (l->co64) {
+			set32 (f, f->chunk_offset, first >> 32);
+			set32 (f, f->chunk_offset + 4, first);
+		} else {
+			set32 (f, f->chunk_offset, first);
+		}
+	}
+}
+
+static FILEBUF build (const LAYOUT *l) {
+	FILEBUF f = { 0 };
+	box_begin (&f, "ftyp");
+	put (&f, "M4A ", 4); put32 (&f, 0); put (&f, "isomM4A mp42", 12);
+	box_end (&f);
+	box_skipped (&f, "free", 17);
+	if (l->fault == FAULT_SHORT_BOX) {
+		put32 (&f, 4);
+		put (&f, "junk", 4);
+	}
+	if (l->fault == FAULT_MDAT_FIRST) {
+		audio_data (&f, l);
+	}
+	box_begin (&f, "moov");
+	box_skipped (&f, "mvhd", 100);
+	track (&f, l, true);
+	if (l->second_track) {
+		track (&f, l, false);
+	}
+	/* A skipped box with a 64 bit size */
+	put32 (&f, 1);
+	put (&f, "udta", 4);
+	put64 (&f, 16 + 300);
+	fill (&f, 0x77, 300);
+	box_end (&f);
+	if (l->fault != FAULT_MDAT_FIRST) {
+		audio_data (&f, l);
+	}
+	/* Whatever follows the frames is dropped */
+	box_skipped (&f, "free", 19);
+	return f;
+}
+
+
+/* Feed a file in pieces; chunk is the piece size, or 0 for random sizes.
+   Each piece is a separate allocation, released once the demuxer is done
+   with it, so frames used beyond their input show up under a sanitizer. */
+static bool feed (const LAYOUT *l, const FILEBUF *file, size_t chunk) {
+	BarMp4_t mp4;
+	BarMp4Init (&mp4);
+	BarMp4Ret_t ret = BAR_MP4_RET_AGAIN;
+	size_t frames = 0;
+	bool ok = true;
+
+	for (size_t done = 0; done < file->size && ok && ret != BAR_MP4_RET_ERR; ) {
+		size_t size = chunk ? chunk : 1 + (size_t) rand () % CHECK_CHUNK_MAX;
+		if (size > file->size - done) {
+			size = file->size - done;
+		}
+		unsigned char *piece = malloc (size);
+		if (!piece) {
+			perror ("malloc");
+			exit (1);
+		}
+		memcpy (piece, file->data + done, size);
+		done += size;
+
+		if (ret == BAR_MP4_RET_AGAIN) {
+			if ((ret = BarMp4ParseHeader (&mp4, piece, size)) != BAR_MP4_RET_OK) {
+				free (piece);
+				continue;
+			}
+		} else {
+			BarMp4Input (&mp4, piece, size);
+		}
+
+		const unsigned char *frame;
+		size_t frame_length;
+		while (ok && (frame = BarMp4NextFrame (&mp4, &frame_length))) {
+			if (frames >= l->frames) {
+				fprintf (stderr, "%s, chunk %zu: more than %zu frames\n", l->name, chunk, l->frames);
+				ok = false;
+				break;
+			}
+			if (frame_length != frame_size (l, frames)) {
+				fprintf (stderr, "%s, chunk %zu: frame %zu has %zu bytes, expected %zu\n",
+						 l->name, chunk, frames, frame_length, frame_size (l, frames));
+				ok = false;
+				break;
+			}
+			for (size_t j = 0; j < frame_length; j++) {
+				if (frame [j] != frame_byte (frames, j)) {
+					fprintf (stderr, "%s, chunk %zu: frame %zu differs at byte %zu\n",
+							 l->name, chunk, frames, j);
+					ok = false;
+					break;
+				}
+			}
+			frames++;
+		}
+		free (piece);
+	}
+
+	if (l->fault != FAULT_NONE) {
+		if (ret != BAR_MP4_RET_ERR || !mp4.error || strcmp (mp4.error, l->error) != 0) {
+			fprintf (stderr, "%s, chunk %zu: expected \"%s\", got %s\n", l->name, chunk,
+					 l->error, ret == BAR_MP4_RET_ERR ? mp4.error : "no error");
+			ok = false;
+		}
+		BarMp4Destroy (&mp4);
+		return ok;
+	}
+
+	if (ok && ret != BAR_MP4_RET_OK) {
+		fprintf (stderr, "%s, chunk %zu: header not complete (%s)\n", l->name, chunk,
+				 mp4.error ? mp4.error : "no error");
+		ok = false;
+	}
+	if (ok && frames != l->frames) {
+		fprintf (stderr, "%s, chunk %zu: %zu frames, expected %zu\n", l->name, chunk, frames, l->frames);
+		ok = false;
+	}
+	if (ok && (mp4.configSize != sizeof (audio_config) ||
+			   memcmp (mp4.config, audio_config, sizeof (audio_config)) != 0)) {
+		fprintf (stderr, "%s, chunk %zu: wrong audio config\n", l->name, chunk);
+		ok = false;
+	}
+	const uint64_t duration = l->mdhd_version >= 0 ? mdhd_duration (l) : stts_duration (l);
+	if (ok && (mp4.timescale != CHECK_TIMESCALE || mp4.sttsDuration != stts_duration (l) ||
+			   BarMp4DurationMs (&mp4) != duration * 1000 / CHECK_TIMESCALE)) {
+		fprintf (stderr, "%s, chunk %zu: timescale %u, duration %lu ms, expected %lu ms\n",
+				 l->name, chunk, (unsigned) mp4.timescale, BarMp4DurationMs (&mp4),
+				 (unsigned long) (duration * 1000 / CHECK_TIMESCALE));
+		ok = false;
+	}
+	BarMp4Destroy (&mp4);
+	return ok;
+}
+
+int main (void) {
+	const size_t count = sizeof (layouts) / sizeof (*layouts);
+	size_t feeds = 0;
+	bool ok = true;
+	srand (1);
+
+	for (size_t i = 0; i < count; i++) {
+		const LAYOUT *l = &layouts [i];
+		FILEBUF file = build (l);
+		for (size_t chunk = 1; chunk <= CHECK_CHUNK_MAX && ok; chunk++) {
+			ok = feed (l, &file, chunk);
+			feeds++;
+		}
+		for (int round = 0; round < CHECK_RANDOM_ROUNDS && ok; round++) {
+			ok = feed (l, &file, 0);
+			feeds++;
+		}
+		if (ok) {
+			/* The whole file at once */
+			ok = feed (l, &file, file.size);
+			feeds++;
+		}
+		free (file.data);
+		if (!ok) {
+			fprintf (stderr, "mp4_check: %s failed\n", l->name);
+			return 1;
+		}
+	}
+	printf ("mp4_check: %zu layouts, %zu feeds, chunk sizes 1-%d and random\n",
+			count, feeds, CHECK_CHUNK_MAX);
+	return 0;
+}
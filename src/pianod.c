@@ -64,6 +64,8 @@
 #include "users.h"
 #include "query.h"
 #include "tuner.h"
+#include "rpc.h"
+#include "metrics.h"
 
 #if defined(USE_MBEDTLS)
 #include <mbedtls/ssl.h>
@@ -76,31 +78,86 @@ extern void capture_open_file(struct audioPlayer *player, PianoSong_t *song, cha
 
 static const char *progname = "pianod";
 
-/*	Fetch a new playlist from Pandora.
+/* A playlist request keeps its own copy of the station; the station list
+   may be replaced while the request is with the worker thread. */
+typedef struct playlist_request_t {
+	PianoRequestDataGetPlaylist_t data;
+	PianoStation_t station;
+} PLAYLIST_REQUEST;
+
+static void destroy_playlist_request (PLAYLIST_REQUEST *request) {
+	free (request->station.id);
+	free (request);
+}
+
+/*	Check whether a playlist request for the selected station is in progress.
+ */
+static bool playlist_request_pending (const APPSTATE *app) {
+	return (app->playlist_request && app->selected_station &&
+			strcmp (app->playlist_request->station.id, app->selected_station->id) == 0);
+}
+
+/*	Playlist retrieval has completed.  If the station was changed or playback
+ *	stopped meanwhile, the reply is stale and is discarded.
+ */
+static void get_play_list_complete (APPSTATE *app, PIANO_ASYNC *request, bool success) {
+	PLAYLIST_REQUEST *playlist_request = request->context;
+	PianoRequestDataGetPlaylist_t *reqData = &playlist_request->data;
+	bool current = (playlist_request == app->playlist_request);
+	if (current) {
+		app->playlist_request = NULL;
+	}
+	if (!current || !app->selected_station ||
+		strcmp (playlist_request->station.id, app->selected_station->id) != 0) {
+		flog (LOG_GENERAL, "Discarding playlist for a station no longer selected");
+		PianoDestroyPlaylist (reqData->retPlaylist);
+	} else if (!success) {
+		app->selected_station = NULL;
+		send_selectedstation (app->service, app);
+	} else if (reqData->retPlaylist == NULL) {
+		send_response_code (app->service, E_RESOURCE, "Unable to retrieve playlist");
+		app->selected_station = NULL;
+		send_selectedstation (app->service, app);
+	} else {
+		app->playlist = PianoListAppendP (app->playlist, reqData->retPlaylist);
+		send_status (app->service, "Retrieved new playlist");
+		app->playlist_retrieved = time (NULL);
+		/* Seeds and feedback are filled in once playback is going */
+		app->playlist_needs_info = true;
+	}
+	destroy_playlist_request (playlist_request);
+}
+
+/*	Fetch a new playlist from Pandora.  The request runs in the background;
+ *	the playlist is added when the reply arrives.
  */
 static void get_play_list (APPSTATE *app) {
 	assert (app->playlist == NULL);
+	assert (app->selected_station);
 
-	PianoRequestDataGetPlaylist_t reqData;
-	memset (&reqData, 0, sizeof (reqData));
-	reqData.station = app->selected_station;
-	reqData.quality = app->settings.audioQuality;
-
+	if (playlist_request_pending (app)) {
+		return;
+	}
+	/* A request for another station may still be in progress; it will be
+	   discarded when it completes. */
+	PLAYLIST_REQUEST *request = calloc (1, sizeof (*request));
+	if (!request || !(request->station.id = strdup (app->selected_station->id))) {
+		free (request);
+		send_response_code (app->service, E_FAILURE, strerror (errno));
+		return;
+	}
+	request->data.station = &request->station;
+	request->data.quality = app->settings.audioQuality;
 
 	flog (LOG_GENERAL, "Retrieving new playlist");
-	if (!piano_transaction (app, NULL, PIANO_REQUEST_GET_PLAYLIST, &reqData)) {
+	app->playlist_request = request;
+	if (!piano_transaction_async (app, PIANO_REQUEST_GET_PLAYLIST, &request->data,
+								  get_play_list_complete, request)) {
+		/* The completion isn't called when submission fails */
+		app->playlist_request = NULL;
+		destroy_playlist_request (request);
 		app->selected_station = NULL;
 		send_selectedstation (app->service, app);
-	} else {
-		app->playlist = reqData.retPlaylist;
-		if (app->playlist == NULL) {
-			send_response_code (app->service, E_RESOURCE, "Unable to retrieve playlist");
-			app->selected_station = NULL;
-			send_selectedstation (app->service, app);
-		} else {
-			send_status (app->service, "Retrieved new playlist");
-			app->playlist_retrieved = time (NULL);
-		}
 	}
 }
 
@@ -117,8 +174,17 @@ static void playback_start (APPSTATE *app, pthread_t *playerThread) {
 	app->playlist = PianoListNextP (app->playlist);
 	app->current_song->head.next = NULL;
 
+	/* Use the prefetched beginning, if it's for this song */
+	struct audioPrefetch *prefetch = app->prefetch;
+	app->prefetch = NULL;
+	if (prefetch && !BarPlayerPrefetchMatches (prefetch, app->current_song->audioUrl)) {
+		BarPlayerPrefetchRelease (prefetch);
+		prefetch = NULL;
+	}
+
 	/* Now play it */
 	if (app->current_song->audioUrl == NULL) {
+		BarPlayerPrefetchRelease (prefetch);
 		send_response_code (app->service, E_FAILURE, "Invalid song url.");
 		PianoDestroyPlaylist (app->current_song);
 		app->current_song = NULL;
@@ -138,6 +204,8 @@ static void playback_start (APPSTATE *app, pthread_t *playerThread) {
 			}
 		}
 
+		app->player.prefetch = prefetch;
+		app->player.output = app->output;
 		app->player.gain = app->current_song->fileGain;
 		app->player.scale = BarPlayerCalcScale (app->player.gain + app->settings.volume);
 		app->player.audioFormat = app->current_song->audioFormat;
@@ -185,6 +253,79 @@ static void playback_start (APPSTATE *app, pthread_t *playerThread) {
 	}
 }
 
+/* Bandwidth adaptation.  Quality drops a step right away when a track
+   stalls, starts slowly, or the throughput estimate leaves too little
+   headroom for the current bitrate.  Raising it takes several tracks in a
+   row with ample headroom for the next bitrate, so quality doesn't flap. */
+#define BANDWIDTH_MIN_BYTES (128 * 1024) /* Smaller samples are too noisy */
+#define BANDWIDTH_RISE_WEIGHT (0.3) /* Weight of a sample above the estimate */
+#define BANDWIDTH_FALL_WEIGHT (0.7) /* Weight of a sample below it */
+#define BANDWIDTH_KEEP_MARGIN (1.5) /* Throughput needed to keep a bitrate */
+#define BANDWIDTH_RAISE_MARGIN (3.0) /* Throughput needed to raise it */
+#define BANDWIDTH_RAISE_VOTES (3) /* Consecutive tracks needed to raise it */
+#define BANDWIDTH_SLOW_STARTUP_MS (5000)
+
+/* Nominal bitrate of an audio quality, in kbit/s */
+static double quality_bitrate (PianoAudioQuality_t quality) {
+	switch (quality) {
+		case PIANO_AQ_LOW:
+			return 32;
+		case PIANO_AQ_HIGH:
+			return 192;
+		default:
+			return 64;
+	}
+}
+
+/*	Update the throughput estimate with the current track, and choose the
+ *	quality for the next playlist.  Done once per track: just before the
+ *	next playlist is requested, or when the track ends if none was.  Stalls
+ *	after that count toward the next track.
+ */
+static void adapt_audio_quality (APPSTATE *app) {
+	BANDWIDTH *bw = &app->bandwidth;
+	bw->track_adapted = true;
+	bw->startup_ms = app->player.startupTime / 1000;
+	/* The player thread may still be downloading */
+	size_t bytes = __atomic_load_n (&app->player.networkBytes, __ATOMIC_RELAXED);
+	uint64_t elapsed = __atomic_load_n (&app->player.networkTime, __ATOMIC_RELAXED);
+	if (bytes >= BANDWIDTH_MIN_BYTES && elapsed > 0) {
+		double sample = bytes * 8000.0 / elapsed;
+		double weight = (sample < bw->estimate) ? BANDWIDTH_FALL_WEIGHT : BANDWIDTH_RISE_WEIGHT;
+		bw->estimate = (bw->tracks == 0) ? sample :
+					   bw->estimate + weight * (sample - bw->estimate);
+		bw->tracks++;
+	}
+	unsigned int stalls = bw->track_stalls;
+	bw->track_stalls = 0;
+	if (!app->settings.adaptive_quality) {
+		return;
+	}
+
+	PianoAudioQuality_t quality = app->settings.audioQuality;
+	bool measured = (bw->tracks > 0);
+	if (stalls > 0 || bw->startup_ms > BANDWIDTH_SLOW_STARTUP_MS ||
+		(measured && bw->estimate < BANDWIDTH_KEEP_MARGIN * quality_bitrate (quality))) {
+		bw->upgrade_votes = 0;
+		if (quality > PIANO_AQ_LOW) {
+			quality = (PianoAudioQuality_t) (quality - 1);
+		}
+	} else if (measured && quality < PIANO_AQ_HIGH &&
+			   bw->estimate >= BANDWIDTH_RAISE_MARGIN * quality_bitrate ((PianoAudioQuality_t) (quality + 1))) {
+		if (++bw->upgrade_votes >= BANDWIDTH_RAISE_VOTES) {
+			bw->upgrade_votes = 0;
+			quality = (PianoAudioQuality_t) (quality + 1);
+		}
+	} else {
+		bw->upgrade_votes = 0;
+	}
+	if (quality != app->settings.audioQuality) {
+		flog (LOG_GENERAL, "Throughput %.0fkbps, %u stalls, startup %lums: audio quality now %s",
+			  bw->estimate, stalls, bw->startup_ms, PianoGetAudioQualityName (quality));
+		app->settings.audioQuality = quality;
+	}
+}
+
 /*	Player thread has completed, clean up.
  */
 static void playback_cleanup (APPSTATE *app, pthread_t *playerThread) {
@@ -223,6 +364,11 @@ static void playback_cleanup (APPSTATE *app, pthread_t *playerThread) {
 		flog (LOG_WARNING, "Playback stalled for %d seconds", (int) (time (NULL) - app->stall.since));
 	}
 
+	if (!app->bandwidth.track_adapted) {
+		adapt_audio_quality (app);
+	}
+	app->bandwidth.track_adapted = false;
+
 	free (app->player.id);
 	free (app->player.server);
 	free (app->player.device);
@@ -254,11 +400,14 @@ static bool run_service (APPSTATE *app) {
 		return false;
 	}
 	USER_CONTEXT *context = (USER_CONTEXT *)event->context;
+	const FB_EVENTTYPE type = event->type;
+	const uint64_t start = metrics_now ();
 
 	switch (event->type) {
 		case FB_EVENT_CONNECT:
 			/* Greet the connection, allocate any resources */
 			flog (LOG_EVENT, "%-5d: New connection", event->socket);
+			register_session (context, event->connection);
 			fb_fprintf (event->connection, "%03d Connected\n", S_OK);
 			reply (event, I_WELCOME);
 			fb_fprintf (event, "%03d %s: %d\n", I_VOLUME, Response (I_VOLUME), app->settings.volume);
@@ -274,8 +423,9 @@ static bool run_service (APPSTATE *app) {
 			if (context->user) {
 				announce_action (event, app, A_SIGNED_OUT, NULL);
 			}
+			abandon_query (context);
 			destroy_search_context ((USER_CONTEXT *) event->context);
-			context->user = NULL;
+			unregister_session (context);
 			recompute_stations (app);
 			flog (LOG_EVENT, "%-5d: Connection closed", event->socket);
 			break;
@@ -298,6 +448,9 @@ static bool run_service (APPSTATE *app) {
 			break;
 		case FB_EVENT_READABLE:
 			/* Handle input on user stream */
+			if (rpc_handle_event (app, event)) {
+				break;
+			}
 			flog (LOG_EVENT, "%-5d: Stream has input ready", event->socket);
 			assert (0);
 			break;
@@ -311,6 +464,7 @@ static bool run_service (APPSTATE *app) {
 			assert (0);
 			break;
 	}
+	metrics_since (&metric_event_loop, type, start);
 	return true;
 }
 
@@ -369,30 +523,45 @@ static void check_player_status (APPSTATE *app) {
 		event_occurred(app->service, EVENT_TRACK_STARTED, S_OK);
 		/* This seems like a good place to periodically persist the user data */
 		users_persist (app->settings.user_file);
+		persist_station_info (app->settings.station_info_file);
 	} else if (app->playback_state == PLAYING) {
 		signed long song_remaining = (signed long int) (app->player.songDuration -
 											   app->player.songPlayed) / BAR_PLAYER_MS_TO_S_FACTOR;
 		if (app->selected_station && song_remaining <= 5) {
 			purge_unselected_songs(app);
 		}
-		if (app->selected_station && app->playlist == NULL && !app->pianoparam_change_pending) {
+		if (app->selected_station && app->playlist == NULL && !playlist_request_pending (app) &&
+			!app->pianoparam_change_pending) {
 			/* Anticipate when we're within seconds of completing the playlist,
 			 and gather a new one just-in-time to minimize breaks in playback. */
 			/* Ugly: songDuration is unsigned _long_ int! Lets hope this won't overflow */
 			if (song_remaining < 15) { /* Less than 15 seconds of playback left */
+				/* Request the new playlist at the quality this track supports */
+				if (!app->bandwidth.track_adapted) {
+					adapt_audio_quality (app);
+				}
 				update_station_list(app);
 				/* If the current station still exists, use it. */
 				if (app->selected_station) {
 					get_play_list (app);
-					apply_station_info (app);
 				}
 			}
 		}
+		/* Fetch the start of the next song so it can follow without a gap. */
+		if (app->selected_station && app->playlist && app->playlist->audioUrl &&
+			!app->prefetch && app->player.songDuration > 0 &&
+			song_remaining <= BAR_PLAYER_PREFETCH_LEAD) {
+			app->prefetch = BarPlayerPrefetchStart (app->playlist->audioUrl, app->settings.proxy,
+													app->playlist->audioFormat);
+		}
 		/* Check for/announce/track stalls */
 		bool stalled = false;
 		if (app->stall.sample_time && song_remaining == app->stall.sample) {
-			/* There is a previous sample and it hasn't changed */
-			stalled = (now - app->stall.sample_time > 2);
+			/* There is a previous sample and it hasn't changed.  The output
+			   buffer may still be carrying us; it's a stall once that's empty. */
+			AUDIO_OUTPUT_STATS stats;
+			stalled = (now - app->stall.sample_time > 2) &&
+					  (!audio_output_stats (app->output, &stats) || stats.buffered_ms == 0);
 		} else {
 			/* Either there's no previous sample, or it's changing (we're not stalled) */
 			app->stall.sample_time = now;
@@ -401,6 +570,8 @@ static void check_player_status (APPSTATE *app) {
 		if (stalled && !app->stall.stalled) {
 			/* New stall detected. */
 			app->stall.since = app->stall.sample_time;
+			app->bandwidth.stalls++;
+			app->bandwidth.track_stalls++;
 		} else if (!stalled && app->stall.stalled) {
 			/* Playback has resumed. */
 			flog (LOG_WARNING, "Playback stalled for %d seconds", (int) (now - app->stall.since));
@@ -447,7 +618,7 @@ static void pianod_run_loop (APPSTATE *app) {
 		}
 
 		/* If requested, change the connection parameters between songs. */
-		if (app->player.mode == PLAYER_FREED && app->pianoparam_change_pending) {
+		if (app->player.mode == PLAYER_FREED && app->pianoparam_change_pending && rpc_pending() == 0) {
 			app->pianoparam_change_pending = false;
 			change_piano_settings (app);
 		}
@@ -483,8 +654,7 @@ static void pianod_run_loop (APPSTATE *app) {
 				/* what's next? */
 				purge_unselected_songs(app);
 				/* If we need a new playlist, get one */
-				bool new_list = (app->playlist == NULL);
-				if (new_list) {
+				if (app->playlist == NULL && !playlist_request_pending (app)) {
 					update_station_list(app);
 					/* If the current station still exists, use it. */
 					if (app->selected_station) {
@@ -515,14 +685,15 @@ static void pianod_run_loop (APPSTATE *app) {
 					playback_start (app, &playerThread);
 					send_song_info (app->service, app, app->current_song);
 					announce_station_ratings (app, NULL);
-					/* If we got a new list, fill in metadata now.  This would be better
-					   as part of get_play_list, but in the interests of responsiveness... */
-					if (new_list) {
-						apply_station_info (app);
-					}
 				}
 			}
 		}
+		/* If we got a new list, fill in metadata now.  This would be better
+		   as part of get_play_list, but in the interests of responsiveness... */
+		if (app->playlist_needs_info) {
+			app->playlist_needs_info = false;
+			apply_station_info (app);
+		}
 		/* If the playback thread is valid, do various monitoring/handling on it */
 		if (app->player.mode >= PLAYER_SAMPLESIZE_INITIALIZED &&
 			app->player.mode < PLAYER_FINISHED_PLAYBACK) {
@@ -579,7 +750,13 @@ static bool initialize_libraries (APPSTATE *app) {
 			app->waith.ca_certs = &app->settings.ca_certs;
 #endif
 			ao_initialize ();
-			return true;
+			if ((app->output = audio_output_create ())) {
+				audio_output_set_buffer (app->output, app->settings.audio_buffer);
+				return true;
+			}
+			ao_shutdown ();
+			WaitressFree (&app->waith);
+			PianoDestroy (&app->ph);
 		} else {
 			flog (LOG_ERROR, "initialize_libraries: PianoInit: %s", PianoErrorToStr (status));
 		}
@@ -613,6 +790,7 @@ static bool init_server (APPSTATE *app) {
     options.greeting_mode = FB_GREETING_ALLOW;
     options.context_size = sizeof (USER_CONTEXT);
     options.serve_directory = app->settings.client_location;
+    options.dynamic_content = metrics_http_content;
     options.name = "pianod";
 	if ((app->service = fb_create_service (&options))) {
 		return true;
@@ -626,7 +804,7 @@ static bool init_server (APPSTATE *app) {
 
 
 static void usage () {
-	fprintf (stderr, "Usage: %s [-v] [-n user] [-g groups]  [-p port] [-i startscript] [-u userfile] [-c clientdir]\n"
+	fprintf (stderr, "Usage: %s [-v] [-n user] [-g groups]  [-p port] [-i startscript] [-u userfile] [-x] [-c clientdir]\n"
 			 "  -v            : Display version and exit.\n"
 			 "  -n user       : the user pianod should change to when run as root\n"
 			 "  -g groups     : supplementary groups pianod should use when run as root\n"
@@ -637,6 +815,7 @@ static void usage () {
 			 "                  (default ~/.config/pianod/startscript)\n"
 			 "  -u userfile   : the location of the user/password file\n"
 			 "                  (default ~/.config/pianod/passwd)\n"
+			 "  -x            : write the user file as XML instead of binary\n"
 			 "  -c clientdir  : a directory with web client files be served\n"
 #if defined(USE_MBEDTLS)
 			 "  -C CAPath     : path to CA Root certificates directory\n"
@@ -668,7 +847,7 @@ int main (int argc, char **argv) {
 	settings_get_config_dir (PACKAGE, "startscript", startscriptname, sizeof (startscriptname));
 	settings_initialize (&app.settings);
 
-	while ((flag = getopt (argc, argv, "vn:g:p:P:s:c:C:i:SZ:z:u:m:")) > 0) {
+	while ((flag = getopt (argc, argv, "vn:g:p:P:s:c:C:i:SZ:z:u:xm:")) > 0) {
         int argval;
 		switch (flag) {
 			case 'S':
@@ -732,6 +911,10 @@ int main (int argc, char **argv) {
 			case 'u':
 				free (app.settings.user_file);
 				app.settings.user_file = strdup (optarg);
+				break;
+			case 'x':
+				app.settings.user_file_xml = true;
+				break;
 			case 'Z':
 				set_logging (strtol (optarg, NULL, 0));
 				break;
@@ -770,17 +953,26 @@ int main (int argc, char **argv) {
 	}
 	select_nobody_user (nobody, nobody_groups);
 	precreate_file (app.settings.user_file);
+	users_set_xml_format (app.settings.user_file_xml);
 	users_restore (app.settings.user_file);
+	if (app.settings.station_info_file) {
+		precreate_file (app.settings.station_info_file);
+		restore_station_info (app.settings.station_info_file);
+	}
 
 	if (initialize_libraries (&app)) {
 		/* If the server initialized, start up, otherwise give up. */
 		if (init_parser (&app)) {
 			if (init_server(&app)) {
+				if (!rpc_init ()) {
+					flog (LOG_WARNING, "Request worker unavailable; Pandora requests will block.");
+				}
 				FB_EVENT *config = fb_accept_file (app.service, startscript);
 				if (config) {
 					USER_CONTEXT *fakeuser = (USER_CONTEXT *)config->context;
 					assert (fakeuser);
-					fakeuser->user = get_startscript_user();
+					register_session (fakeuser, config->connection);
+					set_session_user (fakeuser, get_startscript_user());
 				} else {
 					/* Error already logged by football */
 				}
@@ -805,6 +997,7 @@ int main (int argc, char **argv) {
 #endif
 					pianod_run_loop (&app);
 				}
+				rpc_shutdown ();
 			}
 			fb_parser_destroy (app.parser);
 		}
@@ -813,13 +1006,19 @@ int main (int argc, char **argv) {
 			sc_close_service(app.shoutcast);
 #endif
 		users_persist (app.settings.user_file);
+		/* Queue before users_destroy, which waits for the writer to finish */
+		persist_station_info (app.settings.station_info_file);
 		users_destroy ();
 		destroy_station_info_cache ();
+		audio_output_destroy (app.output);
 		ao_shutdown ();
 		PianoDestroy (&app.ph);
 		PianoDestroyPlaylist (app.song_history);
 		PianoDestroyPlaylist (app.playlist);
+		BarPlayerPrefetchRelease (app.prefetch);
 		WaitressFree (&app.waith);
+		WaitressPoolFlush ();
+		WaitressResolverFlush ();
 #if defined(USE_MBEDTLS)
         if (app.settings.use_CAcerts) {
             mbedtls_x509_crt_free(&app.settings.ca_certs);
@@ -55,13 +55,28 @@ typedef struct stallinfo_t {
 	bool stalled;
 } STALLED;
 
+/* Download throughput, for choosing the audio quality */
+typedef struct bandwidth_t {
+	double estimate; /* kbit/s, moving average; 0 until measured */
+	int upgrade_votes; /* Consecutive tracks that would support better quality */
+	unsigned int track_stalls; /* Stalls during the current track */
+	unsigned int stalls; /* Since startup */
+	unsigned int tracks; /* Tracks measured */
+	unsigned long startup_ms; /* Last track's time to first audio */
+	bool track_adapted; /* Current track has been used for adaptation */
+} BANDWIDTH;
+
 typedef struct appstate_t {
 	PianoHandle_t ph;
 	WaitressHandle_t waith;
 	struct audioPlayer player;
+	AUDIO_OUTPUT *output; /* Shared by successive players */
 	BarSettings_t settings;
 	PianoSong_t *playlist;
 	time_t playlist_retrieved;
+	struct playlist_request_t *playlist_request; /* Playlist request in progress, if any */
+	bool playlist_needs_info; /* New playlist needs station info applied */
+	struct audioPrefetch *prefetch; /* Beginning of the next song on the playlist */
 	PianoSong_t *current_song;
 	PianoSong_t *song_history;
 	PianoStation_t *selected_station;
@@ -69,6 +84,7 @@ typedef struct appstate_t {
 	bool automatic_stations;
 	time_t paused_since;
 	STALLED stall;
+	BANDWIDTH bandwidth;
 	int player_soft_errors;
 #if defined(ENABLE_SHOUT)
 	sc_service *shoutcast;
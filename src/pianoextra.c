@@ -41,21 +41,6 @@ char * PianoGetAudioQualityName (PianoAudioQuality_t quality) {
 }
 
 
-/*	get station from list by name
- *	@param search here
- *	@param search for this
- *	@return the first station structure matching the given id
- */
-PianoStation_t *PianoFindStationByName (PianoStation_t *stations, const char *searchStation) {
-	assert (searchStation);
-	PianoListForeachP (stations) {
-		if (strcasecmp (stations->name, searchStation) == 0) {
-			return stations;
-		}
-	}
-	return NULL;
-}
-
 /*	get the quick mix station
  *	@param search here
  *	@return the quick mix station
@@ -14,7 +14,6 @@
 #define _PIANOEXTRA_H
 
 extern char * PianoGetAudioQualityName (PianoAudioQuality_t quality);
-extern PianoStation_t *PianoFindStationByName (PianoStation_t *stations, const char *searchStation);
 extern PianoStation_t *PianoFindQuickMixStation (PianoStation_t *stations);
 extern PianoSong_t *PianoFindSongById (PianoSong_t *songs, const char *searchSong);
 
@@ -35,23 +35,40 @@ THE SOFTWARE.
 #include <sys/stat.h>
 
 #include "player.h"
+#include "metrics.h"
+#include "replaygain.h"
 
 #define bigToHostEndian32(x) ntohl(x)
 
 #if defined(ENABLE_CAPTURE)
 void capture_open_file(struct audioPlayer *player, PianoSong_t *song, char *station_name);
 void capture_close_file(struct audioPlayer *player);
-void capture_write_stream(struct audioPlayer *player);
+void capture_write_stream(struct audioPlayer *player, const void *data, size_t size);
 #if defined(ENABLE_ID3)
 int ID3WriteTags(struct audioPlayer *player, PianoSong_t *song, char *station_name);
 #endif
 #endif
 
-/* pandora uses float values with 2 digits precision. Scale them by 100 to get
- * a "nice" integer */
-#define RG_SCALE_FACTOR 100.0
-
 #define PANDORA_MP3_BITRATE 192000
+#define PANDORA_AAC_BITRATE 64000
+/* room for the mp4 header in front of the audio data */
+#define PREFETCH_HEADER_SIZE (64*1024)
+
+struct audioPrefetch {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	bool doQuit; /* stop fetching; protected by mutex */
+	bool finished; /* fetch thread is done; protected by mutex */
+	bool abandoned; /* nobody wants the data; protected by mutex */
+
+	char *url;
+	unsigned char *buffer;
+	size_t size;
+	size_t filled;
+	size_t contentLength;
+	WaitressReturn_t wRet;
+	WaitressHandle_t waith;
+};
 
 /*	wait until the pause flag is cleared
  *	@param player structure
@@ -90,110 +107,118 @@ unsigned int BarPlayerCalcScale (const float applyGain) {
 	return powf(10.0, applyGain / 20.0) * RG_SCALE_FACTOR;
 }
 
-/*	apply replaygain to signed short value
- *	@param value
- *	@/ replaygain scale (calculated by computeReplayGainScale)
- *	@return scaled value
- */
-static inline signed short int applyReplayGain (const signed short int value,
-		const unsigned int scale) {
-	int tmpReplayBuf = value * scale;
-	/* avoid clipping */
-	if (tmpReplayBuf > SHRT_MAX*RG_SCALE_FACTOR) {
-		return SHRT_MAX;
-	} else if (tmpReplayBuf < SHRT_MIN*RG_SCALE_FACTOR) {
-		return SHRT_MIN;
-	} else {
-		return tmpReplayBuf / RG_SCALE_FACTOR;
-	}
-}
-
-/*	Refill player's buffer with dataSize of data
+/*	account for received data
  *	@param player structure
- *	@param new data
  *	@param data size
- *	@return 1 on success, 0 when buffer overflow occured
  */
-static inline int BarPlayerBufferFill (struct audioPlayer *player,
-		const char *data, const size_t dataSize) {
-	/* fill buffer */
-	if (player->bufferFilled + dataSize > BAR_PLAYER_BUFSIZE) {
-		BarUiMsg (player->settings, MSG_ERR, "Buffer overflow!\n");
-		return 0;
-	}
-	memcpy (player->buffer+player->bufferFilled, data, dataSize);
-	player->bufferFilled += dataSize;
-	player->bufferRead = 0;
+static inline void BarPlayerCountReceived (struct audioPlayer *player,
+		const size_t dataSize) {
+	/* range requests report only the remainder */
+	if (player->contentLength == 0) {
+		player->contentLength = player->bytesReceived +
+				player->waith.request.contentLength;
+	}
 	player->bytesReceived += dataSize;
-	return 1;
 }
 
-/*	move data beginning from read pointer to buffer beginning and
- *	overwrite data already read from buffer
+/*	record startup latency once the first samples reach the output
  *	@param player structure
- *	@return nothing at all
  */
-static inline void BarPlayerBufferMove (struct audioPlayer *player) {
-	/* move remaining bytes to buffer beginning */
-	memmove (player->buffer, player->buffer + player->bufferRead,
-			(player->bufferFilled - player->bufferRead));
-	player->bufferFilled -= player->bufferRead;
+static inline void BarPlayerCountStartup (struct audioPlayer *player) {
+	if (player->startTime) {
+		player->startupTime = metrics_now () - player->startTime;
+		metrics_record (&metric_player_startup, 0, player->startupTime);
+		player->startTime = 0;
+	}
 }
 
-/*	open audio output stream, passing output parameters to libao.
+/*	select output format for the decoded audio; the device stays open
+ *	across songs while format and destination are unchanged
  *	@param player data structure
- *	@return audio output device from libao (NULL on failure)
+ *	@return true on success
  */
-static ao_device *BarPlayerOpenAudioOut (struct audioPlayer *player) {
-	int audioOutDriver = -1;
+static bool BarPlayerConfigureAudioOut (struct audioPlayer *player) {
+	return audio_output_configure (player->output, player->samplerate,
+			player->channels, player->driver, player->device, player->id,
+			player->server);
+}
+
+#ifdef ENABLE_FAAD
 
-	/* Find driver, or use default if unspecified. */
-	audioOutDriver = player->driver ? ao_driver_id (player->driver)
-								    : ao_default_driver_id();
-	if (audioOutDriver < 0) {
+/*	set up the decoder and audio output once the mp4 header is complete
+ *	@param player structure
+ *	@return false on error
+ */
+static bool BarPlayerAACInit (struct audioPlayer *player) {
+	char err = NeAACDecInit2 (player->aacHandle, player->mp4.config,
+			player->mp4.configSize, &player->samplerate, &player->channels);
+	if (err != 0) {
 		BarUiMsg (player->settings, MSG_ERR,
-				  "audio driver '%s' not found\n",
-				  player->driver ? player->driver : "(default)");
-		return NULL;
+				"Error while initializing audio decoder (%i)\n", err);
+		return false;
+	}
+	if (!BarPlayerConfigureAudioOut (player)) {
+		/* we're not interested in the errno */
+		player->aoError = 1;
+		BarUiMsg (player->settings, MSG_ERR, "Cannot open audio device\n");
+		return false;
 	}
 
-	/* Audio format structure for libao */
-	ao_sample_format format;
-	memset (&format, 0, sizeof (format));
-	format.bits = 16;
-	format.channels = player->channels;
-	format.rate = player->samplerate;
-	format.byte_format = AO_FMT_NATIVE;
-
-	/* Create a list of ao_options */
-	ao_option *options = NULL;
-	ao_append_option(&options, "client_name", PACKAGE);
-	if (player->device) {
-		ao_append_option (&options, "dev", player->device);
+	/* prefer the mp4 header, else guess from the frame count */
+	player->songDuration = BarMp4DurationMs (&player->mp4);
+	if (player->songDuration == 0 && player->samplerate != 0) {
+		/* assuming 2048 samples per channel and frame (HE-AAC) */
+		player->songDuration = (unsigned long long int) player->mp4.sampleSizeN *
+				4096LL * (unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR /
+				(unsigned long long int) player->samplerate /
+				(unsigned long long int) (player->channels ? player->channels : 1);
 	}
-	if (player->id) {
-		ao_append_option (&options, "id", player->id);
+	player->mode = PLAYER_RECV_DATA;
+	return true;
+}
+
+/*	decode one aac frame and play it
+ *	@param player structure
+ *	@param frame
+ *	@param frame size
+ *	@return false on error
+ */
+static bool BarPlayerAACDecodeFrame (struct audioPlayer *player,
+		const unsigned char *frame, const size_t frameSize) {
+	NeAACDecFrameInfo frameInfo;
+	short int *aacDecoded;
+
+	aacDecoded = NeAACDecDecode(player->aacHandle, &frameInfo,
+			(unsigned char *) frame, frameSize);
+
+	if (frameInfo.error != 0) {
+		/* skip this frame, songPlayed will be slightly off if this
+		 * happens */
+		BarUiMsg (player->settings, MSG_ERR, "Decoding error: %s\n",
+				NeAACDecGetErrorMessage (frameInfo.error));
+		return true;
 	}
-	if (player->server) {
-		ao_append_option (&options, "server", player->server);
+	/* assuming data in stsz atom is correct */
+	assert (frameInfo.bytesconsumed == frameSize);
+
+	BarPlayerApplyReplayGain (aacDecoded, frameInfo.samples, player->scale);
+	/* output needs bytes: 1 sample = 16 bits = 2 bytes */
+	if (!audio_output_play (player->output, aacDecoded,
+			frameInfo.samples * 2)) {
+		player->aoError = 1;
+		return false;
 	}
-
-	ao_device *dev = ao_open_live (audioOutDriver, &format, options);
-	if (dev == NULL) {
-		BarUiMsg (player->settings, MSG_ERR,
-				  "Cannot open audio device %s/%s/%s, trying default\n",
-				  player->device ? player->device : "default",
-				  player->id ? player->id : "default",
-				  player->server ? player->server : "default");
-		dev = ao_open_live (audioOutDriver, &format, NULL);
-	}
-	ao_free_options (options);
-	return dev;
+	BarPlayerCountStartup (player);
+	/* add played frame length to played time, explained below */
+	player->songPlayed += (unsigned long long int) frameInfo.samples *
+			(unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR /
+			(unsigned long long int) player->samplerate /
+			(unsigned long long int) (player->channels ? player->channels : 1);
+	return true;
 }
 
-#ifdef ENABLE_FAAD
-
-/*	play aac stream
+/*	play aac stream; frames are decoded straight from the received data,
+ *	only a frame split across callbacks is copied
  *	@param streamed data
  *	@param received bytes
  *	@param extra data (player data)
@@ -201,185 +226,52 @@ static ao_device *BarPlayerOpenAudioOut (struct audioPlayer *player) {
  */
 static WaitressCbReturn_t BarPlayerAACCb (void *ptr, size_t size,
 		void *stream) {
-	const char *data = ptr;
+	const unsigned char *data = ptr;
 	struct audioPlayer *player = stream;
+	const unsigned char *frame;
+	size_t frameSize;
 
-	if (BarPlayerCheckPauseQuit (player) ||
-			!BarPlayerBufferFill (player, data, size)) {
+	if (BarPlayerCheckPauseQuit (player)) {
 		return WAITRESS_CB_RET_ERR;
 	}
+	BarPlayerCountReceived (player, size);
 
-	if (player->mode == PLAYER_RECV_DATA) {
-		short int *aacDecoded;
-		NeAACDecFrameInfo frameInfo;
-		size_t i;
+#if defined(ENABLE_CAPTURE)
+	/* Dump received data to file */
+	capture_write_stream(player, data, size);
+#endif
 
-		while (player->sampleSizeCurr < player->sampleSizeN &&
-				(player->bufferFilled - player->bufferRead) >=
-			player->sampleSize[player->sampleSizeCurr]) {
-			/* going through this loop can take up to a few seconds =>
-			 * allow earlier thread abort */
-			if (BarPlayerCheckPauseQuit (player)) {
-				return WAITRESS_CB_RET_ERR;
-			}
+	if (player->mode != PLAYER_RECV_DATA) {
+		switch (BarMp4ParseHeader (&player->mp4, data, size)) {
+			case BAR_MP4_RET_AGAIN:
+				return WAITRESS_CB_RET_OK;
 
-			/* decode frame */
-			aacDecoded = NeAACDecDecode(player->aacHandle, &frameInfo,
-					&player->buffer[player->bufferRead],
-					player->sampleSize[player->sampleSizeCurr]);
-			player->bufferRead += player->sampleSize[player->sampleSizeCurr];
-			++player->sampleSizeCurr;
-
-			if (frameInfo.error != 0) {
-				/* skip this frame, songPlayed will be slightly off if this
-				 * happens */
-				BarUiMsg (player->settings, MSG_ERR, "Decoding error: %s\n",
-						NeAACDecGetErrorMessage (frameInfo.error));
-				continue;
-			}
-			/* assuming data in stsz atom is correct */
-			assert (frameInfo.bytesconsumed ==
-					player->sampleSize[player->sampleSizeCurr-1]);
+			case BAR_MP4_RET_ERR:
+				BarUiMsg (player->settings, MSG_ERR, "%s\n",
+						player->mp4.error);
+				return WAITRESS_CB_RET_ERR;
 
-			for (i = 0; i < frameInfo.samples; i++) {
-				aacDecoded[i] = applyReplayGain (aacDecoded[i], player->scale);
-			}
-			/* ao_play needs bytes: 1 sample = 16 bits = 2 bytes */
-			ao_play (player->audioOutDevice, (char *) aacDecoded,
-					frameInfo.samples * 2);
-			/* add played frame length to played time, explained below */
-			player->songPlayed += (unsigned long long int) frameInfo.samples *
-					(unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR /
-					(unsigned long long int) player->samplerate /
-					(unsigned long long int) (player->channels ? player->channels : 1);
-		}
-		if (player->sampleSizeCurr >= player->sampleSizeN) {
-			/* no more frames, drop data */
-			player->bufferRead = player->bufferFilled;
-		}
-	} else {
-		if (player->mode == PLAYER_INITIALIZED) {
-			while (player->bufferRead+4 < player->bufferFilled) {
-				if (memcmp (player->buffer + player->bufferRead, "esds",
-						4) == 0) {
-					player->mode = PLAYER_FOUND_ESDS;
-					player->bufferRead += 4;
-					break;
-				}
-				player->bufferRead++;
-			}
-		}
-		if (player->mode == PLAYER_FOUND_ESDS) {
-			/* FIXME: is this the correct way? */
-			/* we're gonna read 10 bytes */
-			while (player->bufferRead+1+4+5 < player->bufferFilled) {
-				if (memcmp (player->buffer + player->bufferRead,
-						"\x05\x80\x80\x80", 4) == 0) {
-					/* +1+4 needs to be replaced by <something>! */
-					player->bufferRead += 1+4;
-					char err = NeAACDecInit2 (player->aacHandle, player->buffer +
-							player->bufferRead, 5, &player->samplerate,
-							&player->channels);
-					player->bufferRead += 5;
-					if (err != 0) {
-						BarUiMsg (player->settings, MSG_ERR,
-								"Error while initializing audio decoder "
-								"(%i)\n", err);
-						return WAITRESS_CB_RET_ERR;
-					}
-
-					if ((player->audioOutDevice = BarPlayerOpenAudioOut (player)) == NULL) {
-						/* we're not interested in the errno */
-						player->aoError = 1;
-						BarUiMsg (player->settings, MSG_ERR,
-								"Cannot open audio device\n");
-						return WAITRESS_CB_RET_ERR;
-					}
-					player->mode = PLAYER_AUDIO_INITIALIZED;
-					break;
-				}
-				player->bufferRead++;
-			}
-		}
-		if (player->mode == PLAYER_AUDIO_INITIALIZED) {
-			while (player->bufferRead+4+8 < player->bufferFilled) {
-				if (memcmp (player->buffer + player->bufferRead, "stsz",
-						4) == 0) {
-					player->mode = PLAYER_FOUND_STSZ;
-					player->bufferRead += 4;
-					/* skip version and unknown */
-					player->bufferRead += 8;
-					break;
+			case BAR_MP4_RET_OK:
+				/* whatever follows the header was queued as input */
+				if (!BarPlayerAACInit (player)) {
+					return WAITRESS_CB_RET_ERR;
 				}
-				player->bufferRead++;
-			}
+				break;
 		}
-		/* get frame sizes */
-		if (player->mode == PLAYER_FOUND_STSZ) {
-			while (player->bufferRead+4 < player->bufferFilled) {
-				/* how many frames do we have? */
-				if (player->sampleSizeN == 0) {
-					/* mp4 uses big endian, convert */
-					memcpy (&player->sampleSizeN, player->buffer +
-							player->bufferRead, sizeof (uint32_t));
-					player->sampleSizeN =
-							bigToHostEndian32 (player->sampleSizeN);
-
-					player->sampleSize = malloc (player->sampleSizeN *
-							sizeof (*player->sampleSize));
-					assert (player->sampleSize != NULL);
-					player->bufferRead += sizeof (uint32_t);
-					player->sampleSizeCurr = 0;
-					/* set up song duration (assuming one frame always contains
-					 * the same number of samples)
-					 * calculation: channels * number of frames * samples per
-					 * frame / samplerate */
-					/* FIXME: Hard-coded number of samples per frame */
-					player->songDuration = (unsigned long long int) player->sampleSizeN *
-							4096LL * (unsigned long long int) BAR_PLAYER_MS_TO_S_FACTOR /
-							(unsigned long long int) player->samplerate /
-							(unsigned long long int) (player->channels ? player->channels : 1);
-					break;
-				} else {
-					memcpy (&player->sampleSize[player->sampleSizeCurr],
-							player->buffer + player->bufferRead,
-							sizeof (uint32_t));
-					player->sampleSize[player->sampleSizeCurr] =
-							bigToHostEndian32 (
-							player->sampleSize[player->sampleSizeCurr]);
-
-					player->sampleSizeCurr++;
-					player->bufferRead += sizeof (uint32_t);
-				}
-				/* all sizes read, nearly ready for data mode */
-				if (player->sampleSizeCurr >= player->sampleSizeN) {
-					player->mode = PLAYER_SAMPLESIZE_INITIALIZED;
-					break;
-				}
-			}
+	} else {
+		BarMp4Input (&player->mp4, data, size);
+	}
+
+	while ((frame = BarMp4NextFrame (&player->mp4, &frameSize)) != NULL) {
+		/* going through this loop can take up to a few seconds =>
+		 * allow earlier thread abort */
+		if (BarPlayerCheckPauseQuit (player)) {
+			return WAITRESS_CB_RET_ERR;
 		}
-		/* search for data atom and let the show begin... */
-		if (player->mode == PLAYER_SAMPLESIZE_INITIALIZED) {
-			while (player->bufferRead+4 < player->bufferFilled) {
-				if (memcmp (player->buffer + player->bufferRead, "mdat",
-						4) == 0) {
-					player->mode = PLAYER_RECV_DATA;
-					player->sampleSizeCurr = 0;
-					player->bufferRead += 4;
-					break;
-				}
-				player->bufferRead++;
-			}
+		if (!BarPlayerAACDecodeFrame (player, frame, frameSize)) {
+			return WAITRESS_CB_RET_ERR;
 		}
 	}
-
-#if defined(ENABLE_CAPTURE)
-	/* Dump decoded data to file */
-	capture_write_stream(player);
-#endif
-
-	BarPlayerBufferMove (player);
-
 	return WAITRESS_CB_RET_OK;
 }
 
@@ -392,7 +284,6 @@ static WaitressCbReturn_t BarPlayerAACCb (void *ptr, size_t size,
 static WaitressCbReturn_t BarPlayerMp3Cb (void *ptr, size_t size, void *stream) {
 	const char *data = ptr;
 	struct audioPlayer *player = stream;
-	size_t i;
 	off_t frame_offset;
 	int encoding, channels;\
 	long rate;
@@ -407,12 +298,13 @@ static WaitressCbReturn_t BarPlayerMp3Cb (void *ptr, size_t size, void *stream)
     size_t mp3_frame_size;
 #endif
 
-	if (BarPlayerCheckPauseQuit (player) ||
-			!BarPlayerBufferFill (player, data, size)) {
+	if (BarPlayerCheckPauseQuit (player)) {
 		return WAITRESS_CB_RET_ERR;
 	}
+	BarPlayerCountReceived (player, size);
 
-	mpg123_feed(player->mh, player->buffer, player->bufferFilled);
+	/* mpg123 keeps its own copy, no need to buffer anything here */
+	mpg123_feed(player->mh, (const unsigned char *) data, size);
 	do {
         ftype = mpg123_framebyframe_next(player->mh);
 		switch (ftype) {
@@ -422,14 +314,14 @@ static WaitressCbReturn_t BarPlayerMp3Cb (void *ptr, size_t size, void *stream)
 			player->channels = (unsigned char)channels;
 
 			if (player->mode < PLAYER_AUDIO_INITIALIZED) {
-				if ((player->audioOutDevice = BarPlayerOpenAudioOut (player)) == NULL) {
+				if (!BarPlayerConfigureAudioOut (player)) {
 					player->aoError = 1;
 					BarUiMsg (player->settings, MSG_ERR, "Cannot open audio device\n");
 					return WAITRESS_CB_RET_ERR;
 				}
 
 				/* calc song length from contentLength (assuming bitrate) */
-				player->songDuration = (unsigned long long int) player->waith.request.contentLength /
+				player->songDuration = (unsigned long long int) player->contentLength /
 						(PANDORA_MP3_BITRATE / BAR_PLAYER_MS_TO_S_FACTOR / 8LL);
 
 				/* must be > PLAYER_SAMPLESIZE_INITIALIZED, otherwise time won't
@@ -465,10 +357,12 @@ static WaitressCbReturn_t BarPlayerMp3Cb (void *ptr, size_t size, void *stream)
             // Decoder can return 0 bytes if no frame found
             if (frame_size > 0) {
                 /* samples * length * channels */
-                for (i = 0; i < (frame_size / sizeof(short)); i++) {
-                    player->mp3Audio[i] = applyReplayGain(player->mp3Audio[i], player->scale);
+                BarPlayerApplyReplayGain ((int16_t *) player->mp3Audio, frame_size / sizeof (short), player->scale);
+                if (!audio_output_play (player->output, player->mp3Audio, frame_size)) {
+                    player->aoError = 1;
+                    return WAITRESS_CB_RET_ERR;
                 }
-                ao_play(player->audioOutDevice, (char *)player->mp3Audio, frame_size);
+                BarPlayerCountStartup (player);
             }
 			break;
 
@@ -491,25 +385,211 @@ static WaitressCbReturn_t BarPlayerMp3Cb (void *ptr, size_t size, void *stream)
 		}
 	} while ((ftype != MPG123_NEED_MORE) && (ftype != MPG123_DONE));
 
-	// MPG123 consumes entire buffer
-	player->bufferRead = player->bufferFilled;
 #if defined(ENABLE_SHOUT)
 	// send raw mp3 data to icecast server
 	if (player->shoutcast) {
-		sdata = sc_buffer_get(player->bufferRead);
+		sdata = sc_buffer_get(size);
 		if (sdata) {
-			memcpy(&sdata->buf[0], player->buffer, player->bufferRead);
+			memcpy(&sdata->buf[0], data, size);
 			sc_queue_add(player->shoutcast, sdata, SCDATA);
 		}
 	}
 #endif
 
-	player->bufferFilled = 0;
-
 	return WAITRESS_CB_RET_OK;
 }
 #endif /* ENABLE_MPG123 */
 
+/*	destroy prefetch data
+ */
+static void BarPlayerPrefetchDestroy (struct audioPrefetch *prefetch) {
+	WaitressFree (&prefetch->waith);
+	pthread_cond_destroy (&prefetch->cond);
+	pthread_mutex_destroy (&prefetch->mutex);
+	free (prefetch->buffer);
+	free (prefetch->url);
+	free (prefetch);
+}
+
+/*	collect the beginning of the audio file
+ */
+static WaitressCbReturn_t BarPlayerPrefetchCb (void *ptr, size_t size,
+		void *data) {
+	struct audioPrefetch *prefetch = data;
+	bool quit;
+
+	pthread_mutex_lock (&prefetch->mutex);
+	quit = prefetch->doQuit;
+	pthread_mutex_unlock (&prefetch->mutex);
+	if (quit) {
+		return WAITRESS_CB_RET_ERR;
+	}
+
+	if (prefetch->contentLength == 0) {
+		prefetch->contentLength = prefetch->waith.request.contentLength;
+	}
+	if (size > prefetch->size - prefetch->filled) {
+		size = prefetch->size - prefetch->filled;
+	}
+	memcpy (prefetch->buffer + prefetch->filled, ptr, size);
+	prefetch->filled += size;
+
+	/* enough; the player requests the rest */
+	return prefetch->filled < prefetch->size ? WAITRESS_CB_RET_OK :
+			WAITRESS_CB_RET_ERR;
+}
+
+/*	prefetch thread
+ */
+static void *BarPlayerPrefetchThread (void *data) {
+	struct audioPrefetch *prefetch = data;
+	bool abandoned;
+
+	prefetch->wRet = WaitressFetchCall (&prefetch->waith);
+
+	pthread_mutex_lock (&prefetch->mutex);
+	prefetch->finished = true;
+	abandoned = prefetch->abandoned;
+	pthread_cond_broadcast (&prefetch->cond);
+	pthread_mutex_unlock (&prefetch->mutex);
+
+	if (abandoned) {
+		BarPlayerPrefetchDestroy (prefetch);
+	}
+	return NULL;
+}
+
+/*	start fetching the beginning of a song in the background
+ *	@param audio url
+ *	@param proxy or NULL
+ *	@param audio format, determines how much to fetch
+ *	@return prefetch handle or NULL on failure
+ */
+struct audioPrefetch *BarPlayerPrefetchStart (const char *url,
+		const char *proxy, PianoAudioFormat_t format) {
+	struct audioPrefetch *prefetch;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int err;
+
+	assert (url != NULL);
+
+	if ((prefetch = calloc (1, sizeof (*prefetch))) == NULL) {
+		return NULL;
+	}
+	prefetch->size = PREFETCH_HEADER_SIZE + BAR_PLAYER_PREFETCH_SECONDS *
+			(format == PIANO_AF_AACPLUS ? PANDORA_AAC_BITRATE :
+			PANDORA_MP3_BITRATE) / 8;
+	if ((prefetch->buffer = malloc (prefetch->size)) == NULL ||
+			(prefetch->url = strdup (url)) == NULL) {
+		free (prefetch->buffer);
+		free (prefetch);
+		return NULL;
+	}
+	pthread_mutex_init (&prefetch->mutex, NULL);
+	pthread_cond_init (&prefetch->cond, NULL);
+
+	WaitressInit (&prefetch->waith);
+	WaitressSetUrl (&prefetch->waith, url);
+	if (proxy != NULL) {
+		WaitressSetProxy (&prefetch->waith, proxy);
+	}
+	prefetch->waith.data = prefetch;
+	prefetch->waith.callback = BarPlayerPrefetchCb;
+
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+	err = pthread_create (&thread, &attr, BarPlayerPrefetchThread, prefetch);
+	pthread_attr_destroy (&attr);
+	if (err != 0) {
+		flog (LOG_ERROR, "BarPlayerPrefetchStart: pthread_create: %s",
+				strerror (err));
+		BarPlayerPrefetchDestroy (prefetch);
+		return NULL;
+	}
+	return prefetch;
+}
+
+/*	check if prefetched data belongs to url
+ */
+bool BarPlayerPrefetchMatches (const struct audioPrefetch *prefetch,
+		const char *url) {
+	assert (prefetch != NULL);
+
+	return url != NULL && strcmp (prefetch->url, url) == 0;
+}
+
+/*	give up prefetched data. The fetch is stopped and the data freed once
+ *	the thread finishes.
+ */
+void BarPlayerPrefetchRelease (struct audioPrefetch *prefetch) {
+	bool finished;
+
+	if (prefetch == NULL) {
+		return;
+	}
+	pthread_mutex_lock (&prefetch->mutex);
+	prefetch->doQuit = true;
+	prefetch->abandoned = true;
+	finished = prefetch->finished;
+	pthread_mutex_unlock (&prefetch->mutex);
+
+	if (finished) {
+		BarPlayerPrefetchDestroy (prefetch);
+	}
+}
+
+/*	play audio fetched ahead of time. Stops the fetch if it is still running
+ *	and passes whatever arrived to the decoder.
+ *	@param player structure
+ *	@return false if the decoder aborted
+ */
+static bool BarPlayerPlayPrefetched (struct audioPlayer *player) {
+	struct audioPrefetch *prefetch = player->prefetch;
+
+	pthread_mutex_lock (&prefetch->mutex);
+	prefetch->doQuit = true;
+	while (!prefetch->finished) {
+		pthread_cond_wait (&prefetch->cond, &prefetch->mutex);
+	}
+	pthread_mutex_unlock (&prefetch->mutex);
+
+	if (prefetch->filled == 0) {
+		return true;
+	}
+	player->contentLength = prefetch->contentLength;
+	for (size_t pos = 0; pos < prefetch->filled; pos += WAITRESS_BUFFER_SIZE) {
+		size_t chunk = prefetch->filled - pos;
+		if (chunk > WAITRESS_BUFFER_SIZE) {
+			chunk = WAITRESS_BUFFER_SIZE;
+		}
+		if (player->waith.callback (prefetch->buffer + pos, chunk, player) ==
+				WAITRESS_CB_RET_ERR) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*	waitress callback wrapper that measures download throughput: time
+ *	between callbacks is time spent waiting for the network
+ *	@param received data
+ *	@param data size
+ *	@param player structure
+ */
+static WaitressCbReturn_t BarPlayerTimedCb (void *ptr, size_t size,
+		void *data) {
+	struct audioPlayer *player = data;
+
+	/* Read by the main thread while the song is still playing */
+	__atomic_add_fetch (&player->networkTime, metrics_now () - player->networkSince,
+			__ATOMIC_RELAXED);
+	__atomic_add_fetch (&player->networkBytes, size, __ATOMIC_RELAXED);
+	const WaitressCbReturn_t ret = player->decodeCallback (ptr, size, data);
+	player->networkSince = metrics_now ();
+	return ret;
+}
+
 /*	player thread; for every song a new thread is started
  *	@param audioPlayer structure
  *	@return PLAYER_RET_*
@@ -523,15 +603,16 @@ void *BarPlayerThread (void *data) {
 	#endif
 	WaitressReturn_t wRet = WAITRESS_RET_ERR;
 
+	player->startTime = metrics_now ();
 	/* init handles */
 	player->waith.data = (void *) player;
 	/* extraHeaders will be initialized later */
 	player->waith.extraHeaders = extraHeaders;
-	player->buffer = malloc (BAR_PLAYER_BUFSIZE);
 
 	switch (player->audioFormat) {
 		#ifdef ENABLE_FAAD
 		case PIANO_AF_AACPLUS:
+			BarMp4Init (&player->mp4);
 			player->aacHandle = NeAACDecOpen();
 			/* set aac conf */
 			conf = NeAACDecGetCurrentConfiguration(player->aacHandle);
@@ -562,20 +643,33 @@ void *BarPlayerThread (void *data) {
 
 	player->mode = PLAYER_INITIALIZED;
 
-	/* This loop should work around song abortions by requesting the
-	 * missing part of the song */
-	do {
-		snprintf (extraHeaders, sizeof (extraHeaders), "Range: bytes=%zu-\r\n",
-				player->bytesReceived);
-		wRet = WaitressFetchCall (&player->waith);
-	} while (wRet == WAITRESS_RET_PARTIAL_FILE || wRet == WAITRESS_RET_TIMEOUT
-			|| wRet == WAITRESS_RET_READ_ERR);
+	/* Start with what was fetched ahead of time; the range request
+	 * below picks up where it ended. */
+	if (player->prefetch != NULL && !BarPlayerPlayPrefetched (player)) {
+		wRet = WAITRESS_RET_CB_ABORT;
+	} else if (player->contentLength > 0 &&
+			player->bytesReceived >= player->contentLength) {
+		/* the whole file was prefetched */
+		wRet = WAITRESS_RET_OK;
+	} else {
+		player->decodeCallback = player->waith.callback;
+		player->waith.callback = BarPlayerTimedCb;
+		/* This loop should work around song abortions by requesting the
+		 * missing part of the song */
+		do {
+			snprintf (extraHeaders, sizeof (extraHeaders), "Range: bytes=%zu-\r\n",
+					player->bytesReceived);
+			player->networkSince = metrics_now ();
+			wRet = WaitressFetchCall (&player->waith);
+		} while (wRet == WAITRESS_RET_PARTIAL_FILE || wRet == WAITRESS_RET_TIMEOUT
+				|| wRet == WAITRESS_RET_READ_ERR);
+	}
 
 	switch (player->audioFormat) {
 		#ifdef ENABLE_FAAD
 		case PIANO_AF_AACPLUS:
 			NeAACDecClose(player->aacHandle);
-			free (player->sampleSize);
+			BarMp4Destroy (&player->mp4);
 			break;
 		#endif /* ENABLE_FAAD */
 
@@ -597,6 +691,7 @@ void *BarPlayerThread (void *data) {
 	/* Close stream capture */
 	capture_close_file(player);
 #endif
+	audio_output_finish (player->output);
 
 	if (player->aoError) {
 		ret = (void *) PLAYER_RET_HARDFAIL;
@@ -609,10 +704,10 @@ void *BarPlayerThread (void *data) {
 		ret = (void *) PLAYER_RET_SOFTFAIL;
 	}
 
-	ao_close(player->audioOutDevice);
 cleanup:
 	WaitressFree (&player->waith);
-	free (player->buffer);
+	BarPlayerPrefetchRelease (player->prefetch);
+	player->prefetch = NULL;
 
 	player->mode = PLAYER_FINISHED_PLAYBACK;
 
@@ -752,12 +847,10 @@ void capture_close_file(struct audioPlayer *player)
 	return;
 }
 
-void capture_write_stream(struct audioPlayer *player)
+void capture_write_stream(struct audioPlayer *player, const void *data, size_t size)
 {
 	if (player->capture_file) {
-		fwrite(player->buffer, sizeof(char),
-		       player->bufferRead,
-		       player->capture_file);
+		fwrite(data, sizeof(char), size, player->capture_file);
 	}
 }
 
@@ -28,6 +28,7 @@ THE SOFTWARE.
 
 #ifdef ENABLE_FAAD
 #include <neaacdec.h>
+#include "mp4.h"
 #endif
 
 #ifdef ENABLE_MPG123
@@ -48,9 +49,16 @@ THE SOFTWARE.
 #endif
 
 #include "settings.h"
+#include "audioout.h"
 
 #define BAR_PLAYER_MS_TO_S_FACTOR 1000
-#define BAR_PLAYER_BUFSIZE (WAITRESS_BUFFER_SIZE*2)
+/* seconds of audio fetched ahead of time for the next song */
+#define BAR_PLAYER_PREFETCH_SECONDS 10
+/* start prefetching when this many seconds of the current song remain */
+#define BAR_PLAYER_PREFETCH_LEAD 20
+
+/* beginning of the next song, fetched while the current one plays */
+struct audioPrefetch;
 
 struct audioPlayer {
 	bool doQuit; /* protected by pauseMutex */
@@ -62,9 +70,7 @@ struct audioPlayer {
 		PLAYER_FREED = 0, /* thread is not running */
 		PLAYER_STARTING, /* thread is starting */
 		PLAYER_INITIALIZED, /* decoder/waitress initialized */
-		PLAYER_FOUND_ESDS,
 		PLAYER_AUDIO_INITIALIZED, /* audio device opened */
-		PLAYER_FOUND_STSZ,
 		PLAYER_SAMPLESIZE_INITIALIZED,
 		PLAYER_RECV_DATA, /* playing track */
 		PLAYER_FINISHED_PLAYBACK
@@ -80,9 +86,25 @@ struct audioPlayer {
 
 	unsigned long samplerate;
 
-	size_t bufferFilled;
-	size_t bufferRead;
+	/* metrics_now() when the thread started; cleared at first output */
+	uint64_t startTime;
+	/* microseconds from thread start to first output, 0 if there was none */
+	uint64_t startupTime;
+
+	/* time spent waiting for the audio download and bytes it delivered,
+	 * for bandwidth estimation; decoding, output and pauses are excluded */
+	uint64_t networkTime;
+	uint64_t networkSince; /* metrics_now() when the last callback returned */
+	size_t networkBytes;
+	/* decoder callback, called by BarPlayerTimedCb */
+	WaitressCbReturn_t (*decodeCallback) (void *, size_t, void *);
+
 	size_t bytesReceived;
+	/* size of the whole audio file, 0 if unknown */
+	size_t contentLength;
+
+	/* audio fetched ahead of time; the player thread releases it */
+	struct audioPrefetch *prefetch;
 
 #if defined(ENABLE_CAPTURE)
 	/* Ripit */
@@ -96,10 +118,7 @@ struct audioPlayer {
 
 	/* aac */
 	#ifdef ENABLE_FAAD
-	/* stsz atom: sample sizes */
-	size_t sampleSizeN;
-	size_t sampleSizeCurr;
-	uint32_t *sampleSize;
+	BarMp4_t mp4;
 	NeAACDecHandle aacHandle;
 	#endif
 
@@ -109,12 +128,10 @@ struct audioPlayer {
 	short *mp3Audio;
 	#endif
 
-	/* audio out */
-	ao_device *audioOutDevice;
+	/* audio out, shared by all players */
+	AUDIO_OUTPUT *output;
 	const BarSettings_t *settings;
 
-	unsigned char *buffer;
-
 	pthread_mutex_t pauseMutex;
 	pthread_cond_t pauseCond;
 	WaitressHandle_t waith;
@@ -130,5 +147,9 @@ enum {PLAYER_RET_OK = 0, PLAYER_RET_HARDFAIL = 1, PLAYER_RET_SOFTFAIL = 2};
 
 void *BarPlayerThread (void *data);
 unsigned int BarPlayerCalcScale (float);
+struct audioPrefetch *BarPlayerPrefetchStart (const char *url,
+		const char *proxy, PianoAudioFormat_t format);
+bool BarPlayerPrefetchMatches (const struct audioPrefetch *, const char *url);
+void BarPlayerPrefetchRelease (struct audioPrefetch *);
 
 #endif /* _PLAYER_H */
@@ -39,6 +39,7 @@
 #include "seeds.h"
 #include "users.h"
 #include "query.h"
+#include "rpc.h"
 
 
 /* When the user issues a search, Pandora provides anything matching the term.
@@ -85,22 +86,100 @@ static void send_genres (APPSTATE *app, FB_EVENT *event, const char *search_genr
 }
 
 
+/* A search in progress.  The connection's input is suspended until it
+   completes; if the connection closes first, the query is abandoned. */
+struct pending_query_t {
+	FB_EVENT event; /* Copy of the requesting event, used for replies */
+	char *kind; /* What to display: any, song, artist, genre */
+	char *term;
+	PianoRequestDataSearch_t reqData;
+};
+
+static void destroy_pending_query (PENDING_QUERY *query) {
+	free (query->kind);
+	free (query->term);
+	free (query);
+}
+
+/* Disassociate a search in progress from a closing connection. */
+void abandon_query (USER_CONTEXT *context) {
+	assert (context);
+	if (context->pending_query) {
+		context->pending_query->event.connection = NULL;
+		context->pending_query = NULL;
+	}
+}
+
+
+/* Send the results of a search, filtered by type. */
+static void send_query_results (APPSTATE *app, FB_EVENT *event, const char *kind) {
+	USER_CONTEXT *context = (USER_CONTEXT *)event->context;
+
+	/* Determine what to display. */
+	bool showAny = strcasecmp (kind, "any") == 0;
+	bool showSongs = strcasecmp (kind, "song") == 0;
+	bool showArtists = strcasecmp (kind, "artist") == 0;
+	bool showGenres = strcasecmp (kind, "genre") == 0;
+
+	if (showAny || showArtists)
+		send_artists (event, context->search_results->artists, INFO_ARTISTSUGGESTION);
+	if (showAny || showSongs)
+		send_songs_or_details (event, app, context->search_results->songs, INFO_SONGSUGGESTION);
+	if (showAny || showGenres)
+		send_genres (app, event, context->search_term);
+	reply (event, S_DATA_END);
+}
+
+
+/* Pandora has replied to a search; stash the results and send them. */
+static void query_complete (APPSTATE *app, PIANO_ASYNC *request, bool success) {
+	PENDING_QUERY *query = request->context;
+	FB_EVENT *event = &query->event;
+
+	if (!event->connection) {
+		/* The connection closed while we were waiting. */
+		if (success) {
+			PianoDestroySearchResult (&query->reqData.searchResult);
+		}
+		destroy_pending_query (query);
+		return;
+	}
+	USER_CONTEXT *context = (USER_CONTEXT *)event->context;
+	context->pending_query = NULL;
+	fb_accept_input (event->connection, true);
+
+	if (!success) {
+		reply (event, E_NAK);
+		destroy_pending_query (query);
+		return;
+	}
+	PianoSearchResult_t *newresults = malloc (sizeof (PianoSearchResult_t));
+	if (!newresults) {
+		data_reply (event, E_NAK, strerror (errno));
+		PianoDestroySearchResult (&query->reqData.searchResult);
+		destroy_pending_query (query);
+		return;
+	}
+	memcpy (newresults, &query->reqData.searchResult, sizeof (*newresults));
+	context->search_results = newresults;
+	context->search_term = query->term;
+	query->term = NULL;
+	send_query_results (app, event, query->kind);
+	destroy_pending_query (query);
+}
+
+
 /* Process a FIND <genre|artist|song|any> command.  If search term is
-   given, use that, otherwise repeat the last query. */
+   given, use that, otherwise repeat the last query.  New searches are
+   sent to Pandora in the background; the results are sent when the reply
+   arrives, and the connection's input is held until then. */
 void perform_query (APPSTATE *app, FB_EVENT *event,	char *term)
 {
 	assert (app);
 	assert (event);
 	
-	PianoRequestDataSearch_t reqData;
 	USER_CONTEXT *context = (USER_CONTEXT *)event->context;
 
-	/* Determine what to display. */
-	bool showAny = strcasecmp (event->argv [1], "any") == 0;
-	bool showSongs = strcasecmp (event->argv [1], "song") == 0;
-	bool showArtists = strcasecmp (event->argv [1], "artist") == 0;
-	bool showGenres = strcasecmp (event->argv [1], "genre") == 0;
-	
 	if (!term && !context->search_results) {
 		data_reply (event, E_WRONG_STATE, "Search must be performed.");
 		return;
@@ -112,32 +191,33 @@ void perform_query (APPSTATE *app, FB_EVENT *event,	char *term)
                  strcasecmp (context->search_term, term) != 0)) {
 		destroy_search_context (context);
 
-		memset (&reqData, 0, sizeof (reqData));
-		reqData.searchStr = term;
-		if (!piano_transaction (app, NULL, PIANO_REQUEST_SEARCH, &reqData)) {
-			reply (event, E_NAK);
-			return;
-		}
-		context->search_term = strdup (event->argv [2]);
-		if (!context->search_term) {
+		PENDING_QUERY *query = calloc (1, sizeof (*query));
+		if (!query || !(query->kind = strdup (event->argv [1])) ||
+			!(query->term = strdup (term))) {
 			data_reply (event, E_NAK, strerror (errno));
+			if (query) {
+				destroy_pending_query (query);
+			}
 			return;
 		}
-		PianoSearchResult_t *newresults = malloc (sizeof (PianoSearchResult_t));
-		if (!newresults) {
-			data_reply (event, E_NAK, strerror (errno));
-			return;
+		/* Keep enough of the event to reply with; the command line goes away. */
+		memcpy (&query->event, event, sizeof (query->event));
+		query->event.command = NULL;
+		query->event.argc = 0;
+		query->event.argv = NULL;
+		query->event.argr = NULL;
+		query->reqData.searchStr = query->term;
+
+		context->pending_query = query;
+		fb_accept_input (event->connection, false);
+		if (!piano_transaction_async (app, PIANO_REQUEST_SEARCH, &query->reqData,
+									  query_complete, query)) {
+			context->pending_query = NULL;
+			fb_accept_input (event->connection, true);
+			destroy_pending_query (query);
+			reply (event, E_NAK);
 		}
-		memcpy (newresults, &reqData.searchResult, sizeof (*newresults));
-		context->search_results = newresults;
+		return;
 	}
-	
-	if (showAny || showArtists)
-		send_artists (event, context->search_results->artists, INFO_ARTISTSUGGESTION);
-	if (showAny || showSongs)
-		send_songs_or_details (event, app, context->search_results->songs, INFO_SONGSUGGESTION);
-	if (showAny || showGenres)
-		send_genres (app, event, context->search_term);
-	reply (event, S_DATA_END);
+	send_query_results (app, event, event->argv [1]);
 }
-
@@ -13,6 +13,7 @@
 #define _QUERY_H
 
 extern void destroy_search_context (USER_CONTEXT *context);
+extern void abandon_query (USER_CONTEXT *context);
 extern void perform_query (APPSTATE *app, FB_EVENT *event, char *term);
 
 #endif
@@ -0,0 +1,101 @@
+/*
+Copyright (c) 2008-2013
+	Lars-Dominik Braun <lars@6xq.net>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+*/
+
+/* replaygain, split from player.c so it can be checked on its own */
+
+#include <config.h>
+
+#include <stdint.h>
+#include <limits.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "replaygain.h"
+
+/*	apply replaygain to a buffer of signed 16 bit samples in place; whole
+ *	frames are processed, so the sample count is frames * channels. the
+ *	vector paths compute value * scale / RG_SCALE_FACTOR in single precision
+ *	and saturate, same as the scalar path.
+ *	@param samples
+ *	@param number of samples
+ *	@param replaygain scale (calculated by BarPlayerCalcScale)
+ */
+void BarPlayerApplyReplayGain (int16_t *samples, size_t count,
+		const unsigned int scale) {
+	size_t i = 0;
+
+	/* unity gain, nothing to do */
+	if (scale == RG_SCALE_FACTOR) {
+		return;
+	}
+
+#if defined(__AVX2__)
+	const __m256 gain = _mm256_set1_ps (scale / RG_SCALE_FACTOR);
+	const __m256 hi = _mm256_set1_ps (SHRT_MAX), lo = _mm256_set1_ps (SHRT_MIN);
+	for (; i + 16 <= count; i += 16) {
+		__m256i in = _mm256_loadu_si256 ((const __m256i *) (samples + i));
+		__m256i l = _mm256_cvtepi16_epi32 (_mm256_castsi256_si128 (in));
+		__m256i h = _mm256_cvtepi16_epi32 (_mm256_extracti128_si256 (in, 1));
+		__m256 fl = _mm256_min_ps (_mm256_max_ps (_mm256_mul_ps (_mm256_cvtepi32_ps (l), gain), lo), hi);
+		__m256 fh = _mm256_min_ps (_mm256_max_ps (_mm256_mul_ps (_mm256_cvtepi32_ps (h), gain), lo), hi);
+		/* packs works per 128 bit lane, permute puts the halves back in order */
+		__m256i out = _mm256_packs_epi32 (_mm256_cvttps_epi32 (fl), _mm256_cvttps_epi32 (fh));
+		_mm256_storeu_si256 ((__m256i *) (samples + i), _mm256_permute4x64_epi64 (out, 0xd8));
+	}
+#elif defined(__SSE2__)
+	const __m128 gain = _mm_set1_ps (scale / RG_SCALE_FACTOR);
+	const __m128 hi = _mm_set1_ps (SHRT_MAX), lo = _mm_set1_ps (SHRT_MIN);
+	for (; i + 8 <= count; i += 8) {
+		__m128i in = _mm_loadu_si128 ((const __m128i *) (samples + i));
+		/* sign extend to 32 bit by unpacking into the high half and shifting */
+		__m128i l = _mm_srai_epi32 (_mm_unpacklo_epi16 (in, in), 16);
+		__m128i h = _mm_srai_epi32 (_mm_unpackhi_epi16 (in, in), 16);
+		__m128 fl = _mm_min_ps (_mm_max_ps (_mm_mul_ps (_mm_cvtepi32_ps (l), gain), lo), hi);
+		__m128 fh = _mm_min_ps (_mm_max_ps (_mm_mul_ps (_mm_cvtepi32_ps (h), gain), lo), hi);
+		_mm_storeu_si128 ((__m128i *) (samples + i),
+				_mm_packs_epi32 (_mm_cvttps_epi32 (fl), _mm_cvttps_epi32 (fh)));
+	}
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	const float32x4_t gain = vdupq_n_f32 (scale / RG_SCALE_FACTOR);
+	for (; i + 8 <= count; i += 8) {
+		int16x8_t in = vld1q_s16 (samples + i);
+		/* vcvtq_s32_f32 truncates and saturates, vqmovn saturates again */
+		float32x4_t fl = vmulq_f32 (vcvtq_f32_s32 (vmovl_s16 (vget_low_s16 (in))), gain);
+		float32x4_t fh = vmulq_f32 (vcvtq_f32_s32 (vmovl_s16 (vget_high_s16 (in))), gain);
+		vst1q_s16 (samples + i, vcombine_s16 (vqmovn_s32 (vcvtq_s32_f32 (fl)),
+				vqmovn_s32 (vcvtq_s32_f32 (fh))));
+	}
+#endif
+
+	for (; i < count; i++) {
+		/* 64 bit, large volume settings overflow an int */
+		const int64_t tmpReplayBuf = (int64_t) samples[i] * scale /
+				(int) RG_SCALE_FACTOR;
+		/* avoid clipping */
+		samples[i] = tmpReplayBuf > SHRT_MAX ? SHRT_MAX :
+				tmpReplayBuf < SHRT_MIN ? SHRT_MIN : tmpReplayBuf;
+	}
+}
@@ -0,0 +1,19 @@
+/*
+ *  replaygain.h
+ *  pianod - Replaygain scaling of decoded samples.
+ *
+ */
+
+#ifndef _REPLAYGAIN_H
+#define _REPLAYGAIN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* pandora uses float values with 2 digits precision. Scale them by 100 to get
+ * a "nice" integer */
+#define RG_SCALE_FACTOR 100.0
+
+void BarPlayerApplyReplayGain (int16_t *, size_t, const unsigned int);
+
+#endif /* _REPLAYGAIN_H */
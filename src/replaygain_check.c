@@ -0,0 +1,117 @@
+/*
+ *  replaygain_check.c
+ *  pianod - Checks the vectorized replaygain against a scalar reference,
+ *  and times both.  Run by "make check".
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+
+#include "replaygain.h"
+
+#define CHECK_TAIL_MAX (67) /* Longest buffer for the length sweep */
+#define CHECK_BENCH_SAMPLES (2304 * 1000 + 7)
+#define CHECK_BENCH_ROUNDS (40)
+
+/* Unity gain is a separate shortcut; the rest cover attenuation,
+   amplification and saturation. */
+static const unsigned int scales [] = { 0, 1, 37, 89, 99, 100, 101, 141, 200, 1000, 31622 };
+static const int16_t extremes [] = { SHRT_MIN, SHRT_MIN + 1, -1, 0, 1, SHRT_MAX - 1, SHRT_MAX };
+
+/* The scalar path, one sample at a time */
+static int16_t reference (int16_t sample, unsigned int scale) {
+	const int64_t value = (int64_t) sample * scale / (int) RG_SCALE_FACTOR;
+	return value > SHRT_MAX ? SHRT_MAX : value < SHRT_MIN ? SHRT_MIN : value;
+}
+
+/* The vector paths multiply in single precision, so a result may be off by
+   one from the reference; saturation and silence must be exact. */
+static bool acceptable (int16_t sample, unsigned int scale, int16_t result) {
+	const int16_t expected = reference (sample, scale);
+	const int64_t exact = (int64_t) sample * scale;
+	if (scale == 0 || exact > (SHRT_MAX + 1) * RG_SCALE_FACTOR ||
+		exact < (SHRT_MIN - 1) * RG_SCALE_FACTOR) {
+		return result == expected;
+	}
+	return abs (result - expected) <= 1;
+}
+
+/* Apply the gain to count samples at an offset into the buffer, so both
+   unaligned starts and every tail length are exercised. */
+static bool check_buffer (const int16_t *source, size_t offset, size_t count, unsigned int scale) {
+	int16_t buffer [CHECK_TAIL_MAX + 8];
+	memcpy (buffer + offset, source, count * sizeof (*source));
+	BarPlayerApplyReplayGain (buffer + offset, count, scale);
+	for (size_t i = 0; i < count; i++) {
+		if (!acceptable (source [i], scale, buffer [offset + i])) {
+			fprintf (stderr, "scale %u, %zu samples at offset %zu: sample %zu: %d became %d, expected %d\n",
+					 scale, count, offset, i, source [i], buffer [offset + i],
+					 reference (source [i], scale));
+			return false;
+		}
+	}
+	return true;
+}
+
+static double now (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main (void) {
+	int16_t source [CHECK_TAIL_MAX];
+	srand (1);
+	for (size_t s = 0; s < sizeof (scales) / sizeof (*scales); s++) {
+		/* Every tail length and alignment, random samples mixed with extremes */
+		for (int round = 0; round < 20; round++) {
+			for (size_t i = 0; i < CHECK_TAIL_MAX; i++) {
+				source [i] = (rand () % 4 == 0) ? extremes [rand () % (sizeof (extremes) / sizeof (*extremes))]
+												: (int16_t) rand ();
+			}
+			for (size_t count = 0; count <= CHECK_TAIL_MAX; count++) {
+				for (size_t offset = 0; offset < 8; offset++) {
+					if (!check_buffer (source, offset, count, scales [s])) {
+						return 1;
+					}
+				}
+			}
+		}
+	}
+
+	/* Throughput, for information */
+	int16_t *samples = malloc (CHECK_BENCH_SAMPLES * sizeof (*samples));
+	if (!samples) {
+		perror ("malloc");
+		return 1;
+	}
+	for (size_t i = 0; i < CHECK_BENCH_SAMPLES; i++) {
+		samples [i] = (int16_t) rand ();
+	}
+	double start = now ();
+	for (int round = 0; round < CHECK_BENCH_ROUNDS; round++) {
+		for (size_t i = 0; i < CHECK_BENCH_SAMPLES; i++) {
+			samples [i] = reference (samples [i] | 1, 89);
+		}
+	}
+	double scalar = now () - start;
+	start = now ();
+	for (int round = 0; round < CHECK_BENCH_ROUNDS; round++) {
+		samples [0] |= 1;
+		BarPlayerApplyReplayGain (samples, CHECK_BENCH_SAMPLES, 89);
+	}
+	double vector = now () - start;
+	printf ("scalar %.1f Msamples/s, BarPlayerApplyReplayGain %.1f Msamples/s (%d)\n",
+			CHECK_BENCH_ROUNDS * (CHECK_BENCH_SAMPLES / 1e6) / scalar,
+			CHECK_BENCH_ROUNDS * (CHECK_BENCH_SAMPLES / 1e6) / vector, samples [1]);
+	free (samples);
+	return 0;
+}
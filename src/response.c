@@ -53,6 +53,7 @@ char *Response (RESPONSE_CODE response) {
 		case I_PAUSED:			return "Paused";
 		case I_BETWEEN_TRACKS:	return "Intertrack";
 		case I_STALLED:			return "Stalled";
+		case I_BUFFER_STATUS:	return "Buffer";
 		case I_TRACK_COMPLETE:	return "Track playback complete";
 		case I_SELECTEDSTATION:	return "SelectedStation";
 		case I_SELECTEDSTATION_NONE:
@@ -68,6 +69,8 @@ char *Response (RESPONSE_CODE response) {
 		case I_USERRATING:		return "UserRating";
 		case I_CHOICEEXPLANATION:
 								return "Explanation";
+		case I_METRIC:			return "Metric";
+		case I_RESOLVER:		return "Resolver";
 		case I_VOLUME:			return "Volume";
 		case I_AUDIOQUALITY:	return "Quality";
 #if defined(ENABLE_CAPTURE)
@@ -81,6 +84,7 @@ char *Response (RESPONSE_CODE response) {
 		case I_PANDORA_RETRY:	return "PandoraRetry";
 		case I_PAUSE_TIMEOUT:	return "PauseTimeout";
 		case I_PLAYLIST_TIMEOUT:return "PlaylistTimeout";
+		case I_BANDWIDTH:		return "Bandwidth";
 		case I_PROXY:			return "Proxy";
 		case I_CONTROLPROXY:	return "ControlProxy";
 		case I_PARTNERUSER:		return "Partner";
@@ -99,6 +103,7 @@ char *Response (RESPONSE_CODE response) {
 		case I_OUTPUT_DEVICE:	return "OutputDevice";
 		case I_OUTPUT_ID:		return "OutputID";
 		case I_OUTPUT_SERVER:	return "OutputServer";
+		case I_AUDIO_BUFFER:	return "AudioBuffer";
 		case I_INFO_URL:		return "SeeAlso";
 		case I_MIX_CHANGED:		return "Mix has been changed";
 		case I_STATIONS_CHANGED:return "Station list has changed";
@@ -258,6 +263,11 @@ void send_playback_status (void *there, APPSTATE *app) {
 					(sign == POSITIVE ? '+' : '-'),
 					songRemaining / 60, songRemaining % 60,
 					Response (state));	
+		AUDIO_OUTPUT_STATS stats;
+		if (audio_output_stats (app->output, &stats)) {
+			fb_fprintf (there, "%03d %s: %d/%d %u\n", I_BUFFER_STATUS, Response (I_BUFFER_STATUS),
+						stats.buffered_ms, stats.capacity_ms, stats.underruns);
+		}
 	} else {
 		send_response (there, app->playback_state == PLAYING && app->selected_station ? I_BETWEEN_TRACKS : I_STOPPED);
 	}
@@ -313,7 +323,8 @@ static void send_song_or_detail_info (void *there, const APPSTATE *app, const Pi
 	send_data (there, I_SONG, song->title);
 	send_data (there, I_COVERART, song->coverArt);
 	if (song->stationId) {
-		PianoStation_t *station = PianoFindStationById (app->ph.stations, song->stationId);
+		/* Lookup may rebuild the station index, but doesn't change the stations */
+		PianoStation_t *station = PianoLookupStationById ((PianoHandle_t *) &app->ph, song->stationId);
 		if (station) {
 			send_data (there, I_STATION, station->name);
 		}
@@ -25,6 +25,7 @@ typedef enum server_status_t {
 	I_BETWEEN_TRACKS = 104,
 	I_TRACK_COMPLETE = 105,
 	I_STALLED = 106,
+	I_BUFFER_STATUS = 107,
 	I_SELECTEDSTATION_NONE = 108,
 	I_SELECTEDSTATION = 109,
 	I_ID = 111, /* Song ID */ /* 111-129 Station/artist/track field ids */
@@ -45,6 +46,8 @@ typedef enum server_status_t {
 	I_STATIONS_CHANGED = 135,
 	I_USER_PRIVILEGES = 136,
 	I_USERRATINGS_CHANGED = 137,
+	I_METRIC = 138,
+	I_RESOLVER = 139,
 	/* pianod settings */
 	I_VOLUME = 141,
 	I_HISTORYSIZE = 142,
@@ -53,6 +56,7 @@ typedef enum server_status_t {
 	I_PANDORA_RETRY =145,
 	I_PAUSE_TIMEOUT = 146,
 	I_PLAYLIST_TIMEOUT = 147,
+	I_BANDWIDTH = 148,
 	/* Pandora communication settings */
 	I_PROXY = 161,
 	I_CONTROLPROXY = 162,
@@ -70,6 +74,7 @@ typedef enum server_status_t {
 	I_OUTPUT_DEVICE = 182,
 	I_OUTPUT_ID = 183,
 	I_OUTPUT_SERVER = 184,
+	I_AUDIO_BUFFER = 185,
 #if defined(ENABLE_CAPTURE)
 	I_CAPTUREPATH = 190,
 #endif
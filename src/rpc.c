@@ -0,0 +1,277 @@
+/*
+ *  rpc.c
+ *  pianod - Asynchronous Pandora requests.
+ *
+ */
+
+/* Pandora requests made with piano_transaction block the run loop for the
+   whole HTTPS round-trip, freezing every connection.  Requests made here are
+   prepared by libpiano on the main thread, then handed to a worker thread
+   for the network exchange.  Completed requests are passed back through a
+   queue, and a pipe registered with Football wakes the run loop, which
+   hands the response to libpiano and invokes the completion.
+
+   libpiano's handle is only ever touched from the main thread; the worker
+   only sees its own copy of the waitress handle and the request buffers. */
+
+#ifndef __FreeBSD__
+#define _DEFAULT_SOURCE /* strdup() */
+#define _DARWIN_C_SOURCE /* strdup() on OS X */
+#endif
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include <piano.h>
+#include <waitress.h>
+#include <fb_public.h>
+
+#include "rpc.h"
+#include "support.h"
+#include "pianod.h"
+#include "logging.h"
+#include "response.h"
+#include "threadqueue.h"
+#include "metrics.h"
+
+typedef enum rpc_message_t {
+	RPC_REQUEST,
+	RPC_QUIT
+} RPC_MESSAGE;
+
+static struct threadqueue requests; /* Main thread to worker */
+static struct threadqueue completions; /* Worker to main thread */
+static pthread_t worker;
+static bool worker_running = false;
+static int wakeup [2] = { -1, -1 }; /* Pipe; read end is registered with Football */
+static int pending = 0;
+
+
+/* Worker thread: perform the HTTP exchange for each request,
+   then pass it back to the main thread. */
+static void *rpc_worker (void *unused) {
+	struct threadmsg msg;
+	while (thread_queue_get (&requests, NULL, &msg) == 0 && msg.msgtype != RPC_QUIT) {
+		PIANO_ASYNC *request = msg.data;
+		request->wRet = BarPianoHttpRequest (&request->waith, &request->req);
+		thread_queue_add (&completions, request, RPC_REQUEST);
+		while (write (wakeup [1], "", 1) < 0 && errno == EINTR)
+			;
+	}
+	return NULL;
+}
+
+
+/* Prepare the next HTTP request with libpiano and queue it for the worker. */
+static bool rpc_submit (APPSTATE *app, PIANO_ASYNC *request) {
+	memset (&request->req, 0, sizeof (request->req));
+	request->req.data = request->data;
+	request->pRet = PianoRequest (&app->ph, &request->req, request->type);
+	if (request->pRet != PIANO_RET_OK) {
+		send_response_code (app->service, E_FAILURE, PianoErrorToStr (request->pRet));
+		PianoDestroyRequest (&request->req);
+		return false;
+	}
+	request->wRet = WAITRESS_RET_OK;
+	request->waith = app->waith;
+	if (thread_queue_add (&requests, request, RPC_REQUEST) != 0) {
+		flog (LOG_ERROR, "rpc_submit: thread_queue_add: %s", strerror (ENOMEM));
+		send_response_code (app->service, E_FAILURE, strerror (ENOMEM));
+		PianoDestroyRequest (&request->req);
+		return false;
+	}
+	pending++;
+	return true;
+}
+
+
+/* Deliver a finished request to its completion and release it. */
+static void rpc_finish (APPSTATE *app, PIANO_ASYNC *request, bool success) {
+	if (request->started) {
+		metrics_since (&metric_requests, request->type, request->started);
+	}
+	request->completion (app, request, success);
+	free (request);
+}
+
+
+/* Process a response returned by the worker.  This mirrors BarUiPianoCall:
+   multi-step requests are resubmitted, and an expired auth token triggers
+   reauthentication and a retry. */
+static void rpc_complete (APPSTATE *app, PIANO_ASYNC *request) {
+	if (request->wRet != WAITRESS_RET_OK) {
+		send_response_code (app->service, E_NETWORK_FAILURE, WaitressErrorToStr (request->wRet));
+		free (request->req.responseData);
+		PianoDestroyRequest (&request->req);
+		rpc_finish (app, request, false);
+		return;
+	}
+
+	request->pRet = PianoResponse (&app->ph, &request->req);
+	free (request->req.responseData);
+	PianoDestroyRequest (&request->req);
+
+	if (request->pRet == PIANO_RET_P_INVALID_AUTH_TOKEN &&
+		request->type != PIANO_REQUEST_LOGIN && !request->reauthenticated) {
+		PianoReturn_t authpRet;
+		WaitressReturn_t authwRet;
+		PianoRequestDataLogin_t reqData;
+		reqData.user = app->settings.pandora.username;
+		reqData.password = app->settings.pandora.password;
+		reqData.step = 0;
+
+		flog (LOG_GENERAL, "Reauthenticating with server...");
+		request->reauthenticated = true;
+		if (!BarUiPianoCall (app, PIANO_REQUEST_LOGIN, &reqData, &authpRet, &authwRet)) {
+			request->pRet = authpRet;
+			request->wRet = authwRet;
+			rpc_finish (app, request, false);
+		} else if (!rpc_submit (app, request)) {
+			rpc_finish (app, request, false);
+		}
+		return;
+	}
+	if (request->pRet == PIANO_RET_CONTINUE_REQUEST) {
+		if (!rpc_submit (app, request)) {
+			rpc_finish (app, request, false);
+		}
+		return;
+	}
+	if (request->pRet != PIANO_RET_OK) {
+		send_data (app->service, E_AUTHENTICATION, PianoErrorToStr (request->pRet));
+		rpc_finish (app, request, false);
+		return;
+	}
+	rpc_finish (app, request, true);
+}
+
+
+/* Start a Pandora request without waiting for the reply.  On success, the
+   completion is called from the run loop when the request finishes (or
+   immediately, if the worker isn't running).  On failure, the completion
+   is not called and the caller retains the context. */
+bool piano_transaction_async (APPSTATE *app, PianoRequestType_t type, void *data,
+							  PIANO_ASYNC_COMPLETION completion, void *context) {
+	assert (app);
+	assert (type);
+	assert (completion);
+
+	PIANO_ASYNC *request = calloc (1, sizeof (*request));
+	if (!request) {
+		flog (LOG_ERROR, "piano_transaction_async: calloc: %s", strerror (errno));
+		send_response_code (app->service, E_FAILURE, strerror (errno));
+		return false;
+	}
+	request->type = type;
+	request->data = data;
+	request->completion = completion;
+	request->context = context;
+	if (!worker_running) {
+		/* No worker; do it the old-fashioned way. */
+		bool success = BarUiPianoCall (app, type, data, &request->pRet, &request->wRet);
+		rpc_finish (app, request, success);
+		return true;
+	}
+	request->started = metrics_now ();
+	if (rpc_submit (app, request)) {
+		return true;
+	}
+	free (request);
+	return false;
+}
+
+
+/* If a Football event is the worker's wakeup, process completed requests.
+   Returns true if the event was handled. */
+bool rpc_handle_event (APPSTATE *app, FB_EVENT *event) {
+	if (event->type != FB_EVENT_READABLE || !worker_running || event->socket != wakeup [0]) {
+		return false;
+	}
+	char drain [64];
+	while (read (wakeup [0], drain, sizeof (drain)) > 0)
+		;
+	struct threadmsg msg;
+	while (thread_queue_length (&completions) > 0 &&
+		   thread_queue_get (&completions, NULL, &msg) == 0) {
+		pending--;
+		rpc_complete (app, (PIANO_ASYNC *) msg.data);
+	}
+	return true;
+}
+
+
+/* Number of requests in flight */
+int rpc_pending (void) {
+	return pending;
+}
+
+
+/* Create the worker thread and its wakeup pipe. */
+bool rpc_init (void) {
+	assert (!worker_running);
+	if (pipe (wakeup) < 0) {
+		flog (LOG_ERROR, "rpc_init: pipe: %s", strerror (errno));
+		return false;
+	}
+	fcntl (wakeup [0], F_SETFL, fcntl (wakeup [0], F_GETFL) | O_NONBLOCK);
+	fcntl (wakeup [0], F_SETFD, FD_CLOEXEC);
+	fcntl (wakeup [1], F_SETFD, FD_CLOEXEC);
+	if (thread_queue_init (&requests) == 0) {
+		if (thread_queue_init (&completions) == 0) {
+			if (fb_register_user_socket (wakeup [0], NULL)) {
+				int err = pthread_create (&worker, NULL, rpc_worker, NULL);
+				if (err == 0) {
+					worker_running = true;
+					return true;
+				}
+				flog (LOG_ERROR, "rpc_init: pthread_create: %s", strerror (err));
+				fb_unregister_user_socket (wakeup [0]);
+			}
+			thread_queue_cleanup (&completions, 0);
+		}
+		thread_queue_cleanup (&requests, 0);
+	}
+	close (wakeup [0]);
+	close (wakeup [1]);
+	wakeup [0] = wakeup [1] = -1;
+	return false;
+}
+
+
+/* Stop the worker.  Any requests still outstanding are discarded. */
+void rpc_shutdown (void) {
+	if (!worker_running) {
+		return;
+	}
+	thread_queue_add (&requests, NULL, RPC_QUIT);
+	pthread_join (worker, NULL);
+	worker_running = false;
+
+	struct threadmsg msg;
+	while (thread_queue_length (&requests) > 0 && thread_queue_get (&requests, NULL, &msg) == 0) {
+		if (msg.msgtype == RPC_REQUEST) {
+			PianoDestroyRequest (&((PIANO_ASYNC *) msg.data)->req);
+			free (msg.data);
+		}
+	}
+	while (thread_queue_length (&completions) > 0 && thread_queue_get (&completions, NULL, &msg) == 0) {
+		free (((PIANO_ASYNC *) msg.data)->req.responseData);
+		PianoDestroyRequest (&((PIANO_ASYNC *) msg.data)->req);
+		free (msg.data);
+	}
+	thread_queue_cleanup (&requests, 0);
+	thread_queue_cleanup (&completions, 0);
+	fb_unregister_user_socket (wakeup [0]);
+	close (wakeup [0]);
+	close (wakeup [1]);
+	wakeup [0] = wakeup [1] = -1;
+	pending = 0;
+}
@@ -0,0 +1,45 @@
+/*
+ *  rpc.h
+ *  pianod - Asynchronous Pandora requests.
+ *
+ */
+
+#ifndef _RPC_H
+#define _RPC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <piano.h>
+#include <waitress.h>
+#include <fb_public.h>
+
+#include "pianod.h"
+
+typedef struct piano_async_t PIANO_ASYNC;
+
+/* Called on the main thread when a request completes.  The completion
+   owns `context` and must free it; request data belongs to the context. */
+typedef void (*PIANO_ASYNC_COMPLETION) (APPSTATE *app, PIANO_ASYNC *request, bool success);
+
+struct piano_async_t {
+	PianoRequestType_t type;
+	void *data; /* Request data, as would be passed to piano_transaction */
+	PIANO_ASYNC_COMPLETION completion;
+	void *context; /* For the completion's use */
+	PianoRequest_t req;
+	WaitressHandle_t waith; /* Private copy used by the worker thread */
+	PianoReturn_t pRet;
+	WaitressReturn_t wRet;
+	bool reauthenticated;
+	uint64_t started; /* metrics_now() at first submission; 0 if not submitted */
+};
+
+extern bool rpc_init (void);
+extern void rpc_shutdown (void);
+extern bool piano_transaction_async (APPSTATE *app, PianoRequestType_t type, void *data,
+									 PIANO_ASYNC_COMPLETION completion, void *context);
+extern bool rpc_handle_event (APPSTATE *app, FB_EVENT *event);
+extern int rpc_pending (void);
+
+#endif
@@ -16,17 +16,23 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <time.h>
 #include <stdio.h>
+#include <errno.h>
 #include <assert.h>
 
 #include <piano.h>
 #include <fb_public.h>
+#include <ezxml.h>
 
 #include "support.h"
 #include "seeds.h"
 #include "response.h"
 #include "pianoextra.h"
+#include "logging.h"
+#include "rpc.h"
+#include "users.h"
 
 
 /* ------------ Station cache ------------- */
@@ -38,20 +44,111 @@
  patch it up with the additional information.  There will also
  be some convenience functions for getting bits that don't fit
  in the song records, like artist seeds.
+
+ The cache is hashed by station ID and bounded, discarding the least
+ recently used station when full.  Expired information is still used
+ while a replacement is fetched in the background; only stations with
+ nothing cached are fetched while you wait.  The cache is saved to a
+ file so a restart doesn't have to fetch everything again.
  */
 
 /* Cache for around 3 hours */
 #define STATION_CACHE_TIME (10000)
+/* Pandora accounts are limited to 100 stations */
+#define STATION_CACHE_SIZE (100)
+/* Hash buckets; must be a power of 2 */
+#define STATION_CACHE_BUCKETS (128)
 
 typedef struct stationinfo_cache_t {
 	char *station_id;
 	time_t retrieved;
 	PianoStationInfo_t *info;
-	struct stationinfo_cache_t *next;
+	bool refreshing; /* Background refresh in progress */
+	struct stationinfo_cache_t *next; /* Hash chain */
+	struct stationinfo_cache_t *newer, *older; /* Recently used order */
 } STATIONINFO_CACHE;
- 
-STATIONINFO_CACHE *cache;
 
+/* Background refresh request.  The request gets its own copy of
+   the station, in case the station list is replaced meanwhile. */
+typedef struct stationinfo_refresh_t {
+	PianoStation_t station;
+	PianoRequestDataGetStationInfo_t reqData;
+} STATIONINFO_REFRESH;
+
+static STATIONINFO_CACHE *cache [STATION_CACHE_BUCKETS];
+static STATIONINFO_CACHE *cache_newest, *cache_oldest;
+static unsigned int cache_count;
+static bool cache_dirty; /* Changed since last persisted */
+
+
+
+/* Hash a station ID to a bucket */
+static unsigned int station_bucket (const char *station_id) {
+	uint32_t hash = 2166136261u;
+	while (*station_id) {
+		hash = (hash ^ (unsigned char) *(station_id++)) * 16777619u;
+	}
+	return hash & (STATION_CACHE_BUCKETS - 1);
+}
+
+
+/* Remove an item from the recently-used list */
+static void unlink_cache_record (STATIONINFO_CACHE *item) {
+	if (item->newer) {
+		item->newer->older = item->older;
+	} else {
+		cache_newest = item->older;
+	}
+	if (item->older) {
+		item->older->newer = item->newer;
+	} else {
+		cache_oldest = item->newer;
+	}
+	item->newer = item->older = NULL;
+}
+
+
+/* Add an item to the recently-used list as the most recent */
+static void link_cache_record (STATIONINFO_CACHE *item) {
+	item->older = cache_newest;
+	if (cache_newest) {
+		cache_newest->newer = item;
+	} else {
+		cache_oldest = item;
+	}
+	cache_newest = item;
+}
+
+
+/* Make an item the most recently used */
+static void touch_cache_record (STATIONINFO_CACHE *item) {
+	if (item != cache_newest) {
+		unlink_cache_record (item);
+		link_cache_record (item);
+	}
+}
+
+
+/* Free a cache item and the information in it */
+static void free_cache_record (STATIONINFO_CACHE *item) {
+	PianoDestroyStationInfo (item->info);
+	free (item->info);
+	free (item->station_id);
+	free (item);
+}
+
+
+/* Remove an item from the cache entirely and release it */
+static void evict_cache_record (STATIONINFO_CACHE *item) {
+	STATIONINFO_CACHE **link = &cache [station_bucket (item->station_id)];
+	while (*link != item) {
+		link = &(*link)->next;
+	}
+	*link = item->next;
+	unlink_cache_record (item);
+	cache_count--;
+	free_cache_record (item);
+}
 
 
 /* Retrieve station information such as seeds, feedback, etc. from Pandora. */
@@ -77,29 +174,41 @@ static PianoStationInfo_t *retrieve_station_info (APPSTATE *app, PianoStation_t
 }
 
 
-/* Create a new cache item with a station ID and the information. */
-static STATIONINFO_CACHE *add_cache_record (APPSTATE *app, PianoStation_t *station, PianoStationInfo_t *item) {
-	assert (app);
-	assert (station);
+/* Create a new cache item with a station ID and the information,
+   making room by discarding the least recently used if necessary. */
+static STATIONINFO_CACHE *add_cache_record (APPSTATE *app, const char *station_id,
+											PianoStationInfo_t *item, time_t retrieved) {
+	assert (station_id);
 	assert (item);
 	
 	STATIONINFO_CACHE *cacheitem;
 	if ((cacheitem = malloc (sizeof (*cacheitem)))) {
 		memset (cacheitem, 0, sizeof (*cacheitem));
-		if ((cacheitem->station_id = strdup (station->id))) {
-			cacheitem->retrieved = time(NULL);
+		if ((cacheitem->station_id = strdup (station_id))) {
+			if (cache_count >= STATION_CACHE_SIZE) {
+				evict_cache_record (cache_oldest);
+			}
+			cacheitem->retrieved = retrieved;
 			cacheitem->info = item;
-			cacheitem->next = cache;
-			cache = cacheitem;
+			unsigned int bucket = station_bucket (station_id);
+			cacheitem->next = cache [bucket];
+			cache [bucket] = cacheitem;
+			link_cache_record (cacheitem);
+			cache_count++;
+			cache_dirty = true;
 			return (cacheitem);
 		} else {
 			perror ("create_cache_record:strdup");
-			send_response_code (app->service, E_FAILURE, strerror (errno));
+			if (app) {
+				send_response_code (app->service, E_FAILURE, strerror (errno));
+			}
 			free (cacheitem);
 		}
 	} else {			
 		perror ("create_cache_record:malloc");
-		send_response_code (app->service, E_FAILURE, strerror (errno));
+		if (app) {
+			send_response_code (app->service, E_FAILURE, strerror (errno));
+		}
 	}
 	return (NULL);
 }
@@ -109,13 +218,13 @@ static STATIONINFO_CACHE *add_cache_record (APPSTATE *app, PianoStation_t *stati
 void destroy_station_info_cache (void)
 {
 	STATIONINFO_CACHE *info;
-	while ((info = cache)) {
-		cache = info->next;
-		PianoDestroyStationInfo (info->info);
-		free (info->info);
-		free (info->station_id);
-		free (info);
+	while ((info = cache_newest)) {
+		cache_newest = info->older;
+		free_cache_record (info);
 	}
+	memset (cache, 0, sizeof (cache));
+	cache_oldest = NULL;
+	cache_count = 0;
 }
 
 
@@ -125,8 +234,9 @@ void destroy_station_info_cache (void)
 static STATIONINFO_CACHE *get_cached_station (const char *station_id) {
 	assert (station_id);
 	
-	for (STATIONINFO_CACHE *info = cache; info; info = info->next) {
+	for (STATIONINFO_CACHE *info = cache [station_bucket (station_id)]; info; info = info->next) {
 		if (strcmp (info->station_id, station_id) == 0) {
+			touch_cache_record (info);
 			return (info);
 		}
 	}
@@ -134,42 +244,266 @@ static STATIONINFO_CACHE *get_cached_station (const char *station_id) {
 }
 
 
-/* Get station information from the cache, adding or refreshing the cache as necessary. */
-static PianoStationInfo_t *get_station_info (APPSTATE *app, PianoStation_t *station) {
-	assert (app);
-	assert (station);
-	
-	STATIONINFO_CACHE *info = get_cached_station (station->id);
-
-	/* If required or expired, get more info. */
-	PianoStationInfo_t *newinfo = NULL;
-	if (!info || (info->retrieved + STATION_CACHE_TIME) < time(NULL)) {
-		newinfo = retrieve_station_info (app, station);
-	}
-	if (newinfo && info) {
+/* Store newly retrieved information, replacing whatever was cached. */
+static STATIONINFO_CACHE *store_station_info (APPSTATE *app, const char *station_id,
+											  PianoStationInfo_t *newinfo) {
+	STATIONINFO_CACHE *info = get_cached_station (station_id);
+	if (info) {
 		/* Update existing cached data */
 		PianoDestroyStationInfo (info->info);
 		free (info->info);
 		info->info = newinfo;
 		info->retrieved = time(NULL);
-	} else if (newinfo) {
+		cache_dirty = true;
+	} else {
 		/* Create new cache record */
-		info = add_cache_record (app, station, newinfo);
+		info = add_cache_record (app, station_id, newinfo, time (NULL));
 		if (!info) {
 			PianoDestroyStationInfo (newinfo);
 			free (newinfo);
 		}
 	}
+	return info;
+}
+
+
+/* Handle completion of a background refresh: replace the cached
+   information and patch up songs with it. */
+static void refresh_station_info_complete (APPSTATE *app, PIANO_ASYNC *request, bool success) {
+	STATIONINFO_REFRESH *refresh = request->context;
+	STATIONINFO_CACHE *info = get_cached_station (refresh->station.id);
+	if (info) {
+		info->refreshing = false;
+	}
+	PianoStationInfo_t *newinfo = NULL;
+	if (success && (newinfo = malloc (sizeof (*newinfo)))) {
+		memcpy (newinfo, &refresh->reqData.info, sizeof (*newinfo));
+	} else {
+		PianoDestroyStationInfo (&refresh->reqData.info);
+	}
+	if (newinfo && store_station_info (app, refresh->station.id, newinfo)) {
+		apply_station_info (app);
+		/* Seeds may have changed, so rebroadcast the rating. */
+		if (app->current_song && app->current_song->stationId &&
+			strcmp (app->current_song->stationId, refresh->station.id) == 0) {
+			send_song_rating (app->service, app->current_song);
+		}
+	}
+	free (refresh->station.id);
+	free (refresh);
+}
+
+
+/* Fetch fresh information for a cached station in the background.
+   The cached information remains in use until the reply arrives. */
+static void refresh_station_info (APPSTATE *app, STATIONINFO_CACHE *info) {
+	assert (app);
+	assert (info);
+
+	if (info->refreshing) {
+		return;
+	}
+	STATIONINFO_REFRESH *refresh = calloc (1, sizeof (*refresh));
+	if (!refresh || !(refresh->station.id = strdup (info->station_id))) {
+		flog (LOG_ERROR, "refresh_station_info: %s", strerror (errno));
+		free (refresh);
+		return;
+	}
+	refresh->reqData.station = &refresh->station;
+	/* Without the request worker, the completion runs before we return. */
+	info->refreshing = true;
+	if (!piano_transaction_async (app, PIANO_REQUEST_GET_STATION_INFO, &refresh->reqData,
+								  refresh_station_info_complete, refresh)) {
+		info->refreshing = false;
+		free (refresh->station.id);
+		free (refresh);
+	}
+}
+
+
+/* Get station information from the cache, adding or refreshing the cache as necessary. */
+static PianoStationInfo_t *get_station_info (APPSTATE *app, PianoStation_t *station) {
+	assert (app);
+	assert (station);
+	
+	STATIONINFO_CACHE *info = get_cached_station (station->id);
+
+	if (!info) {
+		/* Nothing to offer, so get it now. */
+		PianoStationInfo_t *newinfo = retrieve_station_info (app, station);
+		if (newinfo) {
+			info = store_station_info (app, station->id, newinfo);
+		}
+	} else if ((info->retrieved + STATION_CACHE_TIME) < time(NULL)) {
+		/* Use what we have while getting an update.  The refresh may
+		   complete immediately, replacing the info, so look it up again. */
+		refresh_station_info (app, info);
+		info = get_cached_station (station->id);
+	}
 	return info ? info->info : NULL;
 }
 
 
+/* Restore song information for a cached station from XML */
+static PianoSong_t *restore_songs (ezxml_t station, const char *element, bool feedback) {
+	PianoSong_t *list = NULL;
+	for (ezxml_t item = ezxml_child (station, element); item; item = item->next) {
+		const char *id = ezxml_attr (item, "id");
+		const char *artist = ezxml_attr (item, "artist");
+		const char *title = ezxml_attr (item, "title");
+		PianoSong_t *song;
+		if (id && artist && title && (song = calloc (1, sizeof (*song)))) {
+			song->artist = strdup (artist);
+			song->title = strdup (title);
+			if (feedback) {
+				const char *rating = ezxml_attr (item, "rating");
+				song->feedbackId = strdup (id);
+				song->rating = (rating && strcmp (rating, "bad") == 0) ? PIANO_RATE_BAN : PIANO_RATE_LOVE;
+			} else {
+				song->seedId = strdup (id);
+			}
+			list = PianoListAppendP (list, song);
+		}
+	}
+	return list;
+}
+
+
+/* Restore cached station information from a file written by persist_station_info */
+void restore_station_info (const char *filename) {
+	assert (filename);
+	ezxml_t data = ezxml_parse_file (filename);
+	if (!data) {
+		return;
+	}
+	int restored = 0;
+	/* Stations are stored least recently used first, so adding each
+	   in turn reproduces the order. */
+	for (ezxml_t station = ezxml_child (data, "station"); station; station = station->next) {
+		const char *id = ezxml_attr (station, "id");
+		const char *retrieved = ezxml_attr (station, "retrieved");
+		PianoStationInfo_t *info;
+		if (!id || !retrieved || get_cached_station (id)) {
+			flog (LOG_ERROR, "Station information file corrupt: %s", filename);
+			continue;
+		}
+		if (!(info = calloc (1, sizeof (*info)))) {
+			break;
+		}
+		info->songSeeds = restore_songs (station, "songseed", false);
+		info->feedback = restore_songs (station, "feedback", true);
+		for (ezxml_t item = ezxml_child (station, "artistseed"); item; item = item->next) {
+			const char *seed = ezxml_attr (item, "id");
+			const char *name = ezxml_attr (item, "name");
+			PianoArtist_t *artist;
+			if (seed && name && (artist = calloc (1, sizeof (*artist)))) {
+				artist->seedId = strdup (seed);
+				artist->name = strdup (name);
+				info->artistSeeds = PianoListAppendP (info->artistSeeds, artist);
+			}
+		}
+		for (ezxml_t item = ezxml_child (station, "stationseed"); item; item = item->next) {
+			const char *seed = ezxml_attr (item, "id");
+			const char *name = ezxml_attr (item, "name");
+			PianoStation_t *seedstation;
+			if (seed && name && (seedstation = calloc (1, sizeof (*seedstation)))) {
+				seedstation->seedId = strdup (seed);
+				seedstation->name = strdup (name);
+				info->stationSeeds = PianoListAppendP (info->stationSeeds, seedstation);
+			}
+		}
+		if (add_cache_record (NULL, id, info, (time_t) strtoll (retrieved, NULL, 10))) {
+			restored++;
+		} else {
+			PianoDestroyStationInfo (info);
+			free (info);
+		}
+	}
+	ezxml_free (data);
+	flog (LOG_GENERAL, "Restored station information for %d stations", restored);
+	cache_dirty = false;
+}
+
+
+/* Write cached station information as XML */
+static bool write_station_info (FILE *out) {
+	assert (out);
+	fprintf (out, "<?xml version='1.0' encoding='UTF-8'?>\n"
+			 "<pianodstationinfo version='1.0'>\n");
+	for (STATIONINFO_CACHE *station = cache_oldest; station; station = station->newer) {
+		char retrieved [24];
+		snprintf (retrieved, sizeof (retrieved), "%lld", (long long) station->retrieved);
+		fprintxml (out, "  <station id='", station->station_id,
+				   "' retrieved='", retrieved, "'>\n", NULL);
+		PianoSong_t *song = station->info->songSeeds;
+		PianoListForeachP (song) {
+			fprintxml (out, "    <songseed id='", song->seedId, "' artist='", song->artist,
+					   "' title='", song->title, "' />\n", NULL);
+		}
+		PianoArtist_t *artist = station->info->artistSeeds;
+		PianoListForeachP (artist) {
+			fprintxml (out, "    <artistseed id='", artist->seedId,
+					   "' name='", artist->name, "' />\n", NULL);
+		}
+		PianoStation_t *seedstation = station->info->stationSeeds;
+		PianoListForeachP (seedstation) {
+			fprintxml (out, "    <stationseed id='", seedstation->seedId,
+					   "' name='", seedstation->name, "' />\n", NULL);
+		}
+		song = station->info->feedback;
+		PianoListForeachP (song) {
+			fprintxml (out, "    <feedback id='", song->feedbackId, "' artist='", song->artist,
+					   "' title='", song->title,
+					   "' rating='", song->rating == PIANO_RATE_BAN ? "bad" : "good", "' />\n", NULL);
+		}
+		fprintf (out, "  </station>\n");
+	}
+	fprintf (out, "</pianodstationinfo>\n");
+	return !ferror (out);
+}
+
+
+/* Save cached station information, if it has changed.  The XML is
+   formatted here and written by the users module's background writer,
+   which replaces the file so a failure doesn't lose the old one. */
+bool persist_station_info (const char *filename) {
+	static bool write_failed = false; /* Set by the writer; try again next time */
+	if (__atomic_exchange_n (&write_failed, false, __ATOMIC_RELAXED)) {
+		cache_dirty = true;
+	}
+	if (!cache_dirty) {
+		return true;
+	}
+	if (!filename) {
+		return false;
+	}
+	char *data = NULL;
+	size_t size = 0;
+	FILE *out = open_memstream (&data, &size);
+	if (!out) {
+		perror ("open_memstream");
+		return false;
+	}
+	bool success = write_station_info (out);
+	success = (fclose (out) == 0) && success;
+	if (!success) {
+		free (data);
+		return false;
+	}
+	if (!persist_file (filename, data, size, &write_failed)) {
+		return false;
+	}
+	cache_dirty = false;
+	return true;
+}
+
+
 /* Get station info when all we have is a station ID, not a full station record */
 static PianoStationInfo_t *get_station_info_by_id (APPSTATE *app, char *station_id) {
 	assert (app);
 	assert (station_id);
 	
-	PianoStation_t *station = PianoFindStationById (app->ph.stations, station_id);
+	PianoStation_t *station = PianoLookupStationById (&app->ph, station_id);
 	if (station) {
 		return (get_station_info (app, station));
 	}
@@ -282,14 +616,15 @@ void apply_station_info (APPSTATE *app) {
 
 
 
-/* Expire and refresh station data in the cache */
+/* Expire and refresh station data in the cache.  Songs are updated
+   when the new data arrives. */
 static void expire_station_info_by_id (APPSTATE *app, char *station) {
 	assert (station);
 	
 	STATIONINFO_CACHE *station_details = get_cached_station (station);
 	if (station_details) {
 		station_details->retrieved = 0;
-		apply_station_info (app);
+		refresh_station_info (app, station_details);
 	}
 }
 
@@ -462,8 +797,8 @@ void add_song_seed (APPSTATE *app, FB_EVENT *event,
 	PianoRequestDataAddSeed_t seedReq;
 	memset (&seedReq, 0, sizeof (seedReq));
 	if ((song = get_song_by_id_or_current (app, event, songid))) {
-		seedReq.station = stationName ? PianoFindStationByName(app->ph.stations, stationName)
-									  : PianoFindStationById(app->ph.stations, song->stationId);
+		seedReq.station = stationName ? PianoLookupStationByName (&app->ph, stationName)
+									  : PianoLookupStationById (&app->ph, song->stationId);
 		if (!seedReq.station) {
 			data_reply (event, E_NOTFOUND, "Station not found");
             return;
@@ -522,7 +857,7 @@ void remove_seed (APPSTATE *app, FB_EVENT *event, const char *seedid) {
 	memset (&reqData, 0, sizeof (reqData));
 	bool success = false;
 
-	STATIONINFO_CACHE *station = cache;
+	STATIONINFO_CACHE *station = cache_newest;
 	while (station) {
 		switch (type) {
 			case INFO_FEEDBACK:
@@ -567,7 +902,7 @@ void remove_seed (APPSTATE *app, FB_EVENT *event, const char *seedid) {
 		if (reqData.artist || reqData.song || reqData.station || feedback) {
 			break;
 		}
-		station = station->next;
+		station = station->older;
 	}
 	if (feedback) {
 		/* We stopped while going through feedback, so this is feedback */
@@ -581,6 +916,6 @@ void remove_seed (APPSTATE *app, FB_EVENT *event, const char *seedid) {
 	}
 	if (success) {
 		station->retrieved = 0;
-		apply_station_info(app);
+		refresh_station_info (app, station);
 	}
 }
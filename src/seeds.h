@@ -28,6 +28,8 @@ typedef enum station_info_types_t {
  
 extern void apply_station_info (APPSTATE *app);
 extern void destroy_station_info_cache (void);
+extern void restore_station_info (const char *filename);
+extern bool persist_station_info (const char *filename);
 
 extern bool song_has_artist_seed (const PianoSong_t *song);
 
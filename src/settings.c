@@ -238,7 +238,9 @@ void settings_get_config_dir (const char *package, const char *filename, char *r
  */
 void settings_initialize (BarSettings_t *settings) {
 	char password_file[PATH_MAX];
+	char station_info_file[PATH_MAX];
 	settings_get_config_dir (PACKAGE, "passwd", password_file, sizeof (password_file));
+	settings_get_config_dir (PACKAGE, "stationinfo", station_info_file, sizeof (station_info_file));
 
 	memset (settings, 0, sizeof (*settings));
 	
@@ -256,10 +258,13 @@ void settings_initialize (BarSettings_t *settings) {
 	settings->inkey = strdup ("R=U!LH$O2B#");
 	settings->outkey = strdup ("6#26FRL$ZWD");
 	settings->audioQuality = PIANO_AQ_MEDIUM;
+	settings->adaptive_quality = true;
 	settings->broadcast_user_actions = true;
 	settings->pause_timeout = 1800; /* Half hour */
+	settings->audio_buffer = 1000;
 	settings->playlist_expiration = 3600; /* One hour */
 	settings->user_file = strdup (password_file);
+	settings->station_info_file = strdup (station_info_file);
 	settings->automatic_mode = TUNE_ON_LOGINS;
 	settings->pandora_retry = 60;
 
@@ -291,6 +296,7 @@ void settings_destroy (BarSettings_t *settings) {
 	free (settings->outkey);
 	free (settings->control_proxy);
 	free (settings->proxy);
+	free (settings->station_info_file);
 	destroy_pandora_credentials (&settings->pending);
 	destroy_pandora_credentials (&settings->pandora);
 	memset (settings, 0, sizeof (*settings));
@@ -65,6 +65,7 @@ typedef struct {
 	mbedtls_x509_crt ca_certs;
 #endif
 	PianoAudioQuality_t audioQuality;
+	bool adaptive_quality; /* Choose audioQuality from measured bandwidth */
 	/* pianod */
 	unsigned int history_length;
 	in_port_t port;
@@ -74,12 +75,15 @@ typedef struct {
 	int pause_timeout;
 	int playlist_expiration;
 	char *user_file;
+	bool user_file_xml; /* Write user file as XML rather than binary */
+	char *station_info_file; /* Persisted station seeds & feedback */
 	AUTOTUNE_MODE automatic_mode;
 	/* libao audio output settings */
 	char *output_driver;
 	char *output_device;
 	char *output_id;
 	char *output_server;
+	int audio_buffer; /* Output buffer depth, milliseconds */
 } BarSettings_t;
 
 /* Functions dealing with dropping root privs */
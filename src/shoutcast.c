@@ -20,9 +20,15 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 */
-
 /* Shoutcast client service */
 
+/* The server setting is a comma separated list of connect strings, each
+   user:passwd@host:port/mount with everything but the host optional.  Each
+   becomes a sink with its own shout connection, sender thread and queue;
+   the player's data buffers are shared by all sinks and reference counted,
+   so one download feeds every mount.  A sink that falls behind drops data
+   rather than holding up the others. */
+
 #include <config.h>
 
 #include <stdio.h>
@@ -35,15 +41,16 @@ THE SOFTWARE.
 #include "piano.h"
 #include "shoutcast.h"
 
-struct _sc_service g_service;
-
 static const char ourname[] = "shout";
 
 void *sc_service_thread(void *);
 
 // icecast buffer handling (max free list size)
 #define ICY_MAX		(4)
-#define ICY_BFRMAXQ	(2 * ICY_MAX)
+// per-sink queue limit (buffers)
+#define SC_QUEUE_MAX	(8)
+// max outstanding buffers; a lagging sink and the others may hold different ones
+#define ICY_BFRMAXQ	(2 * (SC_QUEUE_MAX + 1))
 
 // WAITRESS_BUFFER_SIZE + 1 MP3 frame
 #define ICY_BUFSIZE	(10 * 1024 + (144 * (192000 / 44100)))
@@ -51,7 +58,7 @@ void *sc_service_thread(void *);
 
 // list of available shoutcast data buffers
 static stream_data *icy_head;
-pthread_mutex_t icy_mutex;	// Mutex for buffer list
+pthread_mutex_t icy_mutex;	// Mutex for buffer list and reference counts
 
 // count of allocated buffers (total outstanding)
 static int icy_bufcnt;
@@ -59,80 +66,146 @@ static int icy_bufcnt;
 // MP3 data for 0.1s of pink noise -80db (calm silence)
 #include "pink_silence.h"
 
-sc_service *sc_init_service(char *server_info)
+// Parse one connect string (user:passwd@host:port/mount) into a sink
+static int sc_parse_sink(sc_sink *sink, const char *spec)
 {
     char *tptr;
-	sc_service *svc = &g_service;
-
-	memset(&g_service, 0, sizeof(struct _sc_service));
 
-	shout_init();
-
-	if ((svc->shout = shout_new()) == NULL) {
-		flog(LOG_ERROR, "%s: shout_new(): %s", ourname, strerror(ENOMEM));
-		return NULL;
+	// Room to split the mount off the host
+	sink->si = malloc(strlen(spec) + 2);
+	if (!sink->si) {
+		return -1;
 	}
-
-	// Startup paused
-	svc->paused = 1;
-	if (server_info) {
-		svc->si = strdup(server_info);
-		// Parse server connect string (user:passwd@host:port)
-		// Break into user-part and host-part
-		tptr = strpbrk(svc->si, "@");
+	strcpy(sink->si, spec);
+	// Break into user-part and host-part
+	tptr = strpbrk(sink->si, "@");
+	if (tptr) {
+		// Have host part - check mount and port spec
+		*tptr++ = '\0';
+		sink->host = tptr;
+		tptr = strpbrk(tptr, "/");
 		if (tptr) {
-			// Have host part - check port spec
+			// Mount keeps its slash; shift it over to terminate the host
+			memmove(tptr + 1, tptr, strlen(tptr) + 1);
 			*tptr++ = '\0';
-			svc->host = tptr;
-			tptr = strpbrk(tptr, ":");
-			if (tptr) {
-                *tptr++ = '\0';
-                svc->port = tptr;
-			}
+			sink->mount = tptr;
 		}
-		// Maybe have user/pass
-		if (*svc->si) {
-			svc->user = svc->si;
-			tptr = strpbrk(svc->si, ":");
-			if (tptr) {
-                *tptr++ = '\0';
-                svc->passwd = tptr;
-			}
+		tptr = strpbrk(sink->host, ":");
+		if (tptr) {
+			*tptr++ = '\0';
+			sink->port = tptr;
+		}
+	}
+	// Maybe have user/pass
+	if (*sink->si) {
+		sink->user = sink->si;
+		tptr = strpbrk(sink->si, ":");
+		if (tptr) {
+			*tptr++ = '\0';
+			sink->passwd = tptr;
 		}
 	}
 
-	svc->mount = "/pandora";
-	svc->bitrate = "192";
+	if (!sink->mount || !sink->mount[1]) {
+		sink->mount = "/pandora";
+	}
+	sink->bitrate = "192";
+
+	// Startup paused
+	sink->paused = 1;
+	return 0;
+}
+
+sc_service *sc_init_service(char *server_info)
+{
+	sc_service *svc;
+	char *list, *spec, *save;
+
+	if ((svc = calloc(1, sizeof(struct _sc_service))) == NULL) {
+		flog(LOG_ERROR, "%s: sc_init_service(): %s", ourname, strerror(ENOMEM));
+		return NULL;
+	}
+
+	shout_init();
 
 	// Init icecast buffer list
 	pthread_mutex_init(&icy_mutex, NULL);
 	icy_head = NULL;
 	icy_bufcnt = 0;
 
+	// One sink per comma separated connect string (at least one)
+	list = strdup(server_info ? server_info : "");
+	if (!list) {
+		flog(LOG_ERROR, "%s: sc_init_service(): %s", ourname, strerror(ENOMEM));
+		sc_close_service(svc);
+		return NULL;
+	}
+	spec = strtok_r(list, ", ", &save);
+	do {
+		sc_sink *sinks = realloc(svc->sinks, (svc->sink_count + 1) * sizeof(sc_sink));
+		if (!sinks) {
+			flog(LOG_ERROR, "%s: sc_init_service(): %s", ourname, strerror(ENOMEM));
+			free(list);
+			sc_close_service(svc);
+			return NULL;
+		}
+		svc->sinks = sinks;
+		sc_sink *sink = &svc->sinks[svc->sink_count++];
+		memset(sink, 0, sizeof(sc_sink));
+
+		if ((sink->shout = shout_new()) == NULL) {
+			flog(LOG_ERROR, "%s: shout_new(): %s", ourname, strerror(ENOMEM));
+			free(list);
+			sc_close_service(svc);
+			return NULL;
+		}
+		if (sc_parse_sink(sink, spec ? spec : "")) {
+			flog(LOG_ERROR, "%s: sc_init_service(): %s", ourname, strerror(ENOMEM));
+			free(list);
+			sc_close_service(svc);
+			return NULL;
+		}
+	} while (spec && (spec = strtok_r(NULL, ", ", &save)));
+	free(list);
+
 	return svc;
 }
 
 void sc_close_service(sc_service *svc)
 {
 	void *threadRet;
+	struct threadmsg msg;
 	stream_data *temp;
+	int i;
 
-	// Terminate shout thread
-	if (svc->sc_thread) {
-		// Force exit if stalled
-		svc->state = SC_QUIT;
-		thread_queue_add(&svc->sc_queue, NULL, SCQUIT);
-		pthread_join(svc->sc_thread, &threadRet);
-	}
+	for (i = 0; i < svc->sink_count; i++) {
+		sc_sink *sink = &svc->sinks[i];
 
-	// Cleanup queue
-	thread_queue_cleanup(&svc->sc_queue, 0);
+		// Terminate shout thread
+		if (sink->sc_thread) {
+			// Force exit if stalled
+			sink->state = SC_QUIT;
+			thread_queue_add(&sink->sc_queue, NULL, SCQUIT);
+			pthread_join(sink->sc_thread, &threadRet);
+		}
 
-	if (svc->si)
-		free(svc->si);
+		// Cleanup queue, dropping our references to anything left in it
+		if (sink->queue_ready) {
+			while (thread_queue_length(&sink->sc_queue) > 0 &&
+				   thread_queue_get(&sink->sc_queue, NULL, &msg) == 0) {
+				if (msg.msgtype == SCDATA)
+					sc_buffer_release((stream_data *)msg.data);
+			}
+			thread_queue_cleanup(&sink->sc_queue, 0);
+		}
 
-	if (svc->shout)
-		shout_free(svc->shout);
+		if (sink->si)
+			free(sink->si);
+
+		if (sink->shout)
+			shout_free(sink->shout);
+	}
+	free(svc->sinks);
 
 	shout_shutdown();
 
@@ -145,14 +218,15 @@ void sc_close_service(sc_service *svc)
 	pthread_mutex_unlock(&icy_mutex);
 	pthread_mutex_destroy(&icy_mutex);
 
+	free(svc);
 	return;
 }
 
-int sc_stream_setup(sc_service *svc, char *station_name)
+static int sc_stream_setup(sc_sink *sink, char *station_name)
 {
-	shout_t *shout = svc->shout;
+	shout_t *shout = sink->shout;
 
-	if (shout_set_host(shout, (svc->host) ? svc->host : "localhost") != SHOUTERR_SUCCESS) {
+	if (shout_set_host(shout, (sink->host) ? sink->host : "localhost") != SHOUTERR_SUCCESS) {
 		flog(LOG_ERROR, "%s: shout_set_host(): %s", ourname, shout_get_error(shout));
 		return -1;
 	}
@@ -160,19 +234,19 @@ int sc_stream_setup(sc_service *svc, char *station_name)
 		flog(LOG_ERROR, "%s: shout_set_protocol(): %s", ourname, shout_get_error(shout));
 		return -1;
 	}
-	if (shout_set_port(shout, (svc->port) ? atoi(svc->port) : 8000) != SHOUTERR_SUCCESS) {
+	if (shout_set_port(shout, (sink->port) ? atoi(sink->port) : 8000) != SHOUTERR_SUCCESS) {
 		flog(LOG_ERROR, "%s: shout_set_port: %s", ourname, shout_get_error(shout));
 		return -1;
 	}
-	if (shout_set_user(shout, (svc->user) ? svc->user : "source") != SHOUTERR_SUCCESS) {
+	if (shout_set_user(shout, (sink->user) ? sink->user : "source") != SHOUTERR_SUCCESS) {
 		flog(LOG_ERROR, "%s: shout_set_user(): %s", ourname, shout_get_error(shout));
 		return -1;
 	}
-	if (shout_set_password(shout, (svc->passwd) ? svc->passwd : "hackme") != SHOUTERR_SUCCESS) {
+	if (shout_set_password(shout, (sink->passwd) ? sink->passwd : "hackme") != SHOUTERR_SUCCESS) {
 		flog(LOG_ERROR, "%s: shout_set_password(): %s", ourname, shout_get_error(shout));
 		return -1;
 	}
-	if (shout_set_mount(shout, svc->mount) != SHOUTERR_SUCCESS) {
+	if (shout_set_mount(shout, sink->mount) != SHOUTERR_SUCCESS) {
 		flog(LOG_ERROR, "%s: shout_set_mount(): %s", ourname, shout_get_error(shout));
 		return -1;
 	}
@@ -200,7 +274,7 @@ int sc_stream_setup(sc_service *svc, char *station_name)
 		flog(LOG_ERROR, "%s: shout_set_description(): %s", ourname, shout_get_error(shout));
 		return -1;
 	}
-	if (shout_set_audio_info(shout, SHOUT_AI_BITRATE, svc->bitrate) != SHOUTERR_SUCCESS) {
+	if (shout_set_audio_info(shout, SHOUT_AI_BITRATE, sink->bitrate) != SHOUTERR_SUCCESS) {
 		flog(LOG_ERROR, "%s: shout_set_audio_info(AI_BITRATE): %s", ourname, shout_get_error(shout));
 		return -1;
 	}
@@ -222,54 +296,63 @@ int sc_stream_setup(sc_service *svc, char *station_name)
 	return 0;
 }
 
-int sc_shout_connect(sc_service *svc, int retry)
+static int sc_shout_connect(sc_sink *sink, int retry)
 {
-	flog(LOG_STATUS, "%s: Connecting to %s...", ourname, svc->host);
+	flog(LOG_STATUS, "%s: Connecting to %s%s...", ourname,
+	     (sink->host) ? sink->host : "localhost", sink->mount);
 
 	while (1) {
-		if (shout_open(svc->shout) == SHOUTERR_SUCCESS) {
-			flog(LOG_STATUS, "%s: Connect to %s successful",
-			     ourname, svc->host);
+		if (shout_open(sink->shout) == SHOUTERR_SUCCESS) {
+			flog(LOG_STATUS, "%s: Connect to %s%s successful", ourname,
+			     (sink->host) ? sink->host : "localhost", sink->mount);
 			return 0;
 		}
 
 		// re-try forever if true
-		if (!retry || (svc->state == SC_QUIT))
+		if (!retry || (sink->state == SC_QUIT))
 		    break;
 
 		// sleep then try again
 		sleep(1);
 	}
 
-	flog(LOG_STATUS, "%s: Connect FAILED: %s", ourname, shout_get_error(svc->shout));
+	flog(LOG_STATUS, "%s: Connect FAILED: %s", ourname, shout_get_error(sink->shout));
 
 	return 1;
 }
 
-int sc_start_service(sc_service *svc, char *station_name)
+static int sc_start_sink(sc_sink *sink, char *station_name)
 {
 	// Do nothing if already running
-	if (svc->state == SC_RUNNING)
+	if (sink->state == SC_RUNNING)
 		return 0;
 
 	// Init shout queue
-	if (thread_queue_init(&svc->sc_queue)) {
-		flog(LOG_ERROR, "%s: thread_queue_init() failed", ourname);
-		return -1;
+	if (!sink->queue_ready) {
+		if (thread_queue_init(&sink->sc_queue)) {
+			flog(LOG_ERROR, "%s: thread_queue_init() failed", ourname);
+			return -1;
+		}
+		sink->queue_ready = 1;
 	}
 
-	if (sc_stream_setup(svc, station_name)) {
+	if (sc_stream_setup(sink, station_name)) {
 		flog(LOG_ERROR, "%s: sc_stream_setup() failed", ourname);
 		return -1;
 	}
 
 	// Connect to icecast and startup shout thread (paused mode)
-	if (sc_shout_connect(svc, 0) == 0) {
-		flog(LOG_STATUS, "%s: Connected to http://%s:%hu%s", ourname,
-		       svc->host, svc->port, svc->mount);
-
-		if (pthread_create(&svc->sc_thread, NULL, sc_service_thread, svc) != 0) {
-			shout_close(svc->shout);
+	if (sc_shout_connect(sink, 0) == 0) {
+		flog(LOG_STATUS, "%s: Connected to http://%s:%s%s", ourname,
+		     (sink->host) ? sink->host : "localhost",
+		     (sink->port) ? sink->port : "8000", sink->mount);
+
+		// Running before the thread starts, so no data is dropped meanwhile
+		sink->state = SC_RUNNING;
+		if (pthread_create(&sink->sc_thread, NULL, sc_service_thread, sink) != 0) {
+			sink->state = SC_IDLE;
+			sink->sc_thread = 0;
+			shout_close(sink->shout);
 			return -1;
 		}
 		return 0;
@@ -278,36 +361,51 @@ int sc_start_service(sc_service *svc, char *station_name)
 	return -1;
 }
 
+// Start any sinks not running; fails only if none are
+int sc_start_service(sc_service *svc, char *station_name)
+{
+	int i;
+	int running = 0;
+
+	for (i = 0; i < svc->sink_count; i++) {
+		if (sc_start_sink(&svc->sinks[i], station_name) == 0)
+			running++;
+	}
+
+	return (running) ? 0 : -1;
+}
+
 void *sc_service_thread(void *arg)
 {
-	sc_service *svc = (sc_service *)arg;
+	sc_sink *sink = (sc_sink *)arg;
 
 	struct threadmsg msg;
 	struct timespec ts;
 	stream_data *data;
+	stream_data *held = NULL;	// Buffer awaiting a re-send, if any
 	int ret;
 	int delay;
 	int retry = 0;
 
-	flog(LOG_STATUS, "%s: sc_service_thread started", ourname);
-
-	svc->state = SC_RUNNING;
+	flog(LOG_STATUS, "%s: sc_service_thread started for %s", ourname, sink->mount);
 
 	while(1) {
 		// Check if still connected
-		if (shout_get_connected(svc->shout) != SHOUTERR_CONNECTED) {
+		if (shout_get_connected(sink->shout) != SHOUTERR_CONNECTED) {
 			// Handle reconnect, etc.
 			flog(LOG_WARNING, "%s: Service disconnected", ourname);
-			shout_close(svc->shout);
+			shout_close(sink->shout);
 			// Reconnect (wait forever)
-			sc_shout_connect(svc, 1);
+			sc_shout_connect(sink, 1);
+			if (sink->state == SC_QUIT)
+				break;
 			// Re-try (cleanup) queue
 			continue;
 		}
 
 		if (!retry) {
 			// Determine send delay
-			delay = shout_delay(svc->shout);
+			delay = shout_delay(sink->shout);
 			ts.tv_sec = 0;
 			if (delay >= 1000) {
 				ts.tv_sec = delay / 1000;
@@ -315,16 +413,16 @@ void *sc_service_thread(void *arg)
 			}
 			ts.tv_nsec = delay * 1000;
 
-			ret = thread_queue_get(&svc->sc_queue, &ts, &msg);
+			ret = thread_queue_get(&sink->sc_queue, &ts, &msg);
 			if (ret == ETIMEDOUT) {
 				// No data - send silence
-				ret = shout_send(svc->shout, mp3_silence, mp3_silence_len);
+				ret = shout_send(sink->shout, mp3_silence, mp3_silence_len);
 				if (ret != SHOUTERR_SUCCESS) {
 					flog(LOG_WARNING, "%s: Service disconnected", ourname);
 					// Handle reconnect, etc
-					shout_close(svc->shout);
+					shout_close(sink->shout);
 					// Reconnect (wait forever)
-					sc_shout_connect(svc, 1);
+					sc_shout_connect(sink, 1);
 				}
 				// Re-try msg queue
 				continue;
@@ -335,29 +433,33 @@ void *sc_service_thread(void *arg)
 		    case SCDATA:
 			data = (stream_data *)msg.data;
 			// Make sure output stream is ready
-			shout_sync(svc->shout);
-			ret = shout_send(svc->shout, &data->buf[0], data->len);
-			if (ret != SHOUTERR_SUCCESS) {
+			shout_sync(sink->shout);
+			ret = shout_send(sink->shout, &data->buf[0], data->len);
+			if (ret != SHOUTERR_SUCCESS && sink->state != SC_QUIT) {
 				flog(LOG_WARNING, "%s: Service disconnected", ourname);
 				// Handle reconnect, etc
-				sc_shout_connect(svc, 1);
+				sc_shout_connect(sink, 1);
+				held = data;
 				retry = 1;
 				break;
 			}
 
-			// Release data
+			// Release our reference
 			sc_buffer_release(data);
+			held = NULL;
 			retry = 0;
 			break;
 
 		    case SCQUIT:
 			// cleanup and exit thread
-			shout_close(svc->shout);
-			svc->state = SC_IDLE;
+			if (held)
+				sc_buffer_release(held);
+			shout_close(sink->shout);
+			sink->state = SC_IDLE;
 			return 0;
 
 		    case SCPAUSE:
-			svc->paused = (svc->paused) ? 0 : 1;
+			sink->paused = (sink->paused) ? 0 : 1;
 			break;
 
 		    default:
@@ -366,14 +468,18 @@ void *sc_service_thread(void *arg)
 		}
 	}
 
-	svc->state = SC_IDLE;
+	// Quit while waiting to re-send; drop our reference
+	if (held)
+		sc_buffer_release(held);
+	shout_close(sink->shout);
+	sink->state = SC_IDLE;
 	return 0;
 }
 
-int sc_set_metadata(sc_service *svc, PianoSong_t *song)
+static void sc_sink_metadata(sc_sink *sink, PianoSong_t *song)
 {
 	shout_metadata_t *sc_meta;
-	shout_t *shout = svc->shout;
+	shout_t *shout = sink->shout;
 
 	sc_meta = shout_metadata_new();
 	if (sc_meta) {
@@ -398,18 +504,28 @@ int sc_set_metadata(sc_service *svc, PianoSong_t *song)
 					shout_get_error(shout));
 		}
 #endif
-		if (shout_set_metadata_utf8(svc->shout, sc_meta) != SHOUTERR_SUCCESS) {
+		if (shout_set_metadata_utf8(shout, sc_meta) != SHOUTERR_SUCCESS) {
 			flog(LOG_ERROR, "%s: shout_set_metadata(): %s", ourname,
 					shout_get_error(shout));
 		}
 
 		shout_metadata_free(sc_meta);
 	}
+}
+
+int sc_set_metadata(sc_service *svc, PianoSong_t *song)
+{
+	int i;
+
+	for (i = 0; i < svc->sink_count; i++) {
+		if (svc->sinks[i].state == SC_RUNNING)
+			sc_sink_metadata(&svc->sinks[i], song);
+	}
 
 	return 0;
 }
 
-// Allocate a stream data buffer
+// Allocate a stream data buffer, holding one reference for the caller
 stream_data *sc_buffer_get(size_t len)
 {
 	stream_data *newbuf;
@@ -439,11 +555,14 @@ stream_data *sc_buffer_get(size_t len)
 		// return buffer (set size used)
 		if (newbuf) {
 			newbuf->len = len;
+			newbuf->refs = 1;
 			newbuf->next = NULL;
 			return newbuf;
 		}
 
+		pthread_mutex_lock(&icy_mutex);
 		icy_bufcnt--;
+		pthread_mutex_unlock(&icy_mutex);
 		flog(LOG_ERROR, "%s: sc_buffer_get(): %s", ourname, strerror(ENOMEM));
 		return NULL;
 	}
@@ -456,6 +575,7 @@ stream_data *sc_buffer_get(size_t len)
 	// return buffer
 	if (newbuf) {
 		newbuf->len = len;
+		newbuf->refs = 1;
 		newbuf->next = (void *)0xFFFFFFFF;
 		return newbuf;
 	}
@@ -464,19 +584,25 @@ stream_data *sc_buffer_get(size_t len)
 	return NULL;
 }
 
-// Release buffer (free it if list is full)
+// Drop a reference; the last one returns the buffer (or frees it if list is full)
 void sc_buffer_release(stream_data *bfr)
 {
 	stream_data *temp;
 
+	pthread_mutex_lock(&icy_mutex);
+
+	if (--bfr->refs > 0) {
+		pthread_mutex_unlock(&icy_mutex);
+		return;
+	}
+
 	// Check for special and free it immediately
 	if (bfr->next == (void *)0xFFFFFFFF) {
+		pthread_mutex_unlock(&icy_mutex);
 		free(bfr);
 		return;
 	}
 
-	pthread_mutex_lock(&icy_mutex);
-
 	// Check for max free buffers
 	if (icy_bufcnt > ICY_MAX) {
 		icy_bufcnt--;
@@ -497,16 +623,35 @@ void sc_buffer_release(stream_data *bfr)
 	return;
 }
 
-// Add buffer to queue if service is connected and running
+// Add buffer to the queue of every connected and running sink; the
+// caller's reference is consumed
 void sc_queue_add(sc_service *svc, stream_data *bfr, int mtype)
 {
-	// Just dump buffer if thread not running
-	if (svc->state != SC_RUNNING) {
-		sc_buffer_release(bfr);
-		return;
+	int i;
+
+	for (i = 0; i < svc->sink_count; i++) {
+		sc_sink *sink = &svc->sinks[i];
+
+		// Skip sinks whose thread isn't running
+		if (sink->state != SC_RUNNING)
+			continue;
+
+		// Don't let a slow server hold up the others
+		if (mtype == SCDATA && thread_queue_length(&sink->sc_queue) >= SC_QUEUE_MAX) {
+			if (sink->dropped++ == 0)
+				flog(LOG_WARNING, "%s: %s is falling behind, dropping data", ourname, sink->mount);
+			continue;
+		}
+		sink->dropped = 0;
+
+		pthread_mutex_lock(&icy_mutex);
+		bfr->refs++;
+		pthread_mutex_unlock(&icy_mutex);
+		if (thread_queue_add(&sink->sc_queue, bfr, mtype) != 0)
+			sc_buffer_release(bfr);
 	}
 
-	thread_queue_add(&svc->sc_queue, bfr, mtype);
+	sc_buffer_release(bfr);
 
 	return;
 }
@@ -30,7 +30,8 @@ THE SOFTWARE.
 
 #include "threadqueue.h"
 
-struct _sc_service {
+// One Icecast server/mount; each has its own sender thread and queue
+struct _sc_sink {
 	shout_t	*shout;
 	pthread_t sc_thread;
 	int paused;		// Sends silence
@@ -49,6 +50,16 @@ struct _sc_service {
 
 	// buffer & message queue
 	struct threadqueue sc_queue;
+	int queue_ready;
+	unsigned long dropped;	// Buffers skipped because the queue was full
+};
+
+typedef struct _sc_sink sc_sink;
+
+// Relay: the same stream to every sink
+struct _sc_service {
+	int sink_count;
+	sc_sink *sinks;
 };
 
 typedef struct _sc_service sc_service;
@@ -62,8 +73,10 @@ typedef struct _sc_service sc_service;
 #define SC_RUNNING	(2)
 
 
+// Shared by all sinks; released when the last reference is dropped
 struct _stream_data {
 	struct _stream_data *next;
+	int refs;
 	size_t len;
 	unsigned char buf[];
 };
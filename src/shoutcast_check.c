@@ -0,0 +1,401 @@
+/*
+ *  shoutcast_check.c
+ *  pianod - Relays a stream to three Icecast mounts through a fake
+ *  libshout, one of them slow, and checks buffer references and queue
+ *  bounds; then a failed send that is re-sent, and a sink quitting while
+ *  it waits to re-send.  Run by "make check".
+ *
+ *  shoutcast.c is included, so the check can see its buffer pool.
+ *
+ */
+
+#include "shoutcast.c"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#define CHECK_SINKS (3)
+#define CHECK_SLOW (2) /* The sink that falls behind */
+#define CHECK_BUFFERS (300)
+#define CHECK_TIMEOUT (10) /* Seconds to wait for a sink */
+
+static const char check_servers [] =
+	"source:pw0@localhost:8001/sink0,source:pw1@127.0.0.1:8002/sink1, source:pw2@localhost:8003/sink2";
+
+/* What the fake Icecast server behind each mount saw, and how it behaves */
+typedef struct fake_sink_t {
+	unsigned int send_time; /* Microseconds each send takes */
+	int fail_sends; /* Data sends to fail; -1 fails all */
+	bool refuse_open; /* Connection attempts fail */
+	bool connected;
+	unsigned long received; /* Data buffers */
+	long last_sequence;
+	bool seen [CHECK_BUFFERS + 1];
+	bool out_of_order;
+	bool corrupt; /* A buffer changed while queued */
+	unsigned long silence;
+	unsigned long failures;
+	unsigned long open_attempts;
+} FAKE_SINK;
+
+static FAKE_SINK fake [CHECK_SINKS];
+static pthread_mutex_t fake_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+struct shout {
+	int sink; /* From the mount name */
+};
+
+
+/* Fake libshout */
+void shout_init (void) {
+}
+
+void shout_shutdown (void) {
+}
+
+shout_t *shout_new (void) {
+	return calloc (1, sizeof (shout_t));
+}
+
+void shout_free (shout_t *self) {
+	free (self);
+}
+
+const char *shout_get_error (shout_t *self) {
+	return "fake error";
+}
+
+int shout_set_host (shout_t *self, const char *host) { return SHOUTERR_SUCCESS; }
+int shout_set_protocol (shout_t *self, unsigned int protocol) { return SHOUTERR_SUCCESS; }
+int shout_set_port (shout_t *self, unsigned short port) { return SHOUTERR_SUCCESS; }
+int shout_set_user (shout_t *self, const char *username) { return SHOUTERR_SUCCESS; }
+int shout_set_password (shout_t *self, const char *password) { return SHOUTERR_SUCCESS; }
+int shout_set_content_format (shout_t *self, unsigned int format, unsigned int usage, const char *codecs) { return SHOUTERR_SUCCESS; }
+int shout_set_meta (shout_t *self, const char *name, const char *value) { return SHOUTERR_SUCCESS; }
+int shout_set_audio_info (shout_t *self, const char *name, const char *value) { return SHOUTERR_SUCCESS; }
+int shout_set_public (shout_t *self, unsigned int make_public) { return SHOUTERR_SUCCESS; }
+
+int shout_set_mount (shout_t *self, const char *mount) {
+	self->sink = atoi (mount + strlen ("/sink"));
+	return (self->sink >= 0 && self->sink < CHECK_SINKS) ? SHOUTERR_SUCCESS : SHOUTERR_SOCKET;
+}
+
+int shout_open (shout_t *self) {
+	pthread_mutex_lock (&fake_mutex);
+	FAKE_SINK *sink = &fake [self->sink];
+	sink->open_attempts++;
+	sink->connected = !sink->refuse_open;
+	pthread_mutex_unlock (&fake_mutex);
+	return sink->connected ? SHOUTERR_SUCCESS : SHOUTERR_SOCKET;
+}
+
+int shout_close (shout_t *self) {
+	pthread_mutex_lock (&fake_mutex);
+	fake [self->sink].connected = false;
+	pthread_mutex_unlock (&fake_mutex);
+	return SHOUTERR_SUCCESS;
+}
+
+int shout_get_connected (shout_t *self) {
+	pthread_mutex_lock (&fake_mutex);
+	bool connected = fake [self->sink].connected;
+	pthread_mutex_unlock (&fake_mutex);
+	return connected ? SHOUTERR_CONNECTED : SHOUTERR_UNCONNECTED;
+}
+
+int shout_delay (shout_t *self) {
+	return 999;
+}
+
+void shout_sync (shout_t *self) {
+}
+
+/* Data buffers start with their sequence number, and the rest follows from it */
+static void fill_buffer (stream_data *bfr, uint32_t sequence) {
+	memcpy (bfr->buf, &sequence, sizeof (sequence));
+	for (size_t i = sizeof (sequence); i < bfr->len; i++) {
+		bfr->buf [i] = (sequence + i) & 0xff;
+	}
+}
+
+int shout_send (shout_t *self, const unsigned char *data, size_t len) {
+	pthread_mutex_lock (&fake_mutex);
+	FAKE_SINK *sink = &fake [self->sink];
+	if (data == mp3_silence) {
+		sink->silence++;
+		pthread_mutex_unlock (&fake_mutex);
+		return SHOUTERR_SUCCESS;
+	}
+	if (sink->fail_sends != 0) {
+		if (sink->fail_sends > 0) {
+			sink->fail_sends--;
+		}
+		sink->failures++;
+		sink->connected = false;
+		pthread_mutex_unlock (&fake_mutex);
+		return SHOUTERR_SOCKET;
+	}
+	unsigned int send_time = sink->send_time;
+	uint32_t sequence;
+	memcpy (&sequence, data, sizeof (sequence));
+	for (size_t i = sizeof (sequence); i < len; i++) {
+		if (data [i] != ((sequence + i) & 0xff)) {
+			sink->corrupt = true;
+			break;
+		}
+	}
+	if (sequence > CHECK_BUFFERS || sink->seen [sequence] || (long) sequence <= sink->last_sequence) {
+		sink->out_of_order = true;
+	} else {
+		sink->seen [sequence] = true;
+		sink->last_sequence = sequence;
+	}
+	sink->received++;
+	pthread_mutex_unlock (&fake_mutex);
+	if (send_time) {
+		usleep (send_time);
+	}
+	return SHOUTERR_SUCCESS;
+}
+
+shout_metadata_t *shout_metadata_new (void) {
+	static int metadata;
+	return (shout_metadata_t *) &metadata;
+}
+
+void shout_metadata_free (shout_metadata_t *self) {
+}
+
+int shout_metadata_add (shout_metadata_t *self, const char *name, const char *value) {
+	return SHOUTERR_SUCCESS;
+}
+
+int shout_set_metadata_utf8 (shout_t *self, shout_metadata_t *metadata) {
+	return SHOUTERR_SUCCESS;
+}
+
+
+/* Wait for a condition on the fake sinks, or give up */
+typedef bool (*CONDITION) (int sink, long value);
+
+static bool wait_for (CONDITION condition, int sink, long value) {
+	time_t give_up = time (NULL) + CHECK_TIMEOUT;
+	while (true) {
+		pthread_mutex_lock (&fake_mutex);
+		bool done = condition (sink, value);
+		pthread_mutex_unlock (&fake_mutex);
+		if (done) {
+			return true;
+		}
+		if (time (NULL) > give_up) {
+			return false;
+		}
+		usleep (100);
+	}
+}
+
+static bool sent (int sink, long sequence) {
+	return fake [sink].last_sequence >= sequence;
+}
+
+static bool silent_since (int sink, long silence) {
+	return fake [sink].silence > (unsigned long) silence;
+}
+
+static bool reconnecting (int sink, long attempts) {
+	return fake [sink].open_attempts > (unsigned long) attempts;
+}
+
+static bool failed (const char *what) {
+	fprintf (stderr, "shoutcast_check: %s\n", what);
+	return false;
+}
+
+/* Relay one data buffer; the queue and pool bounds must hold afterwards */
+static bool relay (sc_service *svc, uint32_t sequence, size_t len, unsigned long *dropped) {
+	stream_data *bfr = sc_buffer_get (len);
+	if (!bfr) {
+		return failed ("buffer pool overdrawn");
+	}
+	fill_buffer (bfr, sequence);
+	sc_queue_add (svc, bfr, SCDATA);
+	for (int i = 0; i < svc->sink_count; i++) {
+		if (thread_queue_length (&svc->sinks [i].sc_queue) > SC_QUEUE_MAX) {
+			return failed ("sink queue over its bound");
+		}
+	}
+	pthread_mutex_lock (&icy_mutex);
+	bool overdrawn = (icy_bufcnt > ICY_BFRMAXQ + 1);
+	pthread_mutex_unlock (&icy_mutex);
+	if (overdrawn) {
+		return failed ("more buffers outstanding than the pool allows");
+	}
+	if (dropped && svc->sinks [CHECK_SLOW].dropped > *dropped) {
+		*dropped = svc->sinks [CHECK_SLOW].dropped;
+	}
+	return true;
+}
+
+static size_t buffer_size (uint32_t sequence) {
+	/* Now and then one too big for the pool */
+	return (sequence % 50 == 49) ? ICY_BUFSIZE + 100 : 1000 + (sequence * 37) % 9000;
+}
+
+/* Every buffer must be back in the pool, with no references left */
+static bool pool_idle (void) {
+	int pooled = 0;
+	bool referenced = false;
+	pthread_mutex_lock (&icy_mutex);
+	for (stream_data *bfr = icy_head; bfr; bfr = bfr->next) {
+		pooled++;
+		referenced = referenced || bfr->refs != 0;
+	}
+	int outstanding = icy_bufcnt;
+	pthread_mutex_unlock (&icy_mutex);
+	if (referenced || pooled != outstanding) {
+		fprintf (stderr, "shoutcast_check: %d buffers allocated, %d back in the pool%s\n",
+				 outstanding, pooled, referenced ? ", some still referenced" : "");
+		return false;
+	}
+	return true;
+}
+
+static bool check_parsing (sc_service *svc) {
+	static const char *hosts [] = { "localhost", "127.0.0.1", "localhost" };
+	static const char *ports [] = { "8001", "8002", "8003" };
+	static const char *mounts [] = { "/sink0", "/sink1", "/sink2" };
+	static const char *passwords [] = { "pw0", "pw1", "pw2" };
+	if (svc->sink_count != CHECK_SINKS) {
+		return failed ("wrong number of sinks");
+	}
+	for (int i = 0; i < CHECK_SINKS; i++) {
+		sc_sink *sink = &svc->sinks [i];
+		if (!sink->host || strcmp (sink->host, hosts [i]) != 0 ||
+			!sink->port || strcmp (sink->port, ports [i]) != 0 ||
+			!sink->mount || strcmp (sink->mount, mounts [i]) != 0 ||
+			!sink->user || strcmp (sink->user, "source") != 0 ||
+			!sink->passwd || strcmp (sink->passwd, passwords [i]) != 0) {
+			return failed ("connect string parsed wrong");
+		}
+	}
+	return true;
+}
+
+int main (void) {
+	for (int i = 0; i < CHECK_SINKS; i++) {
+		fake [i].last_sequence = -1;
+	}
+	sc_service *svc = sc_init_service ((char *) check_servers);
+	if (!svc || !check_parsing (svc)) {
+		return 1;
+	}
+	if (sc_start_service (svc, "Check Radio") != 0) {
+		return failed ("service did not start");
+	}
+
+	/* The slow sink falls behind; the others must get everything,
+	   without waiting for it */
+	fake [CHECK_SLOW].send_time = 3000;
+	unsigned long dropped = 0;
+	uint32_t sequence;
+	for (sequence = 0; sequence < CHECK_BUFFERS - 30; sequence++) {
+		if (!relay (svc, sequence, buffer_size (sequence), &dropped)) {
+			return 1;
+		}
+		for (int i = 0; i < CHECK_SINKS; i++) {
+			if (i != CHECK_SLOW && !wait_for (sent, i, sequence)) {
+				return failed ("a fast sink waited for the slow one");
+			}
+		}
+	}
+	for (int i = 0; i < CHECK_SINKS; i++) {
+		if (i != CHECK_SLOW && fake [i].received != sequence) {
+			return failed ("a fast sink missed data");
+		}
+	}
+	if (dropped == 0 || fake [CHECK_SLOW].received == 0 || fake [CHECK_SLOW].received >= sequence) {
+		return failed ("the slow sink did not fall behind");
+	}
+
+	/* Let the slow sink catch up; once every sink is idle, every buffer
+	   must be back in the pool */
+	pthread_mutex_lock (&fake_mutex);
+	fake [CHECK_SLOW].send_time = 0;
+	pthread_mutex_unlock (&fake_mutex);
+	for (int i = 0; i < CHECK_SINKS; i++) {
+		time_t give_up = time (NULL) + CHECK_TIMEOUT;
+		while (thread_queue_length (&svc->sinks [i].sc_queue) > 0 && time (NULL) <= give_up) {
+			usleep (100);
+		}
+		pthread_mutex_lock (&fake_mutex);
+		long silence = fake [i].silence;
+		pthread_mutex_unlock (&fake_mutex);
+		if (!wait_for (silent_since, i, silence)) {
+			return failed ("a sink did not go idle");
+		}
+	}
+	if (!pool_idle ()) {
+		return 1;
+	}
+
+	/* A failed send is re-sent once the sink reconnects */
+	pthread_mutex_lock (&fake_mutex);
+	fake [1].fail_sends = 1;
+	pthread_mutex_unlock (&fake_mutex);
+	for (; sequence < CHECK_BUFFERS; sequence++) {
+		if (!relay (svc, sequence, buffer_size (sequence), NULL)) {
+			return 1;
+		}
+		for (int i = 0; i < CHECK_SINKS; i++) {
+			if (!wait_for (sent, i, sequence)) {
+				return failed ("a sink stopped after a failed send");
+			}
+		}
+	}
+	if (fake [1].failures != 1 || !fake [1].seen [CHECK_BUFFERS - 30]) {
+		return failed ("the failed buffer was not re-sent");
+	}
+
+	/* The slow sink's server goes away while it holds a buffer to re-send;
+	   closing the service must drop that reference.  We keep one of our own
+	   to see what is left. */
+	pthread_mutex_lock (&fake_mutex);
+	fake [CHECK_SLOW].fail_sends = -1;
+	fake [CHECK_SLOW].refuse_open = true;
+	long attempts = fake [CHECK_SLOW].open_attempts;
+	pthread_mutex_unlock (&fake_mutex);
+	stream_data *held = sc_buffer_get (1000);
+	if (!held) {
+		return failed ("buffer pool overdrawn");
+	}
+	fill_buffer (held, sequence);
+	pthread_mutex_lock (&icy_mutex);
+	held->refs++;
+	pthread_mutex_unlock (&icy_mutex);
+	sc_queue_add (svc, held, SCDATA);
+	if (!wait_for (reconnecting, CHECK_SLOW, attempts) ||
+		!wait_for (sent, 0, sequence) || !wait_for (sent, 1, sequence)) {
+		return failed ("the slow sink never tried to reconnect");
+	}
+	sc_close_service (svc);
+	if (held->refs != 1) {
+		fprintf (stderr, "shoutcast_check: %d references left on a buffer held for re-sending, expected 1\n",
+				 held->refs);
+		return 1;
+	}
+	free (held);
+
+	for (int i = 0; i < CHECK_SINKS; i++) {
+		if (fake [i].out_of_order) {
+			return failed ("data sent out of order or twice");
+		}
+		if (fake [i].corrupt) {
+			return failed ("a buffer changed while it was queued");
+		}
+	}
+	printf ("shoutcast_check: %d sinks, %u buffers, slow sink sent %lu and dropped up to %lu in a row\n",
+			CHECK_SINKS, (unsigned) sequence, fake [CHECK_SLOW].received, dropped);
+	return 0;
+}
@@ -0,0 +1,369 @@
+/*
+ *  snapshot.c
+ *  pianod - Compact binary snapshot of user data.
+ *
+ *  Snapshots are written from in-memory tables.  On reading, the file
+ *  is mapped and validated; records are read in place, while the string
+ *  table is copied once into a block that stays allocated so strings can
+ *  be used without copying each of them.  snapshot_free() knows not to
+ *  free those strings individually.
+ *
+ */
+
+#ifndef __FreeBSD__
+#define _DEFAULT_SOURCE /* mmap() */
+#endif
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fb_public.h>
+
+#include "logging.h"
+#include "snapshot.h"
+
+struct snapshot_writer_t {
+	bool failed;
+	SNAPSHOT_USER *users;
+	size_t user_count;
+	size_t user_capacity;
+	SNAPSHOT_RATING *ratings;
+	size_t rating_count;
+	size_t rating_capacity;
+	char *strings;
+	size_t string_size;
+	size_t string_capacity;
+	uint32_t *interned; /* Hash of string offset + 1; 0 for empty slots */
+	size_t interned_count;
+	size_t interned_capacity; /* A power of 2 */
+};
+
+struct snapshot_t {
+	void *map;
+	size_t map_size;
+	const SNAPSHOT_HEADER *header;
+	const SNAPSHOT_USER *users;
+	const SNAPSHOT_RATING *ratings;
+	char *strings; /* Retained copy of the string table */
+};
+
+/* String tables retained from snapshots, so their strings stay valid */
+typedef struct retained_strings_t {
+	char *strings;
+	size_t size;
+	struct retained_strings_t *next;
+} RETAINED_STRINGS;
+
+static RETAINED_STRINGS *retained_strings;
+
+
+/* FNV-1a hash */
+static uint32_t hash_string (const char *value) {
+	uint32_t hash = 2166136261u;
+	while (*value) {
+		hash = (hash ^ (unsigned char) *value++) * 16777619u;
+	}
+	return hash;
+}
+
+
+SNAPSHOT_WRITER *snapshot_writer_create (void) {
+	SNAPSHOT_WRITER *writer = calloc (1, sizeof (*writer));
+	if (!writer) {
+		perror ("snapshot_writer_create:calloc");
+	}
+	return writer;
+}
+
+void snapshot_writer_destroy (SNAPSHOT_WRITER *writer) {
+	if (writer) {
+		free (writer->users);
+		free (writer->ratings);
+		free (writer->strings);
+		free (writer->interned);
+		free (writer);
+	}
+}
+
+/* Double the intern table and rehash existing strings into it */
+static bool expand_interned (SNAPSHOT_WRITER *writer) {
+	size_t capacity = writer->interned_capacity ? writer->interned_capacity * 2 : 256;
+	uint32_t *interned = calloc (capacity, sizeof (*interned));
+	if (!interned) {
+		perror ("expand_interned:calloc");
+		return false;
+	}
+	for (size_t i = 0; i < writer->interned_capacity; i++) {
+		if (writer->interned [i]) {
+			size_t slot = hash_string (writer->strings + writer->interned [i] - 1) & (capacity - 1);
+			while (interned [slot]) {
+				slot = (slot + 1) & (capacity - 1);
+			}
+			interned [slot] = writer->interned [i];
+		}
+	}
+	free (writer->interned);
+	writer->interned = interned;
+	writer->interned_capacity = capacity;
+	return true;
+}
+
+/* Add a string to the snapshot's string table, unless it's already there.
+   Returns the string's offset.  Failures are reported by snapshot_write. */
+uint32_t snapshot_string (SNAPSHOT_WRITER *writer, const char *value) {
+	assert (writer);
+	if (!value) {
+		return SNAPSHOT_NONE;
+	}
+	if (writer->interned_count * 2 >= writer->interned_capacity && !expand_interned (writer)) {
+		writer->failed = true;
+		return SNAPSHOT_NONE;
+	}
+	size_t mask = writer->interned_capacity - 1;
+	size_t slot = hash_string (value) & mask;
+	while (writer->interned [slot]) {
+		if (strcmp (writer->strings + writer->interned [slot] - 1, value) == 0) {
+			return writer->interned [slot] - 1;
+		}
+		slot = (slot + 1) & mask;
+	}
+	size_t length = strlen (value) + 1;
+	if (writer->string_size + length >= SNAPSHOT_NONE ||
+		!fb_expandcalloc ((void **) &writer->strings, &writer->string_capacity,
+						  writer->string_size + length, 1)) {
+		perror ("snapshot_string");
+		writer->failed = true;
+		return SNAPSHOT_NONE;
+	}
+	uint32_t offset = writer->string_size;
+	memcpy (writer->strings + offset, value, length);
+	writer->string_size += length;
+	writer->interned [slot] = offset + 1;
+	writer->interned_count++;
+	return offset;
+}
+
+/* Append a station rating to the rating array */
+void snapshot_add_rating (SNAPSHOT_WRITER *writer, const char *station_id, unsigned int rating) {
+	assert (writer);
+	assert (station_id);
+	if (!fb_expandcalloc ((void **) &writer->ratings, &writer->rating_capacity,
+						  writer->rating_count + 1, sizeof (SNAPSHOT_RATING))) {
+		perror ("snapshot_add_rating");
+		writer->failed = true;
+		return;
+	}
+	SNAPSHOT_RATING *record = &writer->ratings [writer->rating_count++];
+	record->station_id = snapshot_string (writer, station_id);
+	record->rating = rating;
+}
+
+uint32_t snapshot_rating_count (const SNAPSHOT_WRITER *writer) {
+	assert (writer);
+	return writer->rating_count;
+}
+
+/* Append a user record.  String fields must come from snapshot_string,
+   and the user's ratings must have been added since the previous user. */
+void snapshot_add_user (SNAPSHOT_WRITER *writer, const SNAPSHOT_USER *user) {
+	assert (writer);
+	assert (user);
+	if (!fb_expandcalloc ((void **) &writer->users, &writer->user_capacity,
+						  writer->user_count + 1, sizeof (SNAPSHOT_USER))) {
+		perror ("snapshot_add_user");
+		writer->failed = true;
+		return;
+	}
+	writer->users [writer->user_count++] = *user;
+}
+
+/* Write the snapshot out.  Returns false if anything failed along the way. */
+bool snapshot_write (SNAPSHOT_WRITER *writer, FILE *out) {
+	assert (writer);
+	assert (out);
+	if (writer->failed) {
+		return false;
+	}
+	SNAPSHOT_HEADER header;
+	memset (&header, 0, sizeof (header));
+	memcpy (header.magic, SNAPSHOT_MAGIC, sizeof (header.magic));
+	header.version = SNAPSHOT_VERSION;
+	header.byte_order = SNAPSHOT_BYTE_ORDER;
+	header.user_count = writer->user_count;
+	header.rating_count = writer->rating_count;
+	header.string_size = writer->string_size;
+	fwrite (&header, sizeof (header), 1, out);
+	fwrite (writer->users, sizeof (SNAPSHOT_USER), writer->user_count, out);
+	fwrite (writer->ratings, sizeof (SNAPSHOT_RATING), writer->rating_count, out);
+	fwrite (writer->strings, 1, writer->string_size, out);
+	return !ferror (out);
+}
+
+
+/* Check if a file begins with the snapshot magic number */
+bool is_snapshot_file (const char *filename) {
+	assert (filename);
+	char magic [sizeof (((SNAPSHOT_HEADER *) NULL)->magic)];
+	bool match = false;
+	FILE *in = fopen (filename, "rb");
+	if (in) {
+		match = (fread (magic, sizeof (magic), 1, in) == 1 &&
+				 memcmp (magic, SNAPSHOT_MAGIC, sizeof (magic)) == 0);
+		fclose (in);
+	}
+	return match;
+}
+
+/* Check a snapshot's header and that all its sections fit in the file */
+static bool validate_snapshot (const SNAPSHOT_HEADER *header, size_t size, const char *filename) {
+	if (header->version != SNAPSHOT_VERSION) {
+		flog (LOG_ERROR, "%s: unsupported snapshot version %u", filename, (unsigned) header->version);
+		return false;
+	}
+	if (header->byte_order != SNAPSHOT_BYTE_ORDER) {
+		flog (LOG_ERROR, "%s: snapshot was written on a machine with different byte order", filename);
+		return false;
+	}
+	uint64_t expected = sizeof (SNAPSHOT_HEADER) +
+						(uint64_t) header->user_count * sizeof (SNAPSHOT_USER) +
+						(uint64_t) header->rating_count * sizeof (SNAPSHOT_RATING) +
+						header->string_size;
+	if (expected != size) {
+		flog (LOG_ERROR, "%s: snapshot is %zu bytes, expected %llu",
+			  filename, size, (unsigned long long) expected);
+		return false;
+	}
+	return true;
+}
+
+/* Map a snapshot file and check its structure.  The string table is
+   copied and retained; everything else is read from the mapping until
+   snapshot_close. */
+SNAPSHOT *snapshot_open (const char *filename) {
+	assert (filename);
+	int fd = open (filename, O_RDONLY);
+	if (fd < 0) {
+		perror (filename);
+		return NULL;
+	}
+	struct stat info;
+	SNAPSHOT *snapshot = NULL;
+	if (fstat (fd, &info) < 0) {
+		perror (filename);
+	} else if (info.st_size < sizeof (SNAPSHOT_HEADER)) {
+		flog (LOG_ERROR, "%s: snapshot is truncated", filename);
+	} else if (!(snapshot = calloc (1, sizeof (*snapshot)))) {
+		perror ("snapshot_open:calloc");
+	} else {
+		snapshot->map_size = info.st_size;
+		snapshot->map = mmap (NULL, snapshot->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (snapshot->map == MAP_FAILED) {
+			perror (filename);
+			snapshot->map = NULL;
+		} else {
+			snapshot->header = snapshot->map;
+			if (validate_snapshot (snapshot->header, snapshot->map_size, filename)) {
+				const char *base = snapshot->map;
+				snapshot->users = (const SNAPSHOT_USER *) (base + sizeof (SNAPSHOT_HEADER));
+				snapshot->ratings = (const SNAPSHOT_RATING *) (snapshot->users + snapshot->header->user_count);
+				const char *strings = (const char *) (snapshot->ratings + snapshot->header->rating_count);
+				size_t string_size = snapshot->header->string_size;
+				if (string_size > 0 && strings [string_size - 1] != '\0') {
+					flog (LOG_ERROR, "%s: snapshot string table is corrupt", filename);
+				} else {
+					RETAINED_STRINGS *retain = malloc (sizeof (*retain));
+					if (retain && (retain->strings = malloc (string_size ? string_size : 1))) {
+						memcpy (retain->strings, strings, string_size);
+						retain->size = string_size;
+						retain->next = retained_strings;
+						retained_strings = retain;
+						snapshot->strings = retain->strings;
+						close (fd);
+						return snapshot;
+					}
+					perror ("snapshot_open:malloc");
+					free (retain);
+				}
+			}
+		}
+	}
+	close (fd);
+	snapshot_close (snapshot);
+	return NULL;
+}
+
+/* Unmap a snapshot.  Strings retrieved from it remain valid. */
+void snapshot_close (SNAPSHOT *snapshot) {
+	if (snapshot) {
+		if (snapshot->map) {
+			munmap (snapshot->map, snapshot->map_size);
+		}
+		free (snapshot);
+	}
+}
+
+uint32_t snapshot_user_count (const SNAPSHOT *snapshot) {
+	assert (snapshot);
+	return snapshot->header->user_count;
+}
+
+const SNAPSHOT_USER *snapshot_user (const SNAPSHOT *snapshot, uint32_t index) {
+	assert (snapshot);
+	assert (index < snapshot->header->user_count);
+	return &snapshot->users [index];
+}
+
+/* Get a user's ratings, or NULL if the record's range is invalid. */
+const SNAPSHOT_RATING *snapshot_ratings (const SNAPSHOT *snapshot, const SNAPSHOT_USER *user) {
+	assert (snapshot);
+	assert (user);
+	if (user->first_rating > snapshot->header->rating_count ||
+		user->rating_count > snapshot->header->rating_count - user->first_rating) {
+		return NULL;
+	}
+	return &snapshot->ratings [user->first_rating];
+}
+
+/* Get a string from the snapshot's string table.  Returns NULL for
+   absent or invalid offsets.  The string must be released with
+   snapshot_free, not free. */
+char *snapshot_get_string (const SNAPSHOT *snapshot, uint32_t offset) {
+	assert (snapshot);
+	if (offset >= snapshot->header->string_size) {
+		return NULL;
+	}
+	return snapshot->strings + offset;
+}
+
+
+/* Free memory, unless it is a string from a retained string table. */
+void snapshot_free (void *ptr) {
+	uintptr_t address = (uintptr_t) ptr;
+	for (RETAINED_STRINGS *retain = retained_strings; retain; retain = retain->next) {
+		if (address >= (uintptr_t) retain->strings &&
+			address < (uintptr_t) retain->strings + retain->size) {
+			return;
+		}
+	}
+	free (ptr);
+}
+
+/* Free all retained string tables.  Strings from them must no longer be in use. */
+void snapshot_release_strings (void) {
+	RETAINED_STRINGS *retain;
+	while ((retain = retained_strings)) {
+		retained_strings = retain->next;
+		free (retain->strings);
+		free (retain);
+	}
+}
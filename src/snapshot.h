@@ -0,0 +1,80 @@
+/*
+ *  snapshot.h
+ *  pianod - Compact binary snapshot of user data.
+ *
+ */
+
+#ifndef _SNAPSHOT_H
+#define _SNAPSHOT_H
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A snapshot file is a header, an array of user records, an array of
+   station ratings, then a table of NUL-terminated strings.  Records
+   refer to strings by their offset in the table; each distinct string
+   is stored once.  Each user's ratings are contiguous in the rating
+   array.  Numbers are in host byte order, which the header records. */
+
+#define SNAPSHOT_MAGIC "pianod\x1a" /* With its terminating NUL, 8 bytes */
+#define SNAPSHOT_VERSION (1)
+#define SNAPSHOT_BYTE_ORDER (0x01020304)
+#define SNAPSHOT_NONE (UINT32_MAX) /* String offset for absent values */
+
+typedef struct snapshot_header_t {
+	char magic [8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t user_count;
+	uint32_t rating_count;
+	uint32_t string_size;
+	uint32_t reserved;
+} SNAPSHOT_HEADER;
+
+typedef struct snapshot_user_t {
+	uint32_t name;
+	uint32_t password;
+	uint32_t pandora_user; /* SNAPSHOT_NONE if credentials aren't stored */
+	uint32_t pandora_password;
+	uint32_t first_rating;
+	uint32_t rating_count;
+	uint8_t rank;
+	uint8_t manager_rule;
+	uint8_t privileges; /* Bit per granted privilege, by PRIVILEGE value */
+	uint8_t reserved;
+} SNAPSHOT_USER;
+
+typedef struct snapshot_rating_t {
+	uint32_t station_id;
+	uint32_t rating;
+} SNAPSHOT_RATING;
+
+typedef struct snapshot_writer_t SNAPSHOT_WRITER;
+typedef struct snapshot_t SNAPSHOT;
+
+/* Writing */
+extern SNAPSHOT_WRITER *snapshot_writer_create (void);
+extern void snapshot_writer_destroy (SNAPSHOT_WRITER *writer);
+extern uint32_t snapshot_string (SNAPSHOT_WRITER *writer, const char *value);
+extern void snapshot_add_rating (SNAPSHOT_WRITER *writer, const char *station_id, unsigned int rating);
+extern uint32_t snapshot_rating_count (const SNAPSHOT_WRITER *writer);
+extern void snapshot_add_user (SNAPSHOT_WRITER *writer, const SNAPSHOT_USER *user);
+extern bool snapshot_write (SNAPSHOT_WRITER *writer, FILE *out);
+
+/* Reading */
+extern bool is_snapshot_file (const char *filename);
+extern SNAPSHOT *snapshot_open (const char *filename);
+extern void snapshot_close (SNAPSHOT *snapshot);
+extern uint32_t snapshot_user_count (const SNAPSHOT *snapshot);
+extern const SNAPSHOT_USER *snapshot_user (const SNAPSHOT *snapshot, uint32_t index);
+extern const SNAPSHOT_RATING *snapshot_ratings (const SNAPSHOT *snapshot, const SNAPSHOT_USER *user);
+extern char *snapshot_get_string (const SNAPSHOT *snapshot, uint32_t offset);
+
+/* Strings loaded from snapshots */
+extern void snapshot_free (void *ptr);
+extern void snapshot_release_strings (void);
+
+#endif
@@ -0,0 +1,321 @@
+/*
+ *  snapshot_check.c
+ *  pianod - Writes user snapshots, reads them back and compares every
+ *  field; checks that damaged files are refused and that snapshot and
+ *  XML user files are told apart.  Run by "make check".
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+#define CHECK_USERS (300) /* Enough names to make the intern table grow */
+#define CHECK_STATIONS (40)
+#define CHECK_PASSWORDS (7) /* Shared among users */
+
+/* What each user is expected to hold */
+typedef struct check_user_t {
+	char name [32];
+	char password [32];
+	char pandora_user [32];
+	char pandora_password [32];
+	bool has_pandora;
+	unsigned int rating_count;
+	unsigned int stations [CHECK_STATIONS];
+	unsigned int ratings [CHECK_STATIONS];
+	uint8_t rank;
+	uint8_t manager_rule;
+	uint8_t privileges;
+} CHECK_USER;
+
+static CHECK_USER users [CHECK_USERS];
+static char directory [] = "/tmp/snapshot_checkXXXXXX";
+
+static void station_name (char *buffer, size_t size, unsigned int station) {
+	snprintf (buffer, size, "%u%u", station * 7919u, station);
+}
+
+/* Make up users: shared passwords, some with Pandora credentials that
+   repeat other users' names, ratings drawn from a common set of stations. */
+static void make_users (void) {
+	srand (1);
+	for (unsigned int u = 0; u < CHECK_USERS; u++) {
+		CHECK_USER *user = &users [u];
+		snprintf (user->name, sizeof (user->name), "user%u", u);
+		snprintf (user->password, sizeof (user->password), "secret%u", u % CHECK_PASSWORDS);
+		user->has_pandora = (u % 3 != 0);
+		if (user->has_pandora) {
+			snprintf (user->pandora_user, sizeof (user->pandora_user), "user%u", (u * 17) % CHECK_USERS);
+			snprintf (user->pandora_password, sizeof (user->pandora_password), "secret%u", u % 5);
+		}
+		user->rank = u % 4;
+		user->manager_rule = u % 3;
+		user->privileges = rand () & 0xff;
+		/* Every so often, a user without ratings */
+		user->rating_count = (u % 11 == 0) ? 0 : rand () % CHECK_STATIONS;
+		for (unsigned int r = 0; r < user->rating_count; r++) {
+			user->stations [r] = (u + r * 3) % CHECK_STATIONS;
+			user->ratings [r] = rand () % 5;
+		}
+	}
+}
+
+/* Write the users to a snapshot file */
+static bool write_users (const char *filename, unsigned int count) {
+	SNAPSHOT_WRITER *writer = snapshot_writer_create ();
+	FILE *out = fopen (filename, "wb");
+	if (!writer || !out) {
+		perror (filename);
+		return false;
+	}
+	char station [32];
+	for (unsigned int u = 0; u < count; u++) {
+		const CHECK_USER *user = &users [u];
+		SNAPSHOT_USER record;
+		memset (&record, 0, sizeof (record));
+		record.name = snapshot_string (writer, user->name);
+		record.password = snapshot_string (writer, user->password);
+		record.pandora_user = snapshot_string (writer, user->has_pandora ? user->pandora_user : NULL);
+		record.pandora_password = snapshot_string (writer, user->has_pandora ? user->pandora_password : NULL);
+		record.rank = user->rank;
+		record.manager_rule = user->manager_rule;
+		record.privileges = user->privileges;
+		record.first_rating = snapshot_rating_count (writer);
+		for (unsigned int r = 0; r < user->rating_count; r++) {
+			station_name (station, sizeof (station), user->stations [r]);
+			snapshot_add_rating (writer, station, user->ratings [r]);
+		}
+		record.rating_count = snapshot_rating_count (writer) - record.first_rating;
+		snapshot_add_user (writer, &record);
+	}
+	/* Interning: a repeated string is stored once */
+	if (count > 0 && snapshot_string (writer, users [0].name) != snapshot_string (writer, users [0].name)) {
+		fprintf (stderr, "repeated string was stored twice\n");
+		return false;
+	}
+	bool ok = snapshot_write (writer, out);
+	snapshot_writer_destroy (writer);
+	return (fclose (out) == 0 && ok);
+}
+
+static bool same_string (const char *what, unsigned int u, const char *got, const char *expected) {
+	if ((got == NULL) != (expected == NULL) || (got && strcmp (got, expected) != 0)) {
+		fprintf (stderr, "user %u %s: got '%s', expected '%s'\n", u, what,
+				 got ? got : "(null)", expected ? expected : "(null)");
+		return false;
+	}
+	return true;
+}
+
+/* Read the snapshot back and compare every field.  Strings obtained are
+   released with snapshot_free after the snapshot is closed, as users.c
+   does, which must neither crash nor free the retained table. */
+static bool read_users (const char *filename, unsigned int count) {
+	if (!is_snapshot_file (filename)) {
+		fprintf (stderr, "%s: snapshot not recognized\n", filename);
+		return false;
+	}
+	SNAPSHOT *snapshot = snapshot_open (filename);
+	if (!snapshot) {
+		fprintf (stderr, "%s: snapshot refused\n", filename);
+		return false;
+	}
+	if (snapshot_user_count (snapshot) != count) {
+		fprintf (stderr, "%u users, expected %u\n", snapshot_user_count (snapshot), count);
+		return false;
+	}
+	char **names = calloc (count + 1, sizeof (*names));
+	const char *shared_password [CHECK_PASSWORDS] = { NULL };
+	char station [32];
+	bool ok = (names != NULL);
+	for (unsigned int u = 0; ok && u < count; u++) {
+		const CHECK_USER *user = &users [u];
+		const SNAPSHOT_USER *record = snapshot_user (snapshot, u);
+		char *password = snapshot_get_string (snapshot, record->password);
+		names [u] = snapshot_get_string (snapshot, record->name);
+		ok = same_string ("name", u, names [u], user->name) &&
+			 same_string ("password", u, password, user->password) &&
+			 same_string ("Pandora user", u, snapshot_get_string (snapshot, record->pandora_user),
+						  user->has_pandora ? user->pandora_user : NULL) &&
+			 same_string ("Pandora password", u, snapshot_get_string (snapshot, record->pandora_password),
+						  user->has_pandora ? user->pandora_password : NULL);
+		if (ok && (record->rank != user->rank || record->manager_rule != user->manager_rule ||
+				   record->privileges != user->privileges)) {
+			fprintf (stderr, "user %u: rank/rule/privileges %u/%u/%02x, expected %u/%u/%02x\n", u,
+					 record->rank, record->manager_rule, record->privileges,
+					 user->rank, user->manager_rule, user->privileges);
+			ok = false;
+		}
+		/* Shared strings come from one copy */
+		const char **shared = &shared_password [u % CHECK_PASSWORDS];
+		if (ok && *shared && *shared != password) {
+			fprintf (stderr, "user %u: shared password not shared\n", u);
+			ok = false;
+		}
+		*shared = password;
+		const SNAPSHOT_RATING *ratings = snapshot_ratings (snapshot, record);
+		if (ok && (!ratings || record->rating_count != user->rating_count)) {
+			fprintf (stderr, "user %u: %u ratings, expected %u\n", u,
+					 ratings ? record->rating_count : 0, user->rating_count);
+			ok = false;
+		}
+		for (unsigned int r = 0; ok && r < user->rating_count; r++) {
+			station_name (station, sizeof (station), user->stations [r]);
+			ok = same_string ("station", u, snapshot_get_string (snapshot, ratings [r].station_id), station);
+			if (ok && ratings [r].rating != user->ratings [r]) {
+				fprintf (stderr, "user %u station %s: rating %u, expected %u\n", u, station,
+						 ratings [r].rating, user->ratings [r]);
+				ok = false;
+			}
+		}
+	}
+	snapshot_close (snapshot);
+	/* Retained strings outlive the mapping, and are not freed singly */
+	for (unsigned int u = 0; ok && u < count; u++) {
+		ok = same_string ("retained name", u, names [u], users [u].name);
+		snapshot_free (names [u]);
+	}
+	snapshot_free (strdup ("an ordinary allocation"));
+	snapshot_free (NULL);
+	free (names);
+	return ok;
+}
+
+/* Copy a file with a change applied, then make sure it is refused. */
+static bool check_refused (const char *source, const char *what, size_t offset,
+						   const void *patch, size_t patch_size, long size_change) {
+	char filename [sizeof (directory) + 32];
+	snprintf (filename, sizeof (filename), "%s/damaged", directory);
+	FILE *in = fopen (source, "rb");
+	if (!in) {
+		perror (source);
+		return false;
+	}
+	char *data = malloc (1 << 20);
+	size_t size = fread (data, 1, 1 << 20, in);
+	fclose (in);
+	if (patch) {
+		memcpy (data + offset, patch, patch_size);
+	}
+	size_t new_size = size + size_change;
+	if (size_change > 0) {
+		memset (data + size, 0, size_change);
+	}
+	FILE *out = fopen (filename, "wb");
+	fwrite (data, 1, new_size, out);
+	fclose (out);
+	free (data);
+	SNAPSHOT *snapshot = snapshot_open (filename);
+	if (snapshot) {
+		fprintf (stderr, "%s: accepted\n", what);
+		snapshot_close (snapshot);
+		return false;
+	}
+	printf ("%s: refused\n", what);
+	return true;
+}
+
+/* Write a short file and see whether it is taken for a snapshot */
+static bool check_magic (const char *what, const char *content, size_t size, bool expected) {
+	char filename [sizeof (directory) + 32];
+	snprintf (filename, sizeof (filename), "%s/magic", directory);
+	FILE *out = fopen (filename, "wb");
+	fwrite (content, 1, size, out);
+	fclose (out);
+	if (is_snapshot_file (filename) != expected) {
+		fprintf (stderr, "%s %s taken for a snapshot\n", what, expected ? "not" : "");
+		return false;
+	}
+	return true;
+}
+
+int main (void) {
+	if (!mkdtemp (directory)) {
+		perror (directory);
+		return 1;
+	}
+	char filename [sizeof (directory) + 32];
+	snprintf (filename, sizeof (filename), "%s/users", directory);
+	make_users ();
+
+	/* Round trips, empty and full */
+	bool ok = write_users (filename, 0) && read_users (filename, 0) &&
+			  write_users (filename, CHECK_USERS) && read_users (filename, CHECK_USERS);
+
+	/* Damaged files */
+	const uint32_t bad_version = SNAPSHOT_VERSION + 1;
+	const uint32_t swapped = __builtin_bswap32 (SNAPSHOT_BYTE_ORDER);
+	const uint32_t more_users = CHECK_USERS + 1;
+	const char unterminated = 'x';
+	FILE *in = fopen (filename, "rb");
+	fseek (in, 0, SEEK_END);
+	const size_t size = ftell (in);
+	fclose (in);
+	ok = ok &&
+		 check_refused (filename, "truncated file", 0, NULL, 0, -1) &&
+		 check_refused (filename, "truncated header", 0, NULL, 0, (long) sizeof (SNAPSHOT_HEADER) - 1 - (long) size) &&
+		 check_refused (filename, "trailing garbage", 0, NULL, 0, 1) &&
+		 check_refused (filename, "bad version", offsetof (SNAPSHOT_HEADER, version),
+						&bad_version, sizeof (bad_version), 0) &&
+		 check_refused (filename, "byte order mismatch", offsetof (SNAPSHOT_HEADER, byte_order),
+						&swapped, sizeof (swapped), 0) &&
+		 check_refused (filename, "user count beyond the file", offsetof (SNAPSHOT_HEADER, user_count),
+						&more_users, sizeof (more_users), 0) &&
+		 check_refused (filename, "string table without final NUL", size - 1,
+						&unterminated, sizeof (unterminated), 0);
+
+	/* A user record whose ratings run past the rating array */
+	if (ok) {
+		SNAPSHOT_WRITER *writer = snapshot_writer_create ();
+		SNAPSHOT_USER record;
+		memset (&record, 0, sizeof (record));
+		record.name = snapshot_string (writer, "overreach");
+		record.password = snapshot_string (writer, "overreach");
+		record.pandora_user = record.pandora_password = SNAPSHOT_NONE;
+		snapshot_add_rating (writer, "1234", 1);
+		record.first_rating = 1;
+		record.rating_count = 1;
+		snapshot_add_user (writer, &record);
+		FILE *out = fopen (filename, "wb");
+		snapshot_write (writer, out);
+		fclose (out);
+		snapshot_writer_destroy (writer);
+		SNAPSHOT *snapshot = snapshot_open (filename);
+		if (!snapshot || snapshot_ratings (snapshot, snapshot_user (snapshot, 0)) != NULL ||
+			snapshot_get_string (snapshot, SNAPSHOT_NONE) != NULL) {
+			fprintf (stderr, "out of range ratings or string not refused\n");
+			ok = false;
+		}
+		snapshot_close (snapshot);
+	}
+
+	/* Format detection */
+	static const char xml [] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<pianod>\n</pianod>\n";
+	ok = ok &&
+		 check_magic ("XML user file", xml, sizeof (xml) - 1, false) &&
+		 check_magic ("short file", SNAPSHOT_MAGIC, 4, false) &&
+		 check_magic ("empty file", "", 0, false) &&
+		 check_magic ("snapshot header", SNAPSHOT_MAGIC, sizeof (SNAPSHOT_MAGIC), true);
+	snprintf (filename, sizeof (filename), "%s/missing", directory);
+	if (ok && is_snapshot_file (filename)) {
+		fprintf (stderr, "missing file taken for a snapshot\n");
+		ok = false;
+	}
+
+	snapshot_release_strings ();
+	snprintf (filename, sizeof (filename), "rm -rf '%s'", directory);
+	if (system (filename) != 0) {
+		fprintf (stderr, "could not remove %s\n", directory);
+	}
+	printf ("%s\n", ok ? "snapshot check passed" : "snapshot check failed");
+	return ok ? 0 : 1;
+}
@@ -47,7 +47,6 @@ THE SOFTWARE.
 #include <assert.h>
 #include <ctype.h>
 #include <pthread.h>
-#include <ao/ao.h>
 #include <math.h>
 
 #include <sys/types.h>
@@ -66,23 +65,54 @@ THE SOFTWARE.
 #include "logging.h"
 #include "response.h"
 #include "pianoextra.h"
+#include "metrics.h"
 
 
 /* ---------- Start of pianobar plagiarized stuff ---------- */
 
+/*	waitress callback, hands each chunk of the response to libpiano's
+ *	incremental parser so the response is never buffered whole. Malformed
+ *	json is reported by PianoResponse () once the fetch is done; only running
+ *	out of memory aborts the transfer.
+ *	@param received data
+ *	@param data size
+ *	@param piano request
+ */
+static WaitressCbReturn_t BarPianoHttpResponseCb (void *data, size_t size,
+		void *extraData) {
+	PianoRequest_t *req = extraData;
+	return PianoResponseFeed (req, data, size) == PIANO_RET_OK ?
+			WAITRESS_CB_RET_OK : WAITRESS_CB_RET_ERR;
+}
+
 /*	fetch http resource (post request)
  *	@param waitress handle
  *	@param piano request (initialized by PianoRequest())
  */
-static WaitressReturn_t BarPianoHttpRequest (WaitressHandle_t *waith,
+WaitressReturn_t BarPianoHttpRequest (WaitressHandle_t *waith,
 		PianoRequest_t *req) {
 	waith->extraHeaders = "Content-Type: text/xml\r\n";
 	waith->postData = req->postData;
 	waith->method = WAITRESS_METHOD_POST;
 	waith->url.path = req->urlPath;
 	waith->url.tls = req->secure;
-
-	return WaitressFetchBuf (waith, &req->responseData);
+	/* Pandora requests come in bursts; keep the connection warm */
+	waith->keepAlive = true;
+
+	waith->data = req;
+	waith->callback = BarPianoHttpResponseCb;
+	WaitressReturn_t wRet = WaitressFetchCall (waith);
+	/* Phases skipped on a reused connection aren't counted */
+	if (waith->request.connectTime) {
+		metrics_record (&metric_waitress, METRIC_PHASE_CONNECT, waith->request.connectTime);
+	}
+	if (waith->request.handshakeTime) {
+		metrics_record (&metric_waitress, METRIC_PHASE_HANDSHAKE, waith->request.handshakeTime);
+	}
+	if (waith->request.transferTime) {
+		metrics_record (&metric_waitress, METRIC_PHASE_TRANSFER, waith->request.transferTime);
+	}
+	return wRet;
 }
 
 /*	piano wrapper: prepare/execute http request and pass result back to
@@ -94,7 +124,7 @@ static WaitressReturn_t BarPianoHttpRequest (WaitressHandle_t *waith,
  *	@param stores waitress return code
  *	@return 1 on success, 0 otherwise
  */
-int BarUiPianoCall (APPSTATE * const app, PianoRequestType_t type,
+static int BarUiPianoExchange (APPSTATE * const app, PianoRequestType_t type,
 		void *data, PianoReturn_t *pRet, WaitressReturn_t *wRet) {
 	PianoRequest_t req;
 
@@ -111,6 +141,8 @@ int BarUiPianoCall (APPSTATE * const app, PianoRequestType_t type,
 			return 0;
 		}
 
+		/* Don't hold queued responses while we wait on Pandora */
+		fb_flush_output ();
 		*wRet = BarPianoHttpRequest (&app->waith, &req);
 		if (*wRet != WAITRESS_RET_OK) {
 			send_response_code(app->service, E_NETWORK_FAILURE, WaitressErrorToStr (*wRet));
@@ -172,6 +204,17 @@ int BarUiPianoCall (APPSTATE * const app, PianoRequestType_t type,
 	return 1;
 }
 
+/*	Perform a Pandora request, recording how long it took (including
+ *	any steps or reauthentication it needed).
+ */
+int BarUiPianoCall (APPSTATE * const app, PianoRequestType_t type,
+		void *data, PianoReturn_t *pRet, WaitressReturn_t *wRet) {
+	uint64_t start = metrics_now ();
+	int result = BarUiPianoExchange (app, type, data, pRet, wRet);
+	metrics_since (&metric_requests, type, start);
+	return result;
+}
+
 
 /* pianod wrapper for PianoBar's BarUIPianoCall. */
 bool piano_transaction (APPSTATE *app, FB_EVENT *event, PianoRequestType_t type, void *data) {
@@ -235,7 +278,7 @@ void purge_unselected_songs (APPSTATE *app) {
 			/* Stop has been requested.  Dump queue */
 		} else if (app->selected_station->isQuickMix) {
 			/* See if the track's station is among the quickmix stations */
-			PianoStation_t *station = PianoFindStationById(app->ph.stations, song->stationId);
+			PianoStation_t *station = PianoLookupStationById (&app->ph, song->stationId);
 			if (station) {
 				assert (!station->isQuickMix);
 				if (station->useQuickMix) {
@@ -264,17 +307,20 @@ void purge_unselected_songs (APPSTATE *app) {
 }
 
 
-/* Compare two station lists and determine what (if anything) has changed. */
-static bool check_for_station_changes (APPSTATE *app, PianoStation_t *old_stations, PianoStation_t *new_stations) {
+/* Compare the old station list with the current one and determine
+   what (if anything) has changed. */
+static bool check_for_station_changes (APPSTATE *app, PianoStation_t *old_stations) {
 	bool quick_mix_changed = false;
 	bool station_added = false;
 	bool station_removed = false;
 	PianoStation_t *past, *present;
+	size_t retained = 0;
 
 	/* Check for stations removed. */
 	past = old_stations;
 	PianoListForeachP (past) {
-		if ((present = PianoFindStationById(new_stations, past->id))) {
+		if ((present = PianoLookupStationById (&app->ph, past->id))) {
+			retained++;
 			quick_mix_changed = quick_mix_changed || (present->useQuickMix != past->useQuickMix);
 		} else {
 			station_removed = true;
@@ -282,15 +328,16 @@ static bool check_for_station_changes (APPSTATE *app, PianoStation_t *old_statio
 			flog (LOG_GENERAL, "check_for_station_changes: Drop Station %s", past->name);
 		}
 	}
-	/* Check for stations added. */
-	present = new_stations;
-	PianoListForeachP (present) {
-		if ((past = PianoFindStationById(old_stations, present->id))) {
-			quick_mix_changed = quick_mix_changed || (present->useQuickMix != past->useQuickMix);
-		} else {
-			station_added = true;
-			if (present->useQuickMix) quick_mix_changed = true;
-			flog (LOG_GENERAL, "check_for_station_changes: Add Station %s", present->name);
+	/* Check for stations added.  Stations in both lists have been compared
+	   already, so only search the old list if there are new ones to find. */
+	if (app->ph.stations && PianoListCountP (app->ph.stations) > retained) {
+		present = app->ph.stations;
+		PianoListForeachP (present) {
+			if (!PianoFindStationById (old_stations, present->id)) {
+				station_added = true;
+				if (present->useQuickMix) quick_mix_changed = true;
+				flog (LOG_GENERAL, "check_for_station_changes: Add Station %s", present->name);
+			}
 		}
 	}
 	if (station_added || station_removed) {
@@ -328,10 +375,10 @@ bool update_station_list (APPSTATE *app) {
 	flog (LOG_GENERAL, "Retrieving/updating station list");
 	if ((ret = piano_transaction (app, NULL, PIANO_REQUEST_GET_STATIONS, NULL))) {
 		/* Announce any changes */
-		check_for_station_changes (app, oldStations, app->ph.stations);
+		check_for_station_changes (app, oldStations);
 		/* Update the current station to use the same station but in the new list */
 		if (app->selected_station) {
-			app->selected_station = PianoFindStationById (app->ph.stations, app->selected_station->id);
+			app->selected_station = PianoLookupStationById (&app->ph, app->selected_station->id);
 			if (!app->selected_station) {
 				send_response_code (app->service, E_RESOURCE, "Selected station has been deleted.");
 				send_selectedstation (app->service, app);
@@ -342,6 +389,7 @@ bool update_station_list (APPSTATE *app) {
 		/* Restore the original station list */
 		PianoDestroyStations(app->ph.stations);
 		app->ph.stations = oldStations;
+		PianoStationIndexInvalidate (&app->ph);
 	}
 	/* Buffer stations for 5 minutes if we have a list,
 	 1 minute if waiting for a list so we don't churn too fast. */
@@ -448,7 +496,7 @@ bool validate_station_list (APPSTATE *app, FB_EVENT *event, char * const*station
 	bool response = true;
 	PianoStation_t *station;
 	while (*stations) {
-		if ((station = PianoFindStationByName (app->ph.stations, *stations))) {
+		if ((station = PianoLookupStationByName (&app->ph, *stations))) {
 			if (station->isQuickMix) {
 				send_data (event, I_STATION_INVALID, station->name);
 				response = false;
@@ -505,7 +553,7 @@ PianoStation_t *get_station_by_name_or_current (APPSTATE *app, FB_EVENT *event,
 	assert (event);
 	PianoStation_t *station = NULL;
 	if (stationname) {
-		station = PianoFindStationByName(app->ph.stations, stationname);
+		station = PianoLookupStationByName (&app->ph, stationname);
 		if (!station) {
 			reply (event, E_NOTFOUND);
 		}
@@ -529,7 +577,7 @@ bool pwn_station (APPSTATE *app, FB_EVENT *event, const char *stationId) {
 	assert (event);
 	assert (stationId);
 
-	PianoStation_t *station = PianoFindStationById (app->ph.stations, stationId);
+	PianoStation_t *station = PianoLookupStationById (&app->ph, stationId);
 	if (!station) {
 		data_reply (event, I_NOTFOUND, "Station not found");
 		flog (LOG_ERROR, "Station %s not found", stationId);
@@ -632,6 +680,8 @@ void cancel_playback (APPSTATE *app) {
 		} else {
 			flog (LOG_ERROR, "cancel_playback:pthread_mutex_lock: %s", strerror (err));
 		}
+		/* Drop audio already decoded so the change is heard immediately. */
+		audio_output_flush (app->output);
 	}
 	app->paused_since = 0;
 }
@@ -645,53 +695,24 @@ void cancel_playback (APPSTATE *app) {
 #define countof(x) (sizeof (x) / sizeof (*x))
 
 void generate_test_tone (APPSTATE *app, FB_EVENT *event) {
-	int audioOutDriver = -1;
-
-	/* Find driver, or use default if unspecified. */
-	audioOutDriver = app->settings.output_driver ? ao_driver_id (app->settings.output_driver)
-					 : ao_default_driver_id();
-	if (audioOutDriver < 0) {
-		fb_fprintf (event, "%03d audio driver '%s' not found\n",
-							E_NAK,
-							app->settings.output_driver ? app->settings.output_driver : "(default)");
-		return;
-	}
-
-	ao_sample_format format;
-	memset (&format, 0, sizeof (format));
-	format.bits = 16;
-	format.channels = 2;
-	format.rate = AO_TEST_SAMPLE_FREQ;
-	format.byte_format = AO_FMT_NATIVE;
-
-	/* Create a list of ao_options */
-	ao_option *options = NULL;
-	ao_append_option(&options, "client_name", PACKAGE);
-	if (app->settings.output_device) {
-		ao_append_option (&options, "dev", app->settings.output_device);
-	}
-	if (app->settings.output_id) {
-		ao_append_option (&options, "id", app->settings.output_id);
-	}
-	if (app->settings.output_server) {
-		ao_append_option (&options, "server", app->settings.output_server);
-	}
-
-	ao_device *device = ao_open_live (audioOutDriver, &format, options);
-	if (device == NULL) {
+	/* Play through the shared output rather than opening a second device,
+	   which would contend with the writer thread for the sound card. */
+	audio_output_flush (app->output);
+	audio_output_pause (app->output, false);
+	if (!audio_output_configure (app->output, AO_TEST_SAMPLE_FREQ, 2,
+								 app->settings.output_driver,
+								 app->settings.output_device,
+								 app->settings.output_id,
+								 app->settings.output_server)) {
 		fb_fprintf (event,
-				  "%03d Cannot open audio device %s/%s/%s: %s\n",
+				  "%03d Cannot open audio device %s/%s/%s/%s\n",
 				  E_NAK,
+				  app->settings.output_driver ? app->settings.output_driver : "default",
 				  app->settings.output_device ? app->settings.output_device : "default",
 				  app->settings.output_id ? app->settings.output_id : "default",
-				  app->settings.output_server ? app->settings.output_server : "default",
-				  errno == AO_ENODRIVER ? "No driver" :
-				  errno == AO_ENOTLIVE ? "Not a live output device" :
-				  errno == AO_EBADOPTION ? "Bad option" :
-				  errno == AO_EOPENDEVICE ? "Cannot open device" : "Other failure");
+				  app->settings.output_server ? app->settings.output_server : "default");
 		return;
 	}
-	ao_free_options (options);
 
 	/* Create the test tone. */
 	int16_t tone [AO_TEST_SAMPLE_FREQ * AO_TEST_DURATION * 2];
@@ -700,7 +721,84 @@ void generate_test_tone (APPSTATE *app, FB_EVENT *event) {
 							sinf(2 * M_PI * AO_TEST_FREQUENCY * ((float) i/AO_TEST_SAMPLE_FREQ)));
 	}
 
-	ao_play(device, (char *) tone, sizeof (tone));
-	ao_close(device);
-	reply (event, S_OK);
+	/* Queue the tone; the writer thread drains it once we mark the end. */
+	bool played = audio_output_play (app->output, tone, sizeof (tone));
+	audio_output_finish (app->output);
+	reply (event, played ? S_OK : E_NAK);
+}
+
+
+
+/* Write XML to a file.  Values alternate literal, value, literal, value...;
+   the list must be NULL-terminated.  Values have XML special characters
+   escaped; runs of ordinary characters are written in one go. */
+void fprintxml (FILE *file, ...) {
+	assert (file);
+	va_list parameters;
+	va_start (parameters, file);
+	char *val;
+	while ((val = va_arg (parameters, char *))) {
+		fputs (val, file);
+		val = va_arg (parameters, char *);
+		if (!val) break;
+		while (*val) {
+			size_t plain = strcspn (val, "'\"<>&");
+			fwrite (val, 1, plain, file);
+			val += plain;
+			switch (*val) {
+				case '\'':
+					fputs ("&apos;", file);
+					break;
+				case '"':
+					fputs ("&quot;", file);
+					break;
+				case '<':
+					fputs ("&lt;", file);
+					break;
+				case '>':
+					fputs ("&gt;", file);
+					break;
+				case '&':
+					fputs ("&amp;", file);
+					break;
+				default:
+					/* End of value */
+					continue;
+			}
+			val++;
+		}
+	}
+	va_end (parameters);
+}
+
+
+/* Send a line of resolver cache statistics */
+typedef struct resolver_report_t {
+	FB_EVENT *event;
+	bool found;
+} RESOLVER_REPORT;
+
+static void send_resolver_host (const WaitressResolverStats_t *stats, void *data) {
+	RESOLVER_REPORT *report = data;
+	char state [64];
+	if (stats->resolved) {
+		snprintf (state, sizeof (state), "age %lus expires %lus", stats->age, stats->expires);
+	} else {
+		snprintf (state, sizeof (state), "unresolved expires %lus", stats->expires);
+	}
+	if (!report->found) {
+		reply (report->event, S_DATA);
+		report->found = true;
+	}
+	fb_fprintf (report->event, "%03d %s: %s:%s hits %lu negative %lu misses %lu refreshes %lu failures %lu %s\n",
+				I_RESOLVER, Response (I_RESOLVER), stats->host, stats->port,
+				stats->hits, stats->negativeHits, stats->misses, stats->refreshes,
+				stats->failures, state);
+}
+
+/* Report libwaitress' resolver cache statistics */
+void send_resolver_stats (FB_EVENT *event) {
+	RESOLVER_REPORT report = { event, false };
+	WaitressResolverStats (send_resolver_host, &report);
+	send_response_code (event, S_DATA_END, report.found ? "End of data" : "No data");
 }
@@ -32,6 +32,7 @@ THE SOFTWARE.
 #ifndef _SUPPORT_H
 #define _SUPPORT_H
 
+#include <stdio.h>
 #include <stdint.h>
 
 #include <piano.h>
@@ -43,6 +44,7 @@ THE SOFTWARE.
 #include "pianod.h"
 #include "response.h"
 
+extern WaitressReturn_t BarPianoHttpRequest (WaitressHandle_t *waith, PianoRequest_t *req);
 extern int BarUiPianoCall (APPSTATE * const, PianoRequestType_t,
 		void *, PianoReturn_t *, WaitressReturn_t *);
 extern bool piano_transaction (APPSTATE *app, FB_EVENT *event, PianoRequestType_t type, void *data);
@@ -57,6 +59,8 @@ extern bool update_station_list (APPSTATE *app);
 extern bool skips_are_available (APPSTATE *app, FB_EVENT *event, char *station);
 extern void cancel_playback (APPSTATE *app);
 extern void generate_test_tone (APPSTATE *app, FB_EVENT *event);
+extern void fprintxml (FILE *file, ...);
+extern void send_resolver_stats (FB_EVENT *event);
 
 extern void report_setting (FB_EVENT *event, RESPONSE_CODE id, const char *setting);
 extern bool change_setting (APPSTATE *app, FB_EVENT *event, char *newvalue, char **setting);
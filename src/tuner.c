@@ -7,6 +7,8 @@
  *
  */
 
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <strings.h>
 #include <assert.h>
@@ -21,6 +23,7 @@
 #include "users.h"
 #include "support.h"
 #include "tuner.h"
+#include "snapshot.h"
 
 
 
@@ -39,8 +42,15 @@ typedef struct station_preferences_t {
 	size_t capacity;
 	size_t count;
 	RATING_RECORD *ratings;
+	/* Autotuner data; see recompute_stations */
+	unsigned int generation; /* Station numbering bitsets match; 0 if not built */
+	bool applied; /* Bitsets are included in autotuner counts */
+	uint64_t *good; /* Bit per station number */
+	uint64_t *bad;
 } STATION_PREF;
 
+static void withdraw_station_ratings (STATION_PREF *pref);
+
 
 static STATION_RATING get_station_rating_by_name (const char *name) {
 	if (strcasecmp (name, "neutral") == 0) {
@@ -69,9 +79,13 @@ static const char *station_rating_name (STATION_RATING rating) {
 
 void destroy_station_preferences (STATION_PREF *pref) {
 	if (pref) {
+		withdraw_station_ratings (pref);
 		for (unsigned i = 0; i < pref->count; i++) {
-			free (pref->ratings [i].station_id);
+			snapshot_free (pref->ratings [i].station_id);
 		}
+		free (pref->ratings);
+		free (pref->good);
+		free (pref->bad);
 		free (pref);
 	}
 }
@@ -112,6 +126,11 @@ static bool set_station_rating (struct user_t *user, const char *station_id, STA
 		return true;
 	}
 	STATION_PREF *pref = get_station_preferences (user);
+	if (pref) {
+		/* Take the old ratings out of the autotuner; they're reapplied when it next runs. */
+		withdraw_station_ratings (pref);
+		pref->generation = 0;
+	}
 	if (rating) {
 		/* Update existing entry */
 		rating->rating = new_rating;
@@ -284,82 +303,277 @@ bool recreate_station_preferences (struct user_t *user, ezxml_t data) {
 	return ok;
 }
 
-typedef struct station_selector_t {
-	char *station_id;
+/* Add station preferences to a binary snapshot */
+void snapshot_station_preferences (SNAPSHOT_WRITER *dest, struct user_t *user) {
+	assert (dest);
+	assert (user);
+	STATION_PREF *prefs = get_station_preferences (user);
+
+	if (prefs) {
+		/* Ratings are kept sorted, so they are written sorted. */
+		for (int i = 0; i < prefs->count; i++) {
+			if (prefs->ratings [i].rating != RATING_NEUTRAL) {
+				snapshot_add_rating (dest, prefs->ratings [i].station_id, prefs->ratings [i].rating);
+			}
+		}
+	}
+}
+
+/* Restore station preferences from a user's packed ratings in a snapshot.
+   Station IDs are used from the snapshot's string table, not copied. */
+bool restore_station_preferences (struct user_t *user, const SNAPSHOT *snapshot, const SNAPSHOT_USER *record) {
+	assert (user);
+	assert (snapshot);
+	assert (record);
+	if (record->rating_count == 0) {
+		return true;
+	}
+	const SNAPSHOT_RATING *ratings = snapshot_ratings (snapshot, record);
+	if (!ratings) {
+		flog (LOG_ERROR, "Station preference data corrupt for user %s\n", get_user_name (user));
+		return false;
+	}
+	STATION_PREF *pref = calloc (sizeof (STATION_PREF), 1);
+	if (!pref || !(pref->ratings = calloc (record->rating_count, sizeof (RATING_RECORD)))) {
+		perror ("restore_station_preferences:calloc");
+		free (pref);
+		return false;
+	}
+	pref->capacity = record->rating_count;
+	bool ok = true;
+	bool sorted = true;
+	for (uint32_t i = 0; i < record->rating_count; i++) {
+		char *station_id = snapshot_get_string (snapshot, ratings [i].station_id);
+		if (station_id && (ratings [i].rating == RATING_GOOD || ratings [i].rating == RATING_BAD)) {
+			RATING_RECORD *rating = &pref->ratings [pref->count++];
+			rating->station_id = station_id;
+			rating->rating = ratings [i].rating;
+			if (pref->count > 1 && strcmp (rating [-1].station_id, station_id) >= 0) {
+				sorted = false;
+			}
+		} else {
+			ok = false;
+		}
+	}
+	if (!ok) {
+		flog (LOG_ERROR, "Station preference data corrupt for user %s\n", get_user_name (user));
+	}
+	if (!sorted) {
+		qsort (pref->ratings, pref->count, sizeof (RATING_RECORD), rating_comparator);
+	}
+	set_station_preferences (user, pref);
+	return ok;
+}
+
+/* Autotuner state.  Stations are numbered by their position in the
+   station list; each user's good and bad ratings are kept as bitsets
+   of station numbers, built when needed.  For each station, the tuner
+   counts how many contributing users rate it good or bad.  When users
+   start or stop contributing, or change a rating, only their bits are
+   added to or removed from the counts. */
+typedef struct tuner_station_t {
 	PianoStation_t *station;
-	bool pure_good;
-	bool partial_good;
-	bool bad;
-	bool include;
-} STATION_SELECTOR;
+	char *id; /* Copy, to recognize station list changes */
+	unsigned int good; /* Contributing users rating station good */
+	unsigned int bad; /* Contributing users rating station bad */
+} TUNER_STATION;
+
+static TUNER_STATION *tuner_stations; /* In station list order */
+static unsigned int *tuner_stations_by_id; /* Station numbers, sorted by ID */
+static size_t tuner_station_count;
+static unsigned int tuner_generation; /* Changes when station numbering does */
+
+#define BITSET_WORDS(count) (((count) + 63) / 64)
+
+
+/* Remove a user's ratings from the station counts */
+static void withdraw_station_ratings (STATION_PREF *pref) {
+	if (pref->applied) {
+		assert (pref->generation == tuner_generation);
+		for (size_t word = 0; word < BITSET_WORDS (tuner_station_count); word++) {
+			for (uint64_t bits = pref->good [word]; bits; bits &= bits - 1) {
+				tuner_stations [word * 64 + __builtin_ctzll (bits)].good--;
+			}
+			for (uint64_t bits = pref->bad [word]; bits; bits &= bits - 1) {
+				tuner_stations [word * 64 + __builtin_ctzll (bits)].bad--;
+			}
+		}
+		pref->applied = false;
+	}
+}
+
+/* Add a user's ratings into the station counts */
+static void apply_station_ratings (STATION_PREF *pref) {
+	assert (!pref->applied);
+	assert (pref->generation == tuner_generation);
+	for (size_t word = 0; word < BITSET_WORDS (tuner_station_count); word++) {
+		for (uint64_t bits = pref->good [word]; bits; bits &= bits - 1) {
+			tuner_stations [word * 64 + __builtin_ctzll (bits)].good++;
+		}
+		for (uint64_t bits = pref->bad [word]; bits; bits &= bits - 1) {
+			tuner_stations [word * 64 + __builtin_ctzll (bits)].bad++;
+		}
+	}
+	pref->applied = true;
+}
 
+static int station_number_comparator (const void *a, const void *b) {
+	return strcmp (tuner_stations [*(const unsigned int *) a].id,
+				   tuner_stations [*(const unsigned int *) b].id);
+}
 
-static void apply_station_ratings (struct user_t *user, size_t station_count, STATION_SELECTOR *stations) {
-	/* Require influence privilege to be considered in calculation */
-	if (!have_privilege (user, PRIVILEGE_INFLUENCE)) {
-		return;
+/* Find a station's number by ID, or -1 if it's not in the station list. */
+static long find_station_number (const char *station_id) {
+	size_t low = 0;
+	size_t high = tuner_station_count;
+	while (low < high) {
+		size_t mid = (low + high) / 2;
+		unsigned int number = tuner_stations_by_id [mid];
+		int comparison = strcmp (station_id, tuner_stations [number].id);
+		if (comparison == 0) {
+			return number;
+		}
+		if (comparison < 0) {
+			high = mid;
+		} else {
+			low = mid + 1;
+		}
 	}
-	/* Get and apply each station's rating for this user. */
-	for (int i = 0; i < station_count; i++) {
-		STATION_RATING rating = get_station_rating(user,
-												   stations [i].station_id);
-		switch (rating) {
-			case RATING_GOOD:
-				stations [i].partial_good = true;
-				break;
-			case RATING_BAD:
-				stations [i].bad = true;
-				/* FALLTHRU */
-			case RATING_NEUTRAL:
-				stations [i].pure_good = false;
-				break;
-			default:
-				assert (0);
-				break;
+	return -1;
+}
+
+/* Build a user's rating bitsets for the current station numbering. */
+static bool build_station_bitsets (STATION_PREF *pref) {
+	assert (!pref->applied);
+	size_t words = BITSET_WORDS (tuner_station_count);
+	uint64_t *good = calloc (words ? words : 1, sizeof (uint64_t));
+	uint64_t *bad = calloc (words ? words : 1, sizeof (uint64_t));
+	if (!good || !bad) {
+		perror ("build_station_bitsets:calloc");
+		free (good);
+		free (bad);
+		return false;
+	}
+	for (size_t i = 0; i < pref->count; i++) {
+		long number = find_station_number (pref->ratings [i].station_id);
+		if (number >= 0 && pref->ratings [i].rating != RATING_NEUTRAL) {
+			uint64_t *bits = (pref->ratings [i].rating == RATING_GOOD) ? good : bad;
+			bits [number / 64] |= (uint64_t) 1 << (number % 64);
 		}
 	}
+	free (pref->good);
+	free (pref->bad);
+	pref->good = good;
+	pref->bad = bad;
+	pref->generation = tuner_generation;
+	return true;
 }
 
+/* Make sure the station numbering matches the station list.
+   If the list has changed, renumber and start counting over. */
+static bool sync_tuner_stations (APPSTATE *app) {
+	size_t station_count = PianoListCountP (app->ph.stations);
+	bool same = (station_count == tuner_station_count);
+	PianoStation_t *station = app->ph.stations;
+	size_t i = 0;
+	if (same) {
+		PianoListForeachP (station) {
+			if (tuner_stations [i].station != station || strcmp (tuner_stations [i].id, station->id) != 0) {
+				same = false;
+				break;
+			}
+			i++;
+		}
+	}
+	if (same) {
+		return true;
+	}
+
+	for (i = 0; i < tuner_station_count; i++) {
+		free (tuner_stations [i].id);
+	}
+	free (tuner_stations);
+	free (tuner_stations_by_id);
+	tuner_station_count = 0;
+	if (++tuner_generation == 0) {
+		tuner_generation = 1;
+	}
+	for (struct user_t *user = get_first_user (); user; user = get_next_user (user)) {
+		STATION_PREF *pref = get_station_preferences (user);
+		if (pref) {
+			pref->applied = false;
+		}
+	}
 
-/* Apply station preferences for logged-in users */
-static bool tune_based_on_logins (APPSTATE *app, size_t station_count, STATION_SELECTOR *stations) {
-    assert (app);
+	tuner_stations = calloc (station_count ? station_count : 1, sizeof (TUNER_STATION));
+	tuner_stations_by_id = calloc (station_count ? station_count : 1, sizeof (unsigned int));
+	if (!tuner_stations || !tuner_stations_by_id) {
+		perror ("sync_tuner_stations:calloc");
+		free (tuner_stations);
+		free (tuner_stations_by_id);
+		tuner_stations = NULL;
+		tuner_stations_by_id = NULL;
+		return false;
+	}
+	i = 0;
+	station = app->ph.stations;
+	PianoListForeachP (station) {
+		tuner_stations [i].station = station;
+		if (!(tuner_stations [i].id = strdup (station->id))) {
+			perror ("sync_tuner_stations:strdup");
+			tuner_station_count = i;
+			return false;
+		}
+		tuner_stations_by_id [i] = i;
+		i++;
+		tuner_station_count = i;
+	}
+	assert (i == station_count);
+	qsort (tuner_stations_by_id, tuner_station_count, sizeof (unsigned int), station_number_comparator);
+	return true;
+}
 
-	/* Iterate over connected users, and add their preferences into the station selection data */
+/* Bring a user's contribution to the station counts up to date. */
+static void update_contribution (STATION_PREF *pref, bool contributes) {
+	if (pref->applied && !contributes) {
+		withdraw_station_ratings (pref);
+	} else if (!pref->applied && contributes) {
+		if (pref->generation == tuner_generation || build_station_bitsets (pref)) {
+			apply_station_ratings (pref);
+		}
+	}
+}
+
+/* Check if any connections are open, authenticated or not */
+static bool anyone_connected (APPSTATE *app) {
+	bool connected = false;
 	FB_ITERATOR *it = fb_new_iterator (app->service);
-	bool anyone_listening = false;
 	if (it) {
 		FB_EVENT *event;
 		while ((event = fb_iterate_next (it))) {
-			USER_CONTEXT *context = event->context;
-			anyone_listening = anyone_listening || event->type == FB_EVENT_ITERATOR;
-			if (event->type == FB_EVENT_ITERATOR /* Ignore closing connections */ &&
-				context->user) {
-				apply_station_ratings (context->user, station_count, stations);
+			if (event->type == FB_EVENT_ITERATOR /* Ignore closing connections */) {
+				connected = true;
+				break;
 			}
 		}
 		fb_destroy_iterator (it);
 	}
-	return anyone_listening;
+	return connected;
 }
 
-
-/* Apply station preferences for useres who are attributed as present. */
-static bool tune_based_on_attribute (APPSTATE *app, size_t station_count, STATION_SELECTOR *stations) {
-    assert (app);
-
-	struct user_t *user;
-	
-	/* Iterate over all users, and add their preferences into the station selection data
-	   if they both have influence and are present. */
-	bool anyone_listening = false;
-	for (user = get_first_user(); user; user = get_next_user (user)) {
-		if (have_privilege (user, ATTRIBUTE_PRESENT)) {
-			anyone_listening = true;
-			apply_station_ratings (user, station_count, stations);
-		}
+/* Check if a station is selected by an autotuning algorithm */
+static bool station_selected (const TUNER_STATION *station, int algorithm, unsigned int contributors) {
+	switch (algorithm) {
+		case 1:
+			/* Everyone rates it good; with no contributors, that's all stations. */
+			return station->good == contributors;
+		case 2:
+			return station->good && !station->bad;
+		case 3:
+			return !station->bad;
 	}
-	return anyone_listening;
+	assert (0);
+	return false;
 }
 
 /*
@@ -378,81 +592,59 @@ void recompute_stations (APPSTATE *app) {
 		return;
 	}
 
-	size_t station_count = PianoListCountP (app->ph.stations);
-	if (station_count == 0) {
-		return;
-	}
-	
-	STATION_SELECTOR *stations = calloc (sizeof (STATION_SELECTOR), station_count);
-	if (!stations) {
-		perror ("recompute_stations:calloc");
+	if (PianoListCountP (app->ph.stations) == 0 || !sync_tuner_stations (app)) {
 		return;
 	}
 
-	/* Copy the stations into an array that we can access efficiently,
-	   with fields to store computations. */
-	unsigned int i = 0;
-	PianoStation_t *station = app->ph.stations;
-	PianoListForeachP (station) {
-		stations [i].station = station;
-		stations [i].station_id = station->id;
-		stations [i].pure_good = true;
-		i++;
+	/* Users with influence count if they are logged in (when tuning on
+	   logins) or present (when tuning on the attribute). */
+	bool on_logins = (app->settings.automatic_mode & TUNE_ON_LOGINS);
+	bool on_attribute = (app->settings.automatic_mode & TUNE_ON_ATTRIBUTE);
+	station_computation_has_listeners = on_logins && anyone_connected (app);
+	unsigned int contributors = 0;
+	for (struct user_t *user = get_first_user (); user; user = get_next_user (user)) {
+		bool present = on_attribute && have_privilege (user, ATTRIBUTE_PRESENT);
+		if (present) {
+			station_computation_has_listeners = true;
+		}
+		bool contributes = have_privilege (user, PRIVILEGE_INFLUENCE) &&
+						   (present || (on_logins && is_user_listening (user)));
+		if (contributes) {
+			contributors++;
+		}
+		STATION_PREF *pref = get_station_preferences (user);
+		if (pref) {
+			update_contribution (pref, contributes);
+		}
 	}
-	assert (i == station_count);
 
-	/* Apply the selected autotuning algorithms */
-	station_computation_has_listeners = false;
-	if (app->settings.automatic_mode & TUNE_ON_LOGINS) {
-		station_computation_has_listeners = tune_based_on_logins (app, station_count, stations) || station_computation_has_listeners;
-	}
-	if (app->settings.automatic_mode & TUNE_ON_ATTRIBUTE) {
-		station_computation_has_listeners = tune_based_on_attribute (app, station_count, stations) || station_computation_has_listeners;
-	}
-	
-	/* We now have a station list with a set of flags. */
 	station_computation_had_results = !station_computation_has_listeners;
 	int algorithm;
-	for (algorithm = 1; algorithm <= 3; algorithm++) {
-		for (i = 0; i < station_count; i++) {
-			switch (algorithm) {
-				case 1:
-					stations[i].include = stations [i].pure_good;
-					break;
-				case 2:
-					stations[i].include = stations [i].partial_good && !stations [i].bad;
-					break;
-				case 3:
-					stations[i].include = !stations [i].bad;
-					break;
-				default:
-					assert (0);
-					break;
-			}
-			if (stations [i].include) {
+	for (algorithm = 1; algorithm <= 3 && !station_computation_had_results; algorithm++) {
+		for (size_t i = 0; i < tuner_station_count; i++) {
+			if (station_selected (&tuner_stations [i], algorithm, contributors)) {
 				station_computation_had_results = true;
+				break;
 			}
 		}
 		if (station_computation_had_results) {
 			break;
 		}
 	}
-	
+
 	if (!station_computation_has_listeners) {
 		send_status (app->service, "No listeners.");
-	} else if (station_computation_had_results && station_computation_has_listeners) {
-		/* Copy the computed stations back into the libpiano structures. */
+	} else if (station_computation_had_results) {
+		/* Copy the computed stations into the libpiano structures,
+		   and tell Pandora only if the mix changed. */
 		bool changed = false;
-		i = 0;
-		station = app->ph.stations;
-		PianoListForeachP (station) {
-			if (stations [i].station->useQuickMix != stations [i].include) {
+		for (size_t i = 0; i < tuner_station_count; i++) {
+			bool include = station_selected (&tuner_stations [i], algorithm, contributors);
+			if (tuner_stations [i].station->useQuickMix != include) {
 				changed = true;
-				stations [i].station->useQuickMix = stations [i].include;
+				tuner_stations [i].station->useQuickMix = include;
 			}
-			i++;
 		}
-		assert (i == station_count);
 		if (changed) {
 			piano_transaction (app, NULL, PIANO_REQUEST_SET_QUICKMIX, NULL);
 			send_response (app->service, I_MIX_CHANGED);
@@ -464,8 +656,6 @@ void recompute_stations (APPSTATE *app) {
 	} else {
 		send_status (app->service, "current listener station preferences are incompatible");
 	}
-	
-	free (stations);
 }
 
 
@@ -11,6 +11,7 @@
 #include <ezxml.h>
 
 #include "users.h"
+#include "snapshot.h"
 
 #ifndef _TUNER_H
 #define _TUNER_H
@@ -24,6 +25,8 @@ extern void announce_station_ratings (APPSTATE *app, struct user_t *user);
 extern void destroy_station_preferences (struct station_preferences_t *pref);
 extern void persist_station_preferences (FILE *dest, struct user_t *user);
 extern bool recreate_station_preferences (struct user_t *user, ezxml_t data);
+extern void snapshot_station_preferences (SNAPSHOT_WRITER *dest, struct user_t *user);
+extern bool restore_station_preferences (struct user_t *user, const SNAPSHOT *snapshot, const SNAPSHOT_USER *record);
 
 extern bool computed_stations_is_empty_set (void);
 extern void recompute_stations (APPSTATE *app);
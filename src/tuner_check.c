@@ -0,0 +1,408 @@
+/*
+ *  tuner_check.c
+ *  pianod - Drives the autotuner through logins, logouts, rating changes
+ *  and station list changes, and compares every result with a recompute
+ *  from scratch.  Run by "make check".
+ *
+ *  The user directory, connections and Pandora are stand-ins defined
+ *  here; tuner.c is the real one.
+ *
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include <fb_public.h>
+#include <piano.h>
+
+#include "pianod.h"
+#include "logging.h"
+#include "response.h"
+#include "users.h"
+#include "support.h"
+#include "tuner.h"
+#include "snapshot.h"
+
+#define CHECK_USERS (9)
+#define CHECK_STATION_POOL (200) /* Station IDs that may be rated */
+#define CHECK_STATIONS (150) /* In a station list; more than two bitset words */
+#define CHECK_STEPS (20000)
+
+typedef enum check_rating_t {
+	CHECK_NEUTRAL,
+	CHECK_GOOD,
+	CHECK_BAD
+} CHECK_RATING;
+
+static const char *rating_names [] = { "neutral", "good", "bad" };
+
+/* A user as the stand-in directory keeps it, plus the ratings the
+   check expects the tuner to hold */
+struct user_t {
+	char name [16];
+	bool influence;
+	bool present;
+	bool listening;
+	struct station_preferences_t *preferences;
+	CHECK_RATING ratings [CHECK_STATION_POOL];
+};
+
+static USER users [CHECK_USERS];
+static bool anonymous_connection; /* An unauthenticated connection is open */
+static unsigned int quickmix_requests;
+static const char *last_status;
+
+/* Station list, as the last Pandora refresh left it */
+static PianoStation_t *stations [CHECK_STATIONS];
+static size_t station_count;
+static unsigned int station_ids [CHECK_STATIONS]; /* Pool index of each */
+
+
+/* Stand-ins for the user directory */
+bool have_privilege (USER *user, PRIVILEGE priv) {
+	return (priv == PRIVILEGE_INFLUENCE ? user->influence :
+			priv == ATTRIBUTE_PRESENT ? user->present : false);
+}
+
+USER *get_first_user (void) {
+	return &users [0];
+}
+
+USER *get_next_user (USER *user) {
+	return (user + 1 < users + CHECK_USERS) ? user + 1 : NULL;
+}
+
+bool is_user_listening (USER *user) {
+	return user->listening;
+}
+
+const char *get_user_name (USER *user) {
+	return user->name;
+}
+
+struct station_preferences_t *get_station_preferences (USER *user) {
+	return user->preferences;
+}
+
+void set_station_preferences (USER *user, struct station_preferences_t *prefs) {
+	user->preferences = prefs;
+}
+
+
+/* Stand-ins for connections: one open connection if anyone is listening */
+static FB_EVENT connection_event;
+static USER_CONTEXT connection_context;
+static int iterator;
+
+FB_ITERATOR *fb_new_iterator (FB_SERVICE *service) {
+	iterator = 0;
+	return (FB_ITERATOR *) &iterator;
+}
+
+FB_EVENT *fb_iterate_next (FB_ITERATOR *it) {
+	bool connected = anonymous_connection;
+	for (USER *user = get_first_user (); user; user = get_next_user (user)) {
+		connected = connected || user->listening;
+	}
+	if (!connected || (*(int *) it)++ > 0) {
+		return NULL;
+	}
+	connection_event.type = FB_EVENT_ITERATOR;
+	connection_event.context = &connection_context;
+	return &connection_event;
+}
+
+void fb_destroy_iterator (FB_ITERATOR *it) {
+}
+
+
+/* Stand-ins for pianod */
+bool piano_transaction (APPSTATE *app, FB_EVENT *event, PianoRequestType_t type, void *data) {
+	if (type == PIANO_REQUEST_SET_QUICKMIX) {
+		quickmix_requests++;
+	}
+	return true;
+}
+
+PianoStation_t *get_station_by_name_or_current (APPSTATE *app, FB_EVENT *event, const char *stationname) {
+	for (size_t i = 0; i < station_count; i++) {
+		if (strcmp (stations [i]->name, stationname) == 0) {
+			return stations [i];
+		}
+	}
+	return NULL;
+}
+
+void reply (FB_EVENT *event, const RESPONSE_CODE status) {
+}
+
+void data_reply (FB_EVENT *event, const RESPONSE_CODE status, const char *detail) {
+}
+
+void send_response (void *there, RESPONSE_CODE code) {
+}
+
+void send_status (void *there, const char *message) {
+	last_status = message;
+}
+
+void flog (LOG_TYPE level, const char *format, ...) {
+	va_list parameters;
+	va_start (parameters, format);
+	vfprintf (stderr, format, parameters);
+	va_end (parameters);
+}
+
+
+/* Stand-ins for snapshots, which this check doesn't use */
+void snapshot_free (void *ptr) {
+	free (ptr);
+}
+
+void snapshot_add_rating (SNAPSHOT_WRITER *writer, const char *station_id, unsigned int rating) {
+	abort ();
+}
+
+const SNAPSHOT_RATING *snapshot_ratings (const SNAPSHOT *snapshot, const SNAPSHOT_USER *user) {
+	abort ();
+}
+
+char *snapshot_get_string (const SNAPSHOT *snapshot, uint32_t offset) {
+	abort ();
+}
+
+
+/* Replace the station list with a random selection from the pool, in
+   random order, as a Pandora refresh would: new records, mix flags as
+   Pandora last had them. */
+static void refresh_station_list (APPSTATE *app) {
+	for (size_t i = 0; i < station_count; i++) {
+		free (stations [i]->name);
+		free (stations [i]->id);
+		free (stations [i]);
+	}
+	bool used [CHECK_STATION_POOL] = { false };
+	station_count = CHECK_STATIONS - rand () % 20;
+	app->ph.stations = NULL;
+	for (size_t i = 0; i < station_count; i++) {
+		unsigned int id;
+		do {
+			id = rand () % CHECK_STATION_POOL;
+		} while (used [id]);
+		used [id] = true;
+		station_ids [i] = id;
+		PianoStation_t *station = calloc (1, sizeof (PianoStation_t));
+		if (!station || asprintf (&station->id, "%u", 4000000 + id * 7919) < 0 ||
+			asprintf (&station->name, "Station %u", id) < 0) {
+			perror ("refresh_station_list");
+			exit (1);
+		}
+		station->useQuickMix = rand () % 2;
+		stations [i] = station;
+		app->ph.stations = PianoListAppendP (app->ph.stations, station);
+	}
+}
+
+/* Rate a station the way the "rate station" command does */
+static void rate (APPSTATE *app, USER *user, size_t station, CHECK_RATING rating) {
+	char *argv [] = { "rate", "station", (char *) rating_names [rating], stations [station]->name, NULL };
+	FB_EVENT event;
+	memset (&event, 0, sizeof (event));
+	event.argc = 4;
+	event.argv = argv;
+	user->ratings [station_ids [station]] = rating;
+	rate_station (app, &event, user); /* Recomputes the mix */
+}
+
+/* The autotuner as it was before the incremental counts: look at every
+   rating of every contributing user. */
+typedef struct reference_t {
+	bool has_listeners;
+	bool has_results;
+	int algorithm;
+	bool include [CHECK_STATIONS];
+} REFERENCE;
+
+static void recompute_from_scratch (APPSTATE *app, REFERENCE *ref) {
+	bool on_logins = (app->settings.automatic_mode & TUNE_ON_LOGINS);
+	bool on_attribute = (app->settings.automatic_mode & TUNE_ON_ATTRIBUTE);
+	bool pure_good [CHECK_STATIONS], partial_good [CHECK_STATIONS], bad [CHECK_STATIONS];
+	for (size_t i = 0; i < station_count; i++) {
+		pure_good [i] = true;
+		partial_good [i] = bad [i] = false;
+	}
+
+	ref->has_listeners = on_logins && anonymous_connection;
+	for (USER *user = get_first_user (); user; user = get_next_user (user)) {
+		bool logged_in = on_logins && user->listening;
+		bool present = on_attribute && user->present;
+		if (logged_in || present) {
+			ref->has_listeners = true;
+		}
+		if (!user->influence || !(logged_in || present)) {
+			continue;
+		}
+		for (size_t i = 0; i < station_count; i++) {
+			switch (user->ratings [station_ids [i]]) {
+				case CHECK_GOOD:
+					partial_good [i] = true;
+					break;
+				case CHECK_BAD:
+					bad [i] = true;
+					/* FALLTHRU */
+				case CHECK_NEUTRAL:
+					pure_good [i] = false;
+					break;
+			}
+		}
+	}
+
+	ref->has_results = !ref->has_listeners;
+	for (ref->algorithm = 1; ref->algorithm <= 3; ref->algorithm++) {
+		for (size_t i = 0; i < station_count; i++) {
+			ref->include [i] = (ref->algorithm == 1 ? pure_good [i] :
+								ref->algorithm == 2 ? partial_good [i] && !bad [i] :
+								!bad [i]);
+			ref->has_results = ref->has_results || ref->include [i];
+		}
+		if (ref->has_results) {
+			break;
+		}
+	}
+}
+
+/* The mix and the request count before a step */
+static bool before [CHECK_STATIONS];
+static unsigned int requests_before;
+
+static void begin_step (void) {
+	for (size_t i = 0; i < station_count; i++) {
+		before [i] = stations [i]->useQuickMix;
+	}
+	requests_before = quickmix_requests;
+}
+
+/* After the tuner ran, compare with the reference: the same mix, and a
+   SET_QUICKMIX request exactly when the mix changed. */
+static bool finish_step (APPSTATE *app, unsigned int step, const char *what) {
+	REFERENCE ref;
+	recompute_from_scratch (app, &ref);
+
+	bool apply = ref.has_listeners && ref.has_results;
+	bool changed = false;
+	for (size_t i = 0; i < station_count; i++) {
+		bool expected = apply ? ref.include [i] : before [i];
+		changed = changed || (expected != before [i]);
+		if ((bool) stations [i]->useQuickMix != expected) {
+			fprintf (stderr, "Step %u (%s): station %u %s the mix, expected %s (algorithm %d)\n",
+					 step, what, station_ids [i], stations [i]->useQuickMix ? "in" : "out of",
+					 expected ? "in" : "out", ref.algorithm);
+			return false;
+		}
+	}
+	if (quickmix_requests - requests_before != (changed ? 1 : 0)) {
+		fprintf (stderr, "Step %u (%s): %u mix requests for %s mix\n", step, what,
+				 quickmix_requests - requests_before, changed ? "a changed" : "an unchanged");
+		return false;
+	}
+	if (computed_stations_is_empty_set () != !apply) {
+		fprintf (stderr, "Step %u (%s): empty set %s, expected %s\n", step, what,
+				 computed_stations_is_empty_set () ? "reported" : "not reported",
+				 apply ? "results" : "none");
+		return false;
+	}
+	if (!ref.has_listeners && (!last_status || strcmp (last_status, "No listeners.") != 0)) {
+		fprintf (stderr, "Step %u (%s): no listeners not reported\n", step, what);
+		return false;
+	}
+	return true;
+}
+
+int main (void) {
+	static APPSTATE app;
+	app.automatic_stations = true;
+	app.settings.automatic_mode = TUNE_ON_LOGINS;
+	srand (1);
+	for (unsigned int u = 0; u < CHECK_USERS; u++) {
+		snprintf (users [u].name, sizeof (users [u].name), "user%u", u);
+		users [u].influence = (u != 0);
+	}
+	refresh_station_list (&app);
+
+	/* Overlapping tastes: everyone likes a few stations in common, and
+	   each user rates others of their own. */
+	bool ok = true;
+	for (unsigned int u = 0; u < CHECK_USERS && ok; u++) {
+		for (size_t i = 0; i < station_count && ok; i++) {
+			int choice = rand () % 8;
+			if (i < 6 || choice < 3) {
+				begin_step ();
+				rate (&app, &users [u], i, i < 6 || choice > 0 ? CHECK_GOOD : CHECK_BAD);
+				ok = finish_step (&app, 0, "initial rating");
+			}
+		}
+	}
+
+	/* A login/logout sequence, with ratings, privileges and the station
+	   list changing in between */
+	unsigned int changes = 0;
+	unsigned int logins = 0;
+	for (unsigned int step = 1; step <= CHECK_STEPS && ok; step++) {
+		USER *user = &users [rand () % CHECK_USERS];
+		int action = rand () % 100;
+		const char *what;
+		begin_step ();
+		if (action < 30) {
+			what = "rating";
+			rate (&app, user, rand () % station_count, rand () % 3);
+		} else {
+			if (action < 70) {
+				user->listening = !user->listening;
+				logins += user->listening;
+				what = user->listening ? "login" : "logout";
+			} else if (action < 78) {
+				what = "influence";
+				user->influence = !user->influence;
+			} else if (action < 86) {
+				what = "presence";
+				user->present = !user->present;
+			} else if (action < 90) {
+				what = "anonymous connection";
+				anonymous_connection = !anonymous_connection;
+			} else if (action < 93) {
+				static const AUTOTUNE_MODE modes [] = { TUNE_ON_LOGINS, TUNE_ON_ATTRIBUTE,
+														TUNE_ON_LOGINS | TUNE_ON_ATTRIBUTE };
+				what = "autotuning mode";
+				app.settings.automatic_mode = modes [rand () % 3];
+			} else if (action < 96) {
+				what = "station list";
+				refresh_station_list (&app);
+				begin_step ();
+			} else if (action < 98) {
+				what = "user deleted";
+				destroy_station_preferences (user->preferences);
+				user->preferences = NULL;
+				memset (user->ratings, 0, sizeof (user->ratings));
+			} else {
+				what = "nothing";
+			}
+			recompute_stations (&app);
+		}
+		ok = finish_step (&app, step, what);
+		changes += quickmix_requests - requests_before;
+	}
+
+	for (unsigned int u = 0; u < CHECK_USERS; u++) {
+		destroy_station_preferences (users [u].preferences);
+	}
+	if (!ok) {
+		return 1;
+	}
+	printf ("tuner_check: %d steps, %u logins, %u mix changes\n", CHECK_STEPS, logins, changes);
+	return 0;
+}
@@ -8,7 +8,8 @@
  */
 
 #ifndef __FreeBSD__
-#define _DEFAULT_SOURCE /* snprintf() */
+#define _DEFAULT_SOURCE /* snprintf(), open_memstream() */
+#define _DARWIN_C_SOURCE /* open_memstream() on OS X */
 #endif
 
 #include <config.h>
@@ -19,7 +20,12 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 /* crypt() is in unistd.h for BSD. */
 #ifdef HAVE_CRYPT_H
@@ -34,6 +40,10 @@
 #include "logging.h"
 #include "pianod.h"
 #include "tuner.h"
+#include "support.h"
+#include "settings.h"
+#include "threadqueue.h"
+#include "snapshot.h"
 
 typedef enum find_kind_t {
 	FIND_OPEN_CONNECTIONS,
@@ -48,9 +58,18 @@ struct user_t {
 	bool privileges[PRIVILEGE_COUNT];
     CREDENTIALS pandora_credentials;
 	struct station_preferences_t *station_preferences;
+	bool dirty; /* Changed since last persisted */
+	USER_CONTEXT *sessions; /* Connections logged in as this user */
 	struct user_t *next;
+	struct user_t *hash_next; /* Next user in directory bucket */
 };
 
+/* Names of users deleted since last persisted */
+typedef struct deleted_user_t {
+	char *name;
+	struct deleted_user_t *next;
+} DELETED_USER;
+
 typedef struct rankings_t {
 	const char *name;
 	USER_RANK value;
@@ -95,6 +114,10 @@ static MANAGER_RULES manager_rules[] = {
 };
 
 static USER *user_list;
+static USER **user_directory; /* Users hashed by case-folded name */
+static size_t user_directory_size; /* Buckets; a power of 2 */
+static size_t user_count;
+static DELETED_USER *deleted_users;
 static bool dirty = false; /* Whether the user data has unsaved changes */
 static USER_RANK visitor_rank = RANK_LISTENER; /* Fucking aliens and their rainbows */
 static MANAGER_RULE ownership_rule = MANAGER_ADMINISTRATOR;
@@ -187,27 +210,19 @@ static const MANAGER_RULES *get_manager_rule_by_id (MANAGER_RULE mr) {
 }
 
 
+/* Each user keeps a list of the sessions logged in as it, so finding
+   a user's connections doesn't require a scan of all connections.
+   The lists are maintained as connections arrive, authenticate and close. */
 static FB_CONNECTION *find_online_user (FB_SERVICE *service, USER *user, FIND_KIND find) {
 	assert (service);
 	assert (user);
 
-	FB_CONNECTION *found = NULL;
-	FB_ITERATOR *it = fb_new_iterator (service);
-	if (it) {
-		FB_EVENT *event;
-		while ((event = fb_iterate_next (it))) {
-			if (find == FIND_OPEN_CONNECTIONS && event->type == FB_EVENT_ITERATOR_CLOSE) {
-				continue;
-			}
-			USER_CONTEXT *context = event->context;
-			if (context->user == user) {
-				found = event->connection;
-				break;
-			}
+	for (USER_CONTEXT *session = user->sessions; session; session = session->next_session) {
+		if (find == FIND_ALL_CONNECTIONS || fb_connection_is_open (session->connection)) {
+			return session->connection;
 		}
-		fb_destroy_iterator (it);
 	}
-	return found;
+	return NULL;
 }
 
 
@@ -215,6 +230,63 @@ bool is_user_online (FB_SERVICE *service, USER *user) {
 	return find_online_user (service, user, FIND_ALL_CONNECTIONS) != NULL;
 }
 
+/* Check if a user has a connection that isn't closing */
+bool is_user_listening (USER *user) {
+	assert (user);
+	for (USER_CONTEXT *session = user->sessions; session; session = session->next_session) {
+		if (fb_connection_is_open (session->connection)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Record a new connection's session */
+void register_session (USER_CONTEXT *context, FB_CONNECTION *connection) {
+	assert (context);
+	assert (connection);
+	context->connection = connection;
+}
+
+/* Change the user a session is logged in as.  NULL logs it out. */
+void set_session_user (USER_CONTEXT *context, USER *user) {
+	assert (context);
+	assert (context->connection);
+	if (context->user == user) {
+		return;
+	}
+	if (context->user) {
+		if (context->prev_session) {
+			context->prev_session->next_session = context->next_session;
+		} else {
+			assert (context->user->sessions == context);
+			context->user->sessions = context->next_session;
+		}
+		if (context->next_session) {
+			context->next_session->prev_session = context->prev_session;
+		}
+	}
+	context->user = user;
+	context->prev_session = NULL;
+	context->next_session = NULL;
+	if (user) {
+		context->next_session = user->sessions;
+		if (user->sessions) {
+			user->sessions->prev_session = context;
+		}
+		user->sessions = context;
+	}
+}
+
+/* Forget a closed connection's session */
+void unregister_session (USER_CONTEXT *context) {
+	assert (context);
+	if (context->connection) {
+		set_session_user (context, NULL);
+		context->connection = NULL;
+	}
+}
+
 /* Iterators on users */
 USER *get_first_user (void) {
 	return user_list;
@@ -228,8 +300,8 @@ USER *get_next_user (USER *user) {
 
 /* Destroy Pandora credentials */
 void destroy_pandora_credentials (CREDENTIALS *creds) {
-    free (creds->username);
-    free (creds->password);
+    snapshot_free (creds->username);
+    snapshot_free (creds->password);
     memset (creds, 0, sizeof (*creds));
 }
 
@@ -239,8 +311,8 @@ static void destroy_users (USER *list) {
 	USER *next;
 	while (list) {
 		next = list->next;
-		free (list->name);
-		free (list->password);
+		snapshot_free (list->name);
+		snapshot_free (list->password);
         destroy_pandora_credentials (&list->pandora_credentials);
 		destroy_station_preferences (list->station_preferences);
 		free (list);
@@ -249,11 +321,85 @@ static void destroy_users (USER *list) {
 }
 
 
+/* Forget users deleted since last persisted */
+static void forget_deleted_users (void) {
+	DELETED_USER *deleted;
+	while ((deleted = deleted_users)) {
+		deleted_users = deleted->next;
+		snapshot_free (deleted->name);
+		free (deleted);
+	}
+}
+
+
+/* FNV-1a hash of a user name, ignoring case */
+static uint32_t hash_user_name (const char *name) {
+	uint32_t hash = 2166136261u;
+	while (*name) {
+		hash = (hash ^ (unsigned char) tolower ((unsigned char) *name++)) * 16777619u;
+	}
+	return hash;
+}
+
+/* Rehash the directory into a new number of buckets */
+static bool resize_user_directory (size_t size) {
+	USER **directory = calloc (size, sizeof (USER *));
+	if (!directory) {
+		perror ("resize_user_directory:calloc");
+		return false;
+	}
+	for (USER *user = user_list; user; user = user->next) {
+		USER **bucket = &directory [hash_user_name (user->name) & (size - 1)];
+		user->hash_next = *bucket;
+		*bucket = user;
+	}
+	free (user_directory);
+	user_directory = directory;
+	user_directory_size = size;
+	return true;
+}
+
+/* Add a user, already on the user list, to the directory.
+   If the directory can't be grown, it stays as is, with longer chains. */
+static bool add_to_user_directory (USER *user) {
+	if (user_count >= user_directory_size) {
+		if (resize_user_directory (user_directory_size ? user_directory_size * 2 : 64)) {
+			/* Resizing hashed the whole list, including this user. */
+			user_count++;
+			return true;
+		}
+		if (!user_directory) {
+			return false;
+		}
+	}
+	USER **bucket = &user_directory [hash_user_name (user->name) & (user_directory_size - 1)];
+	user->hash_next = *bucket;
+	*bucket = user;
+	user_count++;
+	return true;
+}
+
+static void remove_from_user_directory (USER *user) {
+	for (USER **bucket = &user_directory [hash_user_name (user->name) & (user_directory_size - 1)];
+		 *bucket; bucket = &(*bucket)->hash_next) {
+		if (*bucket == user) {
+			*bucket = user->hash_next;
+			user->hash_next = NULL;
+			user_count--;
+			return;
+		}
+	}
+	assert (0);
+}
+
 /* Get a user's record by name */
 static USER *find_user (const char *username) {
 	assert (username);
+	if (!user_directory) {
+		return NULL;
+	}
 	USER *user;
-	for (user = user_list; user; user = user->next) {
+	for (user = user_directory [hash_user_name (username) & (user_directory_size - 1)]; user; user = user->hash_next) {
 		if (strcasecmp (username, user->name) == 0) {
 			return user;
 		}
@@ -286,13 +432,42 @@ void set_ownership_rule (MANAGER_RULE rule, USER *manager) {
 static char *encrypt_password (const char *password) {
 	static char *saltchars = "./0123456789QWERTYUIOPASDFGHJKLZXCVBNMqwertyuiopasdfghjklzxcvbnm";
 	assert (strlen (saltchars) == 64);
-	char salt[2];
+	char salt[3];
 	salt [0] = saltchars [random() % 64];
 	salt [1] = saltchars [random() % 64];
+	salt [2] = '\0';
 	return (crypt (password, salt));
 }
 
 
+/* Add a user to the user list, taking ownership of the name and
+   (already encrypted) password.  Returns NULL on allocation failure. */
+static USER *add_user (char *username, char *password) {
+	assert (username);
+	assert (password);
+	USER *newuser = calloc (1, sizeof (USER));
+	if (newuser) {
+		newuser->name = username;
+		newuser->password = password;
+		/* Initialize the new user's privileges */
+		for (int i = 0; i < countof (privileges); i++) {
+			newuser->privileges [privileges [i].index] = privileges [i].initial_value;
+		}
+		/* Add to the user list */
+		newuser->next = user_list;
+		user_list = newuser;
+		if (!add_to_user_directory (newuser)) {
+			user_list = newuser->next;
+			free (newuser);
+			return NULL;
+		}
+		newuser->dirty = dirty = true;
+	} else {
+		perror ("calloc");
+	}
+	return newuser;
+}
+
 /* Create a new user with the username and password.
    Encrypt the password if requested (if not, it's already encrypted).
  Returns true on success, false on duplicate user or other failure */
@@ -300,27 +475,18 @@ static USER *create_user (const char *username, const char *password, bool encry
 	assert (username);
 	assert (password);
 	if (!find_user (username)) {
-		USER *newuser = calloc (1, sizeof (USER));
-		if (newuser) {
-			if ((newuser->name = strdup (username)) &&
-				(newuser->password = strdup (encrypt ? encrypt_password (password) : password))) {
-				/* Initialize the new user's privileges */
-				for (int i = 0; i < countof (privileges); i++) {
-					newuser->privileges [privileges [i].index] = privileges [i].initial_value;
-				}
-				/* Add to the user list */
-				newuser->next = user_list;
-				user_list = newuser;
-				dirty = true;
+		char *name = strdup (username);
+		char *crypted = strdup (encrypt ? encrypt_password (password) : password);
+		if (name && crypted) {
+			USER *newuser = add_user (name, crypted);
+			if (newuser) {
 				return newuser;
-			} else {
-				perror ("strdup");
 			}
-			free (newuser->name);
-			free (newuser);
 		} else {
-			perror ("calloc");
+			perror ("strdup");
 		}
+		free (name);
+		free (crypted);
 	}
 	return NULL;
 }
@@ -329,9 +495,9 @@ static USER *create_user (const char *username, const char *password, bool encry
 bool set_user_password (USER *user, const char *password) {
 	char *newword = strdup (encrypt_password (password));
 	if (newword) {
-		free (user->password);
+		snapshot_free (user->password);
 		user->password = newword;
-		dirty = true;
+		user->dirty = dirty = true;
 		return true;
 	}
 	return false;
@@ -349,6 +515,7 @@ USER *create_new_user (char *username, char *password) {
 /* Delete a user */
 void delete_user (USER *deluser) {
 	assert (deluser);
+	assert (!deluser->sessions);
 	USER *user, *prior;
 	for (prior = NULL, user = user_list; user; prior = user, user = user->next) {
 		if (user == deluser) {
@@ -358,6 +525,17 @@ void delete_user (USER *deluser) {
 				user_list = user->next;
 			}
 			user->next = NULL;
+			remove_from_user_directory (user);
+			/* Remember the deletion for the journal */
+			DELETED_USER *deleted = malloc (sizeof (*deleted));
+			if (deleted) {
+				deleted->name = user->name;
+				user->name = NULL;
+				deleted->next = deleted_users;
+				deleted_users = deleted;
+			} else {
+				perror ("malloc");
+			}
 			destroy_users (user);
 			dirty = true;
 			return;
@@ -371,6 +549,15 @@ void delete_user (USER *deluser) {
 void user_logoff (FB_SERVICE *service, USER *user, const char *message) {
 	assert (service);
 
+	if (user) {
+		for (USER_CONTEXT *session = user->sessions; session; session = session->next_session) {
+			if (fb_connection_is_open (session->connection)) {
+				send_status (session->connection, message ? message : "Logged off by an administrator");
+				fb_close_connection (session->connection);
+			}
+		}
+		return;
+	}
 	FB_ITERATOR *it = fb_new_iterator (service);
 	if (it) {
 		FB_EVENT *event;
@@ -440,7 +627,9 @@ bool have_rank (USER *user, USER_RANK minimum) {
 /* Set a user's rank */
 void set_rank (USER *user, USER_RANK rank) {
 	assert (user);
-	dirty = dirty || (user->rank != rank);
+	if (user->rank != rank) {
+		user->dirty = dirty = true;
+	}
 	user->rank = rank;
 }
 
@@ -472,7 +661,9 @@ bool have_privilege (USER *user, PRIVILEGE priv) {
 void set_privilege (USER *user, PRIVILEGE priv, bool setting) {
 	assert (user);
 	assert (priv >= 0 && priv < PRIVILEGE_COUNT);
-	dirty = dirty || (user->privileges [priv] != setting && get_privilege_by_id (priv)->persistable);
+	if (user->privileges [priv] != setting && get_privilege_by_id (priv)->persistable) {
+		user->dirty = dirty = true;
+	}
 	user->privileges [priv] = setting;
 }
 
@@ -523,21 +714,25 @@ struct station_preferences_t *get_station_preferences (USER *user) {
 
 void set_station_preferences (USER *user, struct station_preferences_t *prefs) {
 	user->station_preferences = prefs;
-	dirty = true;
+	user->dirty = dirty = true;
 }
 
 /* Transmit a user's privileges, or visitor privileges if user parameter is NULL */
-void send_privileges (FB_EVENT *event, USER *user) {
-	fb_fprintf (event->connection, "%03d %s: %s", I_USER_PRIVILEGES,
+static void send_privileges_to (FB_CONNECTION *connection, USER *user) {
+	fb_fprintf (connection, "%03d %s: %s", I_USER_PRIVILEGES,
 				Response (I_USER_PRIVILEGES), user_type_name (user ? user->rank : visitor_rank));
 	for (PRIVILEGE p = 0; p < PRIVILEGE_COUNT; p++) {
 		const PRIVILEGES *priv = get_privilege_by_id (p);
 		assert (priv);
 		if (have_privilege (user, p)) {
-			fb_fprintf (event->connection, " %s", priv->name);
+			fb_fprintf (connection, " %s", priv->name);
 		}
 	}
-	fb_fprintf (event->connection, "\n");
+	fb_fprintf (connection, "\n");
+}
+
+void send_privileges (FB_EVENT *event, USER *user) {
+	send_privileges_to (event->connection, user);
 }
 
 /* Stash Pandora credentials in a user's record, if indicated to do so by credentials record. */
@@ -552,7 +747,7 @@ void save_pandora_credentials (CREDENTIALS *creds) {
         if (newcred.username && newcred.password) {
             destroy_pandora_credentials (&creds->creator->pandora_credentials);
             creds->creator->pandora_credentials = newcred;
-            dirty = true;
+            creds->creator->dirty = dirty = true;
         } else {
             flog (LOG_ERROR, "save_pandora_credentials:strdup: %s", strerror (errno));
         }
@@ -586,14 +781,18 @@ bool restore_pandora_credentials (USER *user, CREDENTIALS *creds) {
    If user parameter is NULL, sends to all clients. */
 void announce_privileges (FB_SERVICE *service, USER *to_user) {
 	assert (service);
+	if (to_user) {
+		for (USER_CONTEXT *session = to_user->sessions; session; session = session->next_session) {
+			send_privileges_to (session->connection, to_user);
+		}
+		return;
+	}
 	FB_ITERATOR *it = fb_new_iterator (service);
 	if (it) {
 		FB_EVENT *event;
 		while ((event = fb_iterate_next (it))) {
 			USER_CONTEXT *context = event->context;
-			if (to_user == NULL || context->user == to_user) {
-				send_privileges (event, context->user);
-			}
+			send_privileges (event, context->user);
 		}
 		fb_destroy_iterator (it);
 	}
@@ -610,14 +809,18 @@ static void send_user (FB_EVENT *there, USER *user, bool details) {
 
 /* Send user list */
 void send_user_list (FB_EVENT *event, const char *who) {
-	bool found = false;
-	for (USER *user = user_list; user; user = user->next) {
-		if (who == NULL || strcasecmp (who, user->name) == 0) {
+	if (who) {
+		USER *user = find_user (who);
+		if (user) {
 			send_user (event, user, true);
-			found = true;
 		}
+		reply (event, user ? S_DATA_END : E_NOTFOUND);
+		return;
 	}
-	reply(event, who == NULL || found == true ? S_DATA_END : E_NOTFOUND);
+	for (USER *user = user_list; user; user = user->next) {
+		send_user (event, user, true);
+	}
+	reply (event, S_DATA_END);
 }
 
 /* Fake administrator for startscript to use */
@@ -741,24 +944,258 @@ static bool recreate_user (ezxml_t userdata) {
 }
 
 
+/* Resubstantiate a user from a binary snapshot record.  Strings are
+   used from the snapshot's string table rather than copied. */
+static bool restore_snapshot_user (const SNAPSHOT *snapshot, const SNAPSHOT_USER *record) {
+	char *name = snapshot_get_string (snapshot, record->name);
+	char *password = snapshot_get_string (snapshot, record->password);
+	if (!name || !password || record->rank > RANK_ADMINISTRATOR) {
+		flog (LOG_ERROR, "User data file corrupt: bad record for user %s\n",
+			  name ? name : "(name unknown)");
+		return false;
+	}
+	if (find_user (name)) {
+		flog (LOG_ERROR, "User listed twice in password file: %s\n", name);
+		return false;
+	}
+	USER *user = add_user (name, password);
+	if (!user) {
+		return false;
+	}
+	user->rank = record->rank;
+	if (record->pandora_user != SNAPSHOT_NONE) {
+		char *pname = snapshot_get_string (snapshot, record->pandora_user);
+		char *ppassword = snapshot_get_string (snapshot, record->pandora_password);
+		if (pname && ppassword && record->manager_rule <= MANAGER_USER) {
+			user->pandora_credentials.manager_rule = record->manager_rule;
+			user->pandora_credentials.manager = user;
+			user->pandora_credentials.username = pname;
+			user->pandora_credentials.password = ppassword;
+		} else {
+			flog (LOG_ERROR, "Ignored bad Pandora credentials for user %s\n", user->name);
+		}
+	}
+	for (int i = 0; i < countof (privileges); i++) {
+		if (privileges [i].persistable) {
+			user->privileges [privileges [i].index] = (record->privileges >> privileges [i].index) & 1;
+		}
+	}
+	restore_station_preferences (user, snapshot, record);
+	return true;
+}
+
+
+/* User data is persisted in two parts: the user file, and a journal of
+   changes since it was written.  Changed users are appended to the
+   journal as complete user records, along with deletions; when the
+   journal has grown large, the whole user file is rewritten and the
+   journal emptied.  On startup, the journal is replayed on top of the
+   user file.  The user file is a binary snapshot (see snapshot.h), or
+   XML if requested; either is read, told apart by the snapshot's magic
+   number.  Journal records are always XML.
+
+   Records are formatted into memory on the main thread, then handed to
+   a background thread for writing, so the run loop doesn't wait on the
+   disk.  The writer processes requests in order, so a rewrite of the
+   user file never overtakes journal entries queued before it.  Other
+   files can be replaced through the same writer; see persist_file. */
+
+#define JOURNAL_SUFFIX "-journal"
+#define JOURNAL_COMPACT_SIZE (32768) /* Journal size at which to rewrite the user file */
+
+typedef enum persist_message_t {
+	PERSIST_JOURNAL, /* Append to the journal */
+	PERSIST_SNAPSHOT, /* Replace the user file, then empty the journal */
+	PERSIST_FILE, /* Replace some other file */
+	PERSIST_QUIT
+} PERSIST_MESSAGE;
+
+typedef struct persist_request_t {
+	char *filename; /* User file, or file to replace */
+	char *data;
+	size_t size;
+	bool *failed; /* Set by the writer if the write fails */
+} PERSIST_REQUEST;
+
+static struct threadqueue persist_queue;
+static pthread_t persist_thread;
+static bool persist_running = false;
+static size_t journal_size = 0; /* Bytes journaled since the user file was written */
+static bool snapshot_required = false; /* Rewrite the user file at next persist */
+static bool write_failed = false; /* Set by writer on failure; rewrite everything next time */
+static bool write_xml = false; /* Write the user file as XML instead of a binary snapshot */
+
+
+/* Get the journal filename for a user file.  Caller must free it. */
+static char *journal_name (const char *filename) {
+	char *journal = malloc (strlen (filename) + sizeof (JOURNAL_SUFFIX));
+	if (journal) {
+		strcat (strcpy (journal, filename), JOURNAL_SUFFIX);
+	} else {
+		perror ("malloc");
+	}
+	return journal;
+}
+
+
+/* Replay journaled user records and deletions */
+static int replay_journal (ezxml_t journal) {
+	int replayed = 0;
+	for (ezxml_t record = journal->child; record; record = record->ordered) {
+		const char *name = ezxml_attr (record, "name");
+		if (!name) {
+			flog (LOG_ERROR, "User journal corrupt: record without a name\n");
+			continue;
+		}
+		USER *user = find_user (name);
+		if (user) {
+			delete_user (user);
+		}
+		if (strcmp (record->name, "user") == 0) {
+			recreate_user (record);
+		} else if (strcmp (record->name, "deleted") != 0) {
+			flog (LOG_ERROR, "User journal corrupt: unknown record %s\n", record->name);
+			continue;
+		}
+		replayed++;
+	}
+	return replayed;
+}
+
+
+/* Find the end of the last complete record in journal text.  Records
+   are indented two spaces; user records end with a closing tag, and
+   deletion records are a single line. */
+static size_t complete_journal_length (const char *data, size_t start, size_t size) {
+	size_t end = size;
+	while (end > start && data [end - 1] != '\n') {
+		end--;
+	}
+	while (end > start) {
+		size_t line = end - 1;
+		while (line > start && data [line - 1] != '\n') {
+			line--;
+		}
+		if (strncmp (data + line, "  </user>\n", 10) == 0 ||
+			strncmp (data + line, "  <deleted ", 11) == 0) {
+			return end;
+		}
+		end = line;
+	}
+	return start;
+}
+
+
+/* Read the journal and apply its changes to the user list */
+static void restore_journal (const char *filename) {
+	char *journal = journal_name (filename);
+	if (!journal) {
+		return;
+	}
+	/* Make sure it's writable once privileges are dropped. */
+	precreate_file (journal);
+	FILE *in = fopen (journal, "r");
+	if (in) {
+		/* Wrap the records in a root element */
+		static const char prefix [] = "<journal>";
+		static const char suffix [] = "</journal>";
+		char *data = NULL;
+		size_t size = 0;
+		FILE *text = open_memstream (&data, &size);
+		if (text) {
+			char buffer [4096];
+			size_t length;
+			fputs (prefix, text);
+			while ((length = fread (buffer, 1, sizeof (buffer), in)) > 0) {
+				fwrite (buffer, 1, length, text);
+			}
+			/* If the last record was cut short, drop it. */
+			if (fflush (text) == 0) {
+				size_t end = complete_journal_length (data, strlen (prefix), size);
+				if (end < size) {
+					flog (LOG_ERROR, "User journal %s is truncated\n", journal);
+					fseeko (text, end, SEEK_SET);
+					/* Don't append after the partial record. */
+					snapshot_required = true;
+				}
+			}
+			fputs (suffix, text);
+			if (fclose (text) == 0) {
+				ezxml_t records = ezxml_parse_str (data, size);
+				if (records && !*ezxml_error (records)) {
+					int replayed = replay_journal (records);
+					if (replayed) {
+						flog (LOG_GENERAL, "Replayed %d user changes from journal\n", replayed);
+						snapshot_required = true;
+					}
+				} else {
+					flog (LOG_ERROR, "User journal %s is corrupt: %s\n", journal,
+						  records ? ezxml_error (records) : strerror (errno));
+				}
+				ezxml_free (records);
+			}
+			free (data);
+		}
+		fclose (in);
+	}
+	free (journal);
+}
+
+
 /* Restore user data from a file */
 void users_restore (const char *filename) {
 	assert (filename);
-	ezxml_t data = ezxml_parse_file (filename);
-	if (data) {
-		/* Read the data */
-		ezxml_t user;
-		int user_count = 0;
-		int restored_count = 0;
-		for (user = ezxml_child (data, "user"); user; user = user->next) {
-			user_count++;
-			if (recreate_user (user)) {
-				restored_count++;
+	int user_count = 0;
+	int restored_count = 0;
+	bool loaded = false;
+	bool loaded_xml = false;
+	/* Choose the format by the file's magic number */
+	if (is_snapshot_file (filename)) {
+		SNAPSHOT *snapshot = snapshot_open (filename);
+		if (snapshot) {
+			user_count = snapshot_user_count (snapshot);
+			for (uint32_t i = 0; i < user_count; i++) {
+				if (restore_snapshot_user (snapshot, snapshot_user (snapshot, i))) {
+					restored_count++;
+				}
+			}
+			snapshot_close (snapshot);
+			loaded = true;
+		}
+	} else {
+		ezxml_t data = ezxml_parse_file (filename);
+		if (data) {
+			/* Read the data */
+			ezxml_t user;
+			for (user = ezxml_child (data, "user"); user; user = user->next) {
+				user_count++;
+				if (recreate_user (user)) {
+					restored_count++;
+				}
 			}
+			/* An empty file, as created on the first run, has no root tag */
+			loaded = loaded_xml = !*ezxml_error (data);
+			ezxml_free (data);
 		}
+	}
+	if (loaded) {
 		flog (restored_count < user_count ? LOG_ERROR : LOG_GENERAL,
-			  "Restored %d of %d users\n", user_count, restored_count);
-		ezxml_free (data);
+			  "Restored %d of %d users\n", restored_count, user_count);
+		/* Convert to the chosen format on the next write. */
+		if (loaded_xml != write_xml) {
+			snapshot_required = true;
+		}
+		restore_journal (filename);
+	} else {
+		/* Any journal holds changes to a user file that is gone; ignore it,
+		   and start over with a whole user file at the first change.  The
+		   journal must still be writable once privileges are dropped. */
+		char *journal = journal_name (filename);
+		if (journal) {
+			precreate_file (journal);
+			free (journal);
+		}
+		snapshot_required = true;
 	}
 	if (!user_list) {
 		flog (LOG_ERROR, "No user data found.  Creating admin user.");
@@ -770,115 +1207,146 @@ void users_restore (const char *filename) {
 	/* Never write the config file until changes are made.
 	   If something goes wrong, this reduces chances of
 	   clobbering the existing password file with a new one. */
+	for (USER *user = user_list; user; user = user->next) {
+		user->dirty = false;
+	}
+	forget_deleted_users ();
 	dirty = false;
 }
 
 
-/* Write XML to a file.  Values alternate literal, value, literal, value...;
-   the list must be NULL-terminated.  Values have*/
-static void fprintxml (FILE *file, ...) {
-	assert (file);
-	va_list parameters;
-	va_start (parameters, file);
-	char *val;
-	while ((val = va_arg (parameters, char *))) {
-		fprintf (file, "%s", val);
-		val = va_arg (parameters, char *);
-		if (!val) break;
-		while (*val) {
-			switch (*val) {
-				case '\'':
-					fprintf (file, "&apos;");
-					break;
-				case '"':
-					fprintf (file, "&quot;");
-					break;
-				case '<':
-					fprintf (file, "&lt;");
-					break;
-				case '>':
-					fprintf (file, "&gt;");
-					break;
-				case '&':
-					fprintf (file, "&amp;");
-					break;
-				default:
-					putc (*val, file);
-			}
-			val++;
+/* Write one user's record */
+static void write_user (FILE *out, USER *user) {
+	fprintxml (out, "  <user name='", user->name,
+					"' password='", user->password,
+					"' level='", user_type_name (user->rank), "'>\n", NULL);
+	if (user->pandora_credentials.username) {
+		assert (user->pandora_credentials.password);
+		fprintxml (out, "    <pandora>\n"
+						"      <user name='", user->pandora_credentials.username,
+						"' password='", user->pandora_credentials.password,
+						"' ownership='", get_manager_rule_by_id
+								(user->pandora_credentials.manager_rule)->name, "' />\n"
+						"    </pandora>\n", NULL);
+	}
+	for (int i = 0; i < countof (privileges); i++) {
+		if (privileges [i].persistable) {
+			fprintxml (out, "    <privilege name='", privileges [i].name,
+					   "' granted='", user->privileges [privileges [i].index] ? "true" : "false",
+					   "' />\n", NULL);
 		}
 	}
-	va_end (parameters);
+	persist_station_preferences (out, user);
+	fprintf (out, "  </user>\n");
 }
 
 /* Write the data into the userdata file */
 static bool write_users (FILE *out) {
 	assert (out);
-	USER *user;
 	fprintf (out, "<?xml version='1.0' encoding='UTF-8'?>\n"
 			 "<pianodpasswd version='1.0'>\n");
-	for (user = user_list; user; user = user->next) {
-		fprintxml (out, "  <user name='", user->name,
-						"' password='", user->password,
-						"' level='", user_type_name (user->rank), "'>\n", NULL);
-        if (user->pandora_credentials.username) {
-            assert (user->pandora_credentials.password);
-            fprintxml (out, "    <pandora>\n"
-                            "      <user name='", user->pandora_credentials.username,
-                            "' password='", user->pandora_credentials.password,
-                            "' ownership='", get_manager_rule_by_id
-                                    (user->pandora_credentials.manager_rule)->name, "' />\n"
-                            "    </pandora>\n", NULL);
-        }
+	for (USER *user = user_list; user; user = user->next) {
+		write_user (out, user);
+	}
+	fprintf (out, "</pianodpasswd>\n");
+	return !ferror (out);
+}
+
+/* Write the user data as a binary snapshot */
+static bool write_users_snapshot (FILE *out) {
+	assert (out);
+	SNAPSHOT_WRITER *writer = snapshot_writer_create ();
+	if (!writer) {
+		return false;
+	}
+	for (USER *user = user_list; user; user = user->next) {
+		SNAPSHOT_USER record;
+		memset (&record, 0, sizeof (record));
+		record.name = snapshot_string (writer, user->name);
+		record.password = snapshot_string (writer, user->password);
+		record.pandora_user = snapshot_string (writer, user->pandora_credentials.username);
+		record.pandora_password = snapshot_string (writer, user->pandora_credentials.password);
+		record.rank = user->rank;
+		record.manager_rule = user->pandora_credentials.manager_rule;
 		for (int i = 0; i < countof (privileges); i++) {
-			if (privileges [i].persistable) {
-				fprintxml (out, "    <privilege name='", privileges [i].name,
-						   "' granted='", user->privileges [privileges [i].index] ? "true" : "false",
-						   "' />\n", NULL);
+			if (privileges [i].persistable && user->privileges [privileges [i].index]) {
+				record.privileges |= 1 << privileges [i].index;
 			}
 		}
-		persist_station_preferences (out, user);
-		fprintf (out, "  </user>\n");
+		record.first_rating = snapshot_rating_count (writer);
+		snapshot_station_preferences (writer, user);
+		record.rating_count = snapshot_rating_count (writer) - record.first_rating;
+		snapshot_add_user (writer, &record);
+	}
+	bool success = snapshot_write (writer, out);
+	snapshot_writer_destroy (writer);
+	return success;
+}
+
+/* Write journal records for users changed or deleted since last persisted */
+static bool write_journal (FILE *out) {
+	assert (out);
+	for (DELETED_USER *deleted = deleted_users; deleted; deleted = deleted->next) {
+		fprintxml (out, "  <deleted name='", deleted->name, "' />\n", NULL);
+	}
+	for (USER *user = user_list; user; user = user->next) {
+		if (user->dirty) {
+			write_user (out, user);
+		}
 	}
-	fprintf (out, "</pianodpasswd>\n");
 	return !ferror (out);
 }
 
-/* Persist user data to a file.  Write to a new file, then carefully move
-   the old one out/new one in in such a way as to minimize risk. */
-bool users_persist (const char *filename) {
-	if (!dirty) {
-		return true;
+
+/* Write a buffer to a file descriptor */
+static bool write_fully (int fd, const char *data, size_t size) {
+	while (size > 0) {
+		ssize_t written = write (fd, data, size);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += written;
+		size -= written;
 	}
-	assert (filename);
+	return true;
+}
+
+/* Replace a file.  Write to a new file, then carefully move the old
+   one out (if a backup is wanted)/new one in in such a way as to
+   minimize risk. */
+static bool write_snapshot (const PERSIST_REQUEST *request, bool backup) {
+	const char *filename = request->filename;
 	bool success = false;
 	char *newfile = malloc (strlen (filename) + 5);
 	char *oldfile = malloc (strlen (filename) + 5);
 	if (newfile && oldfile) {
 		strcat (strcpy (newfile, filename), "-new");
 		strcat (strcpy (oldfile, filename), "-old");
-		FILE *out;
-		if ((out = fopen (newfile, "w"))) {
-			success = write_users (out);
-			fclose (out);
+		int fd;
+		if ((fd = open (newfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) >= 0) {
+			success = write_fully (fd, request->data, request->size);
+			success = (close (fd) == 0) && success;
 			if (success) {
-				unlink (oldfile);
-				if (link (filename, oldfile)) {
-                    perror("link");
-                }
+				if (backup) {
+					unlink (oldfile);
+					if (link (filename, oldfile)) {
+						perror("link");
+					}
+				}
 				success = (rename (newfile, filename) >= 0);
-				if (success) {
-					dirty = false;
-				} else {
+				if (!success) {
 					perror ("rename");
 				}
 			}
 		} else {
 			/* Write without making a backup. */
 			/* Required when running as nobody with files in /etc. */
-			if ((out = fopen (filename, "w"))) {
-				success = write_users (out);
-				fclose (out);
+			if ((fd = open (filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR)) >= 0) {
+				success = write_fully (fd, request->data, request->size);
+				success = (close (fd) == 0) && success;
 			} else {
 				perror (filename);
 			}
@@ -891,8 +1359,156 @@ bool users_persist (const char *filename) {
 	return (success);
 }
 
-/* Destroy the userlist and free up memory. */
+/* Carry out a persistence request; runs on the writer thread, or the
+   main thread if the writer is unavailable. */
+static void perform_persist_request (PERSIST_MESSAGE type, PERSIST_REQUEST *request) {
+	char *journal = (type == PERSIST_FILE ? NULL : journal_name (request->filename));
+	if (type == PERSIST_FILE) {
+		if (!write_snapshot (request, false)) {
+			__atomic_store_n (request->failed, true, __ATOMIC_RELAXED);
+		}
+	} else if (journal) {
+		if (type == PERSIST_SNAPSHOT) {
+			/* Once the user file is replaced, the journal is obsolete.
+			   Truncate rather than unlink, to keep its ownership. */
+			if (!write_snapshot (request, true)) {
+				__atomic_store_n (request->failed, true, __ATOMIC_RELAXED);
+			} else if (truncate (journal, 0) < 0 && errno != ENOENT) {
+				perror (journal);
+			}
+		} else {
+			int fd = open (journal, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+			if (fd < 0 || !write_fully (fd, request->data, request->size)) {
+				perror (journal);
+				/* Ask for the whole user file to be written next time. */
+				__atomic_store_n (request->failed, true, __ATOMIC_RELAXED);
+			}
+			if (fd >= 0) {
+				close (fd);
+			}
+		}
+		free (journal);
+	}
+	free (request->filename);
+	free (request->data);
+	free (request);
+}
+
+/* Writer thread: write out requests in the order they were queued. */
+static void *persist_writer (void *unused) {
+	struct threadmsg msg;
+	while (thread_queue_get (&persist_queue, NULL, &msg) == 0 && msg.msgtype != PERSIST_QUIT) {
+		perform_persist_request (msg.msgtype, msg.data);
+	}
+	return NULL;
+}
+
+/* Hand data to the writer thread, starting it if necessary.
+   If it can't be started, write the data now. */
+static bool queue_persist_request (PERSIST_MESSAGE type, const char *filename,
+								   char *data, size_t size, bool *failed) {
+	PERSIST_REQUEST *request = calloc (1, sizeof (*request));
+	if (!request || !(request->filename = strdup (filename))) {
+		perror ("queue_persist_request");
+		free (request);
+		free (data);
+		return false;
+	}
+	request->data = data;
+	request->size = size;
+	request->failed = failed;
+	if (!persist_running && thread_queue_init (&persist_queue) == 0) {
+		int err = pthread_create (&persist_thread, NULL, persist_writer, NULL);
+		if (err == 0) {
+			persist_running = true;
+		} else {
+			flog (LOG_ERROR, "queue_persist_request: pthread_create: %s", strerror (err));
+			thread_queue_cleanup (&persist_queue, 0);
+		}
+	}
+	if (!persist_running || thread_queue_add (&persist_queue, request, type) != 0) {
+		perform_persist_request (type, request);
+	}
+	return true;
+}
+
+/* Persist user data changes.  Normally, changes are appended to the
+   journal; the whole file is rewritten when the journal gets large
+   or couldn't be written. */
+bool users_persist (const char *filename) {
+	if (__atomic_exchange_n (&write_failed, false, __ATOMIC_RELAXED)) {
+		snapshot_required = dirty = true;
+	}
+	if (!dirty) {
+		return true;
+	}
+	assert (filename);
+	bool snapshot = snapshot_required || journal_size >= JOURNAL_COMPACT_SIZE;
+	char *data = NULL;
+	size_t size = 0;
+	FILE *out = open_memstream (&data, &size);
+	if (!out) {
+		perror ("open_memstream");
+		return false;
+	}
+	bool success = (!snapshot ? write_journal (out) :
+					write_xml ? write_users (out) : write_users_snapshot (out));
+	success = (fclose (out) == 0) && success;
+	if (!success) {
+		free (data);
+		return false;
+	}
+	if (!queue_persist_request (snapshot ? PERSIST_SNAPSHOT : PERSIST_JOURNAL, filename,
+								data, size, &write_failed)) {
+		return false;
+	}
+	if (snapshot) {
+		journal_size = 0;
+		snapshot_required = false;
+	} else {
+		journal_size += size;
+	}
+	for (USER *user = user_list; user; user = user->next) {
+		user->dirty = false;
+	}
+	forget_deleted_users ();
+	dirty = false;
+	return true;
+}
+
+/* Replace a file from the writer thread, after any user data queued
+   before it.  Takes ownership of data.  If the write fails, *failed is
+   set (atomically) so the caller can try again later. */
+bool persist_file (const char *filename, char *data, size_t size, bool *failed) {
+	assert (filename);
+	assert (failed);
+	return queue_persist_request (PERSIST_FILE, filename, data, size, failed);
+}
+
+/* Select the format for the user file.  Either format is read. */
+void users_set_xml_format (bool xml) {
+	write_xml = xml;
+}
+
+/* Wait for pending writes to finish, then stop the writer. */
+static void persist_shutdown (void) {
+	if (persist_running) {
+		thread_queue_add (&persist_queue, NULL, PERSIST_QUIT);
+		pthread_join (persist_thread, NULL);
+		thread_queue_cleanup (&persist_queue, 0);
+		persist_running = false;
+	}
+}
+
+/* Destroy the userlist and free up memory.  Waits for pending writes. */
 void users_destroy (void) {
+	persist_shutdown ();
 	destroy_users (user_list);
 	user_list = NULL;
+	free (user_directory);
+	user_directory = NULL;
+	user_directory_size = 0;
+	user_count = 0;
+	forget_deleted_users ();
+	snapshot_release_strings ();
 }
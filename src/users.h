@@ -35,10 +35,16 @@ typedef enum user_privileges_t {
 	PRIVILEGE_COUNT
 } PRIVILEGE;
 
+typedef struct pending_query_t PENDING_QUERY;
+
 typedef struct user_context_t {
-	USER *user;
+	USER *user; /* Set with set_session_user */
+	FB_CONNECTION *connection;
+	struct user_context_t *next_session; /* Other sessions of the same user */
+	struct user_context_t *prev_session;
 	char *search_term;
 	PianoSearchResult_t *search_results;
+	PENDING_QUERY *pending_query; /* Search awaiting a reply from Pandora */
 	WAIT_EVENT waiting_for;
 } USER_CONTEXT;
 
@@ -89,6 +95,10 @@ extern bool set_user_password (USER *user, const char *password);
 extern void delete_user (USER *user);
 
 extern bool is_user_online (FB_SERVICE *service, struct user_t *user);
+extern bool is_user_listening (struct user_t *user);
+extern void register_session (USER_CONTEXT *context, FB_CONNECTION *connection);
+extern void set_session_user (USER_CONTEXT *context, struct user_t *user);
+extern void unregister_session (USER_CONTEXT *context);
 extern bool valid_user_list (FB_EVENT *event, char * const*username);
 extern void clear_privilege (PRIVILEGE priv);
 extern void set_privileges (char * const*username, PRIVILEGE priv, bool setting);
@@ -109,6 +119,8 @@ extern void set_station_preferences (struct user_t *user, struct station_prefere
 extern void destroy_pandora_credentials (CREDENTIALS *creds);
 extern void users_restore (const char *filename);
 extern bool users_persist (const char *filename);
+extern bool persist_file (const char *filename, char *data, size_t size, bool *failed);
+extern void users_set_xml_format (bool xml);
 extern void users_destroy (void);
 
 